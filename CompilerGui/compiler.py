@@ -1,5 +1,13 @@
 #!/usr/bin/env python3
+import hashlib
+import json
+import os
+import queue
 import subprocess
+import threading
+import time
+from concurrent.futures import ThreadPoolExecutor
+from tkinter import *
 from tkinter.ttk import *
 from tkinter.filedialog import *
 try:
@@ -18,6 +26,11 @@ OPTIMIZE_FLAGS = [
     {'text': "-O3 (Optimize for code size and speed, more than -O2)", 'value': "-O3"}
 ]
 
+# Objects, depfiles and the build cache go here, relative to the directory the sources are relative to
+BUILD_DIR = ".build"
+BUILD_CACHE = "cache.json"
+BUILD_JOBS = os.cpu_count() or 1
+
 
 def get_gcc_version(path):
     return str(check_output([path, "--version"]).decode('UTF-8').split()[2])
@@ -35,6 +48,179 @@ def find_compilers():
         COMPILERS.append({'text': "g++ " + get_gcc_version(c) + ": " + c, 'path': c})
 
 
+def object_for(source):
+    # Sources with the same name in different directories still get objects of their own
+    name = os.path.splitext(os.path.basename(source))[0]
+    digest = hashlib.sha1(os.path.abspath(source).encode('UTF-8')).hexdigest()[:8]
+    return os.path.join(BUILD_DIR, name + "-" + digest + ".o")
+
+
+def read_depfile(path):
+    # make syntax: "target: dep dep \" with continuation lines, and spaces in names escaped as "\ "
+    with open(path) as f:
+        text = f.read().replace("\\\n", " ")
+
+    deps = []
+    for line in text.splitlines():
+        if ":" not in line:
+            continue
+
+        current = ""
+        escaped = False
+        for c in line.split(":", 1)[1] + " ":
+            if escaped:
+                current += c
+                escaped = False
+            elif c == "\\":
+                escaped = True
+            elif c.isspace():
+                if current:
+                    deps.append(current)
+                current = ""
+            else:
+                current += c
+
+    return deps
+
+
+# Compiles each source to an object in parallel, then links them. A unit is skipped if its compile command is unchanged
+# and so is every file its last depfile listed (by content, files whose size and mtime haven't changed aren't hashed
+# again), and the link is skipped if nothing was compiled and its command is unchanged
+class Builder:
+
+    def __init__(self, compiler, flags, sources, executable, output):
+        self.compiler = compiler
+        self.flags = flags
+        self.sources = sources
+        self.executable = executable
+        self.output = output
+        self.cache_path = os.path.join(BUILD_DIR, BUILD_CACHE)
+        self.cache = {}
+        self.hashes = {}
+        self.lock = threading.Lock()
+
+    def compile_command(self, source):
+        obj = object_for(source)
+        return [self.compiler] + self.flags + ["-MMD", "-MF", obj[:-2] + ".d", "-c", source, "-o", obj]
+
+    def link_command(self):
+        return [self.compiler] + self.flags + [object_for(s) for s in self.sources] + ["-o", self.executable]
+
+    def load_cache(self):
+        try:
+            with open(self.cache_path) as f:
+                self.cache = json.load(f)
+        except (OSError, ValueError):
+            self.cache = {}
+
+    def save_cache(self):
+        with open(self.cache_path, "w") as f:
+            json.dump(self.cache, f, indent=1, sort_keys=True)
+
+    def fingerprint(self, path, previous=None):
+        with self.lock:
+            if path in self.hashes:
+                return self.hashes[path]
+
+        try:
+            info = os.stat(path)
+        except OSError:
+            return None
+
+        if previous is not None and previous[0] == info.st_mtime_ns and previous[1] == info.st_size:
+            result = previous
+        else:
+            with open(path, "rb") as f:
+                result = [info.st_mtime_ns, info.st_size, hashlib.sha256(f.read()).hexdigest()]
+
+        with self.lock:
+            self.hashes[path] = result
+
+        return result
+
+    def up_to_date(self, source):
+        entry = self.cache.get(source)
+        if entry is None or entry["command"] != self.compile_command(source) or not os.path.exists(object_for(source)):
+            return False
+
+        current = {}
+        for path, previous in entry["deps"].items():
+            current[path] = self.fingerprint(path, previous)
+            if current[path] is None or current[path][2] != previous[2]:
+                return False
+
+        # Remember new mtimes for files that were only touched, so they don't have to be hashed again next time
+        entry["deps"] = current
+        return True
+
+    def compile(self, source):
+        if self.up_to_date(source):
+            return source, None, 0, ""
+
+        command = self.compile_command(source)
+        start = time.monotonic()
+        result = subprocess.run(command, stdout=subprocess.PIPE, stderr=subprocess.STDOUT)
+        elapsed = time.monotonic() - start
+
+        entry = None
+        if result.returncode == 0:
+            deps = {d: self.fingerprint(d) for d in read_depfile(command[command.index("-MF") + 1])}
+            entry = {'command': command, 'deps': {d: f for d, f in deps.items() if f is not None}}
+
+        with self.lock:
+            if entry is not None:
+                self.cache[source] = entry
+            else:
+                self.cache.pop(source, None)
+
+        return source, result.returncode, elapsed, result.stdout.decode('UTF-8', 'replace')
+
+    def run(self):
+        start = time.monotonic()
+        os.makedirs(BUILD_DIR, exist_ok=True)
+        self.load_cache()
+
+        compiled = 0
+        failed = 0
+        with ThreadPoolExecutor(max_workers=BUILD_JOBS) as pool:
+            for source, rc, elapsed, out in pool.map(self.compile, self.sources):
+                if rc is None:
+                    self.output(source + ": up to date")
+                    continue
+
+                compiled += 1
+                if out:
+                    self.output(out.rstrip())
+
+                if rc == 0:
+                    self.output("{}: compiled in {:.2f}s".format(source, elapsed))
+                else:
+                    failed += 1
+                    self.output("{}: failed with status {} after {:.2f}s".format(source, rc, elapsed))
+
+        rc = 1 if failed > 0 else 0
+        if failed == 0:
+            link = self.link_command()
+            if compiled == 0 and self.cache.get("__link__") == link and os.path.exists(self.executable):
+                self.output(self.executable + ": up to date")
+            else:
+                link_start = time.monotonic()
+                result = subprocess.run(link, stdout=subprocess.PIPE, stderr=subprocess.STDOUT)
+                if result.stdout:
+                    self.output(result.stdout.decode('UTF-8', 'replace').rstrip())
+
+                rc = result.returncode
+                self.cache["__link__"] = link if rc == 0 else None
+                self.output("{}: linked in {:.2f}s".format(self.executable, time.monotonic() - link_start))
+
+        self.save_cache()
+        self.output("Compiled {} of {} units with {} jobs in {:.2f}s".format(
+            compiled, len(self.sources), BUILD_JOBS, time.monotonic() - start
+        ))
+
+        return rc
+
+
 class ReadOnlyText(Text):
     def __init__(self, *args, **kwargs):
         super().__init__(*args, **kwargs)
@@ -99,7 +285,8 @@ class MainWindow(Frame):
     def __init__(self, master=None):
         super().__init__(master)
 
-        self.__generated_cmd = ""
+        self.__output = queue.Queue()
+        self.__building = False
 
         self.grid(sticky=N+S+E+W)
 
@@ -177,28 +364,35 @@ class MainWindow(Frame):
         self.optimize_select.selection_clear()
         self.rebuild_command()
 
-    def rebuild_command(self):
-        self.__generated_cmd = COMPILERS[self.compiler_select.current()]["path"] + " "
-        self.__generated_cmd += "-std=" + self.standard_select.get() + " "
-        self.__generated_cmd += OPTIMIZE_FLAGS[self.optimize_select.current()]["value"] + " "
+    def make_builder(self):
+        flags = ["-std=" + self.standard_select.get(), OPTIMIZE_FLAGS[self.optimize_select.current()]["value"]]
 
         if self.debug_data.get() == 1:
-            self.__generated_cmd += "-g "
+            flags.append("-g")
+
+        executable = self.executable.get()
+        if executable is None or executable == "":
+            executable = "a.out"
 
-        if self.executable.get() is not None and self.executable.get() is not "":
-            self.__generated_cmd += "-o " + self.executable.get() + " "
+        return Builder(
+            COMPILERS[self.compiler_select.current()]["path"], flags, list(self.sources.get_sources()), executable,
+            self.__output.put
+        )
 
-        if len(self.sources.get_sources()) <= 0:
+    def rebuild_command(self):
+        builder = self.make_builder()
+
+        if len(builder.sources) <= 0 or self.__building:
             self.compile_button.config(state='disabled')
         else:
             self.compile_button.config(state='normal')
 
-        for file in self.sources.get_sources():
-            self.__generated_cmd += "'" + file + "' "
-
-        self.__generated_cmd.rstrip(' ')
+        cmd = "Generated Commands ({} parallel jobs):\n\n".format(BUILD_JOBS)
+        for file in builder.sources:
+            cmd += " ".join(builder.compile_command(file)) + "\n"
 
-        cmd = "Generated Command:\n\n" + self.__generated_cmd
+        if len(builder.sources) > 0:
+            cmd += "\n" + " ".join(builder.link_command())
 
         self.generated_command.delete("1.0", END)
         self.generated_command.insert(END, cmd)
@@ -208,24 +402,39 @@ class MainWindow(Frame):
         self.compiler_output.see(END)
 
     def run_compile(self):
-        self.append_compiler_output_line(os.getcwd() + "> " + self.__generated_cmd)
-
-        compiler = subprocess.Popen(
-                self.__generated_cmd.rstrip() + " 2>&1",
-                shell=True,
-                stdout=subprocess.PIPE,
-                stderr=subprocess.PIPE,
-                cwd=os.getcwd()
-            )
-
-        (out, err) = compiler.communicate()
-        rc = compiler.returncode
-
-        self.append_compiler_output_line(out.decode('UTF-8'))
-
-        self.append_compiler_output_line(
-            COMPILERS[self.compiler_select.current()]["path"] + " exited with status " + str(rc) + "\n"
-        )
+        builder = self.make_builder()
+        self.append_compiler_output_line(os.getcwd() + "> building " + builder.executable)
+
+        # Build in the background so the window stays responsive, the output is picked up by poll_output
+        self.__building = True
+        self.compile_button.config(state='disabled')
+
+        def build():
+            # Compile has to come back even if the build blows up, so the status and the sentinel always get queued
+            rc = -1
+            try:
+                rc = builder.run()
+            except Exception as e:
+                self.__output.put("Build failed: " + type(e).__name__ + ": " + str(e) + "\n")
+            finally:
+                self.__output.put(builder.compiler + " build exited with status " + str(rc) + "\n")
+                self.__output.put(None)
+
+        threading.Thread(target=build, daemon=True).start()
+        self.after(50, self.poll_output)
+
+    def poll_output(self):
+        try:
+            while True:
+                msg = self.__output.get_nowait()
+                if msg is None:
+                    self.__building = False
+                    self.rebuild_command()
+                    return
+
+                self.append_compiler_output_line(msg)
+        except queue.Empty:
+            self.after(50, self.poll_output)
 
 
 if __name__ == "__main__":
@@ -22,21 +22,23 @@
 
 std::mutex L3::Logger::output_lock;
 L3::Level L3::GlobalLogLevel(L3::Level::INFO);
+thread_local L3::Level L3::ThreadLogLevel(L3::Level::TRACE);
+std::ostream* L3::GlobalOutput(&std::cout);
 
 /**
  * Write the specified message to standard out at the specified level. If the logger is not configured to log
  * at or below this level, or the logger is disabled, the message will not be emitted and the call returns
- * immediately. Note that fatal messages will always be emitted.
+ * immediately. Note that fatal messages are emitted unless the calling thread has silenced its logging.
  *
  * @param level The level of the message
  * @param msg The message to log
  */
 void L3::Logger::Log(L3::Level level, std::string msg) {
     // Log if the level is FATAL, or if the logger isn't disabled and the specified level is acceptable
-    if (level == L3::Level::FATAL || (level != L3::Level::OFF && L3::GlobalLogLevel <= level))
+    if (Enabled(level))
     {
         output_lock.lock();
-        std::cout << "[" << NameOfLevel(level) << "] [" << scope << "] " << msg << std::endl;
+        *L3::GlobalOutput << "[" << NameOfLevel(level) << "] [" << scope << "] " << msg << std::endl;
         output_lock.unlock();
     }
 }
@@ -20,6 +20,7 @@
 #ifndef EECS3540_L3_LOGGER_H
 #define EECS3540_L3_LOGGER_H
 
+#include <ostream>
 #include <string>
 #include <assert.h>
 #include <mutex>
@@ -48,6 +49,15 @@ namespace L3 {
     /** The level all loggers will log at */
     extern Level GlobalLogLevel;
 
+    /**
+     * The level loggers log at on the calling thread, on top of GlobalLogLevel. Lets one thread be quieter than the
+     * rest of the program; OFF silences even FATAL messages. Defaults to TRACE
+     */
+    extern thread_local Level ThreadLogLevel;
+
+    /** The stream all loggers write to. Defaults to standard output */
+    extern std::ostream* GlobalOutput;
+
     /**
      * A general purpose class for writing log messages to standard output. The output is thread safe but will
      * block on logging calls until standard out becomes available.
@@ -71,6 +81,19 @@ namespace L3 {
          */
         void Log(Level level, std::string msg);
 
+        /**
+         * Checks to see if a message at the specified level would be emitted, so that messages that are expensive to
+         * build can be skipped entirely
+         *
+         * @param level The level of the message
+         * @return true iff a message at the specified level would be emitted
+         */
+        static inline bool Enabled(Level level)
+        {
+            return level != Level::OFF && ThreadLogLevel <= level &&
+                   (level == Level::FATAL || GlobalLogLevel <= level);
+        }
+
         /**
          * Write the specified message at the TRACE level to standard output
          *
@@ -0,0 +1,697 @@
+/*
+ * Copyright (c) 2016 Nathan Lowe
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of this software
+ * and associated documentation files (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all copies or substantial
+ * portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT
+ * LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN
+ * NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include <fcntl.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+#include <regex>
+#include <sstream>
+#include <vector>
+#include "treegen.h"
+#include "Logger.h"
+#include "util.h"
+
+L3::Logger Log("bench");
+
+/** A way of running parcp that is benchmarked */
+struct Mode
+{
+    std::string Name;
+    std::vector<std::string> Args;
+};
+
+/** A storage location the benchmark is run against */
+struct Backend
+{
+    std::string Name;
+    std::string Path;
+};
+
+/** The measurements for a single run of parcp */
+struct Run
+{
+    double WallSeconds = 0;
+    double UserSeconds = 0;
+    double SystemSeconds = 0;
+    long PeakRssKb = 0;
+    uint64_t FilesCopied = 0;
+    uint64_t BytesCopied = 0;
+    int ExitStatus = 0;
+    bool Verified = false;
+};
+
+/** The summarized measurements for a mode on a backend */
+struct Result
+{
+    std::string Backend;
+    std::string Mode;
+    unsigned Runs = 0;
+    Run Median;
+    /**
+     * Filesystem operations made through the Sys layer, counted in an extra run with --latency-file. Not every
+     * syscall: forks, execs, mmaps and the like aren't instrumented
+     */
+    uint64_t InstrumentedOps = 0;
+    /** Heap allocations made by the whole process tree, counted in an extra run */
+    uint64_t Allocations = 0;
+    uint64_t AllocationFiles = 0;
+    /** Whether every timed run produced an exact copy, if verification was requested */
+    bool Verified = true;
+
+    double FilesPerSecond() const { return Median.WallSeconds > 0 ? Median.FilesCopied / Median.WallSeconds : 0; }
+    double MegabytesPerSecond() const { return Median.WallSeconds > 0 ? Median.BytesCopied / 1048576.0 / Median.WallSeconds : 0; }
+    double AllocationsPerFile() const { return AllocationFiles > 0 ? (double) Allocations / AllocationFiles : 0; }
+
+    std::string ToJson() const
+    {
+        char buf[1024];
+        snprintf(buf, sizeof(buf),
+                 "{\"backend\": \"%s\", \"mode\": \"%s\", \"runs\": %u, \"wall_seconds\": %.4f, "
+                 "\"files_per_second\": %.1f, \"mb_per_second\": %.2f, \"user_cpu_seconds\": %.4f, "
+                 "\"system_cpu_seconds\": %.4f, \"peak_rss_kb\": %ld, \"files_copied\": %llu, \"bytes_copied\": %llu, "
+                 "\"instrumented_ops\": %llu, \"allocations\": %llu, \"allocations_per_file\": %.2f, \"verified\": %s}",
+                 Backend.c_str(), Mode.c_str(), Runs, Median.WallSeconds, FilesPerSecond(), MegabytesPerSecond(),
+                 Median.UserSeconds, Median.SystemSeconds, Median.PeakRssKb,
+                 (unsigned long long) Median.FilesCopied, (unsigned long long) Median.BytesCopied,
+                 (unsigned long long) InstrumentedOps, (unsigned long long) Allocations, AllocationsPerFile(),
+                 Verified ? "true" : "false");
+
+        return std::string(buf);
+    }
+};
+
+/** Everything passed on the command line */
+struct BenchOptions
+{
+    std::string ParcpPath = PARCP_BENCH_DEFAULT_BINARY;
+    std::vector<Backend> Backends;
+    std::vector<Mode> Modes;
+    unsigned Runs = 3;
+    std::string OutputFile = "parcp-bench.json";
+    std::string CompareFile;
+    double Threshold = 5.0;
+    std::string GenerateOnly;
+    bool Keep = false;
+    bool Verify = false;
+    std::string Faults;
+    /** The allocation counting library to preload for the allocation counting run, or empty to skip it */
+    std::string AllocCounter = PARCP_BENCH_DEFAULT_ALLOC_COUNTER;
+    TreeGen::Config Tree;
+};
+
+void PrintUsage();
+bool ParseArgs(int argc, char* argv[], BenchOptions& opts);
+bool RunParcp(const BenchOptions& opts, const std::vector<std::string>& args, Run& run, const std::string& allocationLog = "");
+bool BenchmarkBackend(const BenchOptions& opts, const Backend& backend, std::vector<Result>& results, bool& verified);
+bool Compare(const std::string& baselineFile, const std::vector<Result>& results, double threshold);
+
+int main(int argc, char* argv[])
+{
+    BenchOptions opts;
+    if(!ParseArgs(argc, argv, opts))
+    {
+        PrintUsage();
+        return -1;
+    }
+
+    // Just generate a tree and leave it there
+    if(!opts.GenerateOnly.empty())
+    {
+        TreeGen::Result generated;
+        if(!TreeGen::Generate(opts.GenerateOnly, opts.Tree, generated)) return -1;
+
+        std::cout << "Generated " << generated.Files << " files (" << generated.SparseFiles << " sparse), "
+                  << generated.Symlinks << " symlinks, " << generated.Hardlinks << " hard links in "
+                  << generated.Directories << " directories, " << generated.Bytes << " bytes" << std::endl;
+        return 0;
+    }
+
+    // parcp refuses to start with faults it can't inject, before it even looks at its arguments
+    if(!opts.Faults.empty())
+    {
+        Run probe;
+        if(!RunParcp(opts, {"--help"}, probe)) return -1;
+        if(probe.ExitStatus != 0)
+        {
+            Log.Fatal(opts.ParcpPath + " can't inject faults, build it with -DPARCP_FAULT_INJECTION=ON to use --faults");
+            return -1;
+        }
+    }
+
+    std::vector<Result> results;
+    bool verified = true;
+    for(auto& backend : opts.Backends)
+    {
+        if(!BenchmarkBackend(opts, backend, results, verified)) return -1;
+    }
+
+    // One result per line, so baselines are easy to diff and to scan in Compare
+    std::ofstream out(opts.OutputFile);
+    out << "{\n\"tree\": " << opts.Tree.ToJson() << ",\n\"results\": [\n";
+    for(size_t i = 0; i < results.size(); i++)
+    {
+        out << results[i].ToJson() << (i + 1 < results.size() ? ",\n" : "\n");
+    }
+    out << "]\n}" << std::endl;
+    out.close();
+
+    Log.Info("Results written to " + opts.OutputFile);
+
+    if(!verified)
+    {
+        Log.Error("At least one copy did not match its source");
+        return 1;
+    }
+
+    if(!opts.CompareFile.empty() && !Compare(opts.CompareFile, results, opts.Threshold)) return 1;
+
+    return 0;
+}
+
+/**
+ * Run parcp once with the specified arguments, with its output discarded
+ *
+ * @param opts the benchmark options
+ * @param args the arguments to pass to parcp (not including the program name)
+ * @param run the measurements for the run
+ * @param allocationLog if set, count heap allocations by preloading the allocation counter, logging them here
+ * @return true iff parcp could be started
+ */
+bool RunParcp(const BenchOptions& opts, const std::vector<std::string>& args, Run& run, const std::string& allocationLog)
+{
+    std::vector<char*> argv;
+    argv.push_back(const_cast<char*>(opts.ParcpPath.c_str()));
+    for(auto& arg : args) argv.push_back(const_cast<char*>(arg.c_str()));
+    argv.push_back(nullptr);
+
+    auto start = std::chrono::steady_clock::now();
+
+    auto pid = fork();
+    if(pid == 0)
+    {
+        int devNull = open("/dev/null", O_WRONLY);
+        dup2(devNull, STDOUT_FILENO);
+        dup2(devNull, STDERR_FILENO);
+
+        // Checked up front, parcp refuses to run with these unless it was built with PARCP_FAULT_INJECTION
+        if(!opts.Faults.empty()) setenv("PARCP_FAULTS", opts.Faults.c_str(), 1);
+
+        // Inherited by every worker, which each log their own count
+        if(!allocationLog.empty())
+        {
+            setenv("LD_PRELOAD", opts.AllocCounter.c_str(), 1);
+            setenv("PARCP_ALLOCATION_LOG", allocationLog.c_str(), 1);
+        }
+
+        execv(opts.ParcpPath.c_str(), argv.data());
+        _exit(127);
+    }
+    else if(pid < 0)
+    {
+        Log.Error("Unable to fork (errno " + std::to_string(errno) + ")");
+        return false;
+    }
+
+    // On Linux, the usage reported by wait4 includes every worker parcp reaped, so this covers the whole process tree
+    int status;
+    struct rusage usage;
+    if(wait4(pid, &status, 0, &usage) < 0)
+    {
+        Log.Error("Unable to wait for parcp (errno " + std::to_string(errno) + ")");
+        return false;
+    }
+
+    run.WallSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    run.UserSeconds = usage.ru_utime.tv_sec + usage.ru_utime.tv_usec / 1e6;
+    run.SystemSeconds = usage.ru_stime.tv_sec + usage.ru_stime.tv_usec / 1e6;
+    run.PeakRssKb = usage.ru_maxrss;
+    run.ExitStatus = WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+
+    if(run.ExitStatus == 127)
+    {
+        Log.Error("Unable to run " + opts.ParcpPath);
+        return false;
+    }
+
+    return true;
+}
+
+/** Read a whole file into a string */
+std::string ReadFile(const std::string& path)
+{
+    std::ifstream in(path);
+    std::stringstream buf;
+    buf << in.rdbuf();
+    return buf.str();
+}
+
+/**
+ * Read the stats file written by a run of parcp. It is removed before every run, so it's missing if the run never
+ * wrote one
+ *
+ * @return false if the file doesn't exist
+ */
+bool ReadStats(const std::string& statsFile, std::string& stats)
+{
+    std::ifstream in(statsFile);
+    if(!in) return false;
+
+    std::stringstream buf;
+    buf << in.rdbuf();
+    stats = buf.str();
+    return true;
+}
+
+/** Pull an unsigned integer field out of a flat JSON object */
+uint64_t JsonField(const std::string& json, const std::string& field)
+{
+    std::smatch match;
+    if(std::regex_search(json, match, std::regex("\"" + field + "\": ([0-9.]+)")))
+    {
+        return (uint64_t) std::stod(match[1]);
+    }
+
+    return 0;
+}
+
+/** Sum every "count" field in a latency report, which is the number of filesystem operations parcp made through Sys */
+uint64_t CountInstrumentedOps(const std::string& latencyFile)
+{
+    auto json = ReadFile(latencyFile);
+    std::regex count("\"count\": ([0-9]+)");
+
+    uint64_t total = 0;
+    for(auto it = std::sregex_iterator(json.begin(), json.end(), count); it != std::sregex_iterator(); ++it)
+    {
+        total += std::stoull((*it)[1]);
+    }
+
+    // The time spent waiting on workers isn't a filesystem call, but it is counted as one
+    std::smatch wait;
+    if(std::regex_search(json, wait, std::regex("\"wait\": \\{\"count\": ([0-9]+)")))
+    {
+        total -= std::stoull(wait[1]);
+    }
+
+    return total;
+}
+
+/** Add up the allocation counts logged by every process */
+uint64_t CountAllocations(const std::string& allocationLog)
+{
+    std::ifstream in(allocationLog);
+
+    uint64_t total = 0, count;
+    while(in >> count) total += count;
+
+    return total;
+}
+
+/**
+ * Generate the benchmark tree on the specified backend and run every mode against it
+ *
+ * @param opts the benchmark options
+ * @param backend the backend to benchmark
+ * @param results the results for every mode
+ * @param verified cleared if any copy did not match the source, when verification was requested
+ * @return true iff every run succeeded
+ */
+bool BenchmarkBackend(const BenchOptions& opts, const Backend& backend, std::vector<Result>& results, bool& verified)
+{
+    auto base = backend.Path + "/parcp-bench." + std::to_string(getpid());
+    auto source = base + "/src";
+    auto dest = base + "/dst";
+    auto statsFile = base + "/stats.json";
+    auto latencyFile = base + "/latency.json";
+    auto allocationLog = base + "/allocations.log";
+
+    if(mkdir(base.c_str(), 0755) != 0)
+    {
+        Log.Error("Unable to create " + base + " (errno " + std::to_string(errno) + ")");
+        return false;
+    }
+
+    Log.Info("[" + backend.Name + "] Generating tree in " + source);
+
+    TreeGen::Result generated;
+    if(!TreeGen::Generate(source, opts.Tree, generated))
+    {
+        TreeGen::RemoveTree(base);
+        return false;
+    }
+
+    Log.Info("[" + backend.Name + "] " + std::to_string(generated.Files) + " files, " +
+             std::to_string(generated.Symlinks) + " symlinks, " + std::to_string(generated.Hardlinks) +
+             " hard links in " + std::to_string(generated.Directories) + " directories (" +
+             std::to_string(generated.Bytes) + " bytes)");
+
+    bool ok = true;
+    for(auto& mode : opts.Modes)
+    {
+        std::vector<Run> runs;
+
+        std::vector<std::string> args = mode.Args;
+        args.insert(args.end(), {"--stats-file", statsFile, "-f", source, "-t", dest});
+
+        for(unsigned i = 0; i < opts.Runs && ok; i++)
+        {
+            // Start every run from an empty destination with the generated data on stable storage, and without the
+            // previous run's stats, which would otherwise pass for this one's if parcp never wrote any
+            TreeGen::RemoveTree(dest);
+            unlink(statsFile.c_str());
+            sync();
+
+            Run run;
+            ok = RunParcp(opts, args, run);
+            if(!ok) break;
+
+            std::string stats;
+            if(!ReadStats(statsFile, stats))
+            {
+                Log.Error("[" + backend.Name + "] [" + mode.Name + "] parcp didn't write " + statsFile);
+                ok = false;
+                break;
+            }
+
+            run.FilesCopied = JsonField(stats, "files_copied");
+            run.BytesCopied = JsonField(stats, "bytes_copied");
+
+            if(run.ExitStatus != 0)
+            {
+                Log.Warn("[" + backend.Name + "] [" + mode.Name + "] parcp exited with " + std::to_string(run.ExitStatus));
+            }
+
+            if(opts.Verify)
+            {
+                std::string difference;
+                run.Verified = TreeGen::CompareTrees(source, dest, difference);
+                if(!run.Verified) Log.Error("[" + backend.Name + "] [" + mode.Name + "] Copy does not match: " + difference);
+            }
+
+            runs.push_back(run);
+        }
+
+        if(!ok) break;
+
+        // One more, instrumented run to count filesystem operations without skewing the timed runs
+        TreeGen::RemoveTree(dest);
+
+        Run counted;
+        auto countArgs = args;
+        countArgs.insert(countArgs.begin(), {"--latency-file", latencyFile});
+        if(!RunParcp(opts, countArgs, counted))
+        {
+            ok = false;
+            break;
+        }
+
+        // And one to count heap allocations, which the preloaded counter slows down
+        uint64_t allocations = 0, allocationFiles = 0;
+        if(!opts.AllocCounter.empty())
+        {
+            TreeGen::RemoveTree(dest);
+            unlink(allocationLog.c_str());
+            unlink(statsFile.c_str());
+
+            Run allocating;
+            if(!RunParcp(opts, args, allocating, allocationLog))
+            {
+                ok = false;
+                break;
+            }
+
+            std::string stats;
+            if(!ReadStats(statsFile, stats))
+            {
+                Log.Error("[" + backend.Name + "] [" + mode.Name + "] parcp didn't write " + statsFile);
+                ok = false;
+                break;
+            }
+
+            allocations = CountAllocations(allocationLog);
+            allocationFiles = JsonField(stats, "files_copied");
+        }
+
+        std::sort(runs.begin(), runs.end(), [](const Run& a, const Run& b) { return a.WallSeconds < b.WallSeconds; });
+
+        Result result;
+        result.Backend = backend.Name;
+        result.Mode = mode.Name;
+        result.Runs = (unsigned) runs.size();
+        result.Median = runs[runs.size() / 2];
+        result.InstrumentedOps = CountInstrumentedOps(latencyFile);
+        result.Allocations = allocations;
+        result.AllocationFiles = allocationFiles;
+        for(auto& run : runs) result.Verified = result.Verified && (!opts.Verify || run.Verified);
+        if(!result.Verified) verified = false;
+
+        char line[320];
+        snprintf(line, sizeof(line), "[%s] [%s] %.3fs, %.0f files/s, %.1f MB/s, %.3fs user, %.3fs sys, %ld KB peak RSS, %llu instrumented ops, %.1f allocations/file",
+                 backend.Name.c_str(), mode.Name.c_str(), result.Median.WallSeconds, result.FilesPerSecond(),
+                 result.MegabytesPerSecond(), result.Median.UserSeconds, result.Median.SystemSeconds,
+                 result.Median.PeakRssKb, (unsigned long long) result.InstrumentedOps, result.AllocationsPerFile());
+        Log.Info(line);
+
+        results.push_back(result);
+    }
+
+    if(!opts.Keep) TreeGen::RemoveTree(base);
+
+    return ok;
+}
+
+/**
+ * Compare the results against a previously saved results file
+ *
+ * @param baselineFile the results file to compare against
+ * @param results the results of this run
+ * @param threshold the percentage drop in throughput that counts as a regression
+ * @return true iff nothing regressed
+ */
+bool Compare(const std::string& baselineFile, const std::vector<Result>& results, double threshold)
+{
+    std::ifstream in(baselineFile);
+    if(!in)
+    {
+        Log.Error("Unable to read baseline " + baselineFile);
+        return false;
+    }
+
+    std::regex key("\"backend\": \"([^\"]*)\", \"mode\": \"([^\"]*)\"");
+    std::regex filesPerSecond("\"files_per_second\": ([0-9.]+)");
+    std::regex mbPerSecond("\"mb_per_second\": ([0-9.]+)");
+
+    bool ok = true;
+    std::string line;
+    while(std::getline(in, line))
+    {
+        std::smatch k, f, m;
+        if(!std::regex_search(line, k, key) || !std::regex_search(line, f, filesPerSecond) || !std::regex_search(line, m, mbPerSecond)) continue;
+
+        for(auto& result : results)
+        {
+            if(result.Backend != k[1] || result.Mode != k[2]) continue;
+
+            auto oldFiles = std::stod(f[1]);
+            auto oldMb = std::stod(m[1]);
+            auto filesDelta = oldFiles > 0 ? (result.FilesPerSecond() - oldFiles) / oldFiles * 100 : 0;
+            auto mbDelta = oldMb > 0 ? (result.MegabytesPerSecond() - oldMb) / oldMb * 100 : 0;
+            bool regressed = filesDelta < -threshold || mbDelta < -threshold;
+
+            char buf[256];
+            snprintf(buf, sizeof(buf), "[%s] [%s] files/s %+.1f%%, MB/s %+.1f%%%s", result.Backend.c_str(),
+                     result.Mode.c_str(), filesDelta, mbDelta, regressed ? " REGRESSED" : "");
+
+            if(regressed)
+            {
+                Log.Warn(buf);
+                ok = false;
+            }
+            else
+            {
+                Log.Info(buf);
+            }
+        }
+    }
+
+    return ok;
+}
+
+/** Split a string of arguments on whitespace */
+std::vector<std::string> SplitArgs(const std::string& raw)
+{
+    std::vector<std::string> args;
+    std::istringstream in(raw);
+    std::string arg;
+    while(in >> arg) args.push_back(arg);
+
+    return args;
+}
+
+bool ParseFraction(const std::string& raw, double& fraction)
+{
+    char* end = nullptr;
+    fraction = strtod(raw.c_str(), &end);
+    return *end == '\0' && fraction >= 0 && fraction <= 1;
+}
+
+bool ParseUnsigned(const std::string& raw, unsigned& value)
+{
+    char* end = nullptr;
+    auto parsed = strtoul(raw.c_str(), &end, 10);
+    value = (unsigned) parsed;
+    return !raw.empty() && *end == '\0';
+}
+
+/**
+ * Parse the command line
+ *
+ * @param argc the number of arguments passed
+ * @param argv an array of c-strings containing the arguments
+ * @param opts the parsed options
+ * @return true iff the arguments were valid
+ */
+bool ParseArgs(int argc, char* argv[], BenchOptions& opts)
+{
+    std::string tmpfs = "/dev/shm";
+    std::string disk = ".";
+    bool noTmpfs = false, noDisk = false;
+
+    for(int i = 1; i < argc; i++)
+    {
+        auto arg = std::string(argv[i]);
+        bool hasValue = i < argc - 1;
+        bool ok = true;
+
+        if(arg == "-h" || arg == "--help") return false;
+        else if(arg == "--keep") opts.Keep = true;
+        else if(arg == "--no-tmpfs") noTmpfs = true;
+        else if(arg == "--no-disk") noDisk = true;
+        else if(arg == "--verify") opts.Verify = true;
+        else if(arg == "--no-allocations") opts.AllocCounter.clear();
+        else if(!hasValue)
+        {
+            std::cerr << arg << ": Unknown argument or not enough arguments remaining" << std::endl;
+            return false;
+        }
+        else if(arg == "--parcp") opts.ParcpPath = argv[++i];
+        else if(arg == "--tmpfs") tmpfs = argv[++i];
+        else if(arg == "--disk") disk = argv[++i];
+        else if(arg == "--out") opts.OutputFile = argv[++i];
+        else if(arg == "--compare") opts.CompareFile = argv[++i];
+        else if(arg == "--generate") opts.GenerateOnly = argv[++i];
+        else if(arg == "--faults") opts.Faults = argv[++i];
+        else if(arg == "--alloc-counter") opts.AllocCounter = argv[++i];
+        else if(arg == "--runs") ok = ParseUnsigned(argv[++i], opts.Runs) && opts.Runs > 0;
+        else if(arg == "--threshold") opts.Threshold = strtod(argv[++i], nullptr);
+        else if(arg == "--depth") ok = ParseUnsigned(argv[++i], opts.Tree.Depth);
+        else if(arg == "--fanout") ok = ParseUnsigned(argv[++i], opts.Tree.FanOut);
+        else if(arg == "--files") ok = ParseUnsigned(argv[++i], opts.Tree.FilesPerDirectory);
+        else if(arg == "--sizes") ok = TreeGen::SizeDistribution::Parse(argv[++i], opts.Tree.Sizes);
+        else if(arg == "--sparse") ok = ParseFraction(argv[++i], opts.Tree.SparseFraction);
+        else if(arg == "--symlinks") ok = ParseFraction(argv[++i], opts.Tree.SymlinkFraction);
+        else if(arg == "--hardlinks") ok = ParseFraction(argv[++i], opts.Tree.HardlinkFraction);
+        else if(arg == "--seed") opts.Tree.Seed = strtoull(argv[++i], nullptr, 10);
+        else if(arg == "--mode")
+        {
+            // name=arg arg arg
+            std::string raw = argv[++i];
+            auto eq = raw.find('=');
+            if(eq == std::string::npos || eq == 0) ok = false;
+            else opts.Modes.push_back(Mode{raw.substr(0, eq), SplitArgs(raw.substr(eq + 1))});
+        }
+        else
+        {
+            std::cerr << arg << ": Unknown argument" << std::endl;
+            return false;
+        }
+
+        if(!ok)
+        {
+            std::cerr << arg << ": Invalid value " << argv[i] << std::endl;
+            return false;
+        }
+    }
+
+    if(!noTmpfs) opts.Backends.push_back(Backend{"tmpfs", tmpfs});
+    if(!noDisk) opts.Backends.push_back(Backend{"disk", disk});
+
+    if(opts.Modes.empty())
+    {
+        opts.Modes = {
+                {"logging", {}},
+                {"quiet", {"-q"}},
+                {"progress", {"-q", "--progress"}},
+                {"latency", {"-q", "--latency"}},
+                {"single", {"-q", "--max-memory", "1"}},
+        };
+    }
+
+    return true;
+}
+
+/**
+ * Prints the usage information for the program
+ */
+void PrintUsage()
+{
+    std::cout << "parcp-bench - Benchmarks parcp against a deterministic synthetic tree" << std::endl;
+    std::cout << "Usage:" << std::endl;
+    std::cout << "     parcp-bench [options]" << std::endl;
+    std::cout << std::endl;
+    std::cout << "args" << std::endl;
+    std::cout << "     --parcp <path>      The parcp binary to benchmark. Defaults to the one built alongside this program" << std::endl;
+    std::cout << "     --tmpfs <dir>       A tmpfs backed directory to benchmark in. Defaults to /dev/shm" << std::endl;
+    std::cout << "     --disk <dir>        A disk backed directory to benchmark in. Defaults to the working directory" << std::endl;
+    std::cout << "     --no-tmpfs          Skip the tmpfs backend" << std::endl;
+    std::cout << "     --no-disk           Skip the disk backend" << std::endl;
+    std::cout << "     --runs <n>          The number of timed runs per mode, the median is reported. Defaults to 3" << std::endl;
+    std::cout << "     --mode <name=args>  Benchmark parcp with the specified arguments. May be repeated. Defaults to" << std::endl;
+    std::cout << "                         logging, quiet (-q), progress (-q --progress), latency (-q --latency) and" << std::endl;
+    std::cout << "                         single (-q --max-memory 1, which copies everything in one process)" << std::endl;
+    std::cout << "     --out <file>        Where to save the results as JSON. Defaults to parcp-bench.json" << std::endl;
+    std::cout << "     --compare <file>    Compare against previously saved results, failing on a regression" << std::endl;
+    std::cout << "     --threshold <pct>   The drop in throughput that counts as a regression. Defaults to 5" << std::endl;
+    std::cout << "     --verify            Check that every copy matches the source byte for byte" << std::endl;
+    std::cout << "     --faults <spec>     Run parcp with PARCP_FAULTS=<spec> to inject I/O faults. parcp must be built" << std::endl;
+    std::cout << "                         with -DPARCP_FAULT_INJECTION=ON, see sys.cpp for the syntax" << std::endl;
+    std::cout << "     --alloc-counter <lib> The library preloaded to count heap allocations. Defaults to the one built" << std::endl;
+    std::cout << "                         alongside this program" << std::endl;
+    std::cout << "     --no-allocations    Skip the run that counts heap allocations" << std::endl;
+    std::cout << "     --keep              Don't remove the generated tree and copies when done" << std::endl;
+    std::cout << "     --generate <dir>    Only generate the tree in the specified directory, don't benchmark" << std::endl;
+    std::cout << std::endl;
+    std::cout << "tree" << std::endl;
+    std::cout << "     --depth <n>         Levels of subdirectories below the root. Defaults to 3" << std::endl;
+    std::cout << "     --fanout <n>        Subdirectories per directory. Defaults to 4" << std::endl;
+    std::cout << "     --files <n>         Entries per directory. Defaults to 16" << std::endl;
+    std::cout << "     --sizes <spec>      File size distribution: fixed:<bytes>, uniform:<min>:<max> or" << std::endl;
+    std::cout << "                         lognormal:<median>:<sigma>[:<max>]. Defaults to lognormal:16K:1.5:64M" << std::endl;
+    std::cout << "     --sparse <f>        Fraction of files that are sparse. Defaults to 0.05" << std::endl;
+    std::cout << "     --symlinks <f>      Fraction of entries that are symlinks. Defaults to 0.05" << std::endl;
+    std::cout << "     --hardlinks <f>     Fraction of entries that are hard links. Defaults to 0.05" << std::endl;
+    std::cout << "     --seed <n>          The seed for the tree generator. Defaults to 3540" << std::endl;
+}
@@ -0,0 +1,220 @@
+/*
+ * Copyright (c) 2016 Nathan Lowe
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of this software
+ * and associated documentation files (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all copies or substantial
+ * portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT
+ * LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN
+ * NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <cstdlib>
+#include <iostream>
+#include <string>
+#include <vector>
+#include "treegen.h"
+#include "Logger.h"
+
+L3::Logger Log("faulttest");
+
+/** A set of faults to copy a tree under, and whether or not parcp should still manage to copy all of it */
+struct Scenario
+{
+    std::string Name;
+    std::string Faults;
+    bool ShouldSucceed;
+};
+
+/**
+ * Interrupted calls and short transfers must be retried until the copy is complete. Errors must fail the copy, and
+ * whatever was copied before the failure has to be correct: files that couldn't be written in full are removed.
+ */
+static const std::vector<Scenario> Scenarios = {
+        {"eintr", "all:eintr=0.2", true},
+        {"short", "read:short=0.5,write:short=0.5", true},
+        {"eintr+short", "read:eintr=0.1,read:short=0.3,write:eintr=0.1,write:short=0.3,close:eintr=0.5", true},
+        {"enospc", "write:enospc=262144", false},
+        {"write-eio", "write:eio=0.05", false},
+        {"close-eio", "close:eio=0.2", false},
+};
+
+/**
+ * Copy the source to the destination under the specified faults
+ *
+ * @param parcp the parcp binary to run
+ * @param faults the value for PARCP_FAULTS
+ * @param source the directory to copy
+ * @param dest the directory to copy into
+ * @return parcp's exit status, or -1 if it couldn't be run
+ */
+int RunParcp(const std::string& parcp, const std::string& faults, const std::string& source, const std::string& dest)
+{
+    std::vector<std::string> args = {parcp, "-q", "-f", source, "-t", dest};
+
+    std::vector<char*> argv;
+    for(auto& arg : args) argv.push_back(const_cast<char*>(arg.c_str()));
+    argv.push_back(nullptr);
+
+    auto pid = fork();
+    if(pid == 0)
+    {
+        int devNull = open("/dev/null", O_WRONLY);
+        dup2(devNull, STDOUT_FILENO);
+        dup2(devNull, STDERR_FILENO);
+
+        setenv("PARCP_FAULTS", faults.c_str(), 1);
+        setenv("PARCP_FAULT_SEED", "3540", 1);
+
+        execv(parcp.c_str(), argv.data());
+        _exit(127);
+    }
+    else if(pid < 0)
+    {
+        Log.Error("Unable to fork (errno " + std::to_string(errno) + ")");
+        return -1;
+    }
+
+    int status;
+    if(waitpid(pid, &status, 0) < 0)
+    {
+        Log.Error("Unable to wait for parcp (errno " + std::to_string(errno) + ")");
+        return -1;
+    }
+
+    int exitStatus = WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+    if(exitStatus == 127) Log.Error("Unable to run " + parcp);
+
+    return exitStatus;
+}
+
+/**
+ * Run a single scenario
+ *
+ * @return true iff parcp failed or succeeded as expected, and the copy matches the source
+ */
+bool RunScenario(const std::string& parcp, const Scenario& scenario, const std::string& source, const std::string& dest)
+{
+    TreeGen::RemoveTree(dest);
+
+    auto status = RunParcp(parcp, scenario.Faults, source, dest);
+    if(status < 0 || status == 127) return false;
+
+    if(scenario.ShouldSucceed && status != 0)
+    {
+        Log.Error("[" + scenario.Name + "] parcp exited with " + std::to_string(status) + ", expected it to recover");
+        return false;
+    }
+
+    if(!scenario.ShouldSucceed && status == 0)
+    {
+        Log.Error("[" + scenario.Name + "] parcp exited with 0, expected the faults to fail the copy");
+        return false;
+    }
+
+    std::string difference;
+    if(!TreeGen::CompareTrees(source, dest, difference, !scenario.ShouldSucceed))
+    {
+        Log.Error("[" + scenario.Name + "] Copy does not match: " + difference);
+        return false;
+    }
+
+    Log.Info("[" + scenario.Name + "] ok");
+    return true;
+}
+
+void PrintUsage()
+{
+    std::cout << "parcp-faulttest: Copy a generated tree with parcp while injecting I/O faults, and check the result" << std::endl;
+    std::cout << std::endl;
+    std::cout << "Usage:" << std::endl;
+    std::cout << "     parcp-faulttest [--parcp <path>] [--dir <dir>] [--keep]" << std::endl;
+    std::cout << std::endl;
+    std::cout << "     --parcp <path>      The parcp binary to test, which must be built with -DPARCP_FAULT_INJECTION=ON." << std::endl;
+    std::cout << "                         Defaults to the parcp-faults built alongside this program" << std::endl;
+    std::cout << "     --dir <dir>         The directory to generate and copy the tree in. Defaults to the working directory" << std::endl;
+    std::cout << "     --keep              Don't delete the generated tree and the last copy when done" << std::endl;
+}
+
+int main(int argc, char* argv[])
+{
+    std::string parcp = PARCP_FAULTTEST_DEFAULT_BINARY;
+    std::string dir = ".";
+    bool keep = false;
+
+    for(int i = 1; i < argc; i++)
+    {
+        auto arg = std::string(argv[i]);
+        if(arg == "--keep") keep = true;
+        else if(arg == "--parcp" && i < argc - 1) parcp = argv[++i];
+        else if(arg == "--dir" && i < argc - 1) dir = argv[++i];
+        else
+        {
+            PrintUsage();
+            return arg == "-h" || arg == "--help" ? 0 : -1;
+        }
+    }
+
+    auto base = dir + "/parcp-faulttest." + std::to_string(getpid());
+    auto source = base + "/src";
+    auto dest = base + "/dst";
+
+    if(mkdir(base.c_str(), 0755) != 0)
+    {
+        Log.Error("Unable to create " + base + " (errno " + std::to_string(errno) + ")");
+        return -1;
+    }
+
+    // Small enough to copy quickly, with enough directories that several workers run at once
+    TreeGen::Config tree;
+    tree.Depth = 2;
+    tree.FanOut = 3;
+    tree.FilesPerDirectory = 8;
+    TreeGen::SizeDistribution::Parse("lognormal:16K:1.5:1M", tree.Sizes);
+
+    TreeGen::Result generated;
+    if(!TreeGen::Generate(source, tree, generated))
+    {
+        TreeGen::RemoveTree(base);
+        return -1;
+    }
+
+    int failed = 0;
+
+    // Without fault injection, every scenario would test nothing at all
+    if(RunParcp(parcp, "", source, dest) != 0)
+    {
+        Log.Error(parcp + " can't inject faults, it must be built with -DPARCP_FAULT_INJECTION=ON");
+        failed++;
+    }
+    else
+    {
+        for(auto& scenario : Scenarios)
+        {
+            if(!RunScenario(parcp, scenario, source, dest)) failed++;
+        }
+    }
+
+    if(!keep) TreeGen::RemoveTree(base);
+
+    if(failed > 0)
+    {
+        Log.Error(std::to_string(failed) + " fault scenario(s) failed");
+        return 1;
+    }
+
+    return 0;
+}
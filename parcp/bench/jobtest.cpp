@@ -0,0 +1,275 @@
+/*
+ * Copyright (c) 2016 Nathan Lowe
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of this software
+ * and associated documentation files (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all copies or substantial
+ * portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT
+ * LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN
+ * NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include <sys/stat.h>
+#include <unistd.h>
+#include <atomic>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include "treegen.h"
+#include "Logger.h"
+#include "parcp.h"
+
+L3::Logger Log("jobtest");
+
+/** What a job told its callbacks */
+struct Observed
+{
+    std::atomic<uint64_t> Files{0};
+    std::atomic<uint64_t> Errors{0};
+    std::atomic<int> Completions{0};
+    std::atomic<int> Result{1};
+};
+
+/** Point a job's callbacks at what they should be recorded in */
+Parcp::JobOptions Options(const std::string& source, const std::string& dest, Observed& observed)
+{
+    Parcp::JobOptions options;
+    options.Source = source;
+    options.Dest = dest;
+    options.OnFile = [&observed](const std::string&, const std::string&, const struct stat&) { observed.Files++; };
+    options.OnError = [&observed](const std::string&, int) { observed.Errors++; };
+    options.OnComplete = [&observed](int result) {
+        observed.Result = result;
+        observed.Completions++;
+    };
+
+    return options;
+}
+
+/**
+ * Check that a job finished the way it should have, and told its callbacks about it once
+ *
+ * @return true iff the job's result, its callbacks and its progress agree with expected
+ */
+bool CheckFinished(const std::string& name, Parcp::Job& job, const Observed& observed, int expected)
+{
+    auto result = job.Wait();
+    if(result != expected || !job.Done())
+    {
+        Log.Error("[" + name + "] Wait returned " + std::to_string(result) + ", expected " + std::to_string(expected));
+        return false;
+    }
+
+    if(observed.Completions != 1 || observed.Result != expected)
+    {
+        Log.Error("[" + name + "] OnComplete was called " + std::to_string(observed.Completions) + " time(s) with " + std::to_string(observed.Result));
+        return false;
+    }
+
+    auto progress = job.Progress();
+    if(progress.FilesCopied != observed.Files || progress.Errors != observed.Errors)
+    {
+        Log.Error("[" + name + "] OnFile/OnError saw " + std::to_string(observed.Files) + "/" + std::to_string(observed.Errors) +
+                  " entries, the job counted " + std::to_string(progress.FilesCopied) + "/" + std::to_string(progress.Errors));
+        return false;
+    }
+
+    return true;
+}
+
+/** Two jobs copying at once on the same pool both make complete copies, without logging every file */
+bool TestConcurrent(Parcp::ThreadPool& pool, const std::string& source, const std::string& base)
+{
+    Observed first, second;
+    Parcp::Job a(Options(source, base + "/a", first), pool);
+    Parcp::Job b(Options(source, base + "/b", second), pool);
+
+    std::ostringstream output;
+    auto previous = L3::GlobalOutput;
+    L3::GlobalOutput = &output;
+
+    bool started = a.Start() && b.Start();
+    bool ok = CheckFinished("concurrent/a", a, first, 0) && CheckFinished("concurrent/b", b, second, 0);
+
+    L3::GlobalOutput = previous;
+
+    if(!started || !ok) return false;
+
+    if(first.Files == 0 || first.Files != second.Files)
+    {
+        Log.Error("[concurrent] The jobs copied " + std::to_string(first.Files) + " and " + std::to_string(second.Files) + " files");
+        return false;
+    }
+
+    std::string difference;
+    for(auto& dest : {base + "/a", base + "/b"})
+    {
+        if(!TreeGen::CompareTrees(source, dest, difference))
+        {
+            Log.Error("[concurrent] Copy does not match: " + difference);
+            return false;
+        }
+    }
+
+    if(!output.str().empty())
+    {
+        Log.Error("[concurrent] Jobs logged at their default level: " + output.str());
+        return false;
+    }
+
+    Log.Info("[concurrent] ok");
+    return true;
+}
+
+/** Include/exclude rules are applied, and a job asked to log at INFO does */
+bool TestFilters(Parcp::ThreadPool& pool, const std::string& source, const std::string& base)
+{
+    Observed observed;
+    auto options = Options(source, base + "/filtered", observed);
+    options.FilterRules.push_back(Filter::Rule{false, "*"});
+    options.LogLevel = L3::Level::DEBUG;
+    Parcp::Job job(options, pool);
+
+    std::ostringstream output;
+    auto previous = L3::GlobalOutput;
+    auto previousLevel = L3::GlobalLogLevel;
+    L3::GlobalOutput = &output;
+    L3::GlobalLogLevel = L3::Level::DEBUG;
+
+    bool ok = job.Start() && CheckFinished("filters", job, observed, 0);
+
+    L3::GlobalOutput = previous;
+    L3::GlobalLogLevel = previousLevel;
+
+    if(!ok) return false;
+
+    if(observed.Files != 0 || job.Progress().Excluded == 0 || output.str().find("Excluding") == std::string::npos)
+    {
+        Log.Error("[filters] Copied " + std::to_string(observed.Files) + " files and excluded " + std::to_string(job.Progress().Excluded) + " entries");
+        return false;
+    }
+
+    Log.Info("[filters] ok");
+    return true;
+}
+
+/** A cancelled job stops, fails, and still finishes */
+bool TestCancel(Parcp::ThreadPool& pool, const std::string& source, const std::string& base)
+{
+    Observed observed;
+    Parcp::Job job(Options(source, base + "/cancelled", observed), pool);
+
+    if(!job.Start()) return false;
+    job.Cancel();
+
+    if(!CheckFinished("cancel", job, observed, -1)) return false;
+
+    Log.Info("[cancel] ok");
+    return true;
+}
+
+/** A job that can't start reports the failure through its callbacks, and can still be waited on */
+bool TestMissingSource(Parcp::ThreadPool& pool, const std::string& base)
+{
+    Observed observed;
+    Parcp::JobOptions options = Options(base + "/missing", base + "/nowhere", observed);
+    options.LogLevel = L3::Level::OFF;
+    Parcp::Job job(options, pool);
+
+    if(job.Start())
+    {
+        Log.Error("[missing] Started a job on a source that doesn't exist");
+        return false;
+    }
+
+    if(!CheckFinished("missing", job, observed, -1)) return false;
+
+    if(observed.Errors != 1)
+    {
+        Log.Error("[missing] OnError was called " + std::to_string(observed.Errors) + " time(s)");
+        return false;
+    }
+
+    Log.Info("[missing] ok");
+    return true;
+}
+
+void PrintUsage()
+{
+    std::cout << "parcp-jobtest: Copy a generated tree with libparcp jobs, and check the copies and the callbacks" << std::endl;
+    std::cout << std::endl;
+    std::cout << "Usage:" << std::endl;
+    std::cout << "     parcp-jobtest [--dir <dir>] [--keep]" << std::endl;
+    std::cout << std::endl;
+    std::cout << "     --dir <dir>         The directory to generate and copy the tree in. Defaults to the working directory" << std::endl;
+    std::cout << "     --keep              Don't delete the generated tree and the copies when done" << std::endl;
+}
+
+int main(int argc, char* argv[])
+{
+    std::string dir = ".";
+    bool keep = false;
+
+    for(int i = 1; i < argc; i++)
+    {
+        auto arg = std::string(argv[i]);
+        if(arg == "--keep") keep = true;
+        else if(arg == "--dir" && i < argc - 1) dir = argv[++i];
+        else
+        {
+            PrintUsage();
+            return arg == "-h" || arg == "--help" ? 0 : -1;
+        }
+    }
+
+    auto base = dir + "/parcp-jobtest." + std::to_string(getpid());
+    auto source = base + "/src";
+
+    if(mkdir(base.c_str(), 0755) != 0)
+    {
+        Log.Error("Unable to create " + base + " (errno " + std::to_string(errno) + ")");
+        return -1;
+    }
+
+    // Enough directories that both jobs have tasks on every thread at once
+    TreeGen::Config tree;
+    tree.Depth = 2;
+    tree.FanOut = 4;
+    tree.FilesPerDirectory = 8;
+    TreeGen::SizeDistribution::Parse("lognormal:4K:1.5:256K", tree.Sizes);
+
+    TreeGen::Result generated;
+    if(!TreeGen::Generate(source, tree, generated))
+    {
+        TreeGen::RemoveTree(base);
+        return -1;
+    }
+
+    int failed = 0;
+    {
+        Parcp::ThreadPool pool(4);
+
+        if(!TestConcurrent(pool, source, base)) failed++;
+        if(!TestFilters(pool, source, base)) failed++;
+        if(!TestCancel(pool, source, base)) failed++;
+        if(!TestMissingSource(pool, base)) failed++;
+    }
+
+    if(!keep) TreeGen::RemoveTree(base);
+
+    if(failed > 0)
+    {
+        Log.Error(std::to_string(failed) + " job test(s) failed");
+        return 1;
+    }
+
+    return 0;
+}
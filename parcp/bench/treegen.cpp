@@ -0,0 +1,479 @@
+/*
+ * Copyright (c) 2016 Nathan Lowe
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of this software
+ * and associated documentation files (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all copies or substantial
+ * portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT
+ * LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN
+ * NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cerrno>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <random>
+#include <sstream>
+#include <vector>
+#include "treegen.h"
+#include "Logger.h"
+#include "util.h"
+
+/** The size of the buffer used to fill files with data */
+#define TREEGEN_BUFFER_SIZE (1024 * 1024)
+/** The size of each written extent in a sparse file */
+#define TREEGEN_SPARSE_EXTENT 4096
+/** The smallest apparent size of a sparse file, so the hole is worth something */
+#define TREEGEN_SPARSE_MIN_SIZE (8 * 1024 * 1024)
+
+namespace TreeGen
+{
+    L3::Logger Log("TreeGen");
+
+    /**
+     * The state of a single generation run. All randomness comes straight from a mt19937_64, whose output is fully
+     * specified by the standard, rather than the <random> distributions which are not. That keeps trees identical
+     * across standard libraries.
+     */
+    class Generator
+    {
+    public:
+        Generator(const std::string& root, const Config& config, Result& result)
+            : root(root), config(config), result(result), rng(config.Seed), buffer(TREEGEN_BUFFER_SIZE) {}
+
+        bool Run()
+        {
+            if(mkdir(root.c_str(), 0755) != 0)
+            {
+                Log.Error("Unable to create " + root + " (errno " + std::to_string(errno) + ")");
+                return false;
+            }
+
+            result.Directories++;
+            return Directory("", 0);
+        }
+
+    private:
+        const std::string& root;
+        const Config& config;
+        Result& result;
+        std::mt19937_64 rng;
+        std::vector<char> buffer;
+
+        /** Every regular file generated so far, relative to the root. Links always point at one of these */
+        std::vector<std::string> files;
+
+        /** A uniformly distributed double in [0, 1) */
+        double Uniform() { return (rng() >> 11) * (1.0 / 9007199254740992.0); }
+
+        /** A normally distributed double with a mean of 0 and a standard deviation of 1 (Box-Muller) */
+        double Normal()
+        {
+            double u1 = 1.0 - Uniform();
+            double u2 = Uniform();
+            return std::sqrt(-2.0 * std::log(u1)) * std::cos(2.0 * M_PI * u2);
+        }
+
+        uint64_t NextSize()
+        {
+            auto& d = config.Sizes;
+            switch(d.Shape)
+            {
+                case FIXED: return d.Min;
+                case UNIFORM: return d.Min + (uint64_t) (Uniform() * (double) (d.Max - d.Min + 1));
+                case LOGNORMAL:
+                {
+                    auto size = (double) d.Min * std::exp(d.Sigma * Normal());
+                    return size > (double) d.Max ? d.Max : (uint64_t) size;
+                }
+            }
+
+            return d.Min;
+        }
+
+        /** Fill the buffer with cheap, deterministic, incompressible bytes (splitmix64) */
+        void Fill(uint64_t seed, size_t length)
+        {
+            auto words = reinterpret_cast<uint64_t*>(buffer.data());
+            for(size_t i = 0; i < (length + 7) / 8; i++)
+            {
+                uint64_t z = (seed += 0x9E3779B97F4A7C15ull);
+                z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+                z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+                words[i] = z ^ (z >> 31);
+            }
+        }
+
+        bool WriteAll(int fd, uint64_t seed, uint64_t length, off_t offset)
+        {
+            while(length > 0)
+            {
+                auto chunk = (size_t) std::min<uint64_t>(length, buffer.size());
+                Fill(seed++, chunk);
+
+                if(pwrite(fd, buffer.data(), chunk, offset) != (ssize_t) chunk) return false;
+
+                offset += chunk;
+                length -= chunk;
+            }
+
+            return true;
+        }
+
+        bool RegularFile(const std::string& relative)
+        {
+            auto path = root + "/" + relative;
+            int fd = open(path.c_str(), O_CREAT | O_EXCL | O_WRONLY, 0644);
+            if(fd < 0)
+            {
+                Log.Error("Unable to create " + path + " (errno " + std::to_string(errno) + ")");
+                return false;
+            }
+
+            auto seed = rng();
+            auto size = NextSize();
+            bool ok;
+
+            if(Uniform() < config.SparseFraction)
+            {
+                // A few extents scattered through a big hole
+                if(size < TREEGEN_SPARSE_MIN_SIZE) size = TREEGEN_SPARSE_MIN_SIZE;
+
+                ok = ftruncate(fd, (off_t) size) == 0
+                     && WriteAll(fd, seed, TREEGEN_SPARSE_EXTENT, 0)
+                     && WriteAll(fd, seed + 1, TREEGEN_SPARSE_EXTENT, (off_t) (size / 2))
+                     && WriteAll(fd, seed + 2, TREEGEN_SPARSE_EXTENT, (off_t) (size - TREEGEN_SPARSE_EXTENT));
+
+                result.SparseFiles++;
+            }
+            else
+            {
+                ok = WriteAll(fd, seed, size, 0);
+            }
+
+            close(fd);
+
+            if(!ok)
+            {
+                Log.Error("Unable to write " + path + " (errno " + std::to_string(errno) + ")");
+                return false;
+            }
+
+            result.Files++;
+            result.Bytes += size;
+            files.push_back(relative);
+
+            return true;
+        }
+
+        bool Link(const std::string& relative, unsigned depth, bool hard)
+        {
+            auto& target = files[(size_t) (rng() % files.size())];
+            auto path = root + "/" + relative;
+
+            if(hard)
+            {
+                if(link((root + "/" + target).c_str(), path.c_str()) != 0)
+                {
+                    Log.Error("Unable to link " + path + " (errno " + std::to_string(errno) + ")");
+                    return false;
+                }
+
+                result.Hardlinks++;
+                return true;
+            }
+
+            // Symlinks are relative so the copied tree is self contained
+            std::string up;
+            for(unsigned i = 0; i < depth; i++) up += "../";
+
+            if(symlink((up + target).c_str(), path.c_str()) != 0)
+            {
+                Log.Error("Unable to symlink " + path + " (errno " + std::to_string(errno) + ")");
+                return false;
+            }
+
+            result.Symlinks++;
+            return true;
+        }
+
+        bool Directory(const std::string& relative, unsigned depth)
+        {
+            auto prefix = relative.empty() ? "" : relative + "/";
+
+            for(unsigned i = 0; i < config.FilesPerDirectory; i++)
+            {
+                auto name = prefix + "file" + std::to_string(i);
+                auto roll = Uniform();
+
+                bool ok;
+                if(!files.empty() && roll < config.SymlinkFraction) ok = Link(name + ".sym", depth, false);
+                else if(!files.empty() && roll < config.SymlinkFraction + config.HardlinkFraction) ok = Link(name + ".lnk", depth, true);
+                else ok = RegularFile(name + ".dat");
+
+                if(!ok) return false;
+            }
+
+            if(depth >= config.Depth) return true;
+
+            for(unsigned i = 0; i < config.FanOut; i++)
+            {
+                auto name = prefix + "dir" + std::to_string(i);
+                if(mkdir((root + "/" + name).c_str(), 0755) != 0)
+                {
+                    Log.Error("Unable to create " + name + " (errno " + std::to_string(errno) + ")");
+                    return false;
+                }
+
+                result.Directories++;
+                if(!Directory(name, depth + 1)) return false;
+            }
+
+            return true;
+        }
+    };
+
+    /**
+     * Parse a size distribution of the form "fixed:<bytes>", "uniform:<min>:<max>" or
+     * "lognormal:<median>:<sigma>[:<max>]". Byte counts may have a K, M or G suffix.
+     *
+     * @param spec the specification to parse
+     * @param result the parsed distribution
+     * @return true iff the specification was valid
+     */
+    bool SizeDistribution::Parse(const std::string& spec, SizeDistribution& result)
+    {
+        std::vector<std::string> parts;
+        std::istringstream in(spec);
+        std::string part;
+        while(std::getline(in, part, ':')) parts.push_back(part);
+
+        if(parts.empty()) return false;
+
+        SizeDistribution d;
+        if(parts[0] == "fixed" && parts.size() == 2)
+        {
+            d.Shape = FIXED;
+            if(!util::ParseBytes(parts[1], d.Min)) return false;
+            d.Max = d.Min;
+        }
+        else if(parts[0] == "uniform" && parts.size() == 3)
+        {
+            d.Shape = UNIFORM;
+            if(!util::ParseBytes(parts[1], d.Min) || !util::ParseBytes(parts[2], d.Max) || d.Max < d.Min) return false;
+        }
+        else if(parts[0] == "lognormal" && (parts.size() == 3 || parts.size() == 4))
+        {
+            d.Shape = LOGNORMAL;
+            if(!util::ParseBytes(parts[1], d.Min)) return false;
+
+            char* end = nullptr;
+            d.Sigma = strtod(parts[2].c_str(), &end);
+            if(*end != '\0' || d.Sigma < 0) return false;
+
+            if(parts.size() == 4 && !util::ParseBytes(parts[3], d.Max)) return false;
+        }
+        else
+        {
+            return false;
+        }
+
+        result = d;
+        return true;
+    }
+
+    /** Gets a human readable description of the distribution */
+    std::string SizeDistribution::Describe() const
+    {
+        switch(Shape)
+        {
+            case FIXED: return "fixed:" + std::to_string(Min);
+            case UNIFORM: return "uniform:" + std::to_string(Min) + ":" + std::to_string(Max);
+            case LOGNORMAL:
+            {
+                std::ostringstream out;
+                out << "lognormal:" << Min << ":" << Sigma << ":" << Max;
+                return out.str();
+            }
+        }
+
+        return "unknown";
+    }
+
+    /** Serialize the configuration as a JSON object */
+    std::string Config::ToJson() const
+    {
+        std::ostringstream out;
+        out << "{\"depth\": " << Depth << ", \"fan_out\": " << FanOut << ", \"files_per_directory\": " << FilesPerDirectory
+            << ", \"sizes\": \"" << Sizes.Describe() << "\", \"sparse_fraction\": " << SparseFraction
+            << ", \"symlink_fraction\": " << SymlinkFraction << ", \"hardlink_fraction\": " << HardlinkFraction
+            << ", \"seed\": " << Seed << "}";
+
+        return out.str();
+    }
+
+    /**
+     * Generate a tree in the specified directory, which must not exist yet
+     *
+     * @param root the directory to generate the tree in
+     * @param config the shape of the tree
+     * @param result a summary of what was generated
+     * @return true iff the tree was generated successfully
+     */
+    bool Generate(const std::string& root, const Config& config, Result& result)
+    {
+        result = Result();
+
+        Generator generator(root, config, result);
+        return generator.Run();
+    }
+
+    static int RemoveEntry(const char* path, const struct stat*, int, struct FTW*)
+    {
+        return remove(path) == 0 ? 0 : -1;
+    }
+
+    /**
+     * Recursively remove the specified path, if it exists
+     *
+     * @param path the path to remove
+     * @return true iff the path no longer exists
+     */
+    bool RemoveTree(const std::string& path)
+    {
+        struct stat s;
+        if(lstat(path.c_str(), &s) != 0) return errno == ENOENT;
+
+        return nftw(path.c_str(), RemoveEntry, 64, FTW_DEPTH | FTW_PHYS) == 0;
+    }
+
+    static bool CompareFiles(const std::string& a, const std::string& b, std::string& difference)
+    {
+        int fdA = open(a.c_str(), O_RDONLY);
+        int fdB = open(b.c_str(), O_RDONLY);
+
+        bool same = fdA >= 0 && fdB >= 0;
+        if(!same) difference = "unable to open " + (fdA < 0 ? a : b);
+
+        std::vector<char> bufA(TREEGEN_BUFFER_SIZE), bufB(TREEGEN_BUFFER_SIZE);
+        while(same)
+        {
+            auto lenA = read(fdA, bufA.data(), bufA.size());
+            auto lenB = read(fdB, bufB.data(), bufB.size());
+
+            if(lenA < 0 || lenB < 0)
+            {
+                difference = "unable to read " + (lenA < 0 ? a : b);
+                same = false;
+            }
+            else if(lenA != lenB || memcmp(bufA.data(), bufB.data(), (size_t) lenA) != 0)
+            {
+                difference = b + " differs from " + a;
+                same = false;
+            }
+            else if(lenA == 0)
+            {
+                break;
+            }
+        }
+
+        if(fdA >= 0) close(fdA);
+        if(fdB >= 0) close(fdB);
+
+        return same;
+    }
+
+    static bool CompareDirectory(const std::string& source, const std::string& copy, std::string& difference, bool allowMissing)
+    {
+        DIR* dir = opendir(source.c_str());
+        if(dir == nullptr)
+        {
+            difference = "unable to open " + source;
+            return false;
+        }
+
+        bool same = true;
+        struct dirent* entry;
+        while(same && (entry = readdir(dir)) != nullptr)
+        {
+            if(strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) continue;
+
+            auto from = source + "/" + entry->d_name;
+            auto to = copy + "/" + entry->d_name;
+
+            struct stat a, b;
+            if(lstat(from.c_str(), &a) != 0) continue;
+            if(!S_ISDIR(a.st_mode) && !S_ISREG(a.st_mode) && !S_ISLNK(a.st_mode)) continue;
+
+            if(lstat(to.c_str(), &b) != 0)
+            {
+                if(allowMissing) continue;
+
+                difference = to + " is missing";
+                same = false;
+            }
+            else if((a.st_mode & S_IFMT) != (b.st_mode & S_IFMT))
+            {
+                difference = to + " is not the same type as " + from;
+                same = false;
+            }
+            else if(S_ISDIR(a.st_mode))
+            {
+                same = CompareDirectory(from, to, difference, allowMissing);
+            }
+            else if(a.st_size != b.st_size)
+            {
+                difference = to + " is " + std::to_string(b.st_size) + " bytes, expected " + std::to_string(a.st_size);
+                same = false;
+            }
+            else if(S_ISLNK(a.st_mode))
+            {
+                std::vector<char> targetA((size_t) a.st_size + 1), targetB((size_t) b.st_size + 1);
+                auto lenA = readlink(from.c_str(), targetA.data(), targetA.size());
+                auto lenB = readlink(to.c_str(), targetB.data(), targetB.size());
+
+                if(lenA != lenB || lenA < 0 || memcmp(targetA.data(), targetB.data(), (size_t) lenA) != 0)
+                {
+                    difference = to + " does not point at the same target as " + from;
+                    same = false;
+                }
+            }
+            else
+            {
+                same = CompareFiles(from, to, difference);
+            }
+        }
+
+        closedir(dir);
+        return same;
+    }
+
+    /**
+     * Check that a copy of a tree matches the original: every directory, regular file and symlink in the source
+     * must exist in the copy with the same type, size and content (or link target). Other special files are skipped.
+     *
+     * @param source the original tree
+     * @param copy the copy to check
+     * @param difference a description of the first difference found
+     * @return true iff the copy matches the source
+     */
+    bool CompareTrees(const std::string& source, const std::string& copy, std::string& difference, bool allowMissing)
+    {
+        return CompareDirectory(source, copy, difference, allowMissing);
+    }
+}
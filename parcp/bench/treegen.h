@@ -0,0 +1,127 @@
+/*
+ * Copyright (c) 2016 Nathan Lowe
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of this software
+ * and associated documentation files (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all copies or substantial
+ * portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT
+ * LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN
+ * NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef EECS3540_BENCH_TREEGEN_H
+#define EECS3540_BENCH_TREEGEN_H
+
+#include <cstdint>
+#include <string>
+
+namespace TreeGen
+{
+    /** The shape of the file size distribution */
+    enum Distribution {
+        /** Every file is exactly Min bytes */
+        FIXED,
+        /** Sizes are spread evenly between Min and Max bytes */
+        UNIFORM,
+        /** Sizes follow a log-normal distribution with a median of Min bytes and a shape of Sigma, capped at Max */
+        LOGNORMAL
+    };
+
+    /** A distribution of file sizes */
+    struct SizeDistribution
+    {
+        Distribution Shape = LOGNORMAL;
+        uint64_t Min = 16 * 1024;
+        uint64_t Max = 64 * 1024 * 1024;
+        double Sigma = 1.5;
+
+        /**
+         * Parse a size distribution of the form "fixed:<bytes>", "uniform:<min>:<max>" or
+         * "lognormal:<median>:<sigma>[:<max>]". Byte counts may have a K, M or G suffix.
+         *
+         * @param spec the specification to parse
+         * @param result the parsed distribution
+         * @return true iff the specification was valid
+         */
+        static bool Parse(const std::string& spec, SizeDistribution& result);
+
+        /** Gets a human readable description of the distribution */
+        std::string Describe() const;
+    };
+
+    /** Everything that determines the shape and content of a generated tree */
+    struct Config
+    {
+        /** The number of levels of subdirectories below the root */
+        unsigned Depth = 3;
+        /** The number of subdirectories in each directory above the deepest level */
+        unsigned FanOut = 4;
+        /** The number of files in each directory */
+        unsigned FilesPerDirectory = 16;
+        /** The distribution of regular file sizes */
+        SizeDistribution Sizes;
+        /** The fraction of files that are sparse (a few written extents in a large hole) */
+        double SparseFraction = 0.05;
+        /** The fraction of entries that are symbolic links to another file in the tree */
+        double SymlinkFraction = 0.05;
+        /** The fraction of entries that are hard links to another file in the tree */
+        double HardlinkFraction = 0.05;
+        /** The seed for the generator. The same seed and config always produce the same tree */
+        uint64_t Seed = 3540;
+
+        /** Serialize the configuration as a JSON object */
+        std::string ToJson() const;
+    };
+
+    /** A summary of a generated tree */
+    struct Result
+    {
+        uint64_t Directories = 0;
+        uint64_t Files = 0;
+        uint64_t SparseFiles = 0;
+        uint64_t Symlinks = 0;
+        uint64_t Hardlinks = 0;
+        /** The apparent size of every regular file (not counting hard links twice) */
+        uint64_t Bytes = 0;
+    };
+
+    /**
+     * Generate a tree in the specified directory, which must not exist yet
+     *
+     * @param root the directory to generate the tree in
+     * @param config the shape of the tree
+     * @param result a summary of what was generated
+     * @return true iff the tree was generated successfully
+     */
+    bool Generate(const std::string& root, const Config& config, Result& result);
+
+    /**
+     * Recursively remove the specified path, if it exists
+     *
+     * @param path the path to remove
+     * @return true iff the path no longer exists
+     */
+    bool RemoveTree(const std::string& path);
+
+    /**
+     * Check that a copy of a tree matches the original: every directory, regular file and symlink in the source
+     * must exist in the copy with the same type, size and content (or link target). Other special files are skipped.
+     *
+     * @param source the original tree
+     * @param copy the copy to check
+     * @param difference a description of the first difference found
+     * @param allowMissing whether entries missing from the copy are fine, for checking what's left of a failed copy
+     * @return true iff the copy matches the source
+     */
+    bool CompareTrees(const std::string& source, const std::string& copy, std::string& difference, bool allowMissing = false);
+}
+
+#endif //EECS3540_BENCH_TREEGEN_H
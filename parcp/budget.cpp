@@ -0,0 +1,314 @@
+/*
+ * Copyright (c) 2016 Nathan Lowe
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of this software
+ * and associated documentation files (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all copies or substantial
+ * portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT
+ * LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN
+ * NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include <sys/mman.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <limits>
+#include <new>
+#include <unordered_map>
+#include <vector>
+#include "budget.h"
+#include "compress.h"
+#include "Logger.h"
+#include "opts.h"
+#include "stats.h"
+#include "sys.h"
+#include "util.h"
+
+/** How much of the temporary file is written or read at a time */
+#define BUDGET_SPILL_CHUNK (64 * 1024)
+
+namespace Budget
+{
+    L3::Logger Log("Budget");
+
+    /** Backing storage used until the slots are created or attached to, which never runs out */
+    static Slots localSlots = {{std::numeric_limits<int64_t>::max()}};
+
+    Slots* Shared = &localSlots;
+
+    uint64_t WorkerMemory()
+    {
+        auto memory = (uint64_t) BUDGET_WORKER_MEMORY + BUDGET_QUEUE_MEMORY;
+
+        // Each worker runs its own compression pipeline
+        if(Options::CommandLineArgs.Compression != Compress::NONE || Options::CommandLineArgs.Decompress)
+        {
+            memory += Compress::PipelineMemory();
+        }
+
+        return memory;
+    }
+
+    /**
+     * Map the slots backed by the specified file descriptor
+     *
+     * @param fd the file descriptor to map
+     * @return the mapped slots, or nullptr if the mapping failed
+     */
+    static Slots* Map(int fd)
+    {
+        void* mem = mmap(nullptr, sizeof(Slots), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        return mem == MAP_FAILED ? nullptr : static_cast<Slots*>(mem);
+    }
+
+    int Create(uint64_t maxMemory)
+    {
+        // Not close-on-exec: the descriptor has to survive into the workers we exec
+        int fd = memfd_create("parcp-budget", 0);
+        if(fd < 0 || ftruncate(fd, sizeof(Slots)) != 0)
+        {
+            Log.Fatal("Unable to create shared memory for the memory budget (errno " + std::to_string(errno) + ")");
+            if(fd >= 0) close(fd);
+            return -1;
+        }
+
+        auto mapped = Map(fd);
+        if(mapped == nullptr)
+        {
+            Log.Fatal("Unable to map shared memory for the memory budget (errno " + std::to_string(errno) + ")");
+            close(fd);
+            return -1;
+        }
+
+        // The root process is a worker too, and always runs no matter how small the budget is
+        auto workers = std::max((uint64_t) 1, maxMemory / WorkerMemory());
+        Shared = new (mapped) Slots();
+        Shared->Free.store((int64_t) std::min(workers, (uint64_t) std::numeric_limits<int64_t>::max()) - 1);
+
+        Log.Debug("A memory budget of " + Stats::HumanBytes((double) maxMemory) + " allows for " + std::to_string(workers) + " workers");
+        return fd;
+    }
+
+    bool Attach(int fd)
+    {
+        auto mapped = Map(fd);
+        if(mapped == nullptr)
+        {
+            Log.Warn("Unable to attach to the shared memory budget (errno " + std::to_string(errno) + ")");
+            return false;
+        }
+
+        Shared = mapped;
+        return true;
+    }
+
+    bool TryAcquire()
+    {
+        auto free = Shared->Free.load();
+        while(free > 0)
+        {
+            if(Shared->Free.compare_exchange_weak(free, free - 1)) return true;
+        }
+
+        return false;
+    }
+
+    void Release()
+    {
+        Shared->Free.fetch_add(1);
+    }
+
+    /** Append a length prefixed string to a record */
+    static void AppendField(std::string& record, const std::string& field)
+    {
+        auto length = (uint32_t) field.size();
+        record.append(reinterpret_cast<const char*>(&length), sizeof(length));
+        record.append(field);
+    }
+
+    /**
+     * Read a length prefixed string from a buffer
+     *
+     * @param data the buffer
+     * @param size the size of the buffer
+     * @param offset where to read from, moved past the string
+     * @param field set to the string
+     * @return false if the buffer ends before the string does
+     */
+    static bool ReadField(const char* data, size_t size, size_t& offset, std::string& field)
+    {
+        uint32_t length;
+        if(size - offset < sizeof(length)) return false;
+        memcpy(&length, data + offset, sizeof(length));
+
+        if(size - offset - sizeof(length) < length) return false;
+        field.assign(data + offset + sizeof(length), length);
+        offset += sizeof(length) + length;
+
+        return true;
+    }
+
+    Pending::~Pending()
+    {
+        if(fd >= 0) close(fd);
+    }
+
+    /** The memory used by the queued directories, including the nodes of directories that have been handed out */
+    size_t Pending::Memory() const
+    {
+        return arena.Used() + queued.size() * sizeof(const Path::Node*);
+    }
+
+    bool Pending::Push(const Path::Node* parent, const char* name, size_t length)
+    {
+        if(Memory() + sizeof(Path::Node) + sizeof(const Path::Node*) + length <= BUDGET_QUEUE_MEMORY || queued.empty())
+        {
+            queued.push_back(arena.Make(parent, name, length));
+            return true;
+        }
+
+        if(fd < 0)
+        {
+            fd = util::TemporaryFile("queue", false);
+            if(fd < 0)
+            {
+                Log.Error("[" + std::to_string(getpid()) + "] Unable to create a temporary file for queued directories (errno " + std::to_string(errno) + ")");
+                failed = true;
+                return false;
+            }
+
+            Log.Debug("[" + std::to_string(getpid()) + "] Spilling queued directories to a temporary file");
+        }
+
+        std::string path;
+        Path::Node{parent, name, length}.AppendTo(path);
+        AppendField(spillBuffer, path);
+
+        return spillBuffer.size() < BUDGET_SPILL_CHUNK || Flush();
+    }
+
+    bool Pending::Pop(const Path::Node*& directory)
+    {
+        if(queued.empty())
+        {
+            // Nothing refers to the nodes any more, including the one handed out last
+            arena.Reset();
+            compacted = 0;
+
+            if(!Refill() || queued.empty()) return false;
+        }
+        else if(arena.Used() >= BUDGET_QUEUE_MEMORY / 2 && arena.Used() > 2 * compacted)
+        {
+            Compact();
+        }
+
+        directory = queued.back();
+        queued.pop_back();
+
+        return true;
+    }
+
+    /**
+     * Copy a node, and any of its parents that haven't been copied yet, to another arena
+     *
+     * @param node the node to copy
+     * @param to the arena to copy it to
+     * @param moved the nodes copied so far, and their copies
+     * @return the copy
+     */
+    static const Path::Node* Move(const Path::Node* node, Path::Arena& to, std::unordered_map<const Path::Node*, const Path::Node*>& moved)
+    {
+        auto found = moved.find(node);
+        if(found != moved.end()) return found->second;
+
+        auto copy = to.Make(Move(node->Parent, to, moved), node->Name, node->Length);
+        moved.emplace(node, copy);
+
+        return copy;
+    }
+
+    /**
+     * Free the nodes of directories that have been handed out and have nothing queued under them any more, by moving
+     * the rest to a new arena
+     */
+    void Pending::Compact()
+    {
+        auto before = arena.Used();
+
+        Path::Arena fresh;
+        std::unordered_map<const Path::Node*, const Path::Node*> moved = {{&root, &root}};
+        for(auto& node : queued) node = Move(node, fresh, moved);
+
+        arena = std::move(fresh);
+        compacted = arena.Used();
+
+        Log.Trace("[" + std::to_string(getpid()) + "] Compacted queued directories from " + std::to_string(before) + " to " + std::to_string(compacted) + " bytes");
+    }
+
+    /** Write out the records waiting in the spill buffer */
+    bool Pending::Flush()
+    {
+        if(spillBuffer.empty()) return true;
+
+        auto count = Sys::PwriteAll(fd, spillBuffer.data(), spillBuffer.size(), (off_t) written, 0);
+        written += count;
+        if(count != spillBuffer.size())
+        {
+            Log.Error("[" + std::to_string(getpid()) + "] Unable to write queued directories to a temporary file (errno " + std::to_string(errno) + ")");
+            failed = true;
+        }
+
+        spillBuffer.clear();
+        return !failed;
+    }
+
+    /** Read spilled directories back into memory, until the memory for the queue is used up again */
+    bool Pending::Refill()
+    {
+        if(fd < 0 || failed || !Flush()) return false;
+
+        std::vector<char> chunk(BUDGET_SPILL_CHUNK);
+        std::string path;
+        while(read < written && Memory() < BUDGET_QUEUE_MEMORY)
+        {
+            auto wanted = (size_t) std::min((uint64_t) chunk.size(), written - read);
+            auto count = Sys::Pread(fd, chunk.data(), wanted, (off_t) read, 0);
+            if(count <= 0)
+            {
+                Log.Error("[" + std::to_string(getpid()) + "] Unable to read queued directories back from a temporary file (errno " + std::to_string(errno) + ")");
+                failed = true;
+                return false;
+            }
+
+            // Only take whole records, the rest is read again next time
+            size_t used = 0;
+            while(Memory() < BUDGET_QUEUE_MEMORY && ReadField(chunk.data(), (size_t) count, used, path))
+            {
+                queued.push_back(arena.Make(&root, path.data(), path.size()));
+            }
+
+            // A record bigger than the chunk can only be read with a bigger chunk
+            if(used == 0) chunk.resize(chunk.size() * 2);
+            read += used;
+        }
+
+        // Start over at the beginning of the file once everything in it has been read back
+        if(read == written)
+        {
+            read = written = 0;
+            if(ftruncate(fd, 0) != 0) Log.Debug("[" + std::to_string(getpid()) + "] Unable to truncate the queued directory file (errno " + std::to_string(errno) + ")");
+        }
+
+        return true;
+    }
+}
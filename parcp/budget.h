@@ -0,0 +1,141 @@
+/*
+ * Copyright (c) 2016 Nathan Lowe
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of this software
+ * and associated documentation files (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all copies or substantial
+ * portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT
+ * LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN
+ * NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef EECS3540_BUDGET_H
+#define EECS3540_BUDGET_H
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+#include "path.h"
+
+/** A rough upper bound on the memory used by a worker process, measured as its RSS while copying */
+#define BUDGET_WORKER_MEMORY (4 * 1024 * 1024)
+/** The most memory a worker spends on directories it has queued, beyond which they are spilled to a temporary file */
+#define BUDGET_QUEUE_MEMORY (256 * 1024)
+
+/**
+ * Bounds the memory used by a copy (--max-memory). The budget is split into worker slots shared by every process: a
+ * worker only forks a new worker for a subdirectory if it can take a slot, otherwise it queues the subdirectory and
+ * copies it itself once it's done with its own directory. That keeps the number of live processes (and so their
+ * buffers) fixed, and slows down scanning to the rate the workers that exist can copy at. The queue itself is kept to
+ * BUDGET_QUEUE_MEMORY, anything beyond that waits in a temporary file.
+ */
+namespace Budget
+{
+    /** The worker slots, in shared memory */
+    struct Slots
+    {
+        /** The number of workers that can still be started */
+        std::atomic<int64_t> Free;
+    };
+
+    /** The slots for the current copy. Always valid, without a limit until Create or Attach has been called */
+    extern Slots* Shared;
+
+    /**
+     * The memory a single worker is expected to need with the current options
+     *
+     * @return the expected memory in bytes
+     */
+    uint64_t WorkerMemory();
+
+    /**
+     * Create the shared slots. This should only be called by the root process, before any workers are forked
+     *
+     * @param maxMemory the memory budget for the whole copy
+     * @return the file descriptor that workers should attach to, or -1 on failure
+     */
+    int Create(uint64_t maxMemory);
+
+    /**
+     * Attach to the shared slots created by the root process
+     *
+     * @param fd the file descriptor passed down from the parent process
+     * @return true iff the slots were mapped successfully
+     */
+    bool Attach(int fd);
+
+    /** Take a slot for a new worker, if one is free */
+    bool TryAcquire();
+
+    /** Give back the slot of a worker that has exited */
+    void Release();
+
+    /**
+     * The directories a worker has yet to copy itself, as paths relative to the directory the worker was started on.
+     * Directories are handed out newest first, so the queue grows with the depth of the tree rather than its width.
+     * Queued directories are nodes in an arena that share their parents' names, and once the queue takes up
+     * BUDGET_QUEUE_MEMORY further directories are appended to a temporary file, to be read back once the ones in
+     * memory have all been handed out.
+     */
+    class Pending
+    {
+    public:
+        ~Pending();
+
+        /** The directory the worker was started on, which every queued directory is relative to */
+        const Path::Node* Root() const { return &root; }
+
+        /**
+         * Queue a directory
+         *
+         * @param parent the directory it was found in, either Root() or a directory handed out by Pop
+         * @param name the name of the directory
+         * @param length the length of the name
+         * @return false if it had to be spilled and the temporary file couldn't be written
+         */
+        bool Push(const Path::Node* parent, const char* name, size_t length);
+
+        /**
+         * Take the next directory to copy
+         *
+         * @param directory set to the directory, which stays valid until the next call to Pop
+         * @return false if there are none left (or the rest couldn't be read back, see Failed)
+         */
+        bool Pop(const Path::Node*& directory);
+
+        /** Whether or not any directories were lost because the temporary file couldn't be written or read */
+        bool Failed() const { return failed; }
+
+    private:
+        const Path::Node root = {nullptr, "", 0};
+        Path::Arena arena;
+        std::vector<const Path::Node*> queued;
+        /** The memory used by the arena right after it was last compacted */
+        size_t compacted = 0;
+
+        int fd = -1;
+        /** Records waiting to be written to the temporary file */
+        std::string spillBuffer;
+        /** The number of bytes written to the temporary file, and read back from it */
+        uint64_t written = 0;
+        uint64_t read = 0;
+        bool failed = false;
+
+        size_t Memory() const;
+        void Compact();
+        bool Flush();
+        bool Refill();
+    };
+}
+
+#endif //EECS3540_BUDGET_H
@@ -0,0 +1,680 @@
+/*
+ * Copyright (c) 2016 Nathan Lowe
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of this software
+ * and associated documentation files (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all copies or substantial
+ * portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT
+ * LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN
+ * NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <algorithm>
+#include <condition_variable>
+#include <cstring>
+#include <deque>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+#ifdef PARCP_HAVE_ZSTD
+#include <zstd.h>
+#endif
+#ifdef PARCP_HAVE_LZ4
+#include <lz4frame.h>
+#endif
+#include "compress.h"
+#include "Logger.h"
+#include "stats.h"
+#include "sys.h"
+#include "util.h"
+
+/** The amount of file data compressed into each frame */
+#define COMPRESS_BLOCK_SIZE (1024 * 1024)
+/** The largest a block can get once compressed (zstd and lz4 both stay well within this for incompressible data) */
+#define COMPRESS_MAX_FRAME_SIZE (COMPRESS_BLOCK_SIZE + COMPRESS_BLOCK_SIZE / 128 + 4096)
+/** The most threads used to compress or decompress frames */
+#define COMPRESS_MAX_THREADS 16
+
+/** The magic number of the skippable frame holding the seek table */
+#define SEEK_TABLE_FRAME_MAGIC 0x184D2A5E
+/** The magic number at the very end of a seekable file */
+#define SEEKABLE_MAGIC 0x8F92EAB1
+/** The size of the seek table footer: the number of frames, a descriptor byte and the seekable magic number */
+#define SEEK_TABLE_FOOTER_SIZE 9
+
+/** The magic numbers at the start of each codec's frames */
+#define ZSTD_FRAME_MAGIC 0xFD2FB528
+#define LZ4_FRAME_MAGIC 0x184D2204
+
+namespace Compress
+{
+    L3::Logger Log("Compress");
+
+    bool Parse(const std::string& spec, Codec& codec, int& level)
+    {
+        auto colon = spec.find(':');
+        auto name = spec.substr(0, colon);
+
+        if(name == "zstd") codec = ZSTD;
+        else if(name == "lz4") codec = LZ4;
+        else return false;
+
+        level = 0;
+        if(colon == std::string::npos) return true;
+
+        try
+        {
+            size_t end;
+            level = std::stoi(spec.substr(colon + 1), &end);
+            if(end != spec.size() - colon - 1) return false;
+        }
+        catch(std::exception&)
+        {
+            return false;
+        }
+
+        return codec == ZSTD ? level >= 1 && level <= 22 : level >= 1 && level <= 12;
+    }
+
+    bool Available(Codec codec)
+    {
+        switch(codec)
+        {
+#ifdef PARCP_HAVE_ZSTD
+            case ZSTD: return true;
+#endif
+#ifdef PARCP_HAVE_LZ4
+            case LZ4: return true;
+#endif
+            default: return false;
+        }
+    }
+
+    const char* NameOf(Codec codec)
+    {
+        switch(codec)
+        {
+            case ZSTD: return "zstd";
+            case LZ4: return "lz4";
+            default: return "none";
+        }
+    }
+
+    const char* Suffix(Codec codec)
+    {
+        switch(codec)
+        {
+            case ZSTD: return ".zst";
+            case LZ4: return ".lz4";
+            default: return "";
+        }
+    }
+
+    Codec CodecFor(const std::string& path)
+    {
+        for(auto codec : {ZSTD, LZ4})
+        {
+            auto suffix = std::string(Suffix(codec));
+            if(path.size() > suffix.size() && path.compare(path.size() - suffix.size(), suffix.size(), suffix) == 0) return codec;
+        }
+
+        return NONE;
+    }
+
+    /** Read a little endian 32 bit number */
+    static uint32_t ReadLE32(const unsigned char* data)
+    {
+        return (uint32_t) data[0] | (uint32_t) data[1] << 8 | (uint32_t) data[2] << 16 | (uint32_t) data[3] << 24;
+    }
+
+    /** Append a little endian 32 bit number */
+    static void AppendLE32(std::string& data, uint32_t value)
+    {
+        for(int i = 0; i < 4; i++) data += (char) ((value >> (8 * i)) & 0xff);
+    }
+
+    /** A range of a file: a block to compress, or a frame to decompress */
+    struct Range
+    {
+        uint64_t Offset;
+        size_t Length;
+        /** The size of the range once it has been transformed, if known up front */
+        size_t Expected;
+    };
+
+    /** Turns one block of data into another, returning an error message on failure */
+    typedef std::function<std::string(const std::string& in, size_t expected, std::string& out)> Transform;
+
+    /** The most threads a pool can have, and the most that every worker's pool can have between them */
+    static unsigned ThreadCount()
+    {
+        return std::min(std::max(1u, std::thread::hardware_concurrency()), (unsigned) COMPRESS_MAX_THREADS);
+    }
+
+    uint64_t PipelineMemory()
+    {
+        // Two ranges in flight per thread (see Pipeline), each with a block and a frame buffer. Seek tables with
+        // bigger frames are refused by ReadSeekTable, so this holds when decompressing too
+        return (uint64_t) 2 * ThreadCount() * (COMPRESS_BLOCK_SIZE + COMPRESS_MAX_FRAME_SIZE);
+    }
+
+    /**
+     * A pool of threads shared by every file copied in this process, started the first time a file has more than
+     * one block to work on
+     */
+    class Pool
+    {
+    public:
+        static Pool& Instance()
+        {
+            static Pool pool;
+            return pool;
+        }
+
+        /** The number of threads in the pool */
+        unsigned Size() const { return (unsigned) threads.size(); }
+
+        /** Run a job on the pool */
+        std::future<std::string> Submit(std::function<std::string()> job)
+        {
+            auto task = std::make_shared<std::packaged_task<std::string()>>(job);
+            auto result = task->get_future();
+
+            std::lock_guard<std::mutex> guard(lock);
+            jobs.push_back([task]{ (*task)(); });
+            work.notify_one();
+
+            return result;
+        }
+
+        ~Pool()
+        {
+            {
+                std::lock_guard<std::mutex> guard(lock);
+                closing = true;
+                work.notify_all();
+            }
+
+            for(auto& thread : threads) thread.join();
+            Stats::Shared->CompressionThreads.Sub(threads.size());
+        }
+
+    private:
+        std::vector<std::thread> threads;
+        std::mutex lock;
+        std::condition_variable work;
+        std::deque<std::function<void()>> jobs;
+        bool closing = false;
+
+        /**
+         * Every worker compressing files has a pool of its own, so the threads are reserved from a count shared by all
+         * of them. Pools started once the cores are taken get a single thread, so their files still make progress
+         */
+        Pool()
+        {
+            unsigned count;
+            auto& running = Stats::Shared->CompressionThreads.Value;
+            uint64_t taken = running.load();
+            do
+            {
+                count = taken >= ThreadCount() ? 1 : ThreadCount() - (unsigned) taken;
+            }
+            while(!running.compare_exchange_weak(taken, taken + count));
+
+            for(unsigned i = 0; i < count; i++) threads.emplace_back([this]{ Work(); });
+        }
+
+        void Work()
+        {
+            while(true)
+            {
+                std::function<void()> job;
+                {
+                    std::unique_lock<std::mutex> guard(lock);
+                    work.wait(guard, [this]{ return closing || !jobs.empty(); });
+                    if(jobs.empty()) return;
+
+                    job = std::move(jobs.front());
+                    jobs.pop_front();
+                }
+
+                job();
+            }
+        }
+    };
+
+    /**
+     * Transform ranges of the source and write the results to the destination in order. Ranges are read in order on
+     * the calling thread and transformed on the pool, with at most two per pool thread in flight at once.
+     *
+     * @param path the source, for error messages
+     * @param reader the source
+     * @param readDevice the device the source lives on
+     * @param writer the destination
+     * @param writeDevice the device the destination lives on
+     * @param ranges the ranges of the source to transform
+     * @param transform the transformation
+     * @param sizes if not null, the size of each transformed range is appended to this
+     * @param counters where the bytes written are counted
+     * @return true iff every range was transformed and written
+     */
+    static bool Pipeline(const std::string& path, int reader, dev_t readDevice, int writer, dev_t writeDevice,
+                         const std::vector<Range>& ranges, const Transform& transform, std::vector<uint32_t>* sizes,
+                         Stats::Counters& counters)
+    {
+        auto myPid = getpid();
+
+        // Each range is read into its own buffer since the transform runs after the next range has been read
+        auto read = [&](const Range& range, std::shared_ptr<std::string>& data) {
+            data = std::make_shared<std::string>(range.Length, '\0');
+
+            size_t done = 0;
+            while(done < range.Length)
+            {
+                auto bytesRead = Sys::Pread(reader, &(*data)[done], range.Length - done, (off_t) (range.Offset + done), readDevice);
+                if(bytesRead <= 0)
+                {
+                    if(bytesRead < 0) Log.Error("[" + std::to_string(myPid) + "] Failure reading " + path + " (errno " + std::to_string(errno) + ")");
+                    else Log.Error("[" + std::to_string(myPid) + "] " + path + " shrank while it was being copied");
+                    return false;
+                }
+
+                done += (size_t) bytesRead;
+            }
+
+            return true;
+        };
+
+        auto write = [&](const std::string& data) {
+            auto written = Sys::WriteAll(writer, data.data(), data.size(), writeDevice);
+            counters.BytesCopied.Add(written);
+
+            if(written != data.size())
+            {
+                Log.Error("[" + std::to_string(myPid) + "] Failure in copying " + std::to_string(data.size()) + " to destination. Actually wrote " + std::to_string(written) + " (errno " + std::to_string(errno) + ")");
+                return false;
+            }
+
+            if(sizes != nullptr) sizes->push_back((uint32_t) data.size());
+            return true;
+        };
+
+        // A single range isn't worth handing off
+        if(ranges.size() == 1)
+        {
+            std::shared_ptr<std::string> in;
+            if(!read(ranges[0], in)) return false;
+
+            std::string out;
+            auto failure = transform(*in, ranges[0].Expected, out);
+            if(!failure.empty())
+            {
+                Log.Error("[" + std::to_string(myPid) + "] Failure transforming " + path + ": " + failure);
+                return false;
+            }
+
+            return write(out);
+        }
+
+        auto& pool = Pool::Instance();
+        size_t window = 2 * pool.Size();
+
+        std::deque<std::future<std::string>> pending;
+        std::deque<std::shared_ptr<std::string>> results;
+        bool error = false;
+
+        auto finishOne = [&]{
+            auto failure = pending.front().get();
+            auto out = results.front();
+            pending.pop_front();
+            results.pop_front();
+
+            if(error) return;
+            if(!failure.empty())
+            {
+                Log.Error("[" + std::to_string(myPid) + "] Failure transforming " + path + ": " + failure);
+                error = true;
+            }
+            else if(!write(*out))
+            {
+                error = true;
+            }
+        };
+
+        for(auto& range : ranges)
+        {
+            if(error) break;
+
+            std::shared_ptr<std::string> in;
+            if(!read(range, in))
+            {
+                error = true;
+                break;
+            }
+
+            auto out = std::make_shared<std::string>();
+            auto expected = range.Expected;
+            pending.push_back(pool.Submit([in, out, expected, &transform]{ return transform(*in, expected, *out); }));
+            results.push_back(out);
+
+            if(pending.size() >= window) finishOne();
+        }
+
+        // Everything in flight has to finish before we return, since the jobs refer to the transform
+        while(!pending.empty()) finishOne();
+
+        return !error;
+    }
+
+#ifdef PARCP_HAVE_ZSTD
+    static std::string CompressZstd(const std::string& in, int level, std::string& out)
+    {
+        out.resize(ZSTD_compressBound(in.size()));
+        auto size = ZSTD_compress(&out[0], out.size(), in.data(), in.size(), level == 0 ? ZSTD_CLEVEL_DEFAULT : level);
+        if(ZSTD_isError(size)) return ZSTD_getErrorName(size);
+
+        out.resize(size);
+        return "";
+    }
+
+    static std::string DecompressZstd(const std::string& in, size_t expected, std::string& out)
+    {
+        out.resize(expected);
+        auto size = ZSTD_decompress(&out[0], out.size(), in.data(), in.size());
+        if(ZSTD_isError(size)) return ZSTD_getErrorName(size);
+        if(size != expected) return "frame decompressed to " + std::to_string(size) + " bytes, expected " + std::to_string(expected);
+
+        return "";
+    }
+#endif
+
+#ifdef PARCP_HAVE_LZ4
+    static std::string CompressLz4(const std::string& in, int level, std::string& out)
+    {
+        LZ4F_preferences_t preferences;
+        memset(&preferences, 0, sizeof(preferences));
+        preferences.frameInfo.contentSize = in.size();
+        preferences.compressionLevel = level;
+
+        out.resize(LZ4F_compressFrameBound(in.size(), &preferences));
+        auto size = LZ4F_compressFrame(&out[0], out.size(), in.data(), in.size(), &preferences);
+        if(LZ4F_isError(size)) return LZ4F_getErrorName(size);
+
+        out.resize(size);
+        return "";
+    }
+
+    static std::string DecompressLz4(const std::string& in, size_t expected, std::string& out)
+    {
+        LZ4F_dctx* context;
+        auto result = LZ4F_createDecompressionContext(&context, LZ4F_VERSION);
+        if(LZ4F_isError(result)) return LZ4F_getErrorName(result);
+
+        out.resize(expected);
+        size_t produced = 0, consumed = 0;
+        std::string failure;
+        do
+        {
+            size_t outSize = out.size() - produced;
+            size_t inSize = in.size() - consumed;
+            result = LZ4F_decompress(context, &out[0] + produced, &outSize, in.data() + consumed, &inSize, nullptr);
+            if(LZ4F_isError(result))
+            {
+                failure = LZ4F_getErrorName(result);
+                break;
+            }
+
+            produced += outSize;
+            consumed += inSize;
+
+            // Out of input or room without reaching the end of the frame
+            if(result != 0 && outSize == 0 && inSize == 0)
+            {
+                failure = "truncated frame";
+                break;
+            }
+        } while(result != 0);
+
+        LZ4F_freeDecompressionContext(context);
+
+        if(failure.empty() && produced != expected)
+        {
+            failure = "frame decompressed to " + std::to_string(produced) + " bytes, expected " + std::to_string(expected);
+        }
+
+        return failure;
+    }
+#endif
+
+    /**
+     * Open the destination for a copy
+     *
+     * @return the descriptor, or -1 on failure (logged)
+     */
+    static int OpenDestination(const std::string& dest, mode_t mode, dev_t destDevice)
+    {
+        int fd = Sys::Open(dest.c_str(), O_CREAT | O_WRONLY | O_TRUNC, mode, destDevice);
+        if(fd < 0) Log.Fatal("[" + std::to_string(getpid()) + "] Could not open file for write " + dest);
+
+        return fd;
+    }
+
+    /**
+     * Close both ends of a copy, removing the destination if anything went wrong, and count it in counters if not
+     *
+     * @return true iff there were no errors, including while closing the destination
+     */
+    static bool FinishCopy(int reader, dev_t readDevice, int writer, const std::string& dest, dev_t destDevice, bool error,
+                           Stats::Counters& counters)
+    {
+        // Errors from close on the writer can be deferred write errors (e.g. on NFS)
+        Sys::Close(reader, readDevice);
+        if(Sys::Close(writer, destDevice) != 0 && !error)
+        {
+            Log.Error("[" + std::to_string(getpid()) + "] Failure closing " + dest + " (errno " + std::to_string(errno) + ")");
+            error = true;
+        }
+
+        // Don't leave a truncated copy behind that looks like a complete one
+        if(error) unlink(dest.c_str());
+        else counters.FilesCopied.Add(1);
+
+        return !error;
+    }
+
+    bool CompressFile(const std::string& source, const std::string& dest, const struct stat& info, dev_t destDevice, Codec codec, int level,
+                      Stats::Counters& counters)
+    {
+        auto myPid = getpid();
+        Log.Info("[" + std::to_string(myPid) + "] '" + source + "' --> '" + dest + "' (" + NameOf(codec) + ")");
+
+        // Only used by the codecs that were built in
+        (void) level;
+
+        Transform transform;
+        switch(codec)
+        {
+#ifdef PARCP_HAVE_ZSTD
+            case ZSTD:
+                transform = [level](const std::string& in, size_t, std::string& out) { return CompressZstd(in, level, out); };
+                break;
+#endif
+#ifdef PARCP_HAVE_LZ4
+            case LZ4:
+                transform = [level](const std::string& in, size_t, std::string& out) { return CompressLz4(in, level, out); };
+                break;
+#endif
+            default:
+                Log.Fatal("[" + std::to_string(myPid) + "] parcp was built without " + NameOf(codec) + " support");
+                return false;
+        }
+
+        int readerFD = Sys::Open(source.c_str(), O_RDONLY, 0, info.st_dev);
+        if(readerFD < 0)
+        {
+            Log.Fatal("[" + std::to_string(myPid) + "] Could not open file for read " + source);
+            return false;
+        }
+
+#ifndef NO_POSIX_ADVISE
+        // Hint to the kernel that we're only sequentially, reading once
+        posix_fadvise(readerFD, 0, 0, POSIX_FADV_SEQUENTIAL | POSIX_FADV_NOREUSE);
+#endif
+
+        int writerFD = OpenDestination(dest, info.st_mode, destDevice);
+        if(writerFD < 0)
+        {
+            Sys::Close(readerFD, info.st_dev);
+            return false;
+        }
+
+        // Even an empty file gets a (empty) frame, so it's still a valid compressed file
+        std::vector<Range> blocks;
+        uint64_t size = (uint64_t) info.st_size;
+        for(uint64_t offset = 0; offset == 0 || offset < size; offset += COMPRESS_BLOCK_SIZE)
+        {
+            blocks.push_back(Range{offset, (size_t) std::min((uint64_t) COMPRESS_BLOCK_SIZE, size - offset), 0});
+        }
+
+        std::vector<uint32_t> compressedSizes;
+        bool error = !Pipeline(source, readerFD, info.st_dev, writerFD, destDevice, blocks, transform, &compressedSizes, counters);
+
+        if(!error)
+        {
+            // The seek table goes in a skippable frame, which decompressors that don't know about it pass over
+            std::string table;
+            AppendLE32(table, SEEK_TABLE_FRAME_MAGIC);
+            AppendLE32(table, (uint32_t) (8 * blocks.size() + SEEK_TABLE_FOOTER_SIZE));
+            for(size_t i = 0; i < blocks.size(); i++)
+            {
+                AppendLE32(table, compressedSizes[i]);
+                AppendLE32(table, (uint32_t) blocks[i].Length);
+            }
+
+            AppendLE32(table, (uint32_t) blocks.size());
+            table += '\0';
+            AppendLE32(table, SEEKABLE_MAGIC);
+
+            auto written = Sys::WriteAll(writerFD, table.data(), table.size(), destDevice);
+            counters.BytesCopied.Add(written);
+            if(written != table.size())
+            {
+                Log.Error("[" + std::to_string(myPid) + "] Failure writing the seek table of " + dest + " (errno " + std::to_string(errno) + ")");
+                error = true;
+            }
+        }
+
+        return FinishCopy(readerFD, info.st_dev, writerFD, dest, destDevice, error, counters);
+    }
+
+    /**
+     * Read the seek table at the end of a compressed file
+     *
+     * @param fd the file
+     * @param info the stat struct of the file
+     * @param codec the codec the file should have been compressed with
+     * @param frames the frames in the file
+     * @return true iff the file ends with a valid seek table and starts with a frame of the right codec
+     */
+    static bool ReadSeekTable(int fd, const struct stat& info, Codec codec, std::vector<Range>& frames)
+    {
+        auto size = (uint64_t) info.st_size;
+        if(size < 4 + 8 + SEEK_TABLE_FOOTER_SIZE) return false;
+
+        unsigned char magic[4];
+        if(Sys::Pread(fd, magic, sizeof(magic), 0, info.st_dev) != sizeof(magic)) return false;
+        if(ReadLE32(magic) != (codec == ZSTD ? ZSTD_FRAME_MAGIC : LZ4_FRAME_MAGIC)) return false;
+
+        unsigned char footer[SEEK_TABLE_FOOTER_SIZE];
+        if(Sys::Pread(fd, footer, sizeof(footer), (off_t) (size - sizeof(footer)), info.st_dev) != sizeof(footer)) return false;
+        if(ReadLE32(footer + 5) != SEEKABLE_MAGIC || (footer[4] & 0x7c) != 0) return false;
+
+        // Entries have a checksum after the sizes if the descriptor says so, which we don't need
+        uint64_t count = ReadLE32(footer);
+        uint64_t entrySize = (footer[4] & 0x80) != 0 ? 12 : 8;
+        uint64_t tableSize = count * entrySize + SEEK_TABLE_FOOTER_SIZE;
+        if(count == 0 || tableSize + 8 > size) return false;
+
+        std::vector<unsigned char> table((size_t) tableSize + 8);
+        if(Sys::Pread(fd, table.data(), table.size(), (off_t) (size - table.size()), info.st_dev) != (ssize_t) table.size()) return false;
+        if(ReadLE32(&table[0]) != SEEK_TABLE_FRAME_MAGIC || ReadLE32(&table[4]) != tableSize) return false;
+
+        uint64_t offset = 0;
+        for(uint64_t i = 0; i < count; i++)
+        {
+            auto entry = &table[8 + i * entrySize];
+            Range frame{offset, ReadLE32(entry), ReadLE32(entry + 4)};
+
+            // We never write frames bigger than a block, and the memory budget counts on that
+            if(frame.Expected > COMPRESS_BLOCK_SIZE || frame.Length > COMPRESS_MAX_FRAME_SIZE) return false;
+
+            frames.push_back(frame);
+            offset += frame.Length;
+        }
+
+        // The frames have to account for everything in front of the seek table
+        return offset + table.size() == size;
+    }
+
+    bool DecompressFile(const std::string& source, const std::string& dest, const struct stat& info, dev_t destDevice, Codec codec, bool& seekable,
+                        Stats::Counters& counters)
+    {
+        auto myPid = getpid();
+        seekable = false;
+
+        Transform transform;
+        switch(codec)
+        {
+#ifdef PARCP_HAVE_ZSTD
+            case ZSTD: transform = DecompressZstd; break;
+#endif
+#ifdef PARCP_HAVE_LZ4
+            case LZ4: transform = DecompressLz4; break;
+#endif
+            default:
+                Log.Fatal("[" + std::to_string(myPid) + "] parcp was built without " + NameOf(codec) + " support");
+                return false;
+        }
+
+        int readerFD = Sys::Open(source.c_str(), O_RDONLY, 0, info.st_dev);
+        if(readerFD < 0)
+        {
+            Log.Fatal("[" + std::to_string(myPid) + "] Could not open file for read " + source);
+            return false;
+        }
+
+        std::vector<Range> frames;
+        if(!ReadSeekTable(readerFD, info, codec, frames))
+        {
+            Sys::Close(readerFD, info.st_dev);
+            return true;
+        }
+
+        seekable = true;
+        Log.Info("[" + std::to_string(myPid) + "] '" + source + "' --> '" + dest + "' (" + NameOf(codec) + ", " + std::to_string(frames.size()) + " frames)");
+
+        int writerFD = OpenDestination(dest, info.st_mode, destDevice);
+        if(writerFD < 0)
+        {
+            Sys::Close(readerFD, info.st_dev);
+            return false;
+        }
+
+        bool error = !Pipeline(source, readerFD, info.st_dev, writerFD, destDevice, frames, transform, nullptr, counters);
+
+        return FinishCopy(readerFD, info.st_dev, writerFD, dest, destDevice, error, counters);
+    }
+}
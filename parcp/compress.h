@@ -0,0 +1,100 @@
+/*
+ * Copyright (c) 2016 Nathan Lowe
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of this software
+ * and associated documentation files (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all copies or substantial
+ * portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT
+ * LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN
+ * NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef EECS3540_COMPRESS_H
+#define EECS3540_COMPRESS_H
+
+#include <sys/stat.h>
+#include <cstdint>
+#include <string>
+#include "stats.h"
+
+/**
+ * Inline compression of file data for slow destinations. Files are split into independent blocks that are compressed
+ * across a pool of threads and written out in order as a series of frames, followed by a seek table in a skippable
+ * frame (the zstd seekable format, which lz4 can carry the same way). The result can be decompressed by the regular
+ * zstd and lz4 tools, and by parcp in parallel, since the seek table says where every frame starts.
+ */
+namespace Compress
+{
+    /** A compression format */
+    enum Codec
+    {
+        NONE,
+        ZSTD,
+        LZ4
+    };
+
+    /**
+     * Parse a codec name with an optional level, like "zstd" or "lz4:9"
+     *
+     * @param spec the codec to parse
+     * @param codec the codec
+     * @param level the compression level, or 0 for the codec's default
+     * @return true iff spec names a codec with a valid level
+     */
+    bool Parse(const std::string& spec, Codec& codec, int& level);
+
+    /** Whether or not parcp was built with support for the specified codec */
+    bool Available(Codec codec);
+
+    /** Gets the name of the specified codec */
+    const char* NameOf(Codec codec);
+
+    /** Gets the file name suffix of the specified codec, including the '.' */
+    const char* Suffix(Codec codec);
+
+    /** Gets the codec for a compressed file by its suffix, or NONE if it doesn't have one */
+    Codec CodecFor(const std::string& path);
+
+    /** The most memory a worker holds in compression buffers at once, for budgeting with --max-memory */
+    uint64_t PipelineMemory();
+
+    /**
+     * Copy a regular file, compressing it on the way
+     *
+     * @param source the file to copy
+     * @param dest where to write the compressed copy. The codec's suffix is not added
+     * @param info the stat struct of the source
+     * @param destDevice the device the destination lives on, used to attribute syscall latencies
+     * @param codec the codec to compress with
+     * @param level the compression level, or 0 for the codec's default
+     * @param counters where the copy and its bytes are counted
+     * @return true iff the file was copied
+     */
+    bool CompressFile(const std::string& source, const std::string& dest, const struct stat& info, dev_t destDevice, Codec codec, int level,
+                      Stats::Counters& counters);
+
+    /**
+     * Copy a compressed file in the seekable format, decompressing its frames in parallel
+     *
+     * @param source the file to copy
+     * @param dest where to write the decompressed copy
+     * @param info the stat struct of the source
+     * @param destDevice the device the destination lives on, used to attribute syscall latencies
+     * @param codec the codec the file was compressed with
+     * @param seekable set to false if the file doesn't end with a seek table, in which case nothing is written
+     * @param counters where the copy and its bytes are counted
+     * @return true iff the file was copied, or isn't in the seekable format
+     */
+    bool DecompressFile(const std::string& source, const std::string& dest, const struct stat& info, dev_t destDevice, Codec codec, bool& seekable,
+                        Stats::Counters& counters);
+}
+
+#endif //EECS3540_COMPRESS_H
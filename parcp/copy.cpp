@@ -21,12 +21,25 @@
 #include <sys/stat.h>
 #include <sys/wait.h>
 #include <unistd.h>
+#include <algorithm>
+#include <climits>
 #include <cstring>
 #include <queue>
+#include <vector>
 #include <fcntl.h>
+#include "budget.h"
+#include "compress.h"
 #include "copy.h"
+#include "dedup.h"
+#include "filter.h"
+#include "latency.h"
+#include "mirror.h"
+#include "path.h"
+#include "plan.h"
+#include "sys.h"
 #include "Logger.h"
 #include "opts.h"
+#include "stats.h"
 #include "util.h"
 
 /** The size of the file copy buffer */
@@ -61,33 +74,72 @@ namespace Copy
      */
     bool IsDirectory(dirent* details) { return details->d_type == DT_DIR; }
 
+    /**
+     * An entry being copied. The entry is opened by name relative to an open source directory and an open destination
+     * directory, so that the kernel doesn't have to walk the whole path for every entry. The full paths are only built
+     * from the nodes for logging.
+     */
+    struct Entry
+    {
+        /** The directory the entry is in, or AT_FDCWD if the name of Source is a full path */
+        int SourceDir;
+        /** The directory the copy goes in, or AT_FDCWD if the name of Dest is a full path */
+        int DestDir;
+        /** The entry, named relative to SourceDir. The name must be null terminated */
+        const Path::Node& Source;
+        /** The copy, named relative to DestDir. The name must be null terminated */
+        const Path::Node& Dest;
+    };
+
     /**
      * Attempts to copy the symbolic link at source to the folder dest. No validation is done on the path that is
      * pointed at by the link, it is copied verbatium. The destination directory should already exist.
      *
-     * @param source The link to copy
-     * @param dest The folder to create the copy of the link in
+     * @param settings where to count the copy
+     * @param entry The link to copy, and where to create the copy
      * @param info the stat struct of the link (from lstat)
+     * @param destDevice the device the destination lives on, used to attribute syscall latencies
      * @return true if the link was successfully created
      */
-    bool CreateSymlink(std::string source, std::string dest, struct stat info)
+    bool CreateSymlink(const Settings& settings, const Entry& entry, const struct stat& info, dev_t destDevice)
     {
         auto myPid = getpid();
-        char* linkedTo = new char[PATH_MAX] {0};
+        char linkedTo[PATH_MAX];
 
         // Figure out what the link points to
-        ssize_t len = readlink(source.c_str(), linkedTo, (size_t) (info.st_size + 1));
+        auto size = std::min((size_t) info.st_size + 1, sizeof(linkedTo));
+        ssize_t len = Sys::Readlinkat(entry.SourceDir, entry.Source.Name, linkedTo, size, info.st_dev);
 
         bool error = false;
-        if(len > info.st_size)
+        if(len < 0)
+        {
+            Log.Fatal("[" + std::to_string(myPid) + "] Unable to read symlink " + entry.Source.Full() + " (errno " + std::to_string(errno) + ")");
+            error = true;
+        }
+        else if(len > info.st_size || (size_t) len == sizeof(linkedTo))
         {
             Log.Fatal("[" + std::to_string(myPid) + "] Symlink may have changed on disk! readlink returned a larger value than st_size from stat");
             error = true;
         }
         else
         {
-            Log.Info("[" + std::to_string(myPid) + "] link ('" + source + "') '" + dest + "' --> '" + std::string(linkedTo) + "'");
-            if (symlink(linkedTo, dest.c_str()) != 0)
+            linkedTo[len] = '\0';
+            if(Log.Enabled(L3::Level::INFO))
+            {
+                Log.Info("[" + std::to_string(myPid) + "] link ('" + entry.Source.Full() + "') '" + entry.Dest.Full() + "' --> '" + std::string(linkedTo) + "'");
+            }
+
+            auto result = Sys::Symlinkat(linkedTo, entry.DestDir, entry.Dest.Name, destDevice);
+
+            // Replace a link left over from a previous copy, the same way a regular file would be overwritten
+            struct stat existing;
+            if(result != 0 && errno == EEXIST && fstatat(entry.DestDir, entry.Dest.Name, &existing, AT_SYMLINK_NOFOLLOW) == 0 &&
+               S_ISLNK(existing.st_mode) && unlinkat(entry.DestDir, entry.Dest.Name, 0) == 0)
+            {
+                result = Sys::Symlinkat(linkedTo, entry.DestDir, entry.Dest.Name, destDevice);
+            }
+
+            if (result != 0)
             {
                 if(errno == EACCES) Log.Fatal("[" + std::to_string(myPid) + "] Failed to create symlink (EACCES)");
                 if(errno == EDQUOT) Log.Fatal("[" + std::to_string(myPid) + "] Failed to create symlink (EDQUOT)");
@@ -108,41 +160,77 @@ namespace Copy
             }
         }
 
-        delete[] linkedTo;
+        if(!error)
+        {
+            settings.Counters->FilesCopied.Add(1);
+            if(settings.OnFile) settings.OnFile(entry.Source.Full(), entry.Dest.Full(), info);
+        }
+
         return !error;
     }
 
     /**
-     * Copies the file at the specified location to the specified destination folder. If the file is a symbolic link,
-     * then the link is copied. Otherwise, if the file is NOT a regular file, it is skipped. The destination directory
-     * should already exist.
+     * Copies the entry to the destination folder. If the entry is a symbolic link, then the link is copied.
+     * Otherwise, if the entry is NOT a regular file, it is skipped. The destination directory should already exist.
      *
-     * @param source
-     * @param dest
-     * @param info
-     * @return
+     * @param settings how to copy the entry, and where to count it
+     * @param entry the entry to copy, and where to copy it to
+     * @param info the stat struct of the entry (from lstat)
+     * @param destDevice the device the destination lives on, used to attribute syscall latencies
+     * @return true iff the entry was copied (or skipped)
      */
-    bool CopyFile(std::string source, std::string dest, struct stat info)
+    bool CopyEntry(const Settings& settings, const Entry& entry, const struct stat& info, dev_t destDevice)
     {
         auto myPid = getpid();
 
         // Handle symlinks
-        if(S_ISLNK(info.st_mode)) return CreateSymlink(source, dest, info);
+        if(S_ISLNK(info.st_mode)) return CreateSymlink(settings, entry, info, destDevice);
 
         // We can't handle special files
         if(!S_ISREG(info.st_mode))
         {
-            Log.Warn("[" + std::to_string(myPid) + "] Skipping '" + source + "' (is a " + ModeName(info.st_mode) + ")");
+            Log.Warn("[" + std::to_string(myPid) + "] Skipping '" + entry.Source.Full() + "' (is a " + ModeName(info.st_mode) + ")");
+            return true;
+        }
+
+        // Compressed copies get the codec's suffix, decompressed copies lose it. Both work on whole paths
+        if(settings.Compression != Compress::NONE)
+        {
+            auto source = entry.Source.Full();
+            auto dest = entry.Dest.Full() + Compress::Suffix(settings.Compression);
+            if(!Compress::CompressFile(source, dest, info, destDevice, settings.Compression, settings.CompressionLevel, *settings.Counters)) return false;
+
+            if(settings.OnFile) settings.OnFile(source, dest, info);
             return true;
         }
 
-        Log.Info("[" + std::to_string(myPid) + "] '" + source + "' --> '" + dest + "'");
+        auto codec = settings.Decompress ? Compress::CodecFor(entry.Dest.Name) : Compress::NONE;
+        if(codec != Compress::NONE && !Compress::Available(codec))
+        {
+            Log.Warn("[" + std::to_string(myPid) + "] parcp was built without " + Compress::NameOf(codec) + " support, copying '" + entry.Source.Full() + "' as it is");
+        }
+        else if(codec != Compress::NONE)
+        {
+            bool seekable;
+            auto dest = entry.Dest.Full();
+            auto decompressed = dest.substr(0, dest.size() - strlen(Compress::Suffix(codec)));
+            if(!Compress::DecompressFile(entry.Source.Full(), decompressed, info, destDevice, codec, seekable, *settings.Counters)) return false;
+            if(seekable)
+            {
+                if(settings.OnFile) settings.OnFile(entry.Source.Full(), decompressed, info);
+                return true;
+            }
+
+            Log.Warn("[" + std::to_string(myPid) + "] '" + entry.Source.Full() + "' wasn't written by --compress " + Compress::NameOf(codec) + ", copying it as it is");
+        }
+
+        if(Log.Enabled(L3::Level::INFO)) Log.Info("[" + std::to_string(myPid) + "] '" + entry.Source.Full() + "' --> '" + entry.Dest.Full() + "'");
 
         // Open the file for read
-        int readerFD = open(source.c_str(), O_RDONLY);
+        int readerFD = Sys::Openat(entry.SourceDir, entry.Source.Name, O_RDONLY, 0, info.st_dev);
         if(readerFD < 0)
         {
-            Log.Fatal("[" + std::to_string(myPid) + "] Could not open file for read " + source);
+            Log.Fatal("[" + std::to_string(myPid) + "] Could not open file for read " + entry.Source.Full());
             return false;
         }
 
@@ -152,11 +240,11 @@ namespace Copy
 #endif
 
         // Open the file for write
-        int writerFD = open(dest.c_str(), O_CREAT | O_WRONLY, info.st_mode);
+        int writerFD = Sys::Openat(entry.DestDir, entry.Dest.Name, O_CREAT | O_WRONLY | O_TRUNC, info.st_mode, destDevice);
         if(writerFD < 0)
         {
-            Log.Fatal("[" + std::to_string(myPid) + "] Could not open file for write " + dest);
-            close(readerFD);
+            Log.Fatal("[" + std::to_string(myPid) + "] Could not open file for write " + entry.Dest.Full());
+            Sys::Close(readerFD, info.st_dev);
             return false;
         }
 
@@ -165,40 +253,92 @@ namespace Copy
         ssize_t bytesRead;
 
         // Copy the file in chunks of COPY_BUFFER_SIZE
-        while((bytesRead = read(readerFD, &buf[0], sizeof(buf))) != 0)
+        while((bytesRead = Sys::Read(readerFD, &buf[0], sizeof(buf), info.st_dev)) != 0)
         {
-            ssize_t bytesWritten = write(writerFD, &buf[0], (size_t) bytesRead);
+            if(bytesRead < 0)
+            {
+                Log.Error("[" + std::to_string(myPid) + "] Failure reading " + entry.Source.Full() + " (errno " + std::to_string(errno) + ")");
+                error = true;
+                break;
+            }
 
-            if(bytesRead != bytesWritten)
+            // Short writes are continued by WriteAll, so anything less than everything is a real error
+            size_t bytesWritten = Sys::WriteAll(writerFD, &buf[0], (size_t) bytesRead, destDevice);
+            settings.Counters->BytesCopied.Add((uint64_t) bytesWritten);
+
+            if((size_t) bytesRead != bytesWritten)
             {
-                Log.Error("[" + std::to_string(myPid) + "] Failure in copying " + std::to_string(bytesRead) + " to destination. Actually wrote " + std::to_string(bytesWritten));
+                Log.Error("[" + std::to_string(myPid) + "] Failure in copying " + std::to_string(bytesRead) + " to destination. Actually wrote " + std::to_string(bytesWritten) + " (errno " + std::to_string(errno) + ")");
                 error = true;
                 break;
             }
         }
 
-        // Close FD's
-        close(readerFD);
-        close(writerFD);
+        // Close FD's. Errors from close on the writer can be deferred write errors (e.g. on NFS)
+        Sys::Close(readerFD, info.st_dev);
+        if(Sys::Close(writerFD, destDevice) != 0 && !error)
+        {
+            Log.Error("[" + std::to_string(myPid) + "] Failure closing " + entry.Dest.Full() + " (errno " + std::to_string(errno) + ")");
+            error = true;
+        }
+
+        // Don't leave a truncated copy behind that looks like a complete one
+        if(error) unlinkat(entry.DestDir, entry.Dest.Name, 0);
+
+        if(!error)
+        {
+            settings.Counters->FilesCopied.Add(1);
+            if(settings.OnFile) settings.OnFile(entry.Source.Full(), entry.Dest.Full(), info);
+        }
 
         return !error;
     }
 
-    // Try to create the specified directory with the specified mode
-    bool TryCreateDirectory(std::string dir, mode_t mode)
+    bool CopyFile(const Settings& settings, const std::string& source, const std::string& dest, const struct stat& info, dev_t destDevice)
+    {
+        Path::Node sourceNode{nullptr, source.c_str(), source.size()};
+        Path::Node destNode{nullptr, dest.c_str(), dest.size()};
+
+        return CopyEntry(settings, Entry{AT_FDCWD, AT_FDCWD, sourceNode, destNode}, info, destDevice);
+    }
+
+    /**
+     * Count an entry that couldn't be copied, and tell the caller about it
+     *
+     * @param settings where to count it
+     * @param path the entry
+     * @param error the errno of the failure, or 0 if it isn't known
+     */
+    static void Failed(const Settings& settings, const std::string& path, int error)
+    {
+        settings.Counters->Errors.Add(1);
+        if(settings.OnError) settings.OnError(path, error);
+    }
+
+    /** Whether or not the copy has been cancelled */
+    static bool Cancelled(const Settings& settings)
+    {
+        return settings.Cancelled != nullptr && settings.Cancelled->load(std::memory_order_relaxed);
+    }
+
+    // Try to create the specified directory with the specified mode. If latency instrumentation is enabled, device is
+    // set to the device the directory ended up on
+    bool TryCreateDirectory(const std::string& dir, mode_t mode, dev_t& device)
     {
         // Ensure the path does not end with a '/'
         auto normailizedPath = dir;
         if(util::StringEndsWith(normailizedPath, '/')) normailizedPath = normailizedPath.substr(0, normailizedPath.length()-1);
 
         Log.Trace("[" + std::to_string(getpid()) + "] Trying to create directory " + normailizedPath);
-        auto result = mkdir(normailizedPath.c_str(), mode);
+        auto result = Sys::Mkdir(normailizedPath.c_str(), mode, device);
 
         if(result != 0)
         {
             if(errno != EEXIST)
             {
-                Log.Fatal("[" + std::to_string(getpid()) + "] Unable to create directory: Error code " + std::to_string(errno));
+                auto error = errno;
+                Log.Fatal("[" + std::to_string(getpid()) + "] Unable to create directory: Error code " + std::to_string(error));
+                errno = error;
                 return false;
             }
             else
@@ -211,118 +351,606 @@ namespace Copy
     }
 
     /**
-     * Begin a file copy operation from the specified directory to the specified directory. The source directory
-     * should exist, it is not validated.
+     * Stat (without following links) an entry found while scanning a directory
      *
-     * @param source The directory to copy from
-     * @param dest The directory to copy to. It will be created if it does not exist
-     * @return the status code for the operation. 0 for success, failure otherwise.
+     * @param settings where to count a failure
+     * @param dir the directory being scanned
+     * @param entry the entry to stat, named relative to dir
+     * @param info the result of the stat
+     * @param dev the device of the directory being scanned
+     * @return true iff the stat succeeded. Failures are logged and counted
      */
-    int BeginCopy(std::string source, std::string dest)
+    bool StatEntry(const Settings& settings, int dir, const Path::Node& entry, struct stat& info, dev_t dev)
+    {
+        if(Sys::Lstatat(dir, entry.Name, &info, dev) == 0) return true;
+
+        // It may have been removed since we read the directory, either way there is nothing to copy
+        auto error = errno;
+        Log.Error("[" + std::to_string(getpid()) + "] Unable to stat " + entry.Full() + " (errno " + std::to_string(error) + ")");
+        Failed(settings, entry.Full(), error);
+        return false;
+    }
+
+    /**
+     * Build the argument list for a worker process that copies the specified directory. Any options that affect how
+     * the copy is performed need to be passed along here, since the worker parses its own command line.
+     *
+     * @param source The directory the worker should copy from
+     * @param dest The directory the worker should copy to
+     * @param relativePath The path of the directory relative to the root of the copy
+     * @return the arguments to pass to execv (not including the trailing NULL)
+     */
+    std::vector<std::string> WorkerArguments(const std::string& source, const std::string& dest, const std::string& relativePath)
+    {
+        std::vector<std::string> args = {
+                Options::CommandLineArgs.ProgramPath,
+                "-__forked", // Signal that this is a forked process. This disables early logging
+                "-l", L3::Logger::NameOfLevel(L3::GlobalLogLevel),
+                "-f", source,
+                "-t", dest
+        };
+
+        if(Options::CommandLineArgs.Quiet) args.push_back("-q");
+        if(Options::CommandLineArgs.Delete) args.push_back("--delete");
+        if(Options::CommandLineArgs.Decompress) args.push_back("--decompress");
+
+        if(Options::CommandLineArgs.Compression != Compress::NONE)
+        {
+            auto level = Options::CommandLineArgs.CompressionLevel;
+            args.push_back("--compress");
+            args.push_back(std::string(Compress::NameOf(Options::CommandLineArgs.Compression)) + (level != 0 ? ":" + std::to_string(level) : ""));
+        }
+
+        if(Options::CommandLineArgs.StatsFd >= 0)
+        {
+            args.push_back("-__stats");
+            args.push_back(std::to_string(Options::CommandLineArgs.StatsFd));
+        }
+
+        if(Options::CommandLineArgs.FilterFd >= 0)
+        {
+            args.push_back("-__filters");
+            args.push_back(std::to_string(Options::CommandLineArgs.FilterFd));
+        }
+
+        if(Options::CommandLineArgs.DedupFd >= 0)
+        {
+            args.push_back("-__dedup");
+            args.push_back(std::to_string(Options::CommandLineArgs.DedupFd));
+        }
+
+        if(Options::CommandLineArgs.PlanFd >= 0)
+        {
+            args.push_back("-__plan");
+            args.push_back(std::to_string(Options::CommandLineArgs.PlanFd));
+        }
+
+        if(Options::CommandLineArgs.BudgetFd >= 0)
+        {
+            args.push_back("-__budget");
+            args.push_back(std::to_string(Options::CommandLineArgs.BudgetFd));
+        }
+
+        if(Options::CommandLineArgs.ThrottleFd >= 0)
+        {
+            args.push_back("-__throttle");
+            args.push_back(std::to_string(Options::CommandLineArgs.ThrottleFd));
+        }
+
+        if(!relativePath.empty())
+        {
+            args.push_back("-__relative");
+            args.push_back(relativePath);
+        }
+
+        if(Options::CommandLineArgs.LatencyFd >= 0)
+        {
+            args.push_back("-__latency");
+            args.push_back(std::to_string(Options::CommandLineArgs.LatencyFd));
+        }
+
+        return args;
+    }
+
+    /**
+     * Fork off a new worker process to copy the specified directory
+     *
+     * @param source The directory the worker should copy from
+     * @param dest The directory the worker should copy to
+     * @param relativePath The path of the directory relative to the root of the copy
+     * @return the pid of the new worker, or -1 if it could not be started
+     */
+    pid_t SpawnWorker(const std::string& source, const std::string& dest, const std::string& relativePath)
+    {
+        // Build the arguments before forking so the child doesn't have to allocate
+        auto args = WorkerArguments(source, dest, relativePath);
+        std::vector<char*> argv;
+        for(auto& arg : args) argv.push_back(const_cast<char*>(arg.c_str()));
+        argv.push_back(NULL);
+
+        // Count the directory as queued before the child can possibly pick it up
+        Stats::Shared->DirectoriesQueued.Add(1);
+
+        auto pid = fork();
+        if(pid == 0)
+        {
+            // Only the root adjusts the limits. Ignored signals stay ignored across exec, handled ones would kill us
+            if(Options::CommandLineArgs.ThrottleFd >= 0)
+            {
+                signal(SIGUSR1, SIG_IGN);
+                signal(SIGUSR2, SIG_IGN);
+            }
+
+            // Spawn the new process
+            execv(Options::CommandLineArgs.ProgramPath.c_str(), argv.data());
+            Log.Fatal("Unable to start child process");
+            _exit(-1);
+        }
+        else if(pid < 0)
+        {
+            Stats::Shared->DirectoriesQueued.Sub(1);
+        }
+
+        return pid;
+    }
+
+    /**
+     * Give back the slot of a worker that has exited and check how it went
+     *
+     * @param child the pid of the worker
+     * @param status its status, from waitpid
+     * @return true iff the worker succeeded
+     */
+    static bool Reaped(pid_t child, int status)
+    {
+        Budget::Release();
+        if(status == 0) return true;
+
+        Log.Error("[" + std::to_string(getpid()) + "] Child process " + std::to_string(child) + " exited with code " + std::to_string(status));
+        return false;
+    }
+
+    /**
+     * Reap the workers that have already exited, without waiting for the rest
+     *
+     * @return true iff all of them succeeded
+     */
+    static bool ReapFinished()
+    {
+        bool ok = true;
+        pid_t child;
+        int status;
+        while((child = waitpid(-1, &status, WNOHANG)) > 0)
+        {
+            if(!Reaped(child, status)) ok = false;
+        }
+
+        return ok;
+    }
+
+    bool CopyDirectory(const Settings& settings, const std::string& source, const std::string& dest,
+                       const std::string& relativePath, const Filter::State& filterState,
+                       const SubdirectoryHandler& subdirectory, dev_t& device)
     {
         auto myPid = getpid();
 
+        if(Cancelled(settings)) return true;
+
         // Get some info about the source directory
         struct stat rootStat;
-        stat(source.c_str(), &rootStat);
+        if(Sys::Stat(source.c_str(), &rootStat) != 0)
+        {
+            auto error = errno;
+            Log.Fatal("[" + std::to_string(myPid) + "] Unable to stat " + source + " (errno " + std::to_string(error) + ")");
+            Failed(settings, source, error);
+            return false;
+        }
+
+        device = rootStat.st_dev;
+
+        // A dry run only records what it finds, nothing is created in the destination
+        bool planning = settings.Planning;
+        if(planning && !relativePath.empty() && !Plan::Record(relativePath, rootStat)) Failed(settings, source, 0);
 
         // Try to create the directory if it doesn't exist, with the same mode as the source
-        if (!TryCreateDirectory(dest, rootStat.st_mode))
+        dev_t destDevice = 0;
+        if (!planning && !TryCreateDirectory(dest, rootStat.st_mode, destDevice))
         {
-            return -1;
+            Failed(settings, dest, errno);
+            return false;
         }
 
         Log.Trace("[" + std::to_string(myPid) + "] Begin Copy To '" + dest + "' - Scanning " + source);
 
         // Open the directory for reading
         DIR* root = nullptr;
-        root = opendir(source.c_str());
+        root = Sys::Opendir(source.c_str(), rootStat.st_dev);
 
         if(root == nullptr)
         {
+            auto error = errno;
             Log.Fatal("[" + std::to_string(myPid) + "] Unable to open directory " + source);
-            return -1;
+            Failed(settings, source, error);
+            return false;
         }
 
+        // Entries are created relative to the destination directory. O_PATH works even if the mode doesn't allow reading
+        int destFd = planning ? -1 : Sys::Open(dest.c_str(), O_PATH | O_DIRECTORY | O_CLOEXEC, 0, destDevice);
+        if(!planning && destFd < 0)
+        {
+            auto error = errno;
+            Log.Fatal("[" + std::to_string(myPid) + "] Unable to open directory " + dest + " (errno " + std::to_string(error) + ")");
+            Failed(settings, dest, error);
+            closedir(root);
+            return false;
+        }
+
+        int sourceFd = dirfd(root);
+
+        settings.Counters->DirectoriesScanned.Add(1);
+
+        // Each entry only has to be matched by name, since filterState already covers this directory
+        bool filtering = settings.Rules != nullptr && !settings.Rules->Empty();
+
+        // Duplicates and planned entries are looked up by their path relative to the root of the copy, so that has to
+        // be tracked too
+        bool deduplicating = settings.Deduplicating;
+        bool tracking = deduplicating || planning;
+        std::string relativeEntry;
+        Filter::State childState;
+
+        // Each entry is a name under these, only turned into a whole path when it has to be
+        Path::Node sourceDir{nullptr, source.data(), source.size()};
+        Path::Node destDir{nullptr, dest.data(), dest.size()};
+
         struct dirent* details;
         struct stat file;
-        std::string path;
 
         bool error = false;
 
+        // In mirror mode, list the source first so that extraneous entries are gone before anything is copied over
+        if(settings.Mirror)
+        {
+            Mirror::Listing listing;
+            while((details = Sys::Readdir(root, rootStat.st_dev)) != nullptr)
+            {
+                if(strcmp(details->d_name, ".") == 0 || strcmp(details->d_name, "..") == 0) continue;
+
+                Path::Node sourceEntry{&sourceDir, details->d_name, strlen(details->d_name)};
+                auto kind = details->d_type == DT_DIR ? Mirror::DIRECTORY : details->d_type == DT_LNK ? Mirror::SYMLINK : Mirror::OTHER;
+                if(details->d_type == DT_UNKNOWN && StatEntry(settings, sourceFd, sourceEntry, file, rootStat.st_dev))
+                {
+                    kind = S_ISDIR(file.st_mode) ? Mirror::DIRECTORY : S_ISLNK(file.st_mode) ? Mirror::SYMLINK : Mirror::OTHER;
+                }
+
+                listing.emplace(details->d_name, kind);
+            }
+
+            rewinddir(root);
+
+            if(!Mirror::RemoveExtraneous(dest, listing, filtering ? &filterState : nullptr)) error = true;
+        }
+
         // Process each item
-        while((details = readdir(root)) != nullptr)
+        while(!Cancelled(settings) && (details = Sys::Readdir(root, rootStat.st_dev)) != nullptr)
         {
-            // Stat the item
-            path = source + details->d_name;
-            lstat(path.c_str(), &file);
+            // Ignore special special directories '.' and '..'
+            if(IsDirectory(details) && (strcmp(details->d_name, ".") == 0 || strcmp(details->d_name, "..") == 0))
+            {
+                Log.Trace("[" + std::to_string(myPid) + "] Skipping special entry " + std::string(details->d_name));
+                continue;
+            }
+
+            auto nameLength = strlen(details->d_name);
+            Path::Node sourceEntry{&sourceDir, details->d_name, nameLength};
+            Path::Node destEntry{&destDir, details->d_name, nameLength};
+
+            // Some filesystems don't fill in d_type, in which case we have to stat the entry to know what it is
+            bool statted = false;
+            bool isDirectory = IsDirectory(details);
+            if(details->d_type == DT_UNKNOWN)
+            {
+                if(!StatEntry(settings, sourceFd, sourceEntry, file, rootStat.st_dev))
+                {
+                    error = true;
+                    continue;
+                }
+
+                statted = true;
+                isDirectory = S_ISDIR(file.st_mode);
+            }
 
-            Log.Trace("[" + std::to_string(myPid) + "] INODE: " + std::to_string(details->d_ino) + ", A " + ModeName(file.st_mode) + ": " + path);
+            // Skip excluded entries before touching them, excluded directories are never descended into
+            if(filtering && !settings.Rules->Included(filterState, details->d_name, isDirectory, isDirectory ? &childState : nullptr))
+            {
+                if(Log.Enabled(L3::Level::DEBUG)) Log.Debug("[" + std::to_string(myPid) + "] Excluding " + sourceEntry.Full());
+                settings.Counters->Excluded.Add(1);
+                continue;
+            }
 
-            auto newDest = dest + details->d_name;
+            if(tracking || (filtering && isDirectory))
+            {
+                relativeEntry.assign(relativePath);
+                relativeEntry += '/';
+                relativeEntry.append(details->d_name, nameLength);
+            }
 
-            // If the entry is a subdirectory, fork off a new process to handle it. Otherwise, try to copy the file
-            if(IsDirectory(details))
+            // Subdirectories are copied however the caller copies directories. Otherwise, try to copy the file
+            if(isDirectory)
             {
-                // Ignore special special directories '.' and '..'
-                if(strcmp(details->d_name, ".") == 0 || strcmp(details->d_name, "..") == 0)
+                if(Log.Enabled(L3::Level::TRACE)) Log.Trace("[" + std::to_string(myPid) + "] INODE: " + std::to_string(details->d_ino) + ", A Directory: " + sourceEntry.Full());
+
+                if(!subdirectory(sourceEntry, destEntry, relativeEntry, childState)) error = true;
+            }
+            else
+            {
+                if(!statted && !StatEntry(settings, sourceFd, sourceEntry, file, rootStat.st_dev))
                 {
-                    Log.Trace("[" + std::to_string(myPid) + "] Skipping special entry " + std::string(details->d_name));
+                    error = true;
                     continue;
                 }
 
-                // Fork and spawn new process and remember child pid
-                auto pid = fork();
-                if(pid == 0)
+                if(Log.Enabled(L3::Level::TRACE))
                 {
-                    char* args[] = {
-                            const_cast<char*>(Options::CommandLineArgs.ProgramPath.c_str()),
-                            (char*)"-__forked", // Signal that this is a forked process. This disables early logging
-                            (char*)"-l", const_cast<char*>(L3::Logger::NameOfLevel(L3::GlobalLogLevel).c_str()),
-                            (char*)"-f", const_cast<char*>(path.c_str()),
-                            (char*)"-t", const_cast<char*>(newDest.c_str()),
-                            NULL, // Placeholder for "-q" if needed
-                            NULL
-                    };
-
-                    if(Options::CommandLineArgs.Quiet)
+                    Log.Trace("[" + std::to_string(myPid) + "] INODE: " + std::to_string(details->d_ino) + ", A " + ModeName(file.st_mode) + ": " + sourceEntry.Full());
+                }
+
+                settings.Counters->FilesScanned.Add(1);
+
+                if(planning)
+                {
+                    if(!Plan::Record(relativeEntry, file))
                     {
-                        args[9] = (char*)"-q";
+                        Failed(settings, sourceEntry.Full(), 0);
+                        error = true;
                     }
 
-                    // Spawn the new process
-                    execv(Options::CommandLineArgs.ProgramPath.c_str(), args);
-                    Log.Fatal("Unable to start child process");
+                    continue;
                 }
-                else
+
+                // Duplicates are recreated from the first copy of their contents once everything has been copied
+                if(deduplicating && S_ISREG(file.st_mode) && Dedup::Skip(relativeEntry))
+                {
+                    if(Log.Enabled(L3::Level::DEBUG)) Log.Debug("[" + std::to_string(myPid) + "] Leaving duplicate " + sourceEntry.Full() + " for later");
+                    continue;
+                }
+
+                errno = 0;
+                if(!CopyEntry(settings, Entry{sourceFd, destFd, sourceEntry, destEntry}, file, destDevice))
                 {
-                    Log.Debug("[" + std::to_string(myPid) + "] Spawned child process " + std::to_string(pid) + " for " + path + " (copying to " + newDest + ")");
+                    Failed(settings, sourceEntry.Full(), errno);
+                    error = true;
                 }
             }
+        }
+
+        // Clean up after ourselves
+        if(destFd >= 0) close(destFd);
+        closedir(root);
+
+        return !error;
+    }
+
+    /**
+     * Start copying a subdirectory found by CopyDirectory. It gets a worker of its own if the memory budget has room
+     * for one, otherwise it is queued for this worker to copy later
+     *
+     * @param settings where to count it
+     * @param source the subdirectory
+     * @param dest where to copy it
+     * @param relativePath its path relative to the root of the copy, if it is tracked
+     * @param directory the directory it is in, as it is queued in pending
+     * @param pending where to queue it
+     * @return true iff it was handed to a worker or queued
+     */
+    static bool StartSubdirectory(const Settings& settings, const Path::Node& source, const Path::Node& dest,
+                                  const std::string& relativePath, const Path::Node* directory, Budget::Pending& pending)
+    {
+        auto myPid = getpid();
+        bool ok = true;
+
+        // Fork a worker if the budget has room for one. Workers that have exited give theirs back once reaped
+        bool haveSlot = Budget::TryAcquire();
+        if(!haveSlot)
+        {
+            if(!ReapFinished()) ok = false;
+            haveSlot = Budget::TryAcquire();
+        }
+
+        pid_t pid = -1;
+        if(haveSlot)
+        {
+            auto path = source.Full();
+            auto newDest = dest.Full();
+            pid = SpawnWorker(path, newDest, relativePath);
+            if(pid < 0)
+            {
+                Budget::Release();
+                Log.Warn("[" + std::to_string(myPid) + "] Unable to fork a worker for " + path + " (errno " + std::to_string(errno) + "), copying it in this process instead");
+            }
             else
             {
-                if(!CopyFile(path, newDest, file)) error = true;
+                Log.Debug("[" + std::to_string(myPid) + "] Spawned child process " + std::to_string(pid) + " for " + path + " (copying to " + newDest + ")");
+            }
+        }
+
+        // Otherwise copy it ourselves once we're done with this directory, which holds back scanning until the workers
+        // that exist catch up
+        if(pid < 0)
+        {
+            if(Log.Enabled(L3::Level::TRACE)) Log.Trace("[" + std::to_string(myPid) + "] Queueing " + source.Full());
+            settings.Counters->DirectoriesQueued.Add(1);
+            if(!pending.Push(directory, source.Name, source.Length))
+            {
+                settings.Counters->DirectoriesQueued.Sub(1);
+                settings.Counters->Errors.Add(1);
+                ok = false;
             }
         }
 
-        //Wait all child pids
-        Log.Debug("[" + std::to_string(myPid) + "] Waiting for child processes to finish");
+        return ok;
+    }
+
+    /**
+     * Copy a directory tree, along with every subdirectory that doesn't get a worker of its own. Queued directories
+     * are copied one at a time, after the root
+     *
+     * @param settings how to copy
+     * @param source the directory to copy from, with a trailing '/'
+     * @param dest the directory to copy to, with a trailing '/'
+     * @param rootRelativePath the path of the root relative to the root of the copy
+     * @param rootDevice set to the device the root lives on
+     * @return true iff everything was copied (or handed off to a worker) without errors
+     */
+    static bool CopyTree(const Settings& settings, const std::string& source, const std::string& dest,
+                         const std::string& rootRelativePath, dev_t& rootDevice)
+    {
+        bool error = false;
+
+        // Subdirectories that couldn't get a worker of their own are copied after this one, one at a time
+        Budget::Pending pending;
+        const Path::Node* directory = pending.Root();
+        SubdirectoryHandler subdirectory = [&](const Path::Node& sourceEntry, const Path::Node& destEntry, const std::string& relativeEntry, const Filter::State&) {
+            return StartSubdirectory(settings, sourceEntry, destEntry, relativeEntry, directory, pending);
+        };
+
+        // Workers and queued directories find where they are in the include/exclude rules from their relative path
+        bool filtering = settings.Rules != nullptr;
+        Filter::State filterState;
+        if(filtering) filterState = settings.Rules->ForPath(rootRelativePath);
+
+        dev_t device;
+        if(!CopyDirectory(settings, source, dest, rootRelativePath, filterState, subdirectory, rootDevice)) error = true;
+
+        // Queued directories are relative to the one this worker was started on. The whole paths are reused from one
+        // directory to the next, so their storage is too
+        std::string directorySource, directoryDest, relativePath;
+        while(pending.Pop(directory))
+        {
+            settings.Counters->DirectoriesQueued.Sub(1);
+
+            directorySource.assign(source);
+            directory->AppendTo(directorySource);
+            directorySource += '/';
+
+            directoryDest.assign(dest);
+            directory->AppendTo(directoryDest);
+            directoryDest += '/';
+
+            relativePath.assign(rootRelativePath);
+            relativePath += '/';
+            directory->AppendTo(relativePath);
+
+            if(filtering) filterState = settings.Rules->ForPath(relativePath);
+
+            if(!CopyDirectory(settings, directorySource, directoryDest, relativePath, filterState, subdirectory, device)) error = true;
+        }
+
+        if(pending.Failed())
+        {
+            settings.Counters->Errors.Add(1);
+            error = true;
+        }
+
+        return !error;
+    }
+
+    /**
+     * Wait for every worker this process started to exit
+     *
+     * @param device the device to attribute the time spent waiting to
+     * @return true iff all of them succeeded
+     */
+    static bool WaitForWorkers(dev_t device)
+    {
+        bool ok = true;
+
+        Log.Debug("[" + std::to_string(getpid()) + "] Waiting for child processes to finish");
+
+        auto waitStart = Latency::Enabled ? Latency::Now() : 0;
 
         __pid_t child;
         int status;
-        while ((child = waitpid(-1, &status, 0)))
+        while ((child = waitpid(-1, &status, 0)) != -1 || errno == EINTR)
+        {
+            if(child == -1) continue;
+            if(!Reaped(child, status)) ok = false;
+        }
+
+        if(Latency::Enabled) Latency::Record(Latency::WAIT, device, Latency::Now() - waitStart);
+
+        return ok;
+    }
+
+    /**
+     * Begin a file copy operation from the specified directory to the specified directory. The source directory
+     * should exist, it is not validated.
+     *
+     * @param source The directory to copy from
+     * @param dest The directory to copy to. It will be created if it does not exist
+     * @return the status code for the operation. 0 for success, failure otherwise.
+     */
+    int BeginCopy(std::string source, std::string dest)
+    {
+        bool error = false;
+
+        Stats::Shared->ActiveWorkers.Add(1);
+
+        dev_t rootDevice = 0;
+        if(!CopyTree(Options::CommandLineArgs.CopySettings(), source, dest, Options::CommandLineArgs.RelativePath, rootDevice)) error = true;
+
+        // This worker is done with its own share of the work, it only has to wait for its children now
+        Stats::Shared->ActiveWorkers.Sub(1);
+
+        if(!WaitForWorkers(rootDevice)) error = true;
+
+        return error ? -1 : 0;
+    }
+
+    int BeginCopy(const std::vector<std::string>& sources, std::string dest)
+    {
+        auto myPid = getpid();
+        bool error = false;
+
+        Stats::Shared->ActiveWorkers.Add(1);
+
+        // Every source but the last gets a worker of its own while the budget has room for one, the rest are copied
+        // here one after the other
+        std::vector<std::string> here;
+        for(size_t i = 0; i + 1 < sources.size(); i++)
         {
-            if(errno == ECHILD) break;
-            if(status != 0)
+            // Workers that have exited give their slots back once reaped
+            bool haveSlot = Budget::TryAcquire();
+            if(!haveSlot)
             {
-                Log.Error("[" + std::to_string(myPid) + "] Child process " + std::to_string(child) + " exited with code " + std::to_string(status));
+                if(!ReapFinished()) error = true;
+                haveSlot = Budget::TryAcquire();
             }
+
+            pid_t pid = -1;
+            if(haveSlot)
+            {
+                pid = SpawnWorker(sources[i], dest, "");
+                if(pid < 0) Budget::Release();
+                else Log.Debug("[" + std::to_string(myPid) + "] Spawned child process " + std::to_string(pid) + " for " + sources[i]);
+            }
+
+            if(pid < 0) here.push_back(sources[i]);
         }
 
-        // Clean up after ourselves
-        closedir(root);
+        if(!sources.empty()) here.push_back(sources.back());
+
+        auto settings = Options::CommandLineArgs.CopySettings();
+        dev_t rootDevice = 0;
+        for(auto& source : here)
+        {
+            if(!CopyTree(settings, source, dest, "", rootDevice)) error = true;
+        }
+
+        Stats::Shared->ActiveWorkers.Sub(1);
+
+        if(!WaitForWorkers(rootDevice)) error = true;
 
         return error ? -1 : 0;
     }
 }
-
@@ -20,10 +20,67 @@
 #ifndef EECS3540_COPY_H
 #define EECS3540_COPY_H
 
+#include <sys/stat.h>
+#include <atomic>
+#include <functional>
 #include <string>
+#include <vector>
+#include "compress.h"
+#include "filter.h"
+#include "path.h"
+#include "stats.h"
 
 namespace Copy
 {
+    /**
+     * How a copy is done, and where it is counted. The engine doesn't read the command line itself: parcp fills this
+     * in from its options (see Options::CopySettings), library jobs from their JobOptions
+     */
+    struct Settings
+    {
+        /** Compress copies with this codec and add its suffix, or NONE */
+        Compress::Codec Compression = Compress::NONE;
+        /** The compression level, or 0 for the codec's default */
+        int CompressionLevel = 0;
+        /** Decompress files that were written by Compression, dropping the suffix */
+        bool Decompress = false;
+
+        /** Where entries, bytes and errors are counted. Must be set */
+        Stats::Counters* Counters = nullptr;
+        /** The include/exclude rules, or nullptr to copy everything */
+        const Filter::Matcher* Rules = nullptr;
+        /** If set, directories stop being copied once this is true */
+        const std::atomic<bool>* Cancelled = nullptr;
+
+        /** Called for each file or symlink that was copied, with its source, its destination and its lstat */
+        std::function<void(const std::string& source, const std::string& dest, const struct stat& info)> OnFile;
+        /** Called for each entry that couldn't be copied, with its path and the errno of the failure (or 0) */
+        std::function<void(const std::string& path, int error)> OnError;
+
+        /**
+         * Only record entries with Plan::Record instead of copying them (--plan). The command line's planning, mirror
+         * and dedup state is shared between its workers, so these are only set by parcp itself
+         */
+        bool Planning = false;
+        /** Remove destination entries that aren't in the source before copying a directory (--delete) */
+        bool Mirror = false;
+        /** Leave files that Dedup::Skip claims for later (--dedup) */
+        bool Deduplicating = false;
+    };
+
+    /**
+     * Called by CopyDirectory for each subdirectory that wasn't excluded, to copy it however the caller copies
+     * directories (parcp starts a worker or queues it, jobs submit a task)
+     *
+     * @param source the subdirectory, its parent is the directory being copied
+     * @param dest where to copy it, its parent is the destination directory
+     * @param relativePath its path relative to the root of the copy, if the copy tracks it (see CopyDirectory)
+     * @param filterState where it is in the include/exclude rules, if there are any
+     * @return false if it couldn't be handed off. The failure must already be counted
+     */
+    typedef std::function<bool(const Path::Node& source, const Path::Node& dest, const std::string& relativePath,
+                               const Filter::State& filterState)> SubdirectoryHandler;
+
     /**
      * Begin a file copy operation from the specified directory to the specified directory. The source directory
      * should exist, it is not validated.
@@ -33,6 +90,49 @@ namespace Copy
      * @return the status code for the operation. 0 for success, failure otherwise.
      */
     int BeginCopy(std::string source, std::string dest);
+
+    /**
+     * Copy the contents of several directories into the same destination, as one copy. Sources are started in order,
+     * each on a worker of its own while the memory budget has room for one
+     *
+     * @param sources the directories to copy from, each with a trailing '/'. They should exist, they are not validated
+     * @param dest the directory to copy to, with a trailing '/'. It will be created if it does not exist
+     * @return the status code for the operation. 0 for success, failure otherwise.
+     */
+    int BeginCopy(const std::vector<std::string>& sources, std::string dest);
+
+    /**
+     * Copies the file at the specified location to the specified destination folder. If the file is a symbolic link,
+     * then the link is copied. Otherwise, if the file is NOT a regular file, it is skipped. The destination directory
+     * should already exist.
+     *
+     * @param settings how to copy it, and where to count it
+     * @param source the file to copy
+     * @param dest where to copy it to
+     * @param info the stat struct of the file (from lstat)
+     * @param destDevice the device the destination lives on, used to attribute syscall latencies
+     * @return true iff the file was copied (or skipped)
+     */
+    bool CopyFile(const Settings& settings, const std::string& source, const std::string& dest, const struct stat& info, dev_t destDevice);
+
+    /**
+     * Copy the files in a directory, and hand its subdirectories to subdirectory. This is the traversal every copy of
+     * a tree goes through, whether it runs in parcp's workers or in a library job. Entries are opened relative to the
+     * open source and destination directories, failures are logged, counted and passed to Settings::OnError.
+     *
+     * @param settings how to copy, and where to count it
+     * @param source the directory to copy from, with a trailing '/'
+     * @param dest the directory to copy to, with a trailing '/'. It is created if it does not exist
+     * @param relativePath the path of the directory relative to the root of the copy ("" for the root). Only needed
+     * when planning or deduplicating, which look entries up by it
+     * @param filterState where the directory is in settings.Rules, if there are any
+     * @param subdirectory called for each subdirectory to copy
+     * @param device set to the device the directory lives on, once it has been stat'd
+     * @return true iff everything in the directory was copied (or handed off) without errors
+     */
+    bool CopyDirectory(const Settings& settings, const std::string& source, const std::string& dest,
+                       const std::string& relativePath, const Filter::State& filterState,
+                       const SubdirectoryHandler& subdirectory, dev_t& device);
 }
 
 #endif //EECS3540_COPY_H
@@ -0,0 +1,653 @@
+/*
+ * Copyright (c) 2016 Nathan Lowe
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of this software
+ * and associated documentation files (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all copies or substantial
+ * portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT
+ * LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN
+ * NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <linux/fs.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <algorithm>
+#include <atomic>
+#include <cstring>
+#include <thread>
+#include <vector>
+#include "copy.h"
+#include "dedup.h"
+#include "filter.h"
+#include "Logger.h"
+#include "opts.h"
+#include "stats.h"
+#include "sys.h"
+#include "util.h"
+
+/** The size of the buffer each hashing thread reads files with */
+#define DEDUP_READ_BUFFER_SIZE (1024 * 1024)
+/** The size of the buffers used to write the temporary files */
+#define DEDUP_SPILL_BUFFER_SIZE (1024 * 1024)
+/** The most threads used to hash candidates or recreate duplicates */
+#define DEDUP_MAX_THREADS 16
+/** Marks the end of an index file, so a worker can tell it attached to the right thing */
+#define DEDUP_INDEX_MAGIC 0x7061726370646470ULL
+
+namespace Dedup
+{
+    L3::Logger Log("Dedup");
+
+    /** A minimal SHA-256, used to tell whether two files of the same size have the same contents */
+    class Sha256
+    {
+    public:
+        Sha256() : state{0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19} {}
+
+        void Update(const unsigned char* data, size_t length)
+        {
+            total += length;
+
+            if(buffered > 0)
+            {
+                auto take = std::min(length, sizeof(buffer) - buffered);
+                memcpy(buffer + buffered, data, take);
+                buffered += take;
+                data += take;
+                length -= take;
+
+                if(buffered < sizeof(buffer)) return;
+                Compress(buffer);
+                buffered = 0;
+            }
+
+            for(; length >= sizeof(buffer); data += sizeof(buffer), length -= sizeof(buffer)) Compress(data);
+
+            memcpy(buffer, data, length);
+            buffered = length;
+        }
+
+        void Final(unsigned char digest[32])
+        {
+            uint64_t bits = total * 8;
+
+            unsigned char padding[72] = {0x80};
+            size_t padLength = (buffered < 56 ? 56 : 120) - buffered;
+            for(int i = 0; i < 8; i++) padding[padLength + i] = (unsigned char) (bits >> (56 - 8 * i));
+
+            Update(padding, padLength + 8);
+
+            for(int i = 0; i < 8; i++)
+            {
+                for(int j = 0; j < 4; j++) digest[4 * i + j] = (unsigned char) (state[i] >> (24 - 8 * j));
+            }
+        }
+
+    private:
+        uint32_t state[8];
+        unsigned char buffer[64];
+        size_t buffered = 0;
+        uint64_t total = 0;
+
+        static uint32_t Rotate(uint32_t x, int n) { return (x >> n) | (x << (32 - n)); }
+
+        void Compress(const unsigned char* block)
+        {
+            static const uint32_t K[64] = {
+                0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+                0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+                0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+                0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+                0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+                0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+                0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+                0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+            };
+
+            uint32_t w[64];
+            for(int i = 0; i < 16; i++)
+            {
+                w[i] = (uint32_t) block[4 * i] << 24 | (uint32_t) block[4 * i + 1] << 16 | (uint32_t) block[4 * i + 2] << 8 | block[4 * i + 3];
+            }
+
+            for(int i = 16; i < 64; i++)
+            {
+                auto s0 = Rotate(w[i - 15], 7) ^ Rotate(w[i - 15], 18) ^ (w[i - 15] >> 3);
+                auto s1 = Rotate(w[i - 2], 17) ^ Rotate(w[i - 2], 19) ^ (w[i - 2] >> 10);
+                w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+            }
+
+            uint32_t a = state[0], b = state[1], c = state[2], d = state[3], e = state[4], f = state[5], g = state[6], h = state[7];
+            for(int i = 0; i < 64; i++)
+            {
+                auto t1 = h + (Rotate(e, 6) ^ Rotate(e, 11) ^ Rotate(e, 25)) + ((e & f) ^ (~e & g)) + K[i] + w[i];
+                auto t2 = (Rotate(a, 2) ^ Rotate(a, 13) ^ Rotate(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+                h = g; g = f; f = e; e = d + t1; d = c; c = b; b = a; a = t1 + t2;
+            }
+
+            state[0] += a; state[1] += b; state[2] += c; state[3] += d;
+            state[4] += e; state[5] += f; state[6] += g; state[7] += h;
+        }
+    };
+
+    /** Where a candidate is in the hashing process */
+    enum CandidateState : uint16_t
+    {
+        /** No other file has the same size, so it isn't hashed */
+        UNIQUE,
+        /** It shares its size with another file and needs to be hashed */
+        PENDING,
+        HASHED,
+        /** It couldn't be read, or changed while being hashed. It is copied as usual */
+        FAILED
+    };
+
+    /** A regular file that might be a duplicate. These live in a mapped temporary file */
+    struct Candidate
+    {
+        uint64_t Size;
+        /** Where the path of the file, relative to the root of the copy, starts in the paths file */
+        uint64_t PathOffset;
+        uint32_t PathLength;
+        /** The permission bits of the file, for reflinked copies */
+        uint16_t Mode;
+        uint16_t State;
+        /** The first half of the SHA-256 of the file's contents */
+        unsigned char Hash[16];
+    };
+
+    /** A duplicate that workers should skip. The index is sorted by path hash so workers can binary search it */
+    struct IndexEntry
+    {
+        uint64_t PathHash;
+        uint64_t PathOffset;
+        uint32_t PathLength;
+        uint32_t Reserved;
+    };
+
+    /** The end of the index file: the paths, followed by the index entries, followed by this */
+    struct IndexFooter
+    {
+        uint64_t EntriesOffset;
+        uint64_t Count;
+        uint64_t Magic;
+    };
+
+    /** The FNV-1a hash of a path */
+    static uint64_t HashPath(const char* path, size_t length)
+    {
+        uint64_t hash = 0xcbf29ce484222325ULL;
+        for(size_t i = 0; i < length; i++) hash = (hash ^ (unsigned char) path[i]) * 0x100000001b3ULL;
+
+        return hash;
+    }
+
+    /** The number of threads to hash or link with */
+    static unsigned ThreadCount()
+    {
+        return std::min(std::max(2u, std::thread::hardware_concurrency()), (unsigned) DEDUP_MAX_THREADS);
+    }
+
+    /** Buffered appends to a temporary file */
+    class Spill
+    {
+    public:
+        int Fd = -1;
+        /** The number of bytes appended so far, including anything still buffered */
+        uint64_t Size = 0;
+
+        bool Append(const void* data, size_t length)
+        {
+            buffer.insert(buffer.end(), static_cast<const char*>(data), static_cast<const char*>(data) + length);
+            Size += length;
+
+            return buffer.size() < DEDUP_SPILL_BUFFER_SIZE || Flush();
+        }
+
+        bool Flush()
+        {
+            auto written = Sys::WriteAll(Fd, buffer.data(), buffer.size(), 0);
+            bool ok = written == buffer.size();
+            buffer.clear();
+
+            return ok;
+        }
+
+    private:
+        std::vector<char> buffer;
+    };
+
+    /** Map the first size bytes of a file, or return nullptr on failure (or if size is 0) */
+    static char* Map(int fd, uint64_t size, bool writable)
+    {
+        if(size == 0) return nullptr;
+
+        auto data = mmap(nullptr, (size_t) size, writable ? PROT_READ | PROT_WRITE : PROT_READ, MAP_SHARED, fd, 0);
+        return data == MAP_FAILED ? nullptr : static_cast<char*>(data);
+    }
+
+    /** The index being used by this process */
+    static const char* index = nullptr;
+    static const IndexEntry* entries = nullptr;
+    static uint64_t entryCount = 0;
+
+    /** The candidates found by the root process, sorted so that files with the same contents are next to each other */
+    static Candidate* candidates = nullptr;
+    static uint64_t candidateCount = 0;
+
+    bool Parse(const std::string& name, Mode& mode)
+    {
+        if(name == "hardlink") mode = HARDLINK;
+        else if(name == "reflink") mode = REFLINK;
+        else return false;
+
+        return true;
+    }
+
+    /**
+     * Add the regular files in a directory, and everything under it, to the candidates
+     *
+     * @param dir the directory to scan, with a trailing '/'
+     * @param relative the path of the directory relative to the root of the copy ("" for the root itself)
+     * @param dev the device the directory lives on
+     * @param filterState where the directory is in the include/exclude rules
+     * @param minSize files smaller than this are skipped
+     * @param paths where to write the paths of the candidates
+     * @param list where to write the candidates
+     * @return false if the temporary files couldn't be written
+     */
+    static bool Scan(const std::string& dir, const std::string& relative, dev_t dev, const Filter::State& filterState,
+                     uint64_t minSize, Spill& paths, Spill& list)
+    {
+        DIR* handle = Sys::Opendir(dir.c_str(), dev);
+        if(handle == nullptr)
+        {
+            // The copy will run into (and report) the same problem
+            Log.Debug("[" + std::to_string(getpid()) + "] Unable to open directory " + dir + " (errno " + std::to_string(errno) + ")");
+            return true;
+        }
+
+        bool filtering = !Filter::Rules.Empty();
+        bool ok = true;
+
+        struct dirent* details;
+        struct stat info;
+        while(ok && (details = Sys::Readdir(handle, dev)) != nullptr)
+        {
+            if(strcmp(details->d_name, ".") == 0 || strcmp(details->d_name, "..") == 0) continue;
+            if(details->d_type != DT_DIR && details->d_type != DT_REG && details->d_type != DT_UNKNOWN) continue;
+
+            auto path = dir + details->d_name;
+            if(Sys::Lstat(path.c_str(), &info, dev) != 0) continue;
+
+            bool isDirectory = S_ISDIR(info.st_mode);
+            Filter::State childState;
+            if(filtering && !Filter::Rules.Included(filterState, details->d_name, isDirectory, &childState)) continue;
+
+            auto childRelative = relative + "/" + details->d_name;
+            if(isDirectory)
+            {
+                ok = Scan(path + "/", childRelative, info.st_dev, childState, minSize, paths, list);
+            }
+            else if(S_ISREG(info.st_mode) && (uint64_t) info.st_size >= minSize)
+            {
+                Candidate candidate;
+                memset(&candidate, 0, sizeof(candidate));
+                candidate.Size = (uint64_t) info.st_size;
+                candidate.PathOffset = paths.Size;
+                candidate.PathLength = (uint32_t) childRelative.size();
+                candidate.Mode = (uint16_t) (info.st_mode & 07777);
+
+                ok = paths.Append(childRelative.data(), childRelative.size()) && list.Append(&candidate, sizeof(candidate));
+            }
+        }
+
+        closedir(handle);
+        return ok;
+    }
+
+    /**
+     * Hash a candidate, marking it FAILED if it can't be read or doesn't have the size it was scanned with
+     *
+     * @param source the root of the copy
+     * @param paths the mapped paths file
+     * @param candidate the candidate to hash
+     * @param buffer a buffer to read the file with
+     */
+    static void Hash(const std::string& source, const char* paths, Candidate& candidate, std::vector<unsigned char>& buffer)
+    {
+        auto path = source + std::string(paths + candidate.PathOffset + 1, candidate.PathLength - 1);
+
+        candidate.State = FAILED;
+        int fd = Sys::Open(path.c_str(), O_RDONLY, 0, 0);
+        if(fd < 0) return;
+
+#ifndef NO_POSIX_ADVISE
+        posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+
+        Sha256 hash;
+        uint64_t total = 0;
+        ssize_t bytesRead;
+        while((bytesRead = Sys::Read(fd, buffer.data(), buffer.size(), 0)) > 0)
+        {
+            hash.Update(buffer.data(), (size_t) bytesRead);
+            total += (uint64_t) bytesRead;
+        }
+
+        Sys::Close(fd, 0);
+        if(bytesRead < 0 || total != candidate.Size) return;
+
+        unsigned char digest[32];
+        hash.Final(digest);
+        memcpy(candidate.Hash, digest, sizeof(candidate.Hash));
+        candidate.State = HASHED;
+    }
+
+    /** Whether or not two hashed candidates have the same contents */
+    static bool SameContents(const Candidate& a, const Candidate& b)
+    {
+        return a.State == HASHED && b.State == HASHED && a.Size == b.Size && memcmp(a.Hash, b.Hash, sizeof(a.Hash)) == 0;
+    }
+
+    int Index(const std::string& source, uint64_t minSize)
+    {
+        auto myPid = getpid();
+
+        Spill paths, list;
+        paths.Fd = util::TemporaryFile("dedup");
+        list.Fd = util::TemporaryFile("dedup");
+        if(paths.Fd < 0 || list.Fd < 0)
+        {
+            Log.Fatal("[" + std::to_string(myPid) + "] Unable to create temporary files (errno " + std::to_string(errno) + ")");
+            return -1;
+        }
+
+        struct stat rootStat;
+        if(Sys::Stat(source.c_str(), &rootStat) != 0 ||
+           !Scan(source, "", rootStat.st_dev, Filter::Rules.Root(), minSize, paths, list) || !paths.Flush() || !list.Flush())
+        {
+            Log.Fatal("[" + std::to_string(myPid) + "] Unable to find duplicates in " + source + " (errno " + std::to_string(errno) + ")");
+            return -1;
+        }
+
+        candidateCount = list.Size / sizeof(Candidate);
+        auto pathData = Map(paths.Fd, paths.Size, false);
+        candidates = reinterpret_cast<Candidate*>(Map(list.Fd, list.Size, true));
+        if(candidateCount > 0 && (pathData == nullptr || candidates == nullptr))
+        {
+            Log.Fatal("[" + std::to_string(myPid) + "] Unable to map the duplicate candidates (errno " + std::to_string(errno) + ")");
+            return -1;
+        }
+
+        // Only files that share their size with another file can have the same contents
+        std::sort(candidates, candidates + candidateCount, [](const Candidate& a, const Candidate& b) { return a.Size < b.Size; });
+        for(uint64_t i = 0; i < candidateCount; i++)
+        {
+            bool shared = (i > 0 && candidates[i - 1].Size == candidates[i].Size) ||
+                          (i + 1 < candidateCount && candidates[i + 1].Size == candidates[i].Size);
+            candidates[i].State = shared ? PENDING : UNIQUE;
+        }
+
+        std::atomic<uint64_t> next{0};
+        std::vector<std::thread> threads;
+        for(unsigned i = 0; i < ThreadCount(); i++)
+        {
+            threads.emplace_back([&]{
+                std::vector<unsigned char> buffer(DEDUP_READ_BUFFER_SIZE);
+                for(uint64_t c = next++; c < candidateCount; c = next++)
+                {
+                    if(candidates[c].State == PENDING) Hash(source, pathData, candidates[c], buffer);
+                }
+            });
+        }
+
+        for(auto& thread : threads) thread.join();
+
+        // Files with the same contents end up next to each other, in the order they were found
+        std::sort(candidates, candidates + candidateCount, [](const Candidate& a, const Candidate& b) {
+            if(a.Size != b.Size) return a.Size < b.Size;
+            if(a.State != b.State) return a.State < b.State;
+
+            auto order = memcmp(a.Hash, b.Hash, sizeof(a.Hash));
+            if(order != 0) return order < 0;
+
+            return a.PathOffset < b.PathOffset;
+        });
+
+        // Everything but the first file with each content is a duplicate that workers skip
+        uint64_t padding = (8 - paths.Size % 8) % 8;
+        uint64_t zero = 0;
+        bool ok = paths.Append(&zero, (size_t) padding);
+
+        IndexFooter footer{paths.Size, 0, DEDUP_INDEX_MAGIC};
+        uint64_t saved = 0;
+        for(uint64_t i = 1; ok && i < candidateCount; i++)
+        {
+            if(!SameContents(candidates[i - 1], candidates[i])) continue;
+
+            auto& candidate = candidates[i];
+            IndexEntry entry{HashPath(pathData + candidate.PathOffset, candidate.PathLength), candidate.PathOffset, candidate.PathLength, 0};
+            ok = paths.Append(&entry, sizeof(entry));
+
+            footer.Count++;
+            saved += candidate.Size;
+        }
+
+        if(pathData != nullptr) munmap(pathData, (size_t) (footer.EntriesOffset - padding));
+
+        ok = ok && paths.Append(&footer, sizeof(footer)) && paths.Flush();
+
+        auto data = ok ? Map(paths.Fd, paths.Size, true) : nullptr;
+        if(data == nullptr)
+        {
+            Log.Fatal("[" + std::to_string(myPid) + "] Unable to write the duplicate index (errno " + std::to_string(errno) + ")");
+            return -1;
+        }
+
+        auto indexEntries = reinterpret_cast<IndexEntry*>(data + footer.EntriesOffset);
+        std::sort(indexEntries, indexEntries + footer.Count, [](const IndexEntry& a, const IndexEntry& b) { return a.PathHash < b.PathHash; });
+        munmap(data, (size_t) paths.Size);
+
+        // The candidates are only needed by this process from here on
+        close(list.Fd);
+
+        Log.Info("[" + std::to_string(myPid) + "] Found " + std::to_string(footer.Count) + " duplicates among " +
+                 std::to_string(candidateCount) + " candidates, saving " + Stats::HumanBytes(saved));
+
+        if(!Attach(paths.Fd)) return -1;
+        return paths.Fd;
+    }
+
+    bool Attach(int fd)
+    {
+        struct stat info;
+        if(fstat(fd, &info) != 0 || (uint64_t) info.st_size < sizeof(IndexFooter)) return false;
+
+        index = Map(fd, (uint64_t) info.st_size, false);
+        if(index == nullptr) return false;
+
+        IndexFooter footer;
+        memcpy(&footer, index + info.st_size - sizeof(footer), sizeof(footer));
+        if(footer.Magic != DEDUP_INDEX_MAGIC) return false;
+
+        entries = reinterpret_cast<const IndexEntry*>(index + footer.EntriesOffset);
+        entryCount = footer.Count;
+
+        return true;
+    }
+
+    bool Skip(const std::string& relativePath)
+    {
+        if(entryCount == 0) return false;
+
+        auto hash = HashPath(relativePath.data(), relativePath.size());
+        auto end = entries + entryCount;
+        auto entry = std::lower_bound(entries, end, hash, [](const IndexEntry& e, uint64_t h) { return e.PathHash < h; });
+
+        for(; entry != end && entry->PathHash == hash; ++entry)
+        {
+            if(entry->PathLength == relativePath.size() && memcmp(index + entry->PathOffset, relativePath.data(), relativePath.size()) == 0)
+            {
+                return true;
+            }
+        }
+
+        return false;
+    }
+
+    /**
+     * Replace whatever is in the way of a duplicate with the specified call. Directories are never replaced
+     *
+     * @return 0 on success
+     */
+    template<typename F>
+    static int Replace(const std::string& path, F create)
+    {
+        auto result = create();
+
+        struct stat existing;
+        if(result != 0 && errno == EEXIST && lstat(path.c_str(), &existing) == 0 && !S_ISDIR(existing.st_mode) && unlink(path.c_str()) == 0)
+        {
+            result = create();
+        }
+
+        return result;
+    }
+
+    /**
+     * Clone the first copy of some contents into a new file, falling back to an in-kernel copy if the destination
+     * doesn't support reflinks
+     *
+     * @return true iff the new file has the same contents as the first copy
+     */
+    static bool Clone(const std::string& first, const std::string& path, const Candidate& candidate)
+    {
+        int in = Sys::Open(first.c_str(), O_RDONLY, 0, 0);
+        if(in < 0) return false;
+
+        int out = Sys::Open(path.c_str(), O_CREAT | O_WRONLY | O_TRUNC, candidate.Mode, 0);
+        if(out < 0)
+        {
+            Sys::Close(in, 0);
+            return false;
+        }
+
+        bool ok = ioctl(out, FICLONE, in) == 0;
+        if(!ok)
+        {
+            // A chunk at a time, so the copy is throttled as it goes like any other write
+            uint64_t done = 0;
+            while(done < candidate.Size)
+            {
+                auto chunk = (size_t) std::min((uint64_t) DEDUP_READ_BUFFER_SIZE, candidate.Size - done);
+                auto copied = Sys::CopyRangeAll(in, out, chunk, 0);
+
+                done += copied;
+                if(copied < chunk) break;
+            }
+
+            Stats::Shared->BytesCopied.Add(done);
+            ok = done == candidate.Size;
+        }
+
+        Sys::Close(in, 0);
+        if(Sys::Close(out, 0) != 0) ok = false;
+        if(!ok) unlink(path.c_str());
+
+        return ok;
+    }
+
+    /**
+     * Recreate a duplicate from the first copy of its contents. If that doesn't work (e.g. the first copy failed),
+     * the duplicate is copied from the source instead
+     *
+     * @return true iff the duplicate exists on the destination
+     */
+    static bool Recreate(const std::string& source, const std::string& dest, const Candidate& first, const Candidate& candidate, Mode mode)
+    {
+        auto firstRelative = std::string(index + first.PathOffset + 1, first.PathLength - 1);
+        auto relative = std::string(index + candidate.PathOffset + 1, candidate.PathLength - 1);
+        auto firstPath = dest + firstRelative;
+        auto path = dest + relative;
+
+        Log.Info("[" + std::to_string(getpid()) + "] " + (mode == HARDLINK ? "link" : "clone") + " '" + path + "' --> '" + firstPath + "'");
+
+        bool ok;
+        if(mode == HARDLINK) ok = Replace(path, [&]{ return link(firstPath.c_str(), path.c_str()); }) == 0;
+        else ok = Clone(firstPath, path, candidate);
+
+        if(ok)
+        {
+            Stats::Shared->FilesCopied.Add(1);
+            Stats::Shared->Deduplicated.Add(1);
+            return true;
+        }
+
+        Log.Warn("[" + std::to_string(getpid()) + "] Unable to recreate " + path + " from " + firstPath + " (errno " + std::to_string(errno) + "), copying it instead");
+
+        struct stat info;
+        auto sourcePath = source + relative;
+        if(Sys::Lstat(sourcePath.c_str(), &info, 0) != 0)
+        {
+            Log.Error("[" + std::to_string(getpid()) + "] Unable to stat " + sourcePath + " (errno " + std::to_string(errno) + ")");
+            Stats::Shared->Errors.Add(1);
+            return false;
+        }
+
+        if(!Copy::CopyFile(Options::CommandLineArgs.CopySettings(), sourcePath, path, info, 0))
+        {
+            Stats::Shared->Errors.Add(1);
+            return false;
+        }
+
+        return true;
+    }
+
+    bool Link(const std::string& source, const std::string& dest, Mode mode)
+    {
+        // Each run of candidates with the same contents is handled by one thread, in the order they were found
+        std::vector<uint64_t> runs;
+        for(uint64_t i = 1; i < candidateCount; i++)
+        {
+            if(SameContents(candidates[i - 1], candidates[i]) && (i == 1 || !SameContents(candidates[i - 2], candidates[i - 1])))
+            {
+                runs.push_back(i - 1);
+            }
+        }
+
+        std::atomic<size_t> next{0};
+        std::atomic<bool> error{false};
+        std::vector<std::thread> threads;
+        for(unsigned i = 0; i < std::min((size_t) ThreadCount(), runs.size()); i++)
+        {
+            threads.emplace_back([&]{
+                for(size_t r = next++; r < runs.size(); r = next++)
+                {
+                    auto& first = candidates[runs[r]];
+                    for(auto c = runs[r] + 1; c < candidateCount && SameContents(first, candidates[c]); c++)
+                    {
+                        if(!Recreate(source, dest, first, candidates[c], mode)) error = true;
+                    }
+                }
+            });
+        }
+
+        for(auto& thread : threads) thread.join();
+
+        return !error;
+    }
+}
@@ -0,0 +1,95 @@
+/*
+ * Copyright (c) 2016 Nathan Lowe
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of this software
+ * and associated documentation files (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all copies or substantial
+ * portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT
+ * LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN
+ * NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef EECS3540_DEDUP_H
+#define EECS3540_DEDUP_H
+
+#include <cstdint>
+#include <string>
+
+/**
+ * Content-addressed deduplication. Before the copy starts, the root process finds regular files with identical
+ * contents: candidates are grouped by size, and only files that share a size with another are hashed (in parallel).
+ * The first file with each content is copied as usual, and workers skip the others, which are recreated afterwards as
+ * hardlinks or reflinks to the copy of the first one.
+ *
+ * Everything about the candidates is kept in unlinked temporary files that are mapped into memory rather than in
+ * the heap, so the memory needed for trees with tens of millions of files is bounded by the page cache rather than
+ * by the size of the tree.
+ */
+namespace Dedup
+{
+    /** How duplicates are recreated on the destination */
+    enum Mode
+    {
+        /** Deduplication is disabled */
+        OFF,
+        /** Duplicates are hardlinks to the first copy, so they share an inode (and permissions) */
+        HARDLINK,
+        /** Duplicates are reflinks (copy on write clones) of the first copy, or plain copies if that isn't supported */
+        REFLINK
+    };
+
+    /**
+     * Parse the name of a mode ("hardlink" or "reflink")
+     *
+     * @param name the name to parse
+     * @param mode the mode
+     * @return true iff name was the name of a mode
+     */
+    bool Parse(const std::string& name, Mode& mode);
+
+    /**
+     * Find the duplicate files under source. This should only be called by the root process, before any workers are
+     * forked.
+     *
+     * @param source the root of the copy
+     * @param minSize files smaller than this are always copied
+     * @return the file descriptor that workers should attach to, or -1 on failure
+     */
+    int Index(const std::string& source, uint64_t minSize);
+
+    /**
+     * Attach to the duplicates found by the root process
+     *
+     * @param fd the file descriptor passed down from the parent process
+     * @return true iff the index was mapped successfully
+     */
+    bool Attach(int fd);
+
+    /**
+     * Check whether a worker should skip copying a file, since it will be recreated from its duplicate
+     *
+     * @param relativePath the path of the file relative to the root of the copy, starting with a '/'
+     * @return true iff the file is a duplicate
+     */
+    bool Skip(const std::string& relativePath);
+
+    /**
+     * Recreate every duplicate once the copy is done. This should only be called by the root process
+     *
+     * @param source the root of the copy
+     * @param dest the destination of the copy
+     * @param mode how to recreate the duplicates
+     * @return true iff every duplicate was recreated
+     */
+    bool Link(const std::string& source, const std::string& dest, Mode mode);
+}
+
+#endif //EECS3540_DEDUP_H
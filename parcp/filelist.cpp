@@ -0,0 +1,291 @@
+/*
+ * Copyright (c) 2016 Nathan Lowe
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of this software
+ * and associated documentation files (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all copies or substantial
+ * portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT
+ * LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN
+ * NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <unordered_set>
+#include <vector>
+#include "copy.h"
+#include "filelist.h"
+#include "filter.h"
+#include "Logger.h"
+#include "opts.h"
+#include "parcp.h"
+#include "stats.h"
+#include "sys.h"
+#include "util.h"
+
+/** How much of the list is read at a time */
+#define FILELIST_READ_SIZE (64 * 1024)
+/** The most paths handed to a thread at once */
+#define FILELIST_BATCH_SIZE 64
+/** The most batches waiting for a thread, per thread, before reading the list waits for them to catch up */
+#define FILELIST_QUEUED_PER_THREAD 4
+/** The most threads paths are copied on */
+#define FILELIST_MAX_THREADS 16
+/** The number of independently locked parts of the directory cache */
+#define FILELIST_CACHE_SHARDS 64
+
+namespace FileList
+{
+    L3::Logger Log("FileList");
+
+    /**
+     * The directories that have been created in the destination. Paths are spread over shards with a lock each, so
+     * threads checking for different directories rarely wait on each other
+     */
+    class DirectoryCache
+    {
+    public:
+        DirectoryCache(const std::string& source, const std::string& dest) : source(source), dest(dest) {}
+
+        /**
+         * Make sure a directory exists in the destination, creating it (and its parents) if this is the first time
+         * it has been asked for
+         *
+         * @param dir the directory, relative to the destination, or an empty string for the destination itself
+         * @return true iff the directory exists
+         */
+        bool Ensure(const std::string& dir);
+
+    private:
+        struct Shard
+        {
+            std::mutex Lock;
+            std::unordered_set<std::string> Created;
+        };
+
+        const std::string& source;
+        const std::string& dest;
+        Shard shards[FILELIST_CACHE_SHARDS];
+    };
+
+    bool DirectoryCache::Ensure(const std::string& dir)
+    {
+        if(dir.empty()) return true;
+
+        auto& shard = shards[std::hash<std::string>()(dir) % FILELIST_CACHE_SHARDS];
+        {
+            std::lock_guard<std::mutex> guard(shard.Lock);
+            if(shard.Created.count(dir) != 0) return true;
+        }
+
+        auto slash = dir.find_last_of('/');
+        if(slash != std::string::npos && !Ensure(dir.substr(0, slash))) return false;
+
+        // The directory gets the same mode as its source, as it would in a regular copy. Two threads can get here for
+        // the same directory at once, the second one just sees that it already exists
+        struct stat info;
+        auto mode = Sys::Stat((source + dir).c_str(), &info) == 0 && S_ISDIR(info.st_mode) ? info.st_mode : (mode_t) (S_IRWXU | S_IRWXG | S_IRWXO);
+
+        dev_t device = 0;
+        if(Sys::Mkdir((dest + dir).c_str(), mode, device) != 0)
+        {
+            if(errno != EEXIST)
+            {
+                Log.Error("[" + std::to_string(getpid()) + "] Unable to create directory " + dest + dir + " (errno " + std::to_string(errno) + ")");
+                return false;
+            }
+        }
+        else
+        {
+            Stats::Shared->DirectoriesScanned.Add(1);
+        }
+
+        std::lock_guard<std::mutex> guard(shard.Lock);
+        shard.Created.insert(dir);
+        return true;
+    }
+
+    /**
+     * Copy one path from the list
+     *
+     * @param source the directory the path is relative to, with a trailing '/'
+     * @param dest the directory to copy to, with a trailing '/'
+     * @param path the path, already cleaned up by util::SanitizePath
+     * @param directories the directories that already exist in the destination
+     * @return true iff the path was copied (or excluded)
+     */
+    static bool CopyPath(const std::string& source, const std::string& dest, const std::string& path, DirectoryCache& directories)
+    {
+        auto sourcePath = source + path;
+        struct stat info;
+        if(Sys::Lstat(sourcePath.c_str(), &info, 0) != 0)
+        {
+            Log.Error("[" + std::to_string(getpid()) + "] Unable to stat " + sourcePath + " (errno " + std::to_string(errno) + ")");
+            return false;
+        }
+
+        auto slash = path.find_last_of('/');
+        auto parent = slash == std::string::npos ? std::string() : path.substr(0, slash);
+
+        // The rules are checked against the listed path alone, its parents were listed (or not) by whoever made the list
+        if(!Filter::Rules.Empty())
+        {
+            auto state = Filter::Rules.ForPath(parent);
+            if(!Filter::Rules.Included(state, path.c_str() + (slash == std::string::npos ? 0 : slash + 1), S_ISDIR(info.st_mode), nullptr))
+            {
+                if(Log.Enabled(L3::Level::DEBUG)) Log.Debug("[" + std::to_string(getpid()) + "] Excluding " + sourcePath);
+                Stats::Shared->Excluded.Add(1);
+                return true;
+            }
+        }
+
+        if(!directories.Ensure(parent)) return false;
+        if(S_ISDIR(info.st_mode)) return directories.Ensure(path);
+
+        Stats::Shared->FilesScanned.Add(1);
+        return Copy::CopyFile(Options::CommandLineArgs.CopySettings(), sourcePath, dest + path, info, 0);
+    }
+
+    int Copy(const std::string& source, const std::string& dest, const std::string& list, bool nullSeparated)
+    {
+        int fd = list == "-" ? STDIN_FILENO : open(list.c_str(), O_RDONLY | O_CLOEXEC);
+        if(fd < 0)
+        {
+            Log.Fatal("Unable to read the file list " + list + " (errno " + std::to_string(errno) + ")");
+            return -1;
+        }
+
+        // The destination root gets the same mode as the source root, as it would in a regular copy
+        struct stat rootStat;
+        dev_t destDevice = 0;
+        if(Sys::Stat(source.c_str(), &rootStat) != 0 ||
+           (Sys::Mkdir(dest.c_str(), rootStat.st_mode, destDevice) != 0 && errno != EEXIST))
+        {
+            Log.Fatal("Unable to create " + dest + " (errno " + std::to_string(errno) + ")");
+            Stats::Shared->Errors.Add(1);
+            if(fd != STDIN_FILENO) close(fd);
+            return -1;
+        }
+
+        DirectoryCache directories(source, dest);
+        std::atomic<bool> error(false);
+
+        Parcp::ThreadPool pool(std::min(std::max(2u, std::thread::hardware_concurrency()), (unsigned) FILELIST_MAX_THREADS));
+
+        // Batches are handed out as the list is read, but only a few per thread at a time so a long list is never
+        // all in memory at once
+        std::mutex lock;
+        std::condition_variable drained;
+        size_t queued = 0;
+        auto maxQueued = pool.Size() * FILELIST_QUEUED_PER_THREAD;
+
+        std::vector<std::string> batch;
+        auto submit = [&]{
+            if(batch.empty()) return;
+
+            {
+                std::unique_lock<std::mutex> guard(lock);
+                drained.wait(guard, [&]{ return queued < maxQueued; });
+                queued++;
+            }
+
+            auto paths = std::make_shared<std::vector<std::string>>(std::move(batch));
+            batch.clear();
+
+            pool.Submit([&, paths]{
+                for(auto& path : *paths)
+                {
+                    if(!CopyPath(source, dest, path, directories))
+                    {
+                        Stats::Shared->Errors.Add(1);
+                        error = true;
+                    }
+                }
+
+                std::lock_guard<std::mutex> guard(lock);
+                queued--;
+                drained.notify_all();
+            });
+        };
+
+        std::string clean;
+        auto take = [&](const std::string& path) {
+            if(path.empty()) return;
+
+            if(!util::SanitizePath(path, clean) || clean.empty())
+            {
+                Log.Error("[" + std::to_string(getpid()) + "] Refusing to copy " + path + ", it isn't inside of " + source);
+                Stats::Shared->Errors.Add(1);
+                error = true;
+                return;
+            }
+
+            batch.push_back(clean);
+            if(batch.size() == FILELIST_BATCH_SIZE) submit();
+        };
+
+        Stats::Shared->ActiveWorkers.Add(1);
+
+        std::vector<char> chunk(FILELIST_READ_SIZE);
+        std::string path;
+        ssize_t count;
+        while((count = read(fd, chunk.data(), chunk.size())) != 0)
+        {
+            if(count < 0)
+            {
+                if(errno == EINTR) continue;
+
+                Log.Fatal("Unable to read the file list " + list + " (errno " + std::to_string(errno) + ")");
+                Stats::Shared->Errors.Add(1);
+                error = true;
+                break;
+            }
+
+            size_t start = 0;
+            for(size_t i = 0; i < (size_t) count; i++)
+            {
+                if(chunk[i] != '\0' && (nullSeparated || chunk[i] != '\n')) continue;
+
+                path.append(&chunk[start], i - start);
+                take(path);
+                path.clear();
+                start = i + 1;
+            }
+
+            path.append(&chunk[start], (size_t) count - start);
+
+            // Whatever has been read so far can be copied while waiting for more of the list
+            submit();
+        }
+
+        take(path);
+        submit();
+
+        // Wait for the rest of the batches
+        {
+            std::unique_lock<std::mutex> guard(lock);
+            drained.wait(guard, [&]{ return queued == 0; });
+        }
+
+        Stats::Shared->ActiveWorkers.Sub(1);
+
+        if(fd != STDIN_FILENO) close(fd);
+        return error ? -1 : 0;
+    }
+}
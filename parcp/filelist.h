@@ -0,0 +1,48 @@
+/*
+ * Copyright (c) 2016 Nathan Lowe
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of this software
+ * and associated documentation files (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all copies or substantial
+ * portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT
+ * LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN
+ * NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef EECS3540_FILELIST_H
+#define EECS3540_FILELIST_H
+
+#include <string>
+
+/**
+ * Copying a list of paths (--files-from) instead of whole trees. The list is read as it arrives, so it can be
+ * streamed from another program, and the paths in it are copied across a pool of threads. Each path is relative to
+ * the source and is copied to the same path under the destination. The directories leading up to it are created
+ * (with the modes of their sources) the first time any path needs them, which is remembered so each one is only
+ * created once.
+ *
+ * Directories in the list are created, but not copied recursively. List their contents too, or copy them with -f.
+ */
+namespace FileList
+{
+    /**
+     * Copy every path in a list
+     *
+     * @param source the directory the paths are relative to, with a trailing '/'
+     * @param dest the directory to copy to, with a trailing '/'. It will be created if it does not exist
+     * @param list the file to read the paths from, or "-" for standard input
+     * @param nullSeparated whether paths are separated by NUL characters only, rather than by newlines or NULs
+     * @return 0 iff every path was copied
+     */
+    int Copy(const std::string& source, const std::string& dest, const std::string& list, bool nullSeparated);
+}
+
+#endif //EECS3540_FILELIST_H
@@ -0,0 +1,402 @@
+/*
+ * Copyright (c) 2016 Nathan Lowe
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of this software
+ * and associated documentation files (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all copies or substantial
+ * portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT
+ * LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN
+ * NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include <fnmatch.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <algorithm>
+#include <climits>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <unordered_map>
+#include "filter.h"
+
+/** The rule index used when no rule matched */
+#define FILTER_NO_RULE INT_MAX
+
+namespace Filter
+{
+    Matcher Rules;
+
+    /** A node in the pattern trie. Each node is one path component into one or more patterns */
+    struct Node
+    {
+        /** Children for components without any wildcards, by name */
+        std::unordered_map<std::string, std::unique_ptr<Node>> Literals;
+        /** Children for components of the form "*<literal>", by the literal suffix */
+        std::unordered_map<std::string, std::unique_ptr<Node>> Suffixes;
+        /** The distinct lengths of the keys in Suffixes, so a name only needs one lookup per length */
+        std::vector<size_t> SuffixLengths;
+        /** Children for every other glob */
+        std::vector<std::pair<std::string, std::unique_ptr<Node>>> Globs;
+        /** The child for a "**" component, which can consume any number of components */
+        std::unique_ptr<Node> Star;
+        /** Whether or not this node is the "**" child of its parent */
+        bool IsStar = false;
+
+        /** The first rule that ends at this node and matches any entry */
+        int AnyRule = FILTER_NO_RULE;
+        /** The first rule that ends at this node and only matches directories */
+        int DirectoryRule = FILTER_NO_RULE;
+    };
+
+    static bool HasWildcards(const std::string& s)
+    {
+        return s.find_first_of("*?[\\") != std::string::npos;
+    }
+
+    /** Gets (or creates) the child of the specified node for the specified pattern component */
+    static Node* Child(Node* node, const std::string& component)
+    {
+        if(component == "**")
+        {
+            if(!node->Star)
+            {
+                node->Star.reset(new Node());
+                node->Star->IsStar = true;
+            }
+
+            return node->Star.get();
+        }
+
+        if(!HasWildcards(component))
+        {
+            auto& child = node->Literals[component];
+            if(!child) child.reset(new Node());
+            return child.get();
+        }
+
+        if(component[0] == '*' && !HasWildcards(component.substr(1)))
+        {
+            auto suffix = component.substr(1);
+            auto& child = node->Suffixes[suffix];
+            if(!child)
+            {
+                child.reset(new Node());
+                if(std::find(node->SuffixLengths.begin(), node->SuffixLengths.end(), suffix.size()) == node->SuffixLengths.end())
+                {
+                    node->SuffixLengths.push_back(suffix.size());
+                }
+            }
+
+            return child.get();
+        }
+
+        for(auto& glob : node->Globs)
+        {
+            if(glob.first == component) return glob.second.get();
+        }
+
+        node->Globs.emplace_back(component, std::unique_ptr<Node>(new Node()));
+        return node->Globs.back().second.get();
+    }
+
+    /**
+     * Parse a rules file for --exclude-from. Each line holds one pattern. Lines starting with "+ " are include rules,
+     * lines starting with "- " (or anything else) are exclude rules. Blank lines and lines starting with '#' are
+     * ignored.
+     *
+     * @param path the file to read
+     * @param rules the rules read from the file are appended to this list
+     * @return true iff the file could be read
+     */
+    bool ReadRulesFile(const std::string& path, std::vector<Rule>& rules)
+    {
+        std::ifstream file;
+        if(path != "-")
+        {
+            file.open(path);
+            if(!file) return false;
+        }
+
+        std::istream& in = path == "-" ? std::cin : file;
+
+        std::string line;
+        while(std::getline(in, line))
+        {
+            if(!line.empty() && line.back() == '\r') line.pop_back();
+            if(line.empty() || line[0] == '#') continue;
+
+            if(line.compare(0, 2, "+ ") == 0) rules.push_back(Rule{true, line.substr(2)});
+            else if(line.compare(0, 2, "- ") == 0) rules.push_back(Rule{false, line.substr(2)});
+            else rules.push_back(Rule{false, line});
+        }
+
+        return true;
+    }
+
+    Matcher::Matcher() : root(new Node()) {}
+
+    Matcher::~Matcher()
+    {
+        delete root;
+    }
+
+    /**
+     * Compile the specified rules, replacing any rules compiled before
+     *
+     * @param rules the rules, in order of precedence
+     * @param errors a description of any rules that could not be compiled
+     * @return true iff every rule compiled
+     */
+    bool Matcher::Compile(const std::vector<Rule>& rules, std::string& errors)
+    {
+        delete root;
+        root = new Node();
+        regexRules.clear();
+        ruleIncludes.clear();
+        ruleCount = rules.size();
+
+        bool ok = true;
+        for(size_t index = 0; index < rules.size(); index++)
+        {
+            auto& rule = rules[index];
+            ruleIncludes.push_back(rule.Include);
+
+            if(rule.Pattern.compare(0, 3, "re:") == 0)
+            {
+                try
+                {
+                    regexRules.emplace_back(std::regex(rule.Pattern.substr(3), std::regex::ECMAScript | std::regex::optimize), (int) index);
+                }
+                catch(std::regex_error& e)
+                {
+                    errors += " * Invalid regular expression '" + rule.Pattern.substr(3) + "': " + e.what() + "\n";
+                    ok = false;
+                }
+
+                continue;
+            }
+
+            auto pattern = rule.Pattern;
+
+            bool directoryOnly = false;
+            while(pattern.size() > 1 && pattern.back() == '/')
+            {
+                directoryOnly = true;
+                pattern.pop_back();
+            }
+
+            bool anchored = !pattern.empty() && pattern[0] == '/';
+
+            std::vector<std::string> components;
+            size_t start = 0;
+            while(start <= pattern.size())
+            {
+                auto end = pattern.find('/', start);
+                if(end == std::string::npos) end = pattern.size();
+                if(end > start) components.push_back(pattern.substr(start, end - start));
+                start = end + 1;
+            }
+
+            if(components.empty())
+            {
+                errors += " * Empty pattern '" + rule.Pattern + "'\n";
+                ok = false;
+                continue;
+            }
+
+            // Unanchored patterns can start at any depth
+            auto node = anchored ? root : Child(root, "**");
+            for(auto& component : components) node = Child(node, component);
+
+            auto& terminal = directoryOnly ? node->DirectoryRule : node->AnyRule;
+            terminal = std::min(terminal, (int) index);
+        }
+
+        return ok;
+    }
+
+    /** Add every node reachable through "**" matching zero components */
+    void Matcher::Close(std::vector<const Node*>& nodes) const
+    {
+        for(size_t i = 0; i < nodes.size(); i++)
+        {
+            auto star = nodes[i]->Star.get();
+            if(star != nullptr && std::find(nodes.begin(), nodes.end(), star) == nodes.end()) nodes.push_back(star);
+        }
+    }
+
+    /** Gets the state for the root of the copy */
+    State Matcher::Root() const
+    {
+        State state;
+        state.Nodes.push_back(root);
+        Close(state.Nodes);
+
+        return state;
+    }
+
+    /**
+     * Gets the state for the specified path relative to the root of the copy, by stepping through it one
+     * component at a time
+     *
+     * @param relativePath the path of a directory, relative to the root of the copy
+     */
+    State Matcher::ForPath(const std::string& relativePath) const
+    {
+        auto state = Root();
+
+        size_t start = 0;
+        while(start < relativePath.size())
+        {
+            auto end = relativePath.find('/', start);
+            if(end == std::string::npos) end = relativePath.size();
+
+            if(end > start)
+            {
+                auto component = relativePath.substr(start, end - start);
+
+                State next;
+                Step(state, component.c_str(), true, state.RelativePath + component, &next.Nodes);
+                Close(next.Nodes);
+                if(!regexRules.empty()) next.RelativePath = state.RelativePath + component + "/";
+
+                state = std::move(next);
+            }
+
+            start = end + 1;
+        }
+
+        return state;
+    }
+
+    /**
+     * Consume one path component
+     *
+     * @return the index of the first rule matching the entry, or FILTER_NO_RULE
+     */
+    int Matcher::Step(const State& dir, const char* name, bool isDirectory, const std::string& relativePath, std::vector<const Node*>* next) const
+    {
+        int first = FILTER_NO_RULE;
+        size_t length = strlen(name);
+
+        auto visit = [&](const Node* node) {
+            first = std::min(first, node->AnyRule);
+            if(isDirectory) first = std::min(first, node->DirectoryRule);
+            if(next != nullptr && std::find(next->begin(), next->end(), node) == next->end()) next->push_back(node);
+        };
+
+        for(auto node : dir.Nodes)
+        {
+            if(!node->Literals.empty())
+            {
+                auto it = node->Literals.find(std::string(name, length));
+                if(it != node->Literals.end()) visit(it->second.get());
+            }
+
+            for(auto suffixLength : node->SuffixLengths)
+            {
+                if(suffixLength > length) continue;
+
+                auto it = node->Suffixes.find(std::string(name + length - suffixLength, suffixLength));
+                if(it != node->Suffixes.end()) visit(it->second.get());
+            }
+
+            for(auto& glob : node->Globs)
+            {
+                if(fnmatch(glob.first.c_str(), name, 0) == 0) visit(glob.second.get());
+            }
+
+            // "**" consumes this component and stays put
+            if(node->IsStar) visit(node);
+        }
+
+        for(auto& regex : regexRules)
+        {
+            // Rules are in order of precedence, so a later regex can't beat what already matched
+            if(regex.second >= first) break;
+            if(std::regex_search(isDirectory ? relativePath + "/" : relativePath, regex.first)) first = regex.second;
+        }
+
+        return first;
+    }
+
+    /**
+     * Check whether an entry in a directory should be copied
+     *
+     * @param dir the state of the directory the entry is in
+     * @param name the name of the entry
+     * @param isDirectory whether or not the entry is a directory
+     * @param child if not null and the entry is an included directory, set to the state for that directory
+     * @return true iff the entry should be copied
+     */
+    bool Matcher::Included(const State& dir, const char* name, bool isDirectory, State* child) const
+    {
+        // Only build the relative path if something is going to look at it
+        std::string relativePath;
+        if(!regexRules.empty()) relativePath = dir.RelativePath + name;
+
+        std::vector<const Node*>* next = nullptr;
+        if(isDirectory && child != nullptr)
+        {
+            child->Nodes.clear();
+            next = &child->Nodes;
+        }
+
+        int first = Step(dir, name, isDirectory, relativePath, next);
+        bool included = first == FILTER_NO_RULE || ruleIncludes[(size_t) first];
+
+        if(included && next != nullptr)
+        {
+            Close(child->Nodes);
+            if(!regexRules.empty()) child->RelativePath = relativePath + "/";
+        }
+
+        return included;
+    }
+
+    /**
+     * Write the specified rules to an anonymous file in the format read by ReadRulesFile, so workers can load the
+     * rules without having them all on their command line
+     *
+     * @param rules the rules to write
+     * @return a file descriptor for the rules (inherited across exec), or -1 on failure
+     */
+    int Share(const std::vector<Rule>& rules)
+    {
+        int fd = memfd_create("parcp-filters", 0);
+        if(fd < 0) return -1;
+
+        std::string contents;
+        for(auto& rule : rules)
+        {
+            contents += rule.Include ? "+ " : "- ";
+            contents += rule.Pattern;
+            contents += '\n';
+        }
+
+        size_t done = 0;
+        while(done < contents.size())
+        {
+            auto written = write(fd, contents.data() + done, contents.size() - done);
+            if(written <= 0)
+            {
+                close(fd);
+                return -1;
+            }
+
+            done += (size_t) written;
+        }
+
+        return fd;
+    }
+}
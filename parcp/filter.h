@@ -0,0 +1,141 @@
+/*
+ * Copyright (c) 2016 Nathan Lowe
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of this software
+ * and associated documentation files (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all copies or substantial
+ * portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT
+ * LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN
+ * NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef EECS3540_FILTER_H
+#define EECS3540_FILTER_H
+
+#include <regex>
+#include <string>
+#include <vector>
+
+namespace Filter
+{
+    /** A single include or exclude rule, as given on the command line */
+    struct Rule
+    {
+        /** Whether matching entries are included (true) or excluded (false) */
+        bool Include;
+        /** The pattern, a glob, or a regular expression if it starts with "re:" */
+        std::string Pattern;
+    };
+
+    /**
+     * Parse a rules file for --exclude-from. Each line holds one pattern. Lines starting with "+ " are include rules,
+     * lines starting with "- " (or anything else) are exclude rules. Blank lines and lines starting with '#' are
+     * ignored.
+     *
+     * @param path the file to read
+     * @param rules the rules read from the file are appended to this list
+     * @return true iff the file could be read
+     */
+    bool ReadRulesFile(const std::string& path, std::vector<Rule>& rules);
+
+    /**
+     * Write the specified rules to an anonymous file in the format read by ReadRulesFile, so workers can load the
+     * rules without having them all on their command line
+     *
+     * @param rules the rules to write
+     * @return a file descriptor for the rules (inherited across exec), or -1 on failure
+     */
+    int Share(const std::vector<Rule>& rules);
+
+    struct Node;
+
+    /**
+     * Where a directory is in the pattern automaton. Computed once per directory and then stepped once per entry,
+     * so the cost of filtering an entry does not depend on how deep it is.
+     */
+    struct State
+    {
+        /** Every node reachable after consuming the directory's path (including zero length "**" matches) */
+        std::vector<const Node*> Nodes;
+        /** The path of the directory relative to the root of the copy, only tracked if there are regex rules */
+        std::string RelativePath;
+    };
+
+    /**
+     * A set of rules compiled into a single automaton over path components. Glob rules are split on '/' and merged
+     * into a trie, where each node indexes its children by literal name, by literal suffix ("*.o") or, for anything
+     * else, by glob. "**" components turn into a node that can consume any number of components. Regular
+     * expressions can't be split up like that, so they are matched against the whole relative path.
+     *
+     * Like rsync, the first rule that matches an entry decides whether it is copied, entries that don't match any
+     * rule are copied, and excluded directories are never descended into. Patterns starting with '/' are anchored
+     * to the root of the copy, any other pattern can match at any depth. Patterns ending in '/' only match
+     * directories. Regular expressions are matched against the path relative to the root of the copy, with a
+     * trailing '/' on directories.
+     */
+    class Matcher
+    {
+    public:
+        Matcher();
+        ~Matcher();
+
+        Matcher(const Matcher&) = delete;
+        Matcher& operator=(const Matcher&) = delete;
+
+        /**
+         * Compile the specified rules, replacing any rules compiled before
+         *
+         * @param rules the rules, in order of precedence
+         * @param errors a description of any rules that could not be compiled
+         * @return true iff every rule compiled
+         */
+        bool Compile(const std::vector<Rule>& rules, std::string& errors);
+
+        /** Whether or not there are any rules at all. If not, filtering can be skipped entirely */
+        bool Empty() const { return ruleCount == 0; }
+
+        /** Gets the state for the root of the copy */
+        State Root() const;
+
+        /**
+         * Gets the state for the specified path relative to the root of the copy, by stepping through it one
+         * component at a time
+         *
+         * @param relativePath the path of a directory, relative to the root of the copy
+         */
+        State ForPath(const std::string& relativePath) const;
+
+        /**
+         * Check whether an entry in a directory should be copied
+         *
+         * @param dir the state of the directory the entry is in
+         * @param name the name of the entry
+         * @param isDirectory whether or not the entry is a directory
+         * @param child if not null and the entry is an included directory, set to the state for that directory
+         * @return true iff the entry should be copied
+         */
+        bool Included(const State& dir, const char* name, bool isDirectory, State* child) const;
+
+    private:
+        Node* root;
+        size_t ruleCount = 0;
+        std::vector<std::pair<std::regex, int>> regexRules;
+        std::vector<bool> ruleIncludes;
+
+        void Close(std::vector<const Node*>& nodes) const;
+        int Step(const State& dir, const char* name, bool isDirectory, const std::string& relativePath, std::vector<const Node*>* next) const;
+    };
+
+    /** The rules for the current copy */
+    extern Matcher Rules;
+}
+
+#endif //EECS3540_FILTER_H
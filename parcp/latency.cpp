@@ -0,0 +1,466 @@
+/*
+ * Copyright (c) 2016 Nathan Lowe
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of this software
+ * and associated documentation files (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all copies or substantial
+ * portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT
+ * LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN
+ * NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include <sys/mman.h>
+#include <sys/sysmacros.h>
+#include <unistd.h>
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
+#include <fstream>
+#include <map>
+#include <mutex>
+#include <new>
+#include <sstream>
+#include <vector>
+#include "latency.h"
+#include "Logger.h"
+#include "util.h"
+
+/** The number of sub-buckets in each power of two */
+#define LATENCY_SUB_COUNT (1u << LATENCY_SUB_BITS)
+/** The total number of buckets in a histogram */
+#define LATENCY_BUCKETS ((LATENCY_MAX_BITS - LATENCY_SUB_BITS + 1) * LATENCY_SUB_COUNT)
+/** The device slot used once every other slot has been claimed */
+#define LATENCY_OVERFLOW_SLOT (LATENCY_MAX_DEVICES - 1)
+/** The marker stored in the overflow slot */
+#define LATENCY_OVERFLOW_DEVICE UINT64_MAX
+
+namespace Latency
+{
+    L3::Logger Log("Latency");
+
+    bool Enabled = false;
+
+    /** A histogram in the shared table. Every worker merges into these when it exits */
+    struct SharedHistogram
+    {
+        std::atomic<uint64_t> Buckets[LATENCY_BUCKETS];
+        std::atomic<uint64_t> Count;
+        std::atomic<uint64_t> Sum;
+        std::atomic<uint64_t> Max;
+    };
+
+    /** The table shared by every worker process */
+    struct SharedTable
+    {
+        /** The device in each slot, plus one so that zero means the slot is free */
+        std::atomic<uint64_t> Devices[LATENCY_MAX_DEVICES];
+        SharedHistogram Histograms[LATENCY_MAX_DEVICES][OP_COUNT];
+    };
+
+    /** A histogram owned by a single thread, so recording a sample is just a couple of increments */
+    struct LocalHistogram
+    {
+        uint64_t Buckets[LATENCY_BUCKETS];
+        uint64_t Count;
+        uint64_t Sum;
+        uint64_t Max;
+    };
+
+    /** The histograms owned by a single thread, indexed the same way as the shared table */
+    struct LocalTable
+    {
+        LocalHistogram Histograms[LATENCY_MAX_DEVICES][OP_COUNT];
+        /** The last device looked up and its slot, since consecutive operations almost always hit the same device */
+        dev_t LastDevice;
+        int LastSlot = -1;
+    };
+
+    static SharedTable* shared = nullptr;
+
+    /** Every thread's local table, so they can all be merged when the process exits */
+    static std::mutex localTablesLock;
+    static std::vector<LocalTable*> localTables;
+    static thread_local LocalTable* local = nullptr;
+
+    static const char* opNames[] = {
+            "open", "close", "read", "write", "lstat", "stat", "mkdir", "opendir", "readdir", "readlink", "symlink", "wait"
+    };
+
+    /**
+     * Gets the name of the specified operation
+     *
+     * @param op the operation
+     * @return the name of the operation, as a string
+     */
+    const char* NameOfOp(Op op)
+    {
+        return op < OP_COUNT ? opNames[op] : "unknown";
+    }
+
+    /**
+     * Gets the bucket that the specified value falls into. Small values get a bucket each, after that every power of
+     * two is split into LATENCY_SUB_COUNT linear sub-buckets
+     */
+    static inline unsigned BucketFor(uint64_t value)
+    {
+        if(value < LATENCY_SUB_COUNT) return (unsigned) value;
+
+        unsigned msb = 63 - (unsigned) __builtin_clzll(value);
+        unsigned shift = msb - LATENCY_SUB_BITS;
+        unsigned bucket = (shift + 1) * LATENCY_SUB_COUNT + (unsigned) ((value >> shift) & (LATENCY_SUB_COUNT - 1));
+
+        return bucket < LATENCY_BUCKETS ? bucket : LATENCY_BUCKETS - 1;
+    }
+
+    /** Gets a representative value (the midpoint) for the specified bucket */
+    static inline uint64_t ValueFor(unsigned bucket)
+    {
+        if(bucket < LATENCY_SUB_COUNT) return bucket;
+
+        unsigned shift = bucket / LATENCY_SUB_COUNT - 1;
+        uint64_t lower = (uint64_t) (LATENCY_SUB_COUNT + bucket % LATENCY_SUB_COUNT) << shift;
+
+        return lower + ((1ull << shift) >> 1);
+    }
+
+    /**
+     * Map the histogram table backed by the specified file descriptor
+     *
+     * @param fd the file descriptor to map
+     * @return the mapped table, or nullptr if the mapping failed
+     */
+    static SharedTable* Map(int fd)
+    {
+        void* mem = mmap(nullptr, sizeof(SharedTable), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        return mem == MAP_FAILED ? nullptr : static_cast<SharedTable*>(mem);
+    }
+
+    /**
+     * Create the shared histogram table and enable instrumentation. This should only be called by the root process,
+     * before any workers are forked.
+     *
+     * @return the file descriptor that workers should attach to, or -1 if instrumentation could not be enabled
+     */
+    int Create()
+    {
+        // Not close-on-exec: the descriptor has to survive into the workers we exec
+        int fd = memfd_create("parcp-latency", 0);
+        if(fd < 0 || ftruncate(fd, sizeof(SharedTable)) != 0)
+        {
+            Log.Error("Unable to create shared memory for latency histograms (errno " + std::to_string(errno) + ")");
+            if(fd >= 0) close(fd);
+            return -1;
+        }
+
+        shared = Map(fd);
+        if(shared == nullptr)
+        {
+            Log.Error("Unable to map shared memory for latency histograms (errno " + std::to_string(errno) + ")");
+            close(fd);
+            return -1;
+        }
+
+        new (shared) SharedTable();
+        Enabled = true;
+
+        return fd;
+    }
+
+    /**
+     * Attach to the shared histogram table created by the root process and enable instrumentation
+     *
+     * @param fd the file descriptor passed down from the parent process
+     * @return true iff the table was mapped successfully
+     */
+    bool Attach(int fd)
+    {
+        shared = Map(fd);
+        if(shared == nullptr)
+        {
+            Log.Warn("Unable to attach to shared latency histograms (errno " + std::to_string(errno) + ")");
+            return false;
+        }
+
+        Enabled = true;
+        return true;
+    }
+
+    /**
+     * Find (or claim) the slot in the shared table for the specified device
+     *
+     * @param dev the device to look up
+     * @return the slot for the device
+     */
+    static int SlotFor(dev_t dev)
+    {
+        uint64_t wanted = (uint64_t) dev + 1;
+
+        for(int slot = 0; slot < LATENCY_OVERFLOW_SLOT; slot++)
+        {
+            uint64_t current = shared->Devices[slot].load(std::memory_order_acquire);
+            if(current == wanted) return slot;
+
+            // Free slot, try to claim it. If another worker beat us to it, it may have claimed it for our device
+            if(current == 0)
+            {
+                if(shared->Devices[slot].compare_exchange_strong(current, wanted)) return slot;
+                if(current == wanted) return slot;
+            }
+        }
+
+        shared->Devices[LATENCY_OVERFLOW_SLOT].store(LATENCY_OVERFLOW_DEVICE, std::memory_order_release);
+        return LATENCY_OVERFLOW_SLOT;
+    }
+
+    /**
+     * Record a single latency sample into the calling thread's histograms
+     *
+     * @param op the operation that was timed
+     * @param dev the device the operation was performed against
+     * @param nanos how long the operation took
+     */
+    void Record(Op op, dev_t dev, uint64_t nanos)
+    {
+        if(!Enabled || shared == nullptr) return;
+
+        if(local == nullptr)
+        {
+            local = new LocalTable();
+
+            std::lock_guard<std::mutex> guard(localTablesLock);
+            localTables.push_back(local);
+        }
+
+        if(local->LastSlot < 0 || local->LastDevice != dev)
+        {
+            local->LastDevice = dev;
+            local->LastSlot = SlotFor(dev);
+        }
+
+        auto& h = local->Histograms[local->LastSlot][op];
+        h.Buckets[BucketFor(nanos)]++;
+        h.Count++;
+        h.Sum += nanos;
+        if(nanos > h.Max) h.Max = nanos;
+    }
+
+    /**
+     * Merge every thread's histograms for this process into the shared table. Workers call this once, right before
+     * they exit.
+     */
+    void Flush()
+    {
+        if(!Enabled || shared == nullptr) return;
+
+        std::lock_guard<std::mutex> guard(localTablesLock);
+        for(auto table : localTables)
+        {
+            for(int slot = 0; slot < LATENCY_MAX_DEVICES; slot++)
+            {
+                for(int op = 0; op < OP_COUNT; op++)
+                {
+                    auto& from = table->Histograms[slot][op];
+                    if(from.Count == 0) continue;
+
+                    auto& to = shared->Histograms[slot][op];
+                    for(unsigned b = 0; b < LATENCY_BUCKETS; b++)
+                    {
+                        if(from.Buckets[b] != 0) to.Buckets[b].fetch_add(from.Buckets[b], std::memory_order_relaxed);
+                    }
+
+                    to.Count.fetch_add(from.Count, std::memory_order_relaxed);
+                    to.Sum.fetch_add(from.Sum, std::memory_order_relaxed);
+
+                    uint64_t max = to.Max.load(std::memory_order_relaxed);
+                    while(from.Max > max && !to.Max.compare_exchange_weak(max, from.Max, std::memory_order_relaxed));
+
+                    // Don't merge the same samples twice if we get flushed again
+                    from = LocalHistogram();
+                }
+            }
+        }
+    }
+
+    /** The summary of a single histogram in the shared table */
+    struct Summary
+    {
+        uint64_t Count;
+        uint64_t Max;
+        double Mean;
+        /** p50, p90, p99, p99.9 */
+        uint64_t Percentiles[4];
+    };
+
+    static const double percentiles[] = {0.50, 0.90, 0.99, 0.999};
+    static const char* percentileNames[] = {"p50", "p90", "p99", "p99.9"};
+
+    static Summary Summarize(const SharedHistogram& h)
+    {
+        Summary s = {};
+        s.Count = h.Count.load();
+        s.Max = h.Max.load();
+        s.Mean = s.Count > 0 ? (double) h.Sum.load() / s.Count : 0;
+
+        uint64_t seen = 0;
+        int next = 0;
+        for(unsigned b = 0; b < LATENCY_BUCKETS && next < 4; b++)
+        {
+            seen += h.Buckets[b].load();
+            while(next < 4 && seen >= (uint64_t) (percentiles[next] * s.Count) && seen > 0)
+            {
+                // Never report a percentile above the largest sample we actually saw
+                s.Percentiles[next++] = std::min(ValueFor(b), s.Max);
+            }
+        }
+
+        return s;
+    }
+
+    /** Decode the octal escapes (\040 for a space, ...) that mountinfo uses for whitespace and '\\' in mount points */
+    static std::string UnescapeMountPoint(const std::string& raw)
+    {
+        std::string decoded;
+        for(size_t i = 0; i < raw.size(); i++)
+        {
+            if(raw[i] == '\\' && i + 3 < raw.size() && raw[i + 1] >= '0' && raw[i + 1] <= '3' &&
+               raw[i + 2] >= '0' && raw[i + 2] <= '7' && raw[i + 3] >= '0' && raw[i + 3] <= '7')
+            {
+                decoded += (char) ((raw[i + 1] - '0') * 64 + (raw[i + 2] - '0') * 8 + (raw[i + 3] - '0'));
+                i += 3;
+            }
+            else decoded += raw[i];
+        }
+
+        return decoded;
+    }
+
+    /**
+     * Gets a human readable name for the device in the specified slot, including where it is mounted if we can
+     * figure that out from /proc/self/mountinfo
+     */
+    static std::string DeviceName(int slot)
+    {
+        uint64_t stored = shared->Devices[slot].load();
+        if(stored == LATENCY_OVERFLOW_DEVICE) return "other";
+
+        auto dev = (dev_t) (stored - 1);
+        auto id = std::to_string(major(dev)) + ":" + std::to_string(minor(dev));
+
+        std::ifstream mounts("/proc/self/mountinfo");
+        std::string line;
+        while(std::getline(mounts, line))
+        {
+            // <mount id> <parent id> <major:minor> <root> <mount point> ...
+            std::istringstream fields(line);
+            std::string mountId, parentId, majorMinor, root, mountPoint;
+            fields >> mountId >> parentId >> majorMinor >> root >> mountPoint;
+
+            if(majorMinor == id) return id + " (" + UnescapeMountPoint(mountPoint) + ")";
+        }
+
+        return id;
+    }
+
+    /** Format a number of nanoseconds for humans */
+    static std::string HumanNanos(double nanos)
+    {
+        char buf[32];
+        if(nanos < 1000) snprintf(buf, sizeof(buf), "%.0fns", nanos);
+        else if(nanos < 1000000) snprintf(buf, sizeof(buf), "%.1fus", nanos / 1000);
+        else if(nanos < 1000000000) snprintf(buf, sizeof(buf), "%.1fms", nanos / 1000000);
+        else snprintf(buf, sizeof(buf), "%.2fs", nanos / 1000000000);
+
+        return std::string(buf);
+    }
+
+    /**
+     * Write the percentiles for every operation and device to standard error
+     */
+    void PrintReport()
+    {
+        if(shared == nullptr) return;
+
+        Flush();
+
+        for(int slot = 0; slot < LATENCY_MAX_DEVICES; slot++)
+        {
+            if(shared->Devices[slot].load() == 0) continue;
+
+            fprintf(stderr, "Latency for device %s\n", DeviceName(slot).c_str());
+            fprintf(stderr, "  %-10s %12s %10s %10s %10s %10s %10s %10s\n", "op", "count", "mean", "p50", "p90", "p99", "p99.9", "max");
+
+            for(int op = 0; op < OP_COUNT; op++)
+            {
+                auto s = Summarize(shared->Histograms[slot][op]);
+                if(s.Count == 0) continue;
+
+                fprintf(stderr, "  %-10s %12llu %10s %10s %10s %10s %10s %10s\n", NameOfOp((Op) op),
+                        (unsigned long long) s.Count, HumanNanos(s.Mean).c_str(),
+                        HumanNanos(s.Percentiles[0]).c_str(), HumanNanos(s.Percentiles[1]).c_str(),
+                        HumanNanos(s.Percentiles[2]).c_str(), HumanNanos(s.Percentiles[3]).c_str(),
+                        HumanNanos(s.Max).c_str());
+            }
+        }
+    }
+
+    /**
+     * Write the percentiles for every operation and device to the specified file as JSON
+     *
+     * @param path the file to write
+     * @return true iff the file was written
+     */
+    bool WriteReport(const std::string& path)
+    {
+        if(shared == nullptr) return false;
+
+        Flush();
+
+        std::ofstream out(path);
+        if(!out)
+        {
+            Log.Error("Unable to write latency report " + path);
+            return false;
+        }
+
+        out << "{\"unit\": \"ns\", \"devices\": [";
+
+        bool firstDevice = true;
+        for(int slot = 0; slot < LATENCY_MAX_DEVICES; slot++)
+        {
+            if(shared->Devices[slot].load() == 0) continue;
+
+            if(!firstDevice) out << ", ";
+            firstDevice = false;
+
+            out << "{\"device\": \"" << util::JsonEscape(DeviceName(slot)) << "\", \"operations\": {";
+
+            bool firstOp = true;
+            for(int op = 0; op < OP_COUNT; op++)
+            {
+                auto s = Summarize(shared->Histograms[slot][op]);
+                if(s.Count == 0) continue;
+
+                if(!firstOp) out << ", ";
+                firstOp = false;
+
+                out << "\"" << NameOfOp((Op) op) << "\": {\"count\": " << s.Count << ", \"mean\": " << (uint64_t) s.Mean;
+                for(int p = 0; p < 4; p++) out << ", \"" << percentileNames[p] << "\": " << s.Percentiles[p];
+                out << ", \"max\": " << s.Max << "}";
+            }
+
+            out << "}}";
+        }
+
+        out << "]}" << std::endl;
+        return true;
+    }
+
+}
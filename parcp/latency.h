@@ -0,0 +1,141 @@
+/*
+ * Copyright (c) 2016 Nathan Lowe
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of this software
+ * and associated documentation files (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all copies or substantial
+ * portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT
+ * LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN
+ * NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef EECS3540_LATENCY_H
+#define EECS3540_LATENCY_H
+
+#include <sys/types.h>
+#include <cstdint>
+#include <ctime>
+#include <string>
+
+/** The number of sub-buckets per power of two, as a power of two. 4 bits keeps values within ~6% */
+#define LATENCY_SUB_BITS 4
+/** The largest latency that can be recorded exactly, as a power of two nanoseconds (2^40ns is ~18 minutes) */
+#define LATENCY_MAX_BITS 40
+/** The number of distinct devices that are tracked. Any beyond this are lumped together */
+#define LATENCY_MAX_DEVICES 16
+
+namespace Latency
+{
+    /** The operations that are timed */
+    enum Op {
+        OPEN,
+        CLOSE,
+        READ,
+        WRITE,
+        LSTAT,
+        STAT,
+        MKDIR,
+        OPENDIR,
+        READDIR,
+        READLINK,
+        SYMLINK,
+        /** Waiting on child workers to finish */
+        WAIT,
+        /** Not an operation, the number of operations */
+        OP_COUNT
+    };
+
+    /** Whether or not latency instrumentation is enabled. When false, timing an operation costs a single branch */
+    extern bool Enabled;
+
+    /**
+     * Gets the name of the specified operation
+     *
+     * @param op the operation
+     * @return the name of the operation, as a string
+     */
+    const char* NameOfOp(Op op);
+
+    /**
+     * Create the shared histogram table and enable instrumentation. This should only be called by the root process,
+     * before any workers are forked.
+     *
+     * @return the file descriptor that workers should attach to, or -1 if instrumentation could not be enabled
+     */
+    int Create();
+
+    /**
+     * Attach to the shared histogram table created by the root process and enable instrumentation
+     *
+     * @param fd the file descriptor passed down from the parent process
+     * @return true iff the table was mapped successfully
+     */
+    bool Attach(int fd);
+
+    /**
+     * Record a single latency sample into the calling thread's histograms
+     *
+     * @param op the operation that was timed
+     * @param dev the device the operation was performed against
+     * @param nanos how long the operation took
+     */
+    void Record(Op op, dev_t dev, uint64_t nanos);
+
+    /**
+     * Merge every thread's histograms for this process into the shared table. Workers call this once, right before
+     * they exit.
+     */
+    void Flush();
+
+    /**
+     * Write the percentiles for every operation and device to standard error
+     */
+    void PrintReport();
+
+    /**
+     * Write the percentiles for every operation and device to the specified file as JSON
+     *
+     * @param path the file to write
+     * @return true iff the file was written
+     */
+    bool WriteReport(const std::string& path);
+
+    /** Read a monotonic clock, in nanoseconds */
+    inline uint64_t Now()
+    {
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return (uint64_t) ts.tv_sec * 1000000000ull + (uint64_t) ts.tv_nsec;
+    }
+
+    /**
+     * Time the specified call, recording its latency against the specified operation and device if instrumentation
+     * is enabled
+     *
+     * @param op the operation being performed
+     * @param dev the device the operation is performed against
+     * @param call the call to time
+     * @return whatever the call returned
+     */
+    template<typename F>
+    inline auto Measure(Op op, dev_t dev, F call) -> decltype(call())
+    {
+        if(!Enabled) return call();
+
+        auto start = Now();
+        auto result = call();
+        Record(op, dev, Now() - start);
+
+        return result;
+    }
+}
+
+#endif //EECS3540_LATENCY_H
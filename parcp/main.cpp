@@ -13,11 +13,105 @@
  *      -q          Quiet Mode, disables all logging. This is equivalent to "-l OFF"
  *
  *      -f <src>    The source directory to copy from, not including itself. That is, the contents of this
- *                  directory are copied to the destination.
+ *                  directory are copied to the destination. Can be given more than once, to copy the contents of
+ *                  several directories into the same destination
  *
  *      -t <dst>    The destination directory to copy into. If the last directory in the path does not exist,
  *                  it will be created.
  *
+ *      --progress  Draws a live, single line progress display on standard error while the copy runs
+ *
+ *      --stats-file <path>
+ *                  Periodically rewrites the specified file with a JSON object containing the copy statistics
+ *                  (files and directories scanned, files and bytes copied, throughput, queue depth and errors)
+ *
+ *      --stats-interval <seconds>
+ *                  The number of seconds between rewrites of the stats file. Defaults to 5
+ *
+ *      --latency   Times every filesystem operation (open, read, write, lstat, mkdir, waiting on workers, ...) and
+ *                  prints latency percentiles per operation and device to standard error once the copy finishes
+ *
+ *      --latency-file <path>
+ *                  Like --latency, but writes the percentiles to the specified file as JSON instead
+ *
+ *      --include <pattern>
+ *      --exclude <pattern>
+ *                  Only copy entries that are not excluded. Rules are checked in the order given and the first rule
+ *                  that matches an entry decides whether it is copied. Entries that match no rule are copied, and
+ *                  excluded directories are never descended into. Patterns are globs (*, ?, [...], and ** to match
+ *                  any number of directories) matched against the entry name at any depth, or against the path from
+ *                  the root of the copy if they start with '/'. A trailing '/' only matches directories. Patterns
+ *                  starting with "re:" are regular expressions matched against the path from the root of the copy
+ *                  (directories have a trailing '/')
+ *
+ *      --exclude-from <file>
+ *                  Reads rules from the specified file ("-" for standard input), one per line. Lines starting with
+ *                  "+ " are include rules, lines starting with "- " or anything else are exclude rules. Blank lines
+ *                  and lines starting with '#' are ignored
+ *
+ *      --delete    Mirror mode. Deletes entries in the destination that don't exist in the source (or that exist with
+ *                  a different type) before copying each directory. Entries excluded by --exclude are left alone.
+ *                  Extraneous directory trees are deleted in parallel
+ *
+ *      --tar-out <file>
+ *                  Instead of copying, writes the source tree to the specified file ("-" for standard output) as a
+ *                  POSIX (pax) tar archive. Files are read in parallel and written out in order. When writing to
+ *                  standard output, the log goes to standard error. -t is not needed
+ *
+ *      --tar-in <file>
+ *                  Instead of copying, extracts the tar archive in the specified file ("-" for standard input) into the
+ *                  destination, writing files in parallel. Members that would end up outside of the destination are
+ *                  refused. -f is not needed
+ *
+ *      --compress <codec>[:<level>]
+ *                  Compresses file data on the way to the destination with zstd (levels 1-22) or lz4 (levels 1-12),
+ *                  adding a .zst or .lz4 suffix to each file. Files are split into 1 MiB blocks that are compressed in
+ *                  parallel into independent frames, followed by a seek table, so the regular zstd and lz4 tools can
+ *                  still decompress them. Only available if parcp was built with the codec's library
+ *
+ *      --decompress
+ *                  Decompresses files written by --compress on the way to the destination, removing their suffix. The
+ *                  frames of each file are decompressed in parallel. Compressed files without a seek table are copied
+ *                  as they are
+ *
+ *      --dedup <hardlink|reflink>
+ *                  Copies each distinct file content once. Before copying, files that share their size with another
+ *                  file are hashed in parallel (SHA-256). Only the first file with each content is copied; the others
+ *                  are recreated afterwards as hardlinks to it, or as reflinks (falling back to an in-kernel copy if
+ *                  the destination doesn't support them). Bookkeeping lives in memory mapped temporary files in $TMPDIR
+ *
+ *      --dedup-min-size <bytes>
+ *                  Files smaller than this (K, M, G or T suffixes allowed) are always copied in full. Defaults to 64K
+ *
+ *      --bwlimit <bytes>
+ *                  Write at most this many bytes per second (K, M, G or T suffixes allowed) across all workers
+ *      --iops-limit <count>
+ *                  Make at most this many reads and writes per second across all workers
+ *      --throttle-file <path>
+ *                  Re-read the limits from this file whenever it changes while copying. It holds "bwlimit <bytes>" and
+ *                  "iops-limit <count>" lines, where 0 removes the limit. SIGUSR1 halves the limits, SIGUSR2 doubles them
+ *      --idle
+ *                  Copy in the idle I/O scheduling class, so other I/O on the system always goes first
+ *
+ *      --max-memory <bytes>
+ *                  Keep the whole copy within this much memory (K, M, G or T suffixes allowed) by starting fewer workers.
+ *                  Directories that can't get a worker are copied by the worker that found them once it's done
+ *
+ *      --plan
+ *                  Scan the source without copying anything, then report what the copy would involve (counts, a size
+ *                  histogram, hard link and sparse file savings, the space needed) and an estimate of how long it would take
+ *      --plan-file <file>
+ *                  Like --plan, and also write a work list of every entry to <file>, directories first, then the largest files
+ *      --from-plan <file>
+ *                  Copy the entries in a work list written by --plan-file instead of scanning the source
+ *
+ *      --files-from <file>
+ *                  Copy only the paths listed in <file> ("-" for standard input, read as it arrives), one per line or
+ *                  NUL separated, relative to -f (the current directory if not given). Missing parent directories are
+ *                  created in the destination. Listed directories are created, not copied recursively
+ *      --from0
+ *                  Paths in the --files-from list are separated by NUL characters only, so they can contain newlines
+ *
  * -----------------------------------------------------------------------------------------------------
  *
  * Copyright (c) 2016 Nathan Lowe
@@ -38,12 +132,23 @@
  * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
  */
 
+#include <cstdlib>
 #include <iostream>
 
 #include "Logger.h"
 #include "opts.h"
 #include "util.h"
+#include "budget.h"
 #include "copy.h"
+#include "dedup.h"
+#include "filelist.h"
+#include "filter.h"
+#include "latency.h"
+#include "plan.h"
+#include "stats.h"
+#include "sys.h"
+#include "tar.h"
+#include "throttle.h"
 
 // Forward declare these so main can be first
 void PrintUsage();
@@ -77,6 +182,14 @@ int main(int argc, char* argv[])
         return -1;
     }
 
+    // Asking for faults that can't be injected would quietly test nothing. Checked ahead of everything else, so that
+    // "parcp --help" tells whether or not a build can inject them
+    if(getenv("PARCP_FAULTS") != nullptr && !Sys::FaultInjectionEnabled())
+    {
+        Log.Fatal("PARCP_FAULTS is set, but parcp was built without -DPARCP_FAULT_INJECTION=ON");
+        return -1;
+    }
+
     // Was the help flag provided?
     if(Options::CommandLineArgs.PrintHelp)
     {
@@ -94,6 +207,18 @@ int main(int argc, char* argv[])
         L3::GlobalLogLevel = L3::Level::OFF;
     }
 
+    // Standard output is the archive, so the log has to go somewhere else
+    if(Options::CommandLineArgs.TarOutput == "-") L3::GlobalOutput = &std::cerr;
+
+    // Compile the include/exclude rules once, up front
+    std::string filterErrors;
+    if(!Filter::Rules.Compile(Options::CommandLineArgs.FilterRules, filterErrors))
+    {
+        Log.Fatal("Invalid include/exclude rules:");
+        Log.Fatal(filterErrors);
+        return -1;
+    }
+
     // Copy all the things
     auto result = InitCopy(Options::CommandLineArgs.SourceFolder, Options::CommandLineArgs.DestinationFolder);
 
@@ -117,15 +242,153 @@ int InitCopy(std::string source, std::string dst)
 
     if(!isForkedProcess) Log.Debug("Trying to copy " + source + " to " + dst);
 
-    // Make sure the source directory exists
-    if(!isForkedProcess) Log.Trace("Validating source location (" + source + ")");
-    if(!util::DirectoryExists(source))
+    // Workers report into the counters created by the root process
+    if(isForkedProcess)
+    {
+        if(Options::CommandLineArgs.StatsFd >= 0) Stats::Attach(Options::CommandLineArgs.StatsFd);
+        if(Options::CommandLineArgs.LatencyFd >= 0) Latency::Attach(Options::CommandLineArgs.LatencyFd);
+        if(Options::CommandLineArgs.DedupFd >= 0 && !Dedup::Attach(Options::CommandLineArgs.DedupFd))
+        {
+            Log.Fatal("Unable to attach to the duplicate index (errno " + std::to_string(errno) + ")");
+            return -1;
+        }
+        if(Options::CommandLineArgs.ThrottleFd >= 0) Throttle::Attach(Options::CommandLineArgs.ThrottleFd);
+        if(Options::CommandLineArgs.PlanFd >= 0) Plan::Attach(Options::CommandLineArgs.PlanFd);
+        if(Options::CommandLineArgs.BudgetFd >= 0 && !Budget::Attach(Options::CommandLineArgs.BudgetFd))
+        {
+            // Without the budget we would fork without limit, copying the whole subtree here is safe
+            Budget::Shared->Free.store(0);
+        }
+        Stats::Shared->DirectoriesQueued.Sub(1);
+    }
+
+    // Make sure the source directory exists. When extracting an archive, the archive is the source
+    bool extracting = !Options::CommandLineArgs.TarInput.empty();
+    if(!isForkedProcess && !extracting) Log.Trace("Validating source location (" + source + ")");
+    if(!extracting && !util::DirectoryExists(source))
     {
         Log.Fatal(source + " does not exist or is not a directory");
         return -1;
     }
 
-    return Copy::BeginCopy(source, dst);
+    if(isForkedProcess)
+    {
+        auto result = Copy::BeginCopy(source, dst);
+
+        // Hand our latency samples and planned entries to the root process before we go away
+        Latency::Flush();
+        if(Options::CommandLineArgs.PlanFd >= 0 && !Plan::Flush()) result = -1;
+        return result;
+    }
+
+    // Any other sources have to exist too
+    std::vector<std::string> sources;
+    for(auto other : Options::CommandLineArgs.SourceFolders)
+    {
+        if(!util::StringEndsWith(other, '/')) other += '/';
+        if(!util::DirectoryExists(other))
+        {
+            Log.Fatal(other + " does not exist or is not a directory");
+            return -1;
+        }
+
+        sources.push_back(other);
+    }
+
+    // The I/O class is inherited by every thread and worker, so switch before starting any
+    if(Options::CommandLineArgs.Idle) Throttle::SetIdlePriority();
+
+    // The root process owns the shared counters and reports on them while the workers run
+    Options::CommandLineArgs.StatsFd = Stats::Create();
+    if(Options::CommandLineArgs.ReportLatency) Options::CommandLineArgs.LatencyFd = Latency::Create();
+
+    // Workers load the rules from a shared file rather than having them all on their command line
+    if(!Filter::Rules.Empty())
+    {
+        Options::CommandLineArgs.FilterFd = Filter::Share(Options::CommandLineArgs.FilterRules);
+        if(Options::CommandLineArgs.FilterFd < 0)
+        {
+            Log.Fatal("Unable to share include/exclude rules with workers (errno " + std::to_string(errno) + ")");
+            return -1;
+        }
+    }
+
+    // Workers are only started while the memory budget has room for them
+    if(Options::CommandLineArgs.MaxMemory > 0)
+    {
+        Options::CommandLineArgs.BudgetFd = Budget::Create(Options::CommandLineArgs.MaxMemory);
+        if(Options::CommandLineArgs.BudgetFd < 0) return -1;
+    }
+
+    // The limits can be changed while copying, so share them even if only the control file is given
+    Throttle::Controller throttle;
+    if(Options::CommandLineArgs.BandwidthLimit > 0 || Options::CommandLineArgs.IopsLimit > 0 || !Options::CommandLineArgs.ThrottleFile.empty())
+    {
+        Options::CommandLineArgs.ThrottleFd = Throttle::Create(Options::CommandLineArgs.BandwidthLimit, Options::CommandLineArgs.IopsLimit);
+        if(Options::CommandLineArgs.ThrottleFd < 0) return -1;
+
+        Throttle::HandleSignals();
+        throttle.Start(Options::CommandLineArgs.ThrottleFile);
+    }
+
+    // Workers record what they find in a dry run, which is reported on once they're done
+    if(Options::CommandLineArgs.DryRun)
+    {
+        Options::CommandLineArgs.PlanFd = Plan::Create();
+        if(Options::CommandLineArgs.PlanFd < 0)
+        {
+            throttle.Stop();
+            return -1;
+        }
+    }
+
+    Stats::Reporter reporter;
+    reporter.Start(Options::CommandLineArgs.ShowProgress, Options::CommandLineArgs.StatsFile, Options::CommandLineArgs.StatsInterval);
+
+    // Find the duplicates up front, so workers know which files to leave for later
+    if(Options::CommandLineArgs.Deduplicate != Dedup::OFF)
+    {
+        Options::CommandLineArgs.DedupFd = Dedup::Index(source, Options::CommandLineArgs.DedupMinSize);
+        if(Options::CommandLineArgs.DedupFd < 0)
+        {
+            throttle.Stop();
+            reporter.Stop();
+            return -1;
+        }
+    }
+
+    int result;
+    if(!Options::CommandLineArgs.TarOutput.empty()) result = Tar::Create(source, Options::CommandLineArgs.TarOutput);
+    else if(extracting) result = Tar::Extract(Options::CommandLineArgs.TarInput, dst);
+    else if(!Options::CommandLineArgs.FromPlan.empty()) result = Plan::Execute(source, dst, Options::CommandLineArgs.FromPlan);
+    else if(!Options::CommandLineArgs.FilesFrom.empty()) result = FileList::Copy(source, dst, Options::CommandLineArgs.FilesFrom, Options::CommandLineArgs.FromNul);
+    else if(sources.size() > 1) result = Copy::BeginCopy(sources, dst);
+    else result = Copy::BeginCopy(source, dst);
+
+    if(Options::CommandLineArgs.DedupFd >= 0 && !Dedup::Link(source, dst, Options::CommandLineArgs.Deduplicate)) result = -1;
+
+    throttle.Stop();
+    auto summary = reporter.Stop();
+
+    if(Options::CommandLineArgs.PlanFd >= 0)
+    {
+        if(Plan::Report(source, dst, Options::CommandLineArgs.PlanFile) != 0) result = -1;
+    }
+    else
+    {
+        Log.Info("Copied " + std::to_string(summary.FilesCopied) + " of " + std::to_string(summary.FilesScanned) +
+                 " files in " + std::to_string(summary.DirectoriesScanned) + " directories (" +
+                 Stats::HumanBytes(summary.BytesCopied) + ", " + Stats::HumanBytes(summary.BytesPerSecond) + "/s) in " +
+                 std::to_string(summary.ElapsedSeconds) + "s with " + std::to_string(summary.Errors) + " errors");
+    }
+
+    if(Latency::Enabled)
+    {
+        if(Options::CommandLineArgs.LatencyFile.empty()) Latency::PrintReport();
+        else Latency::WriteReport(Options::CommandLineArgs.LatencyFile);
+    }
+
+    return result;
 }
 
 /**
@@ -147,8 +410,102 @@ void PrintUsage()
     std::cout << "     -q          Quiet Mode, disables all logging. This is equivalent to \"-l OFF\"" << std::endl;
     std::cout << std::endl;
     std::cout << "     -f <src>    The source directory to copy from, not including itself. That is, the contents of this" << std::endl;
-    std::cout << "                 directory are copied to the destination." << std::endl;
+    std::cout << "                 directory are copied to the destination. Can be given more than once, to copy the contents of" << std::endl;
+    std::cout << "                 several directories into the same destination" << std::endl;
     std::cout << std::endl;
     std::cout << "     -t <dst>    The destination directory to copy into. If the last directory in the path does not exist," << std::endl;
     std::cout << "                 it will be created." << std::endl;
+    std::cout << std::endl;
+    std::cout << "     --progress  Draws a live, single line progress display on standard error while the copy runs" << std::endl;
+    std::cout << std::endl;
+    std::cout << "     --stats-file <path>" << std::endl;
+    std::cout << "                 Periodically rewrites the specified file with a JSON object containing the copy statistics" << std::endl;
+    std::cout << "                 (files and directories scanned, files and bytes copied, throughput, queue depth and errors)" << std::endl;
+    std::cout << std::endl;
+    std::cout << "     --stats-interval <seconds>" << std::endl;
+    std::cout << "                 The number of seconds between rewrites of the stats file. Defaults to 5" << std::endl;
+    std::cout << std::endl;
+    std::cout << "     --latency   Times every filesystem operation (open, read, write, lstat, mkdir, waiting on workers, ...) and" << std::endl;
+    std::cout << "                 prints latency percentiles per operation and device to standard error once the copy finishes" << std::endl;
+    std::cout << std::endl;
+    std::cout << "     --latency-file <path>" << std::endl;
+    std::cout << "                 Like --latency, but writes the percentiles to the specified file as JSON instead" << std::endl;
+    std::cout << std::endl;
+    std::cout << "     --include <pattern>" << std::endl;
+    std::cout << "     --exclude <pattern>" << std::endl;
+    std::cout << "                 Only copy entries that are not excluded. Rules are checked in the order given and the first rule" << std::endl;
+    std::cout << "                 that matches an entry decides whether it is copied. Entries that match no rule are copied, and" << std::endl;
+    std::cout << "                 excluded directories are never descended into. Patterns are globs (*, ?, [...], and ** to match" << std::endl;
+    std::cout << "                 any number of directories) matched against the entry name at any depth, or against the path from" << std::endl;
+    std::cout << "                 the root of the copy if they start with '/'. A trailing '/' only matches directories. Patterns" << std::endl;
+    std::cout << "                 starting with \"re:\" are regular expressions matched against the path from the root of the copy" << std::endl;
+    std::cout << "                 (directories have a trailing '/')" << std::endl;
+    std::cout << std::endl;
+    std::cout << "     --exclude-from <file>" << std::endl;
+    std::cout << "                 Reads rules from the specified file (\"-\" for standard input), one per line. Lines starting with" << std::endl;
+    std::cout << "                 \"+ \" are include rules, lines starting with \"- \" or anything else are exclude rules. Blank lines" << std::endl;
+    std::cout << "                 and lines starting with '#' are ignored" << std::endl;
+    std::cout << std::endl;
+    std::cout << "     --delete    Mirror mode. Deletes entries in the destination that don't exist in the source (or that exist with" << std::endl;
+    std::cout << "                 a different type) before copying each directory. Entries excluded by --exclude are left alone." << std::endl;
+    std::cout << "                 Extraneous directory trees are deleted in parallel" << std::endl;
+    std::cout << std::endl;
+    std::cout << "     --tar-out <file>" << std::endl;
+    std::cout << "                 Instead of copying, writes the source tree to the specified file (\"-\" for standard output) as a" << std::endl;
+    std::cout << "                 POSIX (pax) tar archive. Files are read in parallel and written out in order. When writing to" << std::endl;
+    std::cout << "                 standard output, the log goes to standard error. -t is not needed" << std::endl;
+    std::cout << std::endl;
+    std::cout << "     --tar-in <file>" << std::endl;
+    std::cout << "                 Instead of copying, extracts the tar archive in the specified file (\"-\" for standard input) into the" << std::endl;
+    std::cout << "                 destination, writing files in parallel. Members that would end up outside of the destination are" << std::endl;
+    std::cout << "                 refused. -f is not needed" << std::endl;
+    std::cout << std::endl;
+    std::cout << "     --compress <codec>[:<level>]" << std::endl;
+    std::cout << "                 Compresses file data on the way to the destination with zstd (levels 1-22) or lz4 (levels 1-12)," << std::endl;
+    std::cout << "                 adding a .zst or .lz4 suffix to each file. Files are split into 1 MiB blocks that are compressed in" << std::endl;
+    std::cout << "                 parallel into independent frames, followed by a seek table, so the regular zstd and lz4 tools can" << std::endl;
+    std::cout << "                 still decompress them. Only available if parcp was built with the codec's library" << std::endl;
+    std::cout << std::endl;
+    std::cout << "     --decompress" << std::endl;
+    std::cout << "                 Decompresses files written by --compress on the way to the destination, removing their suffix. The" << std::endl;
+    std::cout << "                 frames of each file are decompressed in parallel. Compressed files without a seek table are copied" << std::endl;
+    std::cout << "                 as they are" << std::endl;
+    std::cout << std::endl;
+    std::cout << "     --dedup <hardlink|reflink>" << std::endl;
+    std::cout << "                 Copies each distinct file content once. Before copying, files that share their size with another" << std::endl;
+    std::cout << "                 file are hashed in parallel (SHA-256). Only the first file with each content is copied; the others" << std::endl;
+    std::cout << "                 are recreated afterwards as hardlinks to it, or as reflinks (falling back to an in-kernel copy if" << std::endl;
+    std::cout << "                 the destination doesn't support them). Bookkeeping lives in memory mapped temporary files in $TMPDIR" << std::endl;
+    std::cout << std::endl;
+    std::cout << "     --dedup-min-size <bytes>" << std::endl;
+    std::cout << "                 Files smaller than this (K, M, G or T suffixes allowed) are always copied in full. Defaults to 64K" << std::endl;
+    std::cout << std::endl;
+    std::cout << "     --bwlimit <bytes>" << std::endl;
+    std::cout << "                 Write at most this many bytes per second (K, M, G or T suffixes allowed) across all workers" << std::endl;
+    std::cout << "     --iops-limit <count>" << std::endl;
+    std::cout << "                 Make at most this many reads and writes per second across all workers" << std::endl;
+    std::cout << "     --throttle-file <path>" << std::endl;
+    std::cout << "                 Re-read the limits from this file whenever it changes while copying. It holds \"bwlimit <bytes>\" and" << std::endl;
+    std::cout << "                 \"iops-limit <count>\" lines, where 0 removes the limit. SIGUSR1 halves the limits, SIGUSR2 doubles them" << std::endl;
+    std::cout << "     --idle" << std::endl;
+    std::cout << "                 Copy in the idle I/O scheduling class, so other I/O on the system always goes first" << std::endl;
+    std::cout << std::endl;
+    std::cout << "     --max-memory <bytes>" << std::endl;
+    std::cout << "                 Keep the whole copy within this much memory (K, M, G or T suffixes allowed) by starting fewer workers." << std::endl;
+    std::cout << "                 Directories that can't get a worker are copied by the worker that found them once it's done" << std::endl;
+    std::cout << std::endl;
+    std::cout << "     --plan" << std::endl;
+    std::cout << "                 Scan the source without copying anything, then report what the copy would involve (counts, a size" << std::endl;
+    std::cout << "                 histogram, hard link and sparse file savings, the space needed) and an estimate of how long it would take" << std::endl;
+    std::cout << "     --plan-file <file>" << std::endl;
+    std::cout << "                 Like --plan, and also write a work list of every entry to <file>, directories first, then the largest files" << std::endl;
+    std::cout << "     --from-plan <file>" << std::endl;
+    std::cout << "                 Copy the entries in a work list written by --plan-file instead of scanning the source" << std::endl;
+    std::cout << std::endl;
+    std::cout << "     --files-from <file>" << std::endl;
+    std::cout << "                 Copy only the paths listed in <file> (\"-\" for standard input, read as it arrives), one per line or" << std::endl;
+    std::cout << "                 NUL separated, relative to -f (the current directory if not given). Missing parent directories are" << std::endl;
+    std::cout << "                 created in the destination. Listed directories are created, not copied recursively" << std::endl;
+    std::cout << "     --from0" << std::endl;
+    std::cout << "                 Paths in the --files-from list are separated by NUL characters only, so they can contain newlines" << std::endl;
 }
@@ -0,0 +1,367 @@
+/*
+ * Copyright (c) 2016 Nathan Lowe
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of this software
+ * and associated documentation files (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all copies or substantial
+ * portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT
+ * LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN
+ * NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <atomic>
+#include <condition_variable>
+#include <cstring>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include "mirror.h"
+#include "Logger.h"
+#include "stats.h"
+
+/** The most threads used to remove subtrees in a single directory */
+#define MIRROR_MAX_THREADS 8
+/** The most directory descriptors held open by queued removals before subtrees are removed inline instead */
+#define MIRROR_MAX_OPEN_DIRECTORIES 256
+
+namespace Mirror
+{
+    L3::Logger Log("Mirror");
+
+    /** Gets the kind of a directory entry, falling back to fstatat if the filesystem doesn't fill in d_type */
+    static Kind KindOf(int dirFd, struct dirent* entry)
+    {
+        unsigned char type = entry->d_type;
+        if(type == DT_UNKNOWN)
+        {
+            struct stat info;
+            if(fstatat(dirFd, entry->d_name, &info, AT_SYMLINK_NOFOLLOW) != 0) return OTHER;
+
+            if(S_ISDIR(info.st_mode)) return DIRECTORY;
+            if(S_ISLNK(info.st_mode)) return SYMLINK;
+            return OTHER;
+        }
+
+        if(type == DT_DIR) return DIRECTORY;
+        if(type == DT_LNK) return SYMLINK;
+        return OTHER;
+    }
+
+    static bool IsSpecial(const char* name)
+    {
+        return strcmp(name, ".") == 0 || strcmp(name, "..") == 0;
+    }
+
+    /** Remove a single non-directory entry */
+    static bool Unlink(int dirFd, const char* name, const std::string& path)
+    {
+        if(unlinkat(dirFd, name, 0) == 0)
+        {
+            Stats::Shared->Deleted.Add(1);
+            return true;
+        }
+
+        Log.Error("[" + std::to_string(getpid()) + "] Unable to delete " + path + " (errno " + std::to_string(errno) + ")");
+        Stats::Shared->Errors.Add(1);
+        return false;
+    }
+
+    /** Remove a directory and everything in it, depth first, on the calling thread */
+    static bool RemoveSequential(int parentFd, const char* name, const std::string& path)
+    {
+        int fd = openat(parentFd, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+        DIR* dir = fd < 0 ? nullptr : fdopendir(fd);
+        if(dir == nullptr)
+        {
+            Log.Error("[" + std::to_string(getpid()) + "] Unable to open " + path + " for deletion (errno " + std::to_string(errno) + ")");
+            Stats::Shared->Errors.Add(1);
+            if(fd >= 0) close(fd);
+            return false;
+        }
+
+        bool ok = true;
+        struct dirent* entry;
+        while((entry = readdir(dir)) != nullptr)
+        {
+            if(IsSpecial(entry->d_name)) continue;
+
+            auto childPath = path + "/" + entry->d_name;
+            if(KindOf(fd, entry) == DIRECTORY) ok = RemoveSequential(fd, entry->d_name, childPath) && ok;
+            else ok = Unlink(fd, entry->d_name, childPath) && ok;
+        }
+
+        closedir(dir);
+
+        if(!ok) return false;
+
+        if(unlinkat(parentFd, name, AT_REMOVEDIR) != 0)
+        {
+            Log.Error("[" + std::to_string(getpid()) + "] Unable to delete " + path + " (errno " + std::to_string(errno) + ")");
+            Stats::Shared->Errors.Add(1);
+            return false;
+        }
+
+        Stats::Shared->Deleted.Add(1);
+        return true;
+    }
+
+    /**
+     * A directory being removed. Its descriptor stays open until everything inside it is gone, so its children can
+     * be removed relative to it by whichever thread picks them up.
+     */
+    struct DirectoryTask
+    {
+        /** The directory this one is in, or nullptr if the parent is the directory being mirrored */
+        std::shared_ptr<DirectoryTask> Parent;
+        int ParentFd;
+        std::string Name;
+        std::string Path;
+        int Fd = -1;
+        /** Set by this directory's own thread and by the threads removing its children */
+        std::atomic<bool> Failed{false};
+        /** Queued children plus one for the listing of this directory, the directory is removed when this hits 0 */
+        std::atomic<int> Pending{1};
+    };
+
+    /** Removes directory trees with a small pool of threads sharing one queue of directories */
+    class ParallelRemover
+    {
+    public:
+        /** Queue the removal of a directory in the directory being mirrored */
+        void Add(int parentFd, const char* name, const std::string& path)
+        {
+            auto task = std::make_shared<DirectoryTask>();
+            task->ParentFd = parentFd;
+            task->Name = name;
+            task->Path = path;
+
+            Push(task);
+        }
+
+        /**
+         * Remove everything that was queued, using the calling thread and up to MIRROR_MAX_THREADS - 1 others
+         *
+         * @return true iff everything was removed
+         */
+        bool Run()
+        {
+            if(queue.empty()) return true;
+
+            auto threadCount = std::max(1u, std::min(std::thread::hardware_concurrency(), (unsigned) MIRROR_MAX_THREADS));
+
+            std::vector<std::thread> threads;
+            for(unsigned i = 1; i < threadCount; i++) threads.emplace_back(&ParallelRemover::Work, this);
+
+            Work();
+            for(auto& thread : threads) thread.join();
+
+            return !failed;
+        }
+
+    private:
+        std::mutex lock;
+        std::condition_variable wake;
+        std::deque<std::shared_ptr<DirectoryTask>> queue;
+        /** The number of directories queued or being removed */
+        size_t outstanding = 0;
+        std::atomic<int> openDirectories{0};
+        std::atomic<bool> failed{false};
+
+        void Push(const std::shared_ptr<DirectoryTask>& task)
+        {
+            {
+                std::lock_guard<std::mutex> guard(lock);
+                queue.push_back(task);
+                outstanding++;
+            }
+
+            wake.notify_one();
+        }
+
+        void Work()
+        {
+            while(true)
+            {
+                std::shared_ptr<DirectoryTask> task;
+                {
+                    std::unique_lock<std::mutex> guard(lock);
+                    wake.wait(guard, [this]{ return !queue.empty() || outstanding == 0; });
+                    if(queue.empty()) return;
+
+                    // Newest first, so the tree is removed roughly depth first and few descriptors are open at once
+                    task = queue.back();
+                    queue.pop_back();
+                }
+
+                Process(task);
+            }
+        }
+
+        void Process(const std::shared_ptr<DirectoryTask>& task)
+        {
+            task->Fd = openat(task->ParentFd, task->Name.c_str(), O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+
+            // Counted for as long as the descriptor is open, which Finish closes whether or not listing works out
+            if(task->Fd >= 0) openDirectories++;
+
+            // fdopendir takes over the descriptor it is given, and we need ours until the children are gone
+            int listFd = task->Fd < 0 ? -1 : dup(task->Fd);
+            DIR* dir = listFd < 0 ? nullptr : fdopendir(listFd);
+            if(dir == nullptr)
+            {
+                Log.Error("[" + std::to_string(getpid()) + "] Unable to open " + task->Path + " for deletion (errno " + std::to_string(errno) + ")");
+                Stats::Shared->Errors.Add(1);
+                if(listFd >= 0) close(listFd);
+
+                task->Failed = true;
+                Finish(task);
+                return;
+            }
+
+            struct dirent* entry;
+            while((entry = readdir(dir)) != nullptr)
+            {
+                if(IsSpecial(entry->d_name)) continue;
+
+                auto childPath = task->Path + "/" + entry->d_name;
+                if(KindOf(task->Fd, entry) != DIRECTORY)
+                {
+                    if(!Unlink(task->Fd, entry->d_name, childPath)) task->Failed = true;
+                }
+                else if(openDirectories < MIRROR_MAX_OPEN_DIRECTORIES)
+                {
+                    auto child = std::make_shared<DirectoryTask>();
+                    child->Parent = task;
+                    child->ParentFd = task->Fd;
+                    child->Name = entry->d_name;
+                    child->Path = childPath;
+
+                    task->Pending++;
+                    Push(child);
+                }
+                else if(!RemoveSequential(task->Fd, entry->d_name, childPath))
+                {
+                    // Too many directories open already, take care of this one right here
+                    task->Failed = true;
+                }
+            }
+
+            closedir(dir);
+            Finish(task);
+        }
+
+        /** Called once the listing of a directory is done, and once for each child directory that is done */
+        void Finish(std::shared_ptr<DirectoryTask> task)
+        {
+            while(task && --task->Pending == 0)
+            {
+                if(task->Fd >= 0)
+                {
+                    close(task->Fd);
+                    openDirectories--;
+                }
+
+                if(task->Failed)
+                {
+                    failed = true;
+                }
+                else if(unlinkat(task->ParentFd, task->Name.c_str(), AT_REMOVEDIR) != 0)
+                {
+                    Log.Error("[" + std::to_string(getpid()) + "] Unable to delete " + task->Path + " (errno " + std::to_string(errno) + ")");
+                    Stats::Shared->Errors.Add(1);
+                    failed = true;
+                    task->Failed = true;
+                }
+                else
+                {
+                    Stats::Shared->Deleted.Add(1);
+                }
+
+                // A directory that couldn't be emptied means its parent can't be removed either
+                if(task->Failed && task->Parent) task->Parent->Failed = true;
+
+                bool done;
+                {
+                    std::lock_guard<std::mutex> guard(lock);
+                    done = --outstanding == 0;
+                }
+                if(done) wake.notify_all();
+
+                task = task->Parent;
+            }
+        }
+    };
+
+    /**
+     * Remove every entry from the destination directory that does not exist in the source directory, or that exists
+     * with a different kind (so that it can be replaced). Entries excluded by the include/exclude rules are left
+     * alone. Extraneous subdirectories are removed in parallel.
+     *
+     * @param dest the destination directory
+     * @param source the entries of the corresponding source directory
+     * @param filterState the state of the directory in the include/exclude rules, or nullptr if not filtering
+     * @return true iff everything extraneous was removed
+     */
+    bool RemoveExtraneous(const std::string& dest, const Listing& source, const Filter::State* filterState)
+    {
+        auto myPid = getpid();
+
+        int destFd = open(dest.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        int listFd = destFd < 0 ? -1 : dup(destFd);
+        DIR* dir = listFd < 0 ? nullptr : fdopendir(listFd);
+        if(dir == nullptr)
+        {
+            Log.Error("[" + std::to_string(myPid) + "] Unable to open " + dest + " to delete extraneous entries (errno " + std::to_string(errno) + ")");
+            Stats::Shared->Errors.Add(1);
+            if(listFd >= 0) close(listFd);
+            if(destFd >= 0) close(destFd);
+            return false;
+        }
+
+        bool ok = true;
+        ParallelRemover remover;
+
+        struct dirent* entry;
+        while((entry = readdir(dir)) != nullptr)
+        {
+            if(IsSpecial(entry->d_name)) continue;
+
+            auto kind = KindOf(destFd, entry);
+            auto match = source.find(entry->d_name);
+            if(match != source.end() && match->second == kind) continue;
+
+            // Excluded entries are protected from deletion, just like they are from being copied over
+            if(match == source.end() && filterState != nullptr && !Filter::Rules.Included(*filterState, entry->d_name, kind == DIRECTORY, nullptr))
+            {
+                continue;
+            }
+
+            auto path = dest + entry->d_name;
+            Log.Info("[" + std::to_string(myPid) + "] deleting '" + path + "'");
+
+            if(kind == DIRECTORY) remover.Add(destFd, entry->d_name, path);
+            else ok = Unlink(destFd, entry->d_name, path) && ok;
+        }
+
+        closedir(dir);
+
+        ok = remover.Run() && ok;
+        close(destFd);
+
+        return ok;
+    }
+}
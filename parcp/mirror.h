@@ -0,0 +1,52 @@
+/*
+ * Copyright (c) 2016 Nathan Lowe
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of this software
+ * and associated documentation files (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all copies or substantial
+ * portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT
+ * LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN
+ * NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef EECS3540_MIRROR_H
+#define EECS3540_MIRROR_H
+
+#include <string>
+#include <unordered_map>
+#include "filter.h"
+
+namespace Mirror
+{
+    /** What kind of entry a name refers to, as far as mirroring is concerned */
+    enum Kind {
+        DIRECTORY,
+        SYMLINK,
+        OTHER
+    };
+
+    /** Every entry in a source directory, by name */
+    typedef std::unordered_map<std::string, Kind> Listing;
+
+    /**
+     * Remove every entry from the destination directory that does not exist in the source directory, or that exists
+     * with a different kind (so that it can be replaced). Entries excluded by the include/exclude rules are left
+     * alone. Extraneous subdirectories are removed in parallel.
+     *
+     * @param dest the destination directory
+     * @param source the entries of the corresponding source directory
+     * @param filterState the state of the directory in the include/exclude rules, or nullptr if not filtering
+     * @return true iff everything extraneous was removed
+     */
+    bool RemoveExtraneous(const std::string& dest, const Listing& source, const Filter::State* filterState);
+}
+
+#endif //EECS3540_MIRROR_H
@@ -17,7 +17,10 @@
  * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
  */
 
+#include <stdexcept>
 #include "opts.h"
+#include "stats.h"
+#include "util.h"
 
 /**
  * The options passed on the command line to the program
@@ -62,8 +65,9 @@ void Options::parse(int argc, char* argv[])
         {
             if(i < argc - 1)
             {
-                SourceFolder = std::string(argv[++i]);
-                Log.Trace("Source Folder set to: " + SourceFolder);
+                SourceFolders.push_back(std::string(argv[++i]));
+                if(SourceFolder.empty()) SourceFolder = SourceFolders.back();
+                Log.Trace("Source Folder added: " + SourceFolders.back());
             }
             else
             {
@@ -105,9 +109,424 @@ void Options::parse(int argc, char* argv[])
             Quiet = true;
             Log.Trace("Quiet Mode Enabled");
         }
+        else if(arg == "--progress")
+        {
+            ShowProgress = true;
+            Log.Trace("Progress display enabled");
+        }
+        else if(arg == "--stats-file")
+        {
+            if(i < argc - 1)
+            {
+                StatsFile = std::string(argv[++i]);
+                Log.Trace("Stats file set to: " + StatsFile);
+            }
+            else
+            {
+                Errors += " * --stats-file: Not enough arguments remaining for argument\n";
+            }
+        }
+        else if(arg == "--stats-interval")
+        {
+            if(i < argc - 1)
+            {
+                auto raw = std::string(argv[++i]);
+                try
+                {
+                    auto interval = std::stoi(raw);
+                    if(interval <= 0) throw std::out_of_range(raw);
+                    StatsInterval = (unsigned) interval;
+                }
+                catch(std::exception&)
+                {
+                    Errors += " * --stats-interval: Expected a positive number of seconds, got " + raw + "\n";
+                }
+            }
+            else
+            {
+                Errors += " * --stats-interval: Not enough arguments remaining for argument\n";
+            }
+        }
+        else if(arg == "--latency")
+        {
+            ReportLatency = true;
+            Log.Trace("Latency instrumentation enabled");
+        }
+        else if(arg == "--latency-file")
+        {
+            if(i < argc - 1)
+            {
+                LatencyFile = std::string(argv[++i]);
+                ReportLatency = true;
+                Log.Trace("Latency file set to: " + LatencyFile);
+            }
+            else
+            {
+                Errors += " * --latency-file: Not enough arguments remaining for argument\n";
+            }
+        }
+        else if(arg == "--delete")
+        {
+            Delete = true;
+            Log.Trace("Mirror mode enabled");
+        }
+        else if(arg == "--tar-out" || arg == "--tar-in")
+        {
+            if(i < argc - 1)
+            {
+                (arg == "--tar-out" ? TarOutput : TarInput) = std::string(argv[++i]);
+                Log.Trace("Tar " + arg.substr(6) + "put set to: " + std::string(argv[i]));
+            }
+            else
+            {
+                Errors += " * " + arg + ": Not enough arguments remaining for argument\n";
+            }
+        }
+        else if(arg == "--compress")
+        {
+            if(i < argc - 1)
+            {
+                auto spec = std::string(argv[++i]);
+                if(!Compress::Parse(spec, Compression, CompressionLevel))
+                {
+                    Errors += " * --compress: Expected zstd[:1-22] or lz4[:1-12], got " + spec + "\n";
+                }
+                else if(!Compress::Available(Compression))
+                {
+                    Errors += " * --compress: parcp was built without " + std::string(Compress::NameOf(Compression)) + " support\n";
+                }
+
+                Log.Trace("Compression set to: " + spec);
+            }
+            else
+            {
+                Errors += " * --compress: Not enough arguments remaining for argument\n";
+            }
+        }
+        else if(arg == "--decompress")
+        {
+            Decompress = true;
+            Log.Trace("Decompression enabled");
+        }
+        else if(arg == "--dedup")
+        {
+            if(i < argc - 1)
+            {
+                auto mode = std::string(argv[++i]);
+                if(!Dedup::Parse(mode, Deduplicate))
+                {
+                    Errors += " * --dedup: Expected hardlink or reflink, got " + mode + "\n";
+                }
+
+                Log.Trace("Deduplication set to: " + mode);
+            }
+            else
+            {
+                Errors += " * --dedup: Not enough arguments remaining for argument\n";
+            }
+        }
+        else if(arg == "--dedup-min-size")
+        {
+            if(i < argc - 1)
+            {
+                auto raw = std::string(argv[++i]);
+                if(!util::ParseBytes(raw, DedupMinSize) || DedupMinSize == 0)
+                {
+                    Errors += " * --dedup-min-size: Expected a positive size, got " + raw + "\n";
+                }
+            }
+            else
+            {
+                Errors += " * --dedup-min-size: Not enough arguments remaining for argument\n";
+            }
+        }
+        else if(arg == "--bwlimit")
+        {
+            if(i < argc - 1)
+            {
+                auto raw = std::string(argv[++i]);
+                if(!util::ParseBytes(raw, BandwidthLimit))
+                {
+                    Errors += " * --bwlimit: Expected a size, got " + raw + "\n";
+                }
+            }
+            else
+            {
+                Errors += " * --bwlimit: Not enough arguments remaining for argument\n";
+            }
+        }
+        else if(arg == "--iops-limit")
+        {
+            if(i < argc - 1)
+            {
+                auto raw = std::string(argv[++i]);
+                if(raw.empty() || raw.find_first_not_of("0123456789") != std::string::npos)
+                {
+                    Errors += " * --iops-limit: Expected a number, got " + raw + "\n";
+                }
+                else
+                {
+                    IopsLimit = std::stoull(raw);
+                }
+            }
+            else
+            {
+                Errors += " * --iops-limit: Not enough arguments remaining for argument\n";
+            }
+        }
+        else if(arg == "--throttle-file")
+        {
+            if(i < argc - 1)
+            {
+                ThrottleFile = std::string(argv[++i]);
+                Log.Trace("Watching " + ThrottleFile + " for I/O limits");
+            }
+            else
+            {
+                Errors += " * --throttle-file: Not enough arguments remaining for argument\n";
+            }
+        }
+        else if(arg == "--idle")
+        {
+            Idle = true;
+            Log.Trace("Idle I/O priority enabled");
+        }
+        else if(arg == "--max-memory")
+        {
+            if(i < argc - 1)
+            {
+                auto raw = std::string(argv[++i]);
+                if(!util::ParseBytes(raw, MaxMemory) || MaxMemory == 0)
+                {
+                    Errors += " * --max-memory: Expected a positive size, got " + raw + "\n";
+                }
+            }
+            else
+            {
+                Errors += " * --max-memory: Not enough arguments remaining for argument\n";
+            }
+        }
+        else if(arg == "--plan")
+        {
+            DryRun = true;
+            Log.Trace("Dry run enabled");
+        }
+        else if(arg == "--plan-file")
+        {
+            if(i < argc - 1)
+            {
+                DryRun = true;
+                PlanFile = std::string(argv[++i]);
+                Log.Trace("Writing the work list to " + PlanFile);
+            }
+            else
+            {
+                Errors += " * --plan-file: Not enough arguments remaining for argument\n";
+            }
+        }
+        else if(arg == "--from-plan")
+        {
+            if(i < argc - 1)
+            {
+                FromPlan = std::string(argv[++i]);
+                Log.Trace("Copying the entries in " + FromPlan);
+            }
+            else
+            {
+                Errors += " * --from-plan: Not enough arguments remaining for argument\n";
+            }
+        }
+        else if(arg == "--files-from")
+        {
+            if(i < argc - 1)
+            {
+                FilesFrom = std::string(argv[++i]);
+                Log.Trace("Copying the paths listed in " + FilesFrom);
+            }
+            else
+            {
+                Errors += " * --files-from: Not enough arguments remaining for argument\n";
+            }
+        }
+        else if(arg == "--from0")
+        {
+            FromNul = true;
+            Log.Trace("File list is NUL separated");
+        }
+        else if(arg == "--include" || arg == "--exclude")
+        {
+            if(i < argc - 1)
+            {
+                FilterRules.push_back(Filter::Rule{arg == "--include", std::string(argv[++i])});
+                Log.Trace("Added " + arg.substr(2) + " rule " + FilterRules.back().Pattern);
+            }
+            else
+            {
+                Errors += " * " + arg + ": Not enough arguments remaining for argument\n";
+            }
+        }
+        else if(arg == "--exclude-from")
+        {
+            if(i < argc - 1)
+            {
+                auto path = std::string(argv[++i]);
+                if(path == "-") FilterRulesFromStdin++;
+
+                if(!Filter::ReadRulesFile(path, FilterRules))
+                {
+                    Errors += " * --exclude-from: Unable to read " + path + "\n";
+                }
+            }
+            else
+            {
+                Errors += " * --exclude-from: Not enough arguments remaining for argument\n";
+            }
+        }
         else if(arg == "-__forked")
         {
             IsForked = true;
         }
+        else if(arg == "-__stats")
+        {
+            if(i < argc - 1)
+            {
+                StatsFd = std::atoi(argv[++i]);
+            }
+        }
+        else if(arg == "-__filters")
+        {
+            if(i < argc - 1)
+            {
+                FilterFd = std::atoi(argv[++i]);
+                Filter::ReadRulesFile("/proc/self/fd/" + std::to_string(FilterFd), FilterRules);
+            }
+        }
+        else if(arg == "-__dedup")
+        {
+            if(i < argc - 1)
+            {
+                DedupFd = std::atoi(argv[++i]);
+            }
+        }
+        else if(arg == "-__budget")
+        {
+            if(i < argc - 1)
+            {
+                BudgetFd = std::atoi(argv[++i]);
+            }
+        }
+        else if(arg == "-__throttle")
+        {
+            if(i < argc - 1)
+            {
+                ThrottleFd = std::atoi(argv[++i]);
+            }
+        }
+        else if(arg == "-__plan")
+        {
+            if(i < argc - 1)
+            {
+                PlanFd = std::atoi(argv[++i]);
+            }
+        }
+        else if(arg == "-__relative")
+        {
+            if(i < argc - 1)
+            {
+                RelativePath = std::string(argv[++i]);
+            }
+        }
+        else if(arg == "-__latency")
+        {
+            if(i < argc - 1)
+            {
+                LatencyFd = std::atoi(argv[++i]);
+            }
+        }
+    }
+
+    if(!TarOutput.empty() && !TarInput.empty())
+    {
+        Errors += " * --tar-out: Can't be combined with --tar-in\n";
+    }
+
+    if(Delete && (!TarOutput.empty() || !TarInput.empty()))
+    {
+        Errors += " * --delete: Can't be combined with --tar-out or --tar-in\n";
+    }
+
+    // Archives are streamed through fixed size windows, there are no workers to budget for
+    if(MaxMemory > 0 && (!TarOutput.empty() || !TarInput.empty()))
+    {
+        Errors += " * --max-memory: Can't be combined with --tar-out or --tar-in\n";
     }
-}
\ No newline at end of file
+
+    // Each of these works on a single tree
+    if(SourceFolders.size() > 1 && (Delete || Deduplicate != Dedup::OFF || DryRun || !FromPlan.empty() || !FilesFrom.empty() || !TarOutput.empty() || !TarInput.empty()))
+    {
+        Errors += " * -f: Only one source can be given with --delete, --dedup, --plan, --from-plan, --files-from, --tar-out or --tar-in\n";
+    }
+
+    if(!FilesFrom.empty() && (Delete || Deduplicate != Dedup::OFF || DryRun || !FromPlan.empty() || !TarOutput.empty() || !TarInput.empty()))
+    {
+        Errors += " * --files-from: Can't be combined with --delete, --dedup, --plan, --from-plan, --tar-out or --tar-in\n";
+    }
+
+    // Standard input can only be read once, whoever read it second would quietly get nothing (or the wrong thing)
+    if(FilterRulesFromStdin + (FilesFrom == "-" ? 1 : 0) + (TarInput == "-" ? 1 : 0) > 1)
+    {
+        Errors += " * --exclude-from, --files-from, --tar-in: Only one of them can read standard input (\"-\")\n";
+    }
+
+    // Listed paths are relative to the source, which is the current directory unless given
+    if(!FilesFrom.empty() && SourceFolder.empty()) SourceFolder = ".";
+
+    if(DryRun && !FromPlan.empty())
+    {
+        Errors += " * --plan: Can't be combined with --from-plan\n";
+    }
+
+    // A dry run only scans the source, anything that changes the destination or only happens while copying is moot
+    if(DryRun && (Delete || Deduplicate != Dedup::OFF || Compression != Compress::NONE || Decompress || !TarOutput.empty() || !TarInput.empty()))
+    {
+        Errors += " * --plan: Can't be combined with --delete, --dedup, --compress, --decompress, --tar-out or --tar-in\n";
+    }
+
+    // Work lists are fixed when they are planned, there is no scan to filter, mirror, deduplicate or archive. Rules
+    // belong on the --plan run that wrote the list
+    if(!FromPlan.empty() && (!FilterRules.empty() || Delete || Deduplicate != Dedup::OFF || !TarOutput.empty() || !TarInput.empty()))
+    {
+        Errors += " * --from-plan: Can't be combined with --include, --exclude, --exclude-from, --delete, --dedup, --tar-out or --tar-in\n";
+    }
+
+    if(Compression != Compress::NONE && Decompress)
+    {
+        Errors += " * --compress: Can't be combined with --decompress\n";
+    }
+
+    if(Deduplicate != Dedup::OFF && (Compression != Compress::NONE || Decompress || !TarOutput.empty() || !TarInput.empty()))
+    {
+        Errors += " * --dedup: Can't be combined with --compress, --decompress, --tar-out or --tar-in\n";
+    }
+
+    // Compressed copies have different names than their sources, which mirror mode would see as extraneous
+    if((Compression != Compress::NONE || Decompress) && (Delete || !TarOutput.empty() || !TarInput.empty()))
+    {
+        Errors += " * --compress, --decompress: Can't be combined with --delete, --tar-out or --tar-in\n";
+    }
+}
+
+Copy::Settings Options::CopySettings() const
+{
+    Copy::Settings settings;
+    settings.Compression = Compression;
+    settings.CompressionLevel = CompressionLevel;
+    settings.Decompress = Decompress;
+    settings.Counters = Stats::Shared;
+    settings.Rules = Filter::Rules.Empty() ? nullptr : &Filter::Rules;
+    settings.Planning = PlanFd >= 0;
+    settings.Mirror = Delete;
+    settings.Deduplicating = DedupFd >= 0;
+
+    return settings;
+}
@@ -23,7 +23,12 @@
 #include <algorithm>
 #include <string>
 #include <thread>
+#include <vector>
 #include "Logger.h"
+#include "compress.h"
+#include "copy.h"
+#include "dedup.h"
+#include "filter.h"
 
 /**
  * A model for all possible arguments passed on the command line
@@ -41,8 +46,10 @@ public:
     /** Whether or not the log level was changed */
     bool LogLevelSet = false;
 
-    /** The Source Folder to copy from */
+    /** The Source Folder to copy from. If more than one was given, this is the first */
     std::string SourceFolder;
+    /** Every Source Folder given, in order */
+    std::vector<std::string> SourceFolders;
     /** The Destination Folder to copy to */
     std::string DestinationFolder;
 
@@ -61,12 +68,114 @@ public:
     /** The path to the program, used to fork new copies */
     std::string ProgramPath;
 
+    /** Whether or not to draw a live progress line on standard error */
+    bool ShowProgress = false;
+
+    /** The path of a JSON file to periodically rewrite with copy statistics, or empty to disable */
+    std::string StatsFile;
+
+    /** The number of seconds between rewrites of the stats file */
+    unsigned StatsInterval = 5;
+
+    /** Whether or not to time every syscall and print latency percentiles when the copy finishes */
+    bool ReportLatency = false;
+
+    /** The path of a JSON file to write the latency percentiles to, or empty to disable */
+    std::string LatencyFile;
+
+    /** The shared latency histogram file descriptor inherited from the parent, or -1 if instrumentation is disabled */
+    int LatencyFd = -1;
+
+    /** Whether or not to delete destination entries that don't exist in the source (mirror mode) */
+    bool Delete = false;
+
+    /** Where to write the source tree as a tar archive ("-" for standard output) instead of copying it, or empty */
+    std::string TarOutput;
+
+    /** A tar archive ("-" for standard input) to extract into the destination instead of copying, or empty */
+    std::string TarInput;
+
+    /** The codec to compress file data with on the way to the destination, or NONE to copy it as it is */
+    Compress::Codec Compression = Compress::NONE;
+
+    /** The compression level, or 0 for the codec's default */
+    int CompressionLevel = 0;
+
+    /** Whether or not to decompress files written with --compress on the way to the destination */
+    bool Decompress = false;
+
+    /** How to recreate files with the same contents as another file, or OFF to copy every file in full */
+    Dedup::Mode Deduplicate = Dedup::OFF;
+
+    /** Files smaller than this are always copied in full, even when deduplicating */
+    uint64_t DedupMinSize = 64 * 1024;
+
+    /** The shared duplicate index file descriptor inherited from the parent, or -1 if not deduplicating */
+    int DedupFd = -1;
+
+    /** The most bytes per second to write across all workers, or 0 for no limit */
+    uint64_t BandwidthLimit = 0;
+
+    /** The most reads and writes per second across all workers, or 0 for no limit */
+    uint64_t IopsLimit = 0;
+
+    /** A file to watch for changes to the I/O limits while copying, or an empty string for none */
+    std::string ThrottleFile;
+
+    /** Whether or not to copy in the idle I/O scheduling class */
+    bool Idle = false;
+
+    /** The most memory the whole copy should use, or 0 for no limit */
+    uint64_t MaxMemory = 0;
+
+    /** The shared memory budget file descriptor inherited from the parent, or -1 if there is no budget */
+    int BudgetFd = -1;
+
+    /** The shared I/O limits file descriptor inherited from the parent, or -1 if there are no limits */
+    int ThrottleFd = -1;
+
+    /** Whether or not to only report what a copy would involve instead of copying */
+    bool DryRun = false;
+
+    /** Where to write the work list of a dry run, or an empty string to not write one */
+    std::string PlanFile;
+
+    /** A work list to copy the entries of, or an empty string to scan the source */
+    std::string FromPlan;
+
+    /** The shared plan records file descriptor inherited from the parent, or -1 if this isn't a dry run */
+    int PlanFd = -1;
+
+    /** A file listing the paths to copy ("-" for standard input), or an empty string to copy whole trees */
+    std::string FilesFrom;
+
+    /** Whether or not the paths in the file list are separated by NUL characters only */
+    bool FromNul = false;
+
+    /** The include and exclude rules, in order of precedence */
+    std::vector<Filter::Rule> FilterRules;
+
+    /** The number of times the rules were read from standard input with "--exclude-from -" */
+    int FilterRulesFromStdin = 0;
+
+    /** The shared filter rules file descriptor inherited from the parent, or -1 if this is the root process */
+    int FilterFd = -1;
+
+    /** The path of the directory being copied, relative to the root of the copy. Only tracked when filtering */
+    std::string RelativePath;
+
+    /** The shared statistics file descriptor inherited from the parent, or -1 if this is the root process */
+    int StatsFd = -1;
+
     /**
      * Parses the specified arguments
      * @param argc the number of arguments passed
      * @param argv an array of c-strings containing the arguments
      */
     void parse(int argc, char* argv[]);
+
+    /** How the copy engine should copy for these options, counting into the shared statistics */
+    Copy::Settings CopySettings() const;
 };
 
 #endif //EECS3540_COPYTREE_OPTS_H
@@ -0,0 +1,272 @@
+/*
+ * Copyright (c) 2016 Nathan Lowe
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of this software
+ * and associated documentation files (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all copies or substantial
+ * portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT
+ * LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN
+ * NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include <algorithm>
+#include <cerrno>
+#include "copy.h"
+#include "Logger.h"
+#include "parcp.h"
+#include "sys.h"
+#include "util.h"
+
+namespace Parcp
+{
+    L3::Logger Log("Parcp");
+
+    /** Sets the log level of the calling thread for as long as it is in scope, so a job logs at its own level */
+    class ThreadLogLevel
+    {
+    public:
+        explicit ThreadLogLevel(L3::Level level) : previous(L3::ThreadLogLevel) { L3::ThreadLogLevel = level; }
+        ~ThreadLogLevel() { L3::ThreadLogLevel = previous; }
+
+    private:
+        L3::Level previous;
+    };
+
+    ThreadPool::ThreadPool(unsigned count)
+    {
+        if(count == 0) count = std::max(1u, std::thread::hardware_concurrency());
+        for(unsigned i = 0; i < count; i++) threads.emplace_back(&ThreadPool::Run, this);
+    }
+
+    ThreadPool::~ThreadPool()
+    {
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            stopping = true;
+        }
+
+        ready.notify_all();
+        for(auto& thread : threads) thread.join();
+    }
+
+    void ThreadPool::Submit(std::function<void()> task)
+    {
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            tasks.push_back(std::move(task));
+        }
+
+        ready.notify_one();
+    }
+
+    /** Run tasks until the pool is stopped and there are none left */
+    void ThreadPool::Run()
+    {
+        for(;;)
+        {
+            std::function<void()> task;
+            {
+                std::unique_lock<std::mutex> guard(lock);
+                ready.wait(guard, [this]{ return stopping || !tasks.empty(); });
+                if(tasks.empty()) return;
+
+                task = std::move(tasks.front());
+                tasks.pop_front();
+            }
+
+            task();
+        }
+    }
+
+    ThreadPool& DefaultPool()
+    {
+        static ThreadPool pool;
+        return pool;
+    }
+
+    Job::Job(JobOptions options, ThreadPool& pool) :
+        options(std::move(options)), pool(pool), counters(), started(std::chrono::steady_clock::now()),
+        cancelled(false), outstanding(0)
+    {
+        // Everything the copy needs comes from the job, none of it from the command line
+        settings.Compression = this->options.Compression;
+        settings.CompressionLevel = this->options.CompressionLevel;
+        settings.Decompress = this->options.Decompress;
+        settings.Counters = &counters;
+        settings.Rules = &rules;
+        settings.Cancelled = &cancelled;
+        settings.OnFile = this->options.OnFile;
+        settings.OnError = this->options.OnError;
+    }
+
+    Job::~Job()
+    {
+        Cancel();
+
+        bool wait;
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            wait = startedOnce;
+        }
+
+        if(wait) Wait();
+    }
+
+    bool Job::Start()
+    {
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            if(startedOnce) return false;
+            startedOnce = true;
+        }
+
+        started = std::chrono::steady_clock::now();
+        ThreadLogLevel level(options.LogLevel);
+
+        // Paths are built by appending names, so make sure the roots end with a '/'
+        auto source = options.Source;
+        auto dest = options.Dest;
+        if(!util::StringEndsWith(source, '/')) source += '/';
+        if(!util::StringEndsWith(dest, '/')) dest += '/';
+
+        // Starting counts as a task of its own, so the job can't finish before the root directory is submitted. If
+        // anything goes wrong before then, finishing it finishes the job straight away
+        outstanding = 1;
+
+        std::string filterErrors;
+        if(!rules.Compile(options.FilterRules, filterErrors))
+        {
+            Log.Error("Invalid include/exclude rules:");
+            Log.Error(filterErrors);
+            Fail(source, EINVAL);
+            Finish();
+            return false;
+        }
+
+        // The destination root is created by the root's task, there's only something to copy if the source exists
+        struct stat info;
+        errno = 0;
+        if(Sys::Stat(source.c_str(), &info) != 0 || !S_ISDIR(info.st_mode))
+        {
+            auto error = errno != 0 ? errno : ENOTDIR;
+            Log.Error(source + " does not exist or is not a directory");
+            Fail(source, error);
+            Finish();
+            return false;
+        }
+
+        Submit(source, dest, rules.Root());
+        Finish();
+
+        return true;
+    }
+
+    void Job::Cancel()
+    {
+        cancelled = true;
+    }
+
+    int Job::Wait()
+    {
+        std::unique_lock<std::mutex> guard(lock);
+        if(!startedOnce) return -1;
+
+        finished.wait(guard, [this]{ return done; });
+        return result;
+    }
+
+    bool Job::Done()
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        return done;
+    }
+
+    Stats::Snapshot Job::Progress() const
+    {
+        auto elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - started).count();
+        return Stats::Take(counters, elapsed);
+    }
+
+    /**
+     * Count an entry that couldn't be copied, and tell the caller about it
+     *
+     * @param path the entry
+     * @param error the errno of the failure, or 0 if it isn't known
+     */
+    void Job::Fail(const std::string& path, int error)
+    {
+        counters.Errors.Add(1);
+        if(options.OnError) options.OnError(path, error);
+    }
+
+    /**
+     * Queue a task to copy a directory
+     *
+     * @param source the directory to copy from, with a trailing '/'
+     * @param dest the directory to copy to, with a trailing '/'
+     * @param filterState where the directory is in the include/exclude rules
+     */
+    void Job::Submit(const std::string& source, const std::string& dest, const Filter::State& filterState)
+    {
+        outstanding.fetch_add(1);
+        counters.DirectoriesQueued.Add(1);
+
+        pool.Submit([this, source, dest, filterState]{
+            ThreadLogLevel level(options.LogLevel);
+            counters.DirectoriesQueued.Sub(1);
+            CopyDirectory(source, dest, filterState);
+            Finish();
+        });
+    }
+
+    /**
+     * Copy the entries in a directory. Files are copied right away, subdirectories are copied by tasks of their own
+     *
+     * @param source the directory to copy from, with a trailing '/'
+     * @param dest the directory to copy to, with a trailing '/'. It is created if it does not exist
+     * @param filterState where the directory is in the include/exclude rules
+     */
+    void Job::CopyDirectory(const std::string& source, const std::string& dest, const Filter::State& filterState)
+    {
+        Copy::SubdirectoryHandler subdirectory = [this](const Path::Node& sourceEntry, const Path::Node& destEntry,
+                                                        const std::string&, const Filter::State& childState) {
+            Submit(sourceEntry.Full() + '/', destEntry.Full() + '/', childState);
+            return true;
+        };
+
+        counters.ActiveWorkers.Add(1);
+
+        // Failures are counted and reported by the traversal, the job's result comes from the counters
+        dev_t device;
+        Copy::CopyDirectory(settings, source, dest, "", filterState, subdirectory, device);
+
+        counters.ActiveWorkers.Sub(1);
+    }
+
+    /**
+     * Mark a task as finished. The last one to finish finishes the job, since every task that is submitted is
+     * submitted by a task that hasn't finished yet
+     */
+    void Job::Finish()
+    {
+        if(outstanding.fetch_sub(1) != 1) return;
+
+        auto status = cancelled || counters.Errors.Get() > 0 ? -1 : 0;
+
+        // The callback goes first, so the job can't be destroyed by a waiter while it's still running
+        if(options.OnComplete) options.OnComplete(status);
+
+        std::lock_guard<std::mutex> guard(lock);
+        result = status;
+        done = true;
+        finished.notify_all();
+    }
+}
@@ -0,0 +1,193 @@
+/*
+ * Copyright (c) 2016 Nathan Lowe
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of this software
+ * and associated documentation files (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all copies or substantial
+ * portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT
+ * LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN
+ * NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef EECS3540_PARCP_H
+#define EECS3540_PARCP_H
+
+#include <sys/stat.h>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include "compress.h"
+#include "copy.h"
+#include "filter.h"
+#include "Logger.h"
+#include "stats.h"
+
+/**
+ * libparcp, for driving copies from inside another program. The parcp command forks a worker process per
+ * subdirectory, which doesn't work inside a long running service. Instead, a Job copies a tree with tasks on a
+ * ThreadPool, one task per directory, and many jobs can share the same pool. Both go through the same traversal
+ * (Copy::CopyDirectory), a job just gives it its own settings and counters instead of the command line's.
+ */
+namespace Parcp
+{
+    /** A fixed set of threads that run tasks in the order they are submitted */
+    class ThreadPool
+    {
+    public:
+        /**
+         * Start the threads
+         *
+         * @param threads the number of threads, or 0 for one per core
+         */
+        explicit ThreadPool(unsigned threads = 0);
+
+        /** Run every task that has already been submitted, then stop the threads */
+        ~ThreadPool();
+
+        ThreadPool(const ThreadPool&) = delete;
+        ThreadPool& operator=(const ThreadPool&) = delete;
+
+        /** Queue a task to be run by one of the threads */
+        void Submit(std::function<void()> task);
+
+        /** The number of threads in the pool */
+        unsigned Size() const { return (unsigned) threads.size(); }
+
+    private:
+        std::mutex lock;
+        std::condition_variable ready;
+        std::deque<std::function<void()>> tasks;
+        std::vector<std::thread> threads;
+        bool stopping = false;
+
+        void Run();
+    };
+
+    /** The pool jobs run on unless they are given another one. Started the first time it is used */
+    ThreadPool& DefaultPool();
+
+    /** What to copy, and who to tell about it. Callbacks are called from the pool's threads, possibly at once */
+    struct JobOptions
+    {
+        /** The directory to copy from, not including itself */
+        std::string Source;
+
+        /** The directory to copy into. If the last directory in the path does not exist, it will be created */
+        std::string Dest;
+
+        /** Include and exclude rules, in order of precedence, with the same meaning as --include and --exclude */
+        std::vector<Filter::Rule> FilterRules;
+
+        /** Compress copies with this codec, as --compress does. The codec has to have been built in */
+        Compress::Codec Compression = Compress::NONE;
+
+        /** The compression level, or 0 for the codec's default */
+        int CompressionLevel = 0;
+
+        /** Decompress files written by Compression, as --decompress does */
+        bool Decompress = false;
+
+        /**
+         * The least severe messages the job logs, on top of L3::GlobalLogLevel. Defaults to WARN so that copied files
+         * aren't logged one by one, OFF silences the job completely
+         */
+        L3::Level LogLevel = L3::Level::WARN;
+
+        /** Called once for each file or symlink that was copied, with its source, its destination and its lstat */
+        std::function<void(const std::string& source, const std::string& dest, const struct stat& info)> OnFile;
+
+        /** Called once for each entry that couldn't be copied, with its path and the errno of the failure (or 0) */
+        std::function<void(const std::string& path, int error)> OnError;
+
+        /** Called once the job has finished, with 0 if everything was copied. Wait returns after this does */
+        std::function<void(int result)> OnComplete;
+    };
+
+    /**
+     * A copy of one directory tree. Subdirectories are copied by tasks of their own, so a job uses as many of the
+     * pool's threads as the tree has directories to keep them busy with. Jobs must not be waited on from one of the
+     * pool's threads (or a callback), since the tasks they are waiting for might be queued behind the waiter.
+     */
+    class Job
+    {
+    public:
+        /**
+         * @param options what to copy
+         * @param pool the pool to copy on
+         */
+        explicit Job(JobOptions options, ThreadPool& pool = DefaultPool());
+
+        /** Cancel the job if it is still running, and wait for it to stop */
+        ~Job();
+
+        Job(const Job&) = delete;
+        Job& operator=(const Job&) = delete;
+
+        /**
+         * Start copying in the background. Jobs can only be started once
+         *
+         * @return false if the job couldn't be started, in which case it has already finished
+         */
+        bool Start();
+
+        /**
+         * Stop copying. Files that are already being copied are finished, nothing else is started. The job still has
+         * to be waited on
+         */
+        void Cancel();
+
+        /**
+         * Wait for the job to finish
+         *
+         * @return 0 iff everything was copied, -1 if anything failed, the job was cancelled or it was never started
+         */
+        int Wait();
+
+        /** Whether or not the job has finished */
+        bool Done();
+
+        /** The progress of the job so far */
+        Stats::Snapshot Progress() const;
+
+    private:
+        JobOptions options;
+        ThreadPool& pool;
+        Filter::Matcher rules;
+        Copy::Settings settings;
+
+        Stats::Counters counters;
+        std::chrono::steady_clock::time_point started;
+
+        std::atomic<bool> cancelled;
+        /** The number of directory tasks that have been submitted but haven't finished */
+        std::atomic<uint64_t> outstanding;
+
+        std::mutex lock;
+        std::condition_variable finished;
+        bool startedOnce = false;
+        bool done = false;
+        int result = 0;
+
+        void Fail(const std::string& path, int error);
+        void CopyDirectory(const std::string& source, const std::string& dest, const Filter::State& filterState);
+        void Submit(const std::string& source, const std::string& dest, const Filter::State& filterState);
+        void Finish();
+    };
+}
+
+#endif //EECS3540_PARCP_H
@@ -0,0 +1,75 @@
+/*
+ * Copyright (c) 2016 Nathan Lowe
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of this software
+ * and associated documentation files (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all copies or substantial
+ * portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT
+ * LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN
+ * NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include <algorithm>
+#include <cstring>
+#include <new>
+#include "path.h"
+
+namespace Path
+{
+    std::string Node::Full() const
+    {
+        std::string path;
+        AppendTo(path);
+
+        return path;
+    }
+
+    void Node::AppendTo(std::string& path) const
+    {
+        if(Parent != nullptr)
+        {
+            Parent->AppendTo(path);
+            if(!path.empty() && path.back() != '/') path += '/';
+        }
+
+        path.append(Name, Length);
+    }
+
+    const Node* Arena::Make(const Node* parent, const char* name, size_t length)
+    {
+        // Keep every node aligned, the name goes right after it
+        auto size = (sizeof(Node) + length + alignof(Node) - 1) / alignof(Node) * alignof(Node);
+
+        // Names longer than a block (which can't be valid paths anyway) get a block to themselves
+        if(offset + size > PATH_ARENA_BLOCK_SIZE || blocks.empty())
+        {
+            blocks.emplace_back(new char[std::max(size, (size_t) PATH_ARENA_BLOCK_SIZE)]);
+            offset = 0;
+        }
+
+        auto memory = blocks.back().get() + offset;
+        offset += size;
+        used += size;
+
+        auto copy = memory + sizeof(Node);
+        memcpy(copy, name, length);
+
+        return new (memory) Node{parent, copy, length};
+    }
+
+    void Arena::Reset()
+    {
+        if(blocks.size() > 1) blocks.resize(1);
+
+        offset = 0;
+        used = 0;
+    }
+}
@@ -0,0 +1,84 @@
+/*
+ * Copyright (c) 2016 Nathan Lowe
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of this software
+ * and associated documentation files (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all copies or substantial
+ * portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT
+ * LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN
+ * NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef EECS3540_PATH_H
+#define EECS3540_PATH_H
+
+#include <cstddef>
+#include <memory>
+#include <string>
+#include <vector>
+
+/** The size of the blocks an Arena allocates nodes from */
+#define PATH_ARENA_BLOCK_SIZE (64 * 1024)
+
+/**
+ * Paths as chains of names, so that a path under a directory shares the directory's part instead of copying it. Most
+ * of the copy works relative to open directory descriptors and never needs a full path at all; it is only built
+ * (with Full or AppendTo) for logging, errors, and handing work to another process.
+ */
+namespace Path
+{
+    /** A name, relative to its parent. A node without a parent is a path on its own (e.g. a directory to copy) */
+    struct Node
+    {
+        const Node* Parent;
+        /** The name, which doesn't have to be null terminated */
+        const char* Name;
+        size_t Length;
+
+        /** Build the full path */
+        std::string Full() const;
+
+        /** Append the full path to the specified string, reusing its storage */
+        void AppendTo(std::string& path) const;
+    };
+
+    /**
+     * Allocates nodes, along with a copy of their names, from large blocks that are only freed all at once. Nodes
+     * that are only needed while a directory is being read can just live on the stack instead.
+     */
+    class Arena
+    {
+    public:
+        /**
+         * Allocate a node
+         *
+         * @param parent the parent of the node, or nullptr
+         * @param name the name of the node, which is copied into the arena
+         * @param length the length of the name
+         * @return the node, valid until the arena is reset or destroyed
+         */
+        const Node* Make(const Node* parent, const char* name, size_t length);
+
+        /** The number of bytes handed out since the arena was last reset */
+        size_t Used() const { return used; }
+
+        /** Free every node at once. The first block is kept for reuse */
+        void Reset();
+
+    private:
+        std::vector<std::unique_ptr<char[]>> blocks;
+        /** Where the next allocation goes in the last block */
+        size_t offset = PATH_ARENA_BLOCK_SIZE;
+        size_t used = 0;
+    };
+}
+
+#endif //EECS3540_PATH_H
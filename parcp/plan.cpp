@@ -0,0 +1,667 @@
+/*
+ * Copyright (c) 2016 Nathan Lowe
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of this software
+ * and associated documentation files (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all copies or substantial
+ * portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT
+ * LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN
+ * NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <thread>
+#include <vector>
+#include "copy.h"
+#include "latency.h"
+#include "Logger.h"
+#include "opts.h"
+#include "plan.h"
+#include "stats.h"
+#include "sys.h"
+#include "util.h"
+
+/** How many bytes of records a worker buffers before appending them to the shared file */
+#define PLAN_BUFFER_SIZE (64 * 1024)
+/** The most threads a work list is run with */
+#define PLAN_MAX_THREADS 16
+/** How much data is read from the source and written to the destination to measure their throughput */
+#define PLAN_CALIBRATION_BYTES (64 * 1024 * 1024)
+/** The size of each read and write while calibrating */
+#define PLAN_CALIBRATION_CHUNK (1024 * 1024)
+/** How many empty files are created in the destination to measure the cost of each entry */
+#define PLAN_CALIBRATION_ENTRIES 200
+
+namespace Plan
+{
+    L3::Logger Log("Plan");
+
+    /** An entry found while scanning, as recorded in the shared file. The path follows it */
+    struct Recorded
+    {
+        uint64_t Size;
+        /** The space the entry takes up on disk, which is less than Size for sparse files */
+        uint64_t Allocated;
+        uint64_t Device;
+        uint64_t Inode;
+        uint32_t Links;
+        uint32_t Mode;
+        uint32_t PathLength;
+    };
+
+    /** The shared file, and the records this process hasn't appended to it yet */
+    static int recordFd = -1;
+    static std::string buffer;
+
+    /** The size classes of the histogram, as upper bounds. Anything bigger goes in the last class */
+    static const uint64_t sizeClasses[] = {1, 4ull << 10, 64ull << 10, 1ull << 20, 16ull << 20, 256ull << 20, 4ull << 30};
+    static const char* sizeClassNames[] = {"empty", "< 4 KiB", "< 64 KiB", "< 1 MiB", "< 16 MiB", "< 256 MiB", "< 4 GiB", ">= 4 GiB"};
+    static const size_t SIZE_CLASSES = sizeof(sizeClassNames) / sizeof(sizeClassNames[0]);
+
+    /** The number of threads to run a work list with */
+    static unsigned ThreadCount()
+    {
+        return std::min(std::max(2u, std::thread::hardware_concurrency()), (unsigned) PLAN_MAX_THREADS);
+    }
+
+    int Create()
+    {
+        int fd = util::TemporaryFile("plan");
+        if(fd < 0)
+        {
+            Log.Fatal("Unable to create a temporary file for the plan (errno " + std::to_string(errno) + ")");
+            return -1;
+        }
+
+        // Every worker appends to the same open file, whole buffers at a time
+        fcntl(fd, F_SETFL, O_APPEND);
+        recordFd = fd;
+
+        return fd;
+    }
+
+    void Attach(int fd)
+    {
+        recordFd = fd;
+    }
+
+    bool Record(const std::string& relativePath, const struct stat& info)
+    {
+        Recorded record;
+        record.Size = (uint64_t) info.st_size;
+        record.Allocated = (uint64_t) info.st_blocks * 512;
+        record.Device = (uint64_t) info.st_dev;
+        record.Inode = (uint64_t) info.st_ino;
+        record.Links = (uint32_t) info.st_nlink;
+        record.Mode = (uint32_t) info.st_mode;
+        record.PathLength = (uint32_t) relativePath.size();
+
+        buffer.append(reinterpret_cast<const char*>(&record), sizeof(record));
+        buffer.append(relativePath);
+
+        return buffer.size() < PLAN_BUFFER_SIZE || Flush();
+    }
+
+    bool Flush()
+    {
+        if(buffer.empty() || recordFd < 0) return true;
+
+        auto written = Sys::WriteAll(recordFd, buffer.data(), buffer.size(), 0);
+        bool ok = written == buffer.size();
+        if(!ok) Log.Error("[" + std::to_string(getpid()) + "] Unable to record entries for the plan (errno " + std::to_string(errno) + ")");
+
+        buffer.clear();
+        return ok;
+    }
+
+    /** The record at the specified offset in the mapped records, which may not be aligned */
+    static Recorded RecordAt(const char* records, size_t offset)
+    {
+        Recorded record;
+        memcpy(&record, records + offset, sizeof(record));
+        return record;
+    }
+
+    /** The number of seconds since the specified time, from Latency::Now */
+    static double SecondsSince(uint64_t start)
+    {
+        return (double) (Latency::Now() - start) / 1e9;
+    }
+
+    /**
+     * Measure how fast files can be read from the source, by reading (up to PLAN_CALIBRATION_BYTES of) the largest
+     * files after asking the kernel to drop them from the page cache
+     *
+     * @param source the root of the source, with a trailing '/'
+     * @param largest the paths of the largest regular files, largest first
+     * @return the throughput in bytes per second, or 0 if nothing could be read
+     */
+    static double CalibrateRead(const std::string& source, const std::vector<std::string>& largest)
+    {
+        std::vector<char> chunk(PLAN_CALIBRATION_CHUNK);
+        uint64_t total = 0;
+        double seconds = 0;
+
+        for(auto& path : largest)
+        {
+            if(total >= PLAN_CALIBRATION_BYTES) break;
+
+            int fd = open((source + path).c_str(), O_RDONLY | O_CLOEXEC);
+            if(fd < 0) continue;
+
+            posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+
+            auto start = Latency::Now();
+            ssize_t count;
+            while(total < PLAN_CALIBRATION_BYTES && (count = read(fd, chunk.data(), chunk.size())) > 0) total += (uint64_t) count;
+            seconds += SecondsSince(start);
+
+            close(fd);
+        }
+
+        return seconds > 0 ? total / seconds : 0;
+    }
+
+    /**
+     * Measure how fast data can be written to the destination, with a temporary file that is synced to disk
+     *
+     * @param dir an existing directory on the destination's filesystem
+     * @param bytes how much to write
+     * @return the throughput in bytes per second, or 0 if nothing could be written
+     */
+    static double CalibrateWrite(const std::string& dir, uint64_t bytes)
+    {
+        int fd = open(dir.c_str(), O_TMPFILE | O_WRONLY | O_CLOEXEC, S_IRUSR | S_IWUSR);
+        if(fd < 0)
+        {
+            auto path = dir + "/.parcp-plan-XXXXXX";
+            fd = mkstemp(&path[0]);
+            if(fd < 0) return 0;
+            unlink(path.c_str());
+        }
+
+        // Incompressible enough that a compressing filesystem can't cheat
+        std::vector<char> chunk(PLAN_CALIBRATION_CHUNK);
+        uint32_t state = 3540;
+        for(auto& c : chunk)
+        {
+            state = state * 1103515245 + 12345;
+            c = (char) (state >> 16);
+        }
+
+        auto start = Latency::Now();
+        uint64_t total = 0;
+        while(total < bytes)
+        {
+            auto length = (size_t) std::min((uint64_t) chunk.size(), bytes - total);
+            if(Sys::WriteAll(fd, chunk.data(), length, 0) != length) break;
+            total += length;
+        }
+        fdatasync(fd);
+        auto seconds = SecondsSince(start);
+
+        close(fd);
+        return seconds > 0 && total > 0 ? total / seconds : 0;
+    }
+
+    /**
+     * Measure the cost of creating an entry in the destination, with empty files that are removed afterwards
+     *
+     * @param dir an existing directory on the destination's filesystem
+     * @return the number of seconds each entry took, or 0 if they couldn't be created
+     */
+    static double CalibrateEntries(const std::string& dir)
+    {
+        auto prefix = dir + "/.parcp-plan-" + std::to_string(getpid()) + "-";
+
+        int created = 0;
+        auto start = Latency::Now();
+        for(; created < PLAN_CALIBRATION_ENTRIES; created++)
+        {
+            int fd = open((prefix + std::to_string(created)).c_str(), O_CREAT | O_EXCL | O_WRONLY | O_CLOEXEC, S_IRUSR | S_IWUSR);
+            if(fd < 0) break;
+            close(fd);
+        }
+        auto seconds = SecondsSince(start);
+
+        for(int i = 0; i < created; i++) unlink((prefix + std::to_string(i)).c_str());
+
+        return created > 0 ? seconds / created : 0;
+    }
+
+    /** Format a duration as h:mm:ss */
+    static std::string HumanDuration(double seconds)
+    {
+        auto total = (unsigned long long) (seconds + 0.5);
+
+        char buf[32];
+        snprintf(buf, sizeof(buf), "%llu:%02llu:%02llu", total / 3600, total / 60 % 60, total % 60);
+        return std::string(buf);
+    }
+
+    /** Escape a path for a work list */
+    static std::string Escape(const char* path, size_t length)
+    {
+        std::string escaped;
+        for(size_t i = 0; i < length; i++)
+        {
+            if(path[i] == '\\') escaped += "\\\\";
+            else if(path[i] == '\n') escaped += "\\n";
+            else escaped += path[i];
+        }
+
+        return escaped;
+    }
+
+    /**
+     * Unescape a path from a work list
+     *
+     * @param escaped the path as written in the work list
+     * @param path set to the path
+     * @return false if the path has an invalid escape
+     */
+    static bool Unescape(const std::string& escaped, std::string& path)
+    {
+        path.clear();
+        for(size_t i = 0; i < escaped.size(); i++)
+        {
+            if(escaped[i] != '\\')
+            {
+                path += escaped[i];
+                continue;
+            }
+
+            if(++i == escaped.size()) return false;
+            if(escaped[i] == '\\') path += '\\';
+            else if(escaped[i] == 'n') path += '\n';
+            else return false;
+        }
+
+        return true;
+    }
+
+    /** Whether or not a path from a work list stays inside the directory it is relative to */
+    static bool Contained(const std::string& path)
+    {
+        if(path.empty() || path[0] == '/') return false;
+
+        size_t start = 0;
+        while(start <= path.size())
+        {
+            auto end = path.find('/', start);
+            if(end == std::string::npos) end = path.size();
+            if(path.compare(start, end - start, "..") == 0 && end - start == 2) return false;
+            start = end + 1;
+        }
+
+        return true;
+    }
+
+    /** The nearest directory at or above the specified path that exists */
+    static std::string ExistingParent(std::string path)
+    {
+        while(!path.empty() && path.back() == '/') path.pop_back();
+
+        while(!path.empty() && !util::DirectoryExists(path))
+        {
+            auto slash = path.find_last_of('/');
+            if(slash == std::string::npos) return ".";
+            path = slash == 0 ? "/" : path.substr(0, slash);
+        }
+
+        return path.empty() ? "/" : path;
+    }
+
+    int Report(const std::string& source, const std::string& dest, const std::string& workList)
+    {
+        if(!Flush()) return -1;
+
+        struct stat info;
+        if(fstat(recordFd, &info) != 0)
+        {
+            Log.Fatal("Unable to read the recorded entries (errno " + std::to_string(errno) + ")");
+            return -1;
+        }
+
+        auto size = (size_t) info.st_size;
+        char* records = nullptr;
+        if(size > 0)
+        {
+            auto mapped = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, recordFd, 0);
+            if(mapped == MAP_FAILED)
+            {
+                Log.Fatal("Unable to map the recorded entries (errno " + std::to_string(errno) + ")");
+                return -1;
+            }
+
+            records = static_cast<char*>(mapped);
+        }
+
+        // Where each entry is in the records, so they can be sorted without copying their paths around
+        struct Entry
+        {
+            uint64_t Size;
+            size_t Offset;
+        };
+
+        std::vector<Entry> directories, files;
+        std::vector<std::pair<uint64_t, uint64_t>> linked;
+        std::vector<uint64_t> linkedSizes;
+        uint64_t symlinks = 0, special = 0, bytes = 0, allocated = 0, sparseFiles = 0, holes = 0;
+        uint64_t histogramCount[SIZE_CLASSES] = {0}, histogramBytes[SIZE_CLASSES] = {0};
+
+        for(size_t offset = 0; offset + sizeof(Recorded) <= size;)
+        {
+            auto record = RecordAt(records, offset);
+
+            if(S_ISDIR(record.Mode)) directories.push_back(Entry{0, offset});
+            else files.push_back(Entry{S_ISREG(record.Mode) ? record.Size : 0, offset});
+
+            if(S_ISLNK(record.Mode)) symlinks++;
+            else if(!S_ISREG(record.Mode) && !S_ISDIR(record.Mode)) special++;
+            else if(S_ISREG(record.Mode))
+            {
+                bytes += record.Size;
+                allocated += record.Allocated;
+
+                size_t sizeClass = 0;
+                while(sizeClass < SIZE_CLASSES - 1 && record.Size >= sizeClasses[sizeClass]) sizeClass++;
+                histogramCount[sizeClass]++;
+                histogramBytes[sizeClass] += record.Size;
+
+                if(record.Allocated < record.Size)
+                {
+                    sparseFiles++;
+                    holes += record.Size - record.Allocated;
+                }
+
+                if(record.Links > 1) linked.emplace_back(record.Device, record.Inode);
+            }
+
+            offset += sizeof(record) + record.PathLength;
+        }
+
+        // Every link to a file after the first is copied again in full by a regular copy
+        uint64_t extraLinks = 0, linkedBytes = 0, linkedFiles = 0;
+        {
+            std::vector<size_t> order;
+            for(size_t i = 0; i < files.size(); i++)
+            {
+                auto record = RecordAt(records, files[i].Offset);
+                if(S_ISREG(record.Mode) && record.Links > 1) order.push_back(i);
+            }
+
+            auto key = [&](size_t i) {
+                auto record = RecordAt(records, files[i].Offset);
+                return std::make_pair(record.Device, record.Inode);
+            };
+
+            std::sort(order.begin(), order.end(), [&](size_t a, size_t b) { return key(a) < key(b); });
+            for(size_t i = 0; i < order.size(); i++)
+            {
+                if(i > 0 && key(order[i]) == key(order[i - 1]))
+                {
+                    extraLinks++;
+                    linkedBytes += files[order[i]].Size;
+                }
+                else
+                {
+                    linkedFiles++;
+                }
+            }
+        }
+
+        auto pathOf = [&](const Entry& entry) {
+            auto record = RecordAt(records, entry.Offset);
+
+            // Recorded paths have a leading '/'
+            return std::make_pair(records + entry.Offset + sizeof(record) + 1, (size_t) record.PathLength - 1);
+        };
+
+        auto byPath = [&](const Entry& a, const Entry& b) {
+            auto pa = pathOf(a), pb = pathOf(b);
+            auto compared = memcmp(pa.first, pb.first, std::min(pa.second, pb.second));
+            return compared != 0 ? compared < 0 : pa.second < pb.second;
+        };
+
+        // Parents before their children, then the largest files first so they aren't what the copy ends up waiting on
+        std::sort(directories.begin(), directories.end(), byPath);
+        std::sort(files.begin(), files.end(), [&](const Entry& a, const Entry& b) {
+            return a.Size != b.Size ? a.Size > b.Size : byPath(a, b);
+        });
+
+        // Calibrate against the largest files, and wherever the destination will be
+        std::vector<std::string> largest;
+        uint64_t sampled = 0;
+        for(auto& file : files)
+        {
+            if(file.Size == 0 || sampled >= PLAN_CALIBRATION_BYTES) break;
+
+            auto path = pathOf(file);
+            largest.emplace_back(path.first, path.second);
+            sampled += file.Size;
+        }
+
+        Log.Debug("Calibrating the source and destination");
+        auto destDir = ExistingParent(dest);
+        auto readRate = CalibrateRead(source, largest);
+        auto writeRate = bytes > 0 ? CalibrateWrite(destDir, std::min(std::max(bytes, (uint64_t) PLAN_CALIBRATION_CHUNK), (uint64_t) PLAN_CALIBRATION_BYTES)) : 0;
+        auto entryCost = CalibrateEntries(destDir);
+
+        auto snapshot = Stats::Take(0);
+        auto entries = files.size() + directories.size();
+        auto threads = ThreadCount();
+
+        printf("Plan for copying %s to %s\n", source.c_str(), dest.c_str());
+        printf("  Files:        %llu regular (%s, %s allocated), %llu symlinks, %llu special (skipped)\n",
+               (unsigned long long) (files.size() - symlinks - special), Stats::HumanBytes((double) bytes).c_str(),
+               Stats::HumanBytes((double) allocated).c_str(), (unsigned long long) symlinks, (unsigned long long) special);
+        printf("  Directories:  %llu\n", (unsigned long long) directories.size() + 1);
+        printf("  Excluded:     %llu\n", (unsigned long long) snapshot.Excluded);
+        printf("  Errors:       %llu\n", (unsigned long long) snapshot.Errors);
+        printf("\n  %-12s %12s %12s\n", "size", "files", "bytes");
+        for(size_t i = 0; i < SIZE_CLASSES; i++)
+        {
+            printf("  %-12s %12llu %12s\n", sizeClassNames[i], (unsigned long long) histogramCount[i], Stats::HumanBytes((double) histogramBytes[i]).c_str());
+        }
+
+        printf("\n  Hard links:   %llu extra links to %llu files, %s that a copy writes again (--dedup hardlink and --tar-out don't)\n",
+               (unsigned long long) extraLinks, (unsigned long long) linkedFiles, Stats::HumanBytes((double) linkedBytes).c_str());
+        printf("  Sparse files: %llu with %s of holes, which a copy writes out in full\n",
+               (unsigned long long) sparseFiles, Stats::HumanBytes((double) holes).c_str());
+        printf("  Space needed: %s\n", Stats::HumanBytes((double) bytes).c_str());
+
+        printf("\n  Calibration:  reading %s/s from %s, writing %s/s and %.3f ms per entry in %s\n",
+               Stats::HumanBytes(readRate).c_str(), source.c_str(), Stats::HumanBytes(writeRate).c_str(), entryCost * 1000, destDir.c_str());
+
+        // Data is limited by the slower device, entries are created by every worker at once
+        auto rate = readRate > 0 && writeRate > 0 ? std::min(readRate, writeRate) : std::max(readRate, writeRate);
+        auto dataSeconds = rate > 0 ? bytes / rate : 0;
+        auto entrySeconds = entries * entryCost / threads;
+        if(rate > 0 || bytes == 0)
+        {
+            printf("  Estimate:     %s (%s for data, %s for %llu entries across %u workers)\n",
+                   HumanDuration(dataSeconds + entrySeconds).c_str(), HumanDuration(dataSeconds).c_str(),
+                   HumanDuration(entrySeconds).c_str(), (unsigned long long) entries, threads);
+        }
+        else
+        {
+            printf("  Estimate:     unavailable, neither the source nor the destination could be measured\n");
+        }
+
+        fflush(stdout);
+
+        int result = 0;
+        if(!workList.empty())
+        {
+            std::ofstream out(workList);
+            for(auto& directory : directories)
+            {
+                auto path = pathOf(directory);
+                out << "d\t0\t" << Escape(path.first, path.second) << "\n";
+            }
+
+            for(auto& file : files)
+            {
+                auto path = pathOf(file);
+                out << "f\t" << file.Size << "\t" << Escape(path.first, path.second) << "\n";
+            }
+
+            out.close();
+            if(!out)
+            {
+                Log.Fatal("Unable to write the work list to " + workList);
+                result = -1;
+            }
+            else
+            {
+                Log.Info("Wrote a work list of " + std::to_string(entries) + " entries to " + workList);
+            }
+        }
+
+        if(records != nullptr) munmap(records, size);
+        return result;
+    }
+
+    /** An entry in a work list */
+    struct Item
+    {
+        bool Directory;
+        std::string Path;
+    };
+
+    /**
+     * Read a work list
+     *
+     * @param workList the work list to read
+     * @param items set to the entries in it
+     * @return false if it couldn't be read or isn't a valid work list
+     */
+    static bool ReadWorkList(const std::string& workList, std::vector<Item>& items)
+    {
+        std::ifstream in(workList);
+        if(!in)
+        {
+            Log.Fatal("Unable to read the work list " + workList);
+            return false;
+        }
+
+        std::string line, path;
+        size_t number = 0;
+        while(std::getline(in, line))
+        {
+            number++;
+            if(line.empty()) continue;
+
+            auto first = line.find('\t');
+            auto second = first == std::string::npos ? std::string::npos : line.find('\t', first + 1);
+            if(first != 1 || second == std::string::npos || (line[0] != 'd' && line[0] != 'f') ||
+               !Unescape(line.substr(second + 1), path) || !Contained(path))
+            {
+                Log.Fatal(workList + ":" + std::to_string(number) + ": Not a valid work list entry");
+                return false;
+            }
+
+            items.push_back(Item{line[0] == 'd', path});
+        }
+
+        return true;
+    }
+
+    int Execute(const std::string& source, const std::string& dest, const std::string& workList)
+    {
+        std::vector<Item> items;
+        if(!ReadWorkList(workList, items)) return -1;
+
+        // The destination root gets the same mode as the source root, as it would in a regular copy
+        struct stat rootStat;
+        dev_t destDevice = 0;
+        if(Sys::Stat(source.c_str(), &rootStat) != 0 ||
+           (Sys::Mkdir(dest.c_str(), rootStat.st_mode, destDevice) != 0 && errno != EEXIST))
+        {
+            Log.Fatal("Unable to create " + dest + " (errno " + std::to_string(errno) + ")");
+            Stats::Shared->Errors.Add(1);
+            return -1;
+        }
+
+        // Directories come first in a work list, parents before children, so they can just be created in order
+        std::atomic<bool> error(false);
+        size_t firstFile = 0;
+        for(; firstFile < items.size() && items[firstFile].Directory; firstFile++)
+        {
+            auto& path = items[firstFile].Path;
+
+            struct stat info;
+            dev_t device = 0;
+            if(Sys::Lstat((source + path).c_str(), &info, 0) != 0 || !S_ISDIR(info.st_mode) ||
+               (Sys::Mkdir((dest + path).c_str(), info.st_mode, device) != 0 && errno != EEXIST))
+            {
+                Log.Error("[" + std::to_string(getpid()) + "] Unable to create directory " + dest + path + " (errno " + std::to_string(errno) + ")");
+                Stats::Shared->Errors.Add(1);
+                error = true;
+            }
+
+            Stats::Shared->DirectoriesScanned.Add(1);
+        }
+
+        // The files are handed out in order, so the largest start first
+        std::atomic<size_t> next(firstFile);
+        auto work = [&]{
+            size_t index;
+            while((index = next.fetch_add(1)) < items.size())
+            {
+                auto& item = items[index];
+                if(item.Directory)
+                {
+                    Log.Error("[" + std::to_string(getpid()) + "] " + item.Path + " is listed after the files in " + workList + ", skipping it");
+                    Stats::Shared->Errors.Add(1);
+                    error = true;
+                    continue;
+                }
+
+                auto sourcePath = source + item.Path;
+                struct stat info;
+                if(Sys::Lstat(sourcePath.c_str(), &info, 0) != 0)
+                {
+                    Log.Error("[" + std::to_string(getpid()) + "] Unable to stat " + sourcePath + " (errno " + std::to_string(errno) + ")");
+                    Stats::Shared->Errors.Add(1);
+                    error = true;
+                    continue;
+                }
+
+                Stats::Shared->FilesScanned.Add(1);
+                if(!Copy::CopyFile(Options::CommandLineArgs.CopySettings(), sourcePath, dest + item.Path, info, destDevice))
+                {
+                    Stats::Shared->Errors.Add(1);
+                    error = true;
+                }
+            }
+        };
+
+        Stats::Shared->ActiveWorkers.Add(1);
+
+        std::vector<std::thread> threads;
+        for(unsigned i = 0; i < ThreadCount(); i++) threads.emplace_back(work);
+        for(auto& thread : threads) thread.join();
+
+        Stats::Shared->ActiveWorkers.Sub(1);
+
+        return error ? -1 : 0;
+    }
+}
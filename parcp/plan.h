@@ -0,0 +1,87 @@
+/*
+ * Copyright (c) 2016 Nathan Lowe
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of this software
+ * and associated documentation files (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all copies or substantial
+ * portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT
+ * LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN
+ * NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef EECS3540_PLAN_H
+#define EECS3540_PLAN_H
+
+#include <sys/stat.h>
+#include <string>
+
+/**
+ * Dry runs (--plan) and running the work lists they produce (--from-plan). A dry run scans the source with the usual
+ * workers, which record every entry instead of copying it. The root process then reports what a copy would involve,
+ * estimates how long it would take from a quick calibration of the source and destination, and optionally writes out
+ * a work list: every directory (parents first), then every file, largest first, so that the biggest files aren't the
+ * ones left running at the end of the copy.
+ *
+ * Work lists are text, one entry per line: a type ('d' for directories, 'f' for everything else), the size in bytes
+ * and the path relative to the source, separated by tabs. Newlines and backslashes in paths are escaped as \n and \\.
+ */
+namespace Plan
+{
+    /**
+     * Create the file workers record entries in. This should only be called by the root process, before any workers
+     * are forked
+     *
+     * @return the file descriptor that workers should attach to, or -1 on failure
+     */
+    int Create();
+
+    /**
+     * Attach to the file created by the root process
+     *
+     * @param fd the file descriptor passed down from the parent process
+     */
+    void Attach(int fd);
+
+    /**
+     * Record an entry found while scanning
+     *
+     * @param relativePath the path of the entry relative to the root of the copy, with a leading '/'
+     * @param info the stat struct of the entry (from lstat)
+     * @return false if the record couldn't be written
+     */
+    bool Record(const std::string& relativePath, const struct stat& info);
+
+    /** Write out any records that are still buffered. Workers must call this before they exit */
+    bool Flush();
+
+    /**
+     * Print what copying the scanned entries would involve, and write the work list if requested. Called by the root
+     * process once every worker has finished
+     *
+     * @param source the directory that was scanned
+     * @param dest the directory it would be copied to, used for calibration
+     * @param workList where to write the work list, or an empty string to not write one
+     * @return 0 iff the report (and work list) were written
+     */
+    int Report(const std::string& source, const std::string& dest, const std::string& workList);
+
+    /**
+     * Copy the entries in a work list, in order, across a pool of threads
+     *
+     * @param source the directory the paths in the work list are relative to
+     * @param dest the directory to copy to. It will be created if it does not exist
+     * @param workList the work list to run
+     * @return 0 iff every entry was copied
+     */
+    int Execute(const std::string& source, const std::string& dest, const std::string& workList);
+}
+
+#endif //EECS3540_PLAN_H
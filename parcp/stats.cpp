@@ -0,0 +1,305 @@
+/*
+ * Copyright (c) 2016 Nathan Lowe
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of this software
+ * and associated documentation files (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all copies or substantial
+ * portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT
+ * LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN
+ * NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include <sys/mman.h>
+#include <unistd.h>
+#include <cstdio>
+#include <iomanip>
+#include <sstream>
+#include <new>
+#include "stats.h"
+#include "Logger.h"
+
+namespace Stats
+{
+    L3::Logger Log("Stats");
+
+    /** Backing storage used when the counters could not be placed in shared memory */
+    static Counters localCounters;
+
+    Counters* Shared = &localCounters;
+
+    /**
+     * Map the counter block backed by the specified file descriptor
+     *
+     * @param fd the file descriptor to map
+     * @return the mapped counters, or nullptr if the mapping failed
+     */
+    static Counters* Map(int fd)
+    {
+        void* mem = mmap(nullptr, sizeof(Counters), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        return mem == MAP_FAILED ? nullptr : static_cast<Counters*>(mem);
+    }
+
+    /**
+     * Create the shared counter block. This should only be called by the root process, before any workers are
+     * forked. If shared memory is unavailable, the counters fall back to process-local memory and only reflect the
+     * work done by the root process.
+     *
+     * @return the file descriptor that workers should attach to, or -1 if the counters are process-local
+     */
+    int Create()
+    {
+        // Not close-on-exec: the descriptor has to survive into the workers we exec
+        int fd = memfd_create("parcp-stats", 0);
+        if(fd < 0 || ftruncate(fd, sizeof(Counters)) != 0)
+        {
+            Log.Warn("Unable to create shared memory for statistics (errno " + std::to_string(errno) + "), only the root process will be counted");
+            if(fd >= 0) close(fd);
+            return -1;
+        }
+
+        auto mapped = Map(fd);
+        if(mapped == nullptr)
+        {
+            Log.Warn("Unable to map shared memory for statistics (errno " + std::to_string(errno) + "), only the root process will be counted");
+            close(fd);
+            return -1;
+        }
+
+        Shared = new (mapped) Counters();
+        return fd;
+    }
+
+    /**
+     * Attach to the shared counter block created by the root process
+     *
+     * @param fd the file descriptor passed down from the parent process
+     * @return true iff the counters were mapped successfully
+     */
+    bool Attach(int fd)
+    {
+        auto mapped = Map(fd);
+        if(mapped == nullptr)
+        {
+            Log.Warn("Unable to attach to shared statistics (errno " + std::to_string(errno) + ")");
+            return false;
+        }
+
+        Shared = mapped;
+        return true;
+    }
+
+    /**
+     * Take a snapshot of the shared counters
+     *
+     * @param elapsedSeconds the number of seconds since the copy started
+     * @return the current values of all counters
+     */
+    Snapshot Take(double elapsedSeconds)
+    {
+        return Take(*Shared, elapsedSeconds);
+    }
+
+    /**
+     * Take a snapshot of the specified counters
+     *
+     * @param counters the counters to read
+     * @param elapsedSeconds the number of seconds since the copy started
+     * @return the current values of all counters
+     */
+    Snapshot Take(const Counters& counters, double elapsedSeconds)
+    {
+        Snapshot s;
+        s.ElapsedSeconds = elapsedSeconds;
+        s.FilesScanned = counters.FilesScanned.Get();
+        s.DirectoriesScanned = counters.DirectoriesScanned.Get();
+        s.FilesCopied = counters.FilesCopied.Get();
+        s.BytesCopied = counters.BytesCopied.Get();
+        s.Excluded = counters.Excluded.Get();
+        s.Deleted = counters.Deleted.Get();
+        s.Deduplicated = counters.Deduplicated.Get();
+        s.Errors = counters.Errors.Get();
+        s.DirectoriesQueued = counters.DirectoriesQueued.Get();
+        s.ActiveWorkers = counters.ActiveWorkers.Get();
+        s.BytesPerSecond = elapsedSeconds > 0 ? s.BytesCopied / elapsedSeconds : 0;
+
+        return s;
+    }
+
+    /**
+     * Serialize the specified snapshot as a single JSON object
+     *
+     * @param s the snapshot to serialize
+     * @param done whether or not the copy has finished
+     * @return the JSON representation of the snapshot
+     */
+    std::string ToJson(const Snapshot& s, bool done)
+    {
+        std::ostringstream out;
+        out << std::fixed << std::setprecision(3)
+            << "{\"done\": " << (done ? "true" : "false")
+            << ", \"elapsed_seconds\": " << s.ElapsedSeconds
+            << ", \"files_scanned\": " << s.FilesScanned
+            << ", \"directories_scanned\": " << s.DirectoriesScanned
+            << ", \"files_copied\": " << s.FilesCopied
+            << ", \"bytes_copied\": " << s.BytesCopied
+            << ", \"bytes_per_second\": " << s.BytesPerSecond
+            << ", \"current_bytes_per_second\": " << s.CurrentBytesPerSecond
+            << ", \"excluded\": " << s.Excluded
+            << ", \"deleted\": " << s.Deleted
+            << ", \"deduplicated\": " << s.Deduplicated
+            << ", \"errors\": " << s.Errors
+            << ", \"directories_queued\": " << s.DirectoriesQueued
+            << ", \"active_workers\": " << s.ActiveWorkers
+            << "}";
+
+        return out.str();
+    }
+
+    /**
+     * Format a byte count for humans (e.g. "12.3 MiB")
+     *
+     * @param bytes the number of bytes
+     * @return the formatted byte count
+     */
+    std::string HumanBytes(double bytes)
+    {
+        static const char* units[] = {"B", "KiB", "MiB", "GiB", "TiB", "PiB"};
+
+        size_t unit = 0;
+        while(bytes >= 1024 && unit < sizeof(units) / sizeof(units[0]) - 1)
+        {
+            bytes /= 1024;
+            unit++;
+        }
+
+        char buf[32];
+        snprintf(buf, sizeof(buf), "%.1f %s", bytes, units[unit]);
+        return std::string(buf);
+    }
+
+    /**
+     * Start reporting
+     *
+     * @param progress whether or not to draw the progress line on standard error
+     * @param statsFile the JSON file to rewrite periodically, or an empty string to disable it
+     * @param statsInterval the number of seconds between rewrites of the stats file
+     */
+    void Reporter::Start(bool progress, std::string statsFile, unsigned statsInterval)
+    {
+        this->progress = progress;
+        this->statsFile = statsFile;
+        this->statsInterval = statsInterval == 0 ? 1 : statsInterval;
+        started = std::chrono::steady_clock::now();
+
+        // Nothing to do periodically, the final summary only needs the start time
+        if(!progress && statsFile.empty()) return;
+
+        worker = std::thread(&Reporter::Run, this);
+    }
+
+    /**
+     * Stop reporting, writing out the final state of the counters
+     *
+     * @return the final snapshot of the counters
+     */
+    Snapshot Reporter::Stop()
+    {
+        if(worker.joinable())
+        {
+            {
+                std::lock_guard<std::mutex> guard(lock);
+                stopping = true;
+            }
+            wake.notify_all();
+            worker.join();
+        }
+
+        auto s = Take(Elapsed());
+        s.CurrentBytesPerSecond = s.BytesPerSecond;
+
+        if(progress)
+        {
+            DrawProgress(s);
+            fputc('\n', stderr);
+        }
+
+        if(!statsFile.empty()) WriteStatsFile(s, true);
+
+        return s;
+    }
+
+    void Reporter::Run()
+    {
+        double lastWrite = 0;
+
+        std::unique_lock<std::mutex> guard(lock);
+        while(!stopping)
+        {
+            // Redraw a couple of times a second, the counters are cheap to read
+            wake.wait_for(guard, std::chrono::milliseconds(500));
+            if(stopping) break;
+
+            auto s = Take(Elapsed());
+            if(s.ElapsedSeconds > lastElapsed)
+            {
+                currentRate = (s.BytesCopied - lastBytes) / (s.ElapsedSeconds - lastElapsed);
+            }
+            lastBytes = s.BytesCopied;
+            lastElapsed = s.ElapsedSeconds;
+            s.CurrentBytesPerSecond = currentRate;
+
+            if(progress) DrawProgress(s);
+
+            if(!statsFile.empty() && s.ElapsedSeconds - lastWrite >= statsInterval)
+            {
+                WriteStatsFile(s, false);
+                lastWrite = s.ElapsedSeconds;
+            }
+        }
+    }
+
+    void Reporter::DrawProgress(const Snapshot& s)
+    {
+        // Carriage return + erase to end of line so the display stays on a single line
+        fprintf(stderr, "\r[%7.1fs] %llu/%llu files, %llu dirs, %s @ %s/s, %llu queued, %llu active, %llu errors\x1b[K",
+                s.ElapsedSeconds, (unsigned long long) s.FilesCopied, (unsigned long long) s.FilesScanned,
+                (unsigned long long) s.DirectoriesScanned, HumanBytes(s.BytesCopied).c_str(),
+                HumanBytes(s.CurrentBytesPerSecond).c_str(), (unsigned long long) s.DirectoriesQueued,
+                (unsigned long long) s.ActiveWorkers, (unsigned long long) s.Errors);
+        fflush(stderr);
+    }
+
+    void Reporter::WriteStatsFile(const Snapshot& s, bool done)
+    {
+        // Write to a temporary file and rename it over the old one so readers never see a partial file
+        auto tmp = statsFile + ".tmp";
+        FILE* out = fopen(tmp.c_str(), "w");
+        if(out == nullptr)
+        {
+            Log.Warn("Unable to write stats file " + tmp);
+            return;
+        }
+
+        auto json = ToJson(s, done);
+        fprintf(out, "%s\n", json.c_str());
+        fclose(out);
+
+        if(rename(tmp.c_str(), statsFile.c_str()) != 0)
+        {
+            Log.Warn("Unable to replace stats file " + statsFile);
+        }
+    }
+
+    double Reporter::Elapsed() const
+    {
+        return std::chrono::duration<double>(std::chrono::steady_clock::now() - started).count();
+    }
+}
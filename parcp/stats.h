@@ -0,0 +1,203 @@
+/*
+ * Copyright (c) 2016 Nathan Lowe
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of this software
+ * and associated documentation files (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all copies or substantial
+ * portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT
+ * LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN
+ * NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef EECS3540_STATS_H
+#define EECS3540_STATS_H
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <thread>
+
+/** The size of a cache line, used to keep counters that are hammered by different workers apart */
+#define STATS_CACHE_LINE 64
+
+namespace Stats
+{
+    /**
+     * A single lock-free counter, padded out to a full cache line so that workers updating different counters
+     * don't bounce the same line between cores
+     */
+    struct alignas(STATS_CACHE_LINE) Counter
+    {
+        std::atomic<uint64_t> Value;
+
+        /** Add the specified amount to the counter */
+        inline void Add(uint64_t amount) { Value.fetch_add(amount, std::memory_order_relaxed); }
+        /** Subtract the specified amount from the counter */
+        inline void Sub(uint64_t amount) { Value.fetch_sub(amount, std::memory_order_relaxed); }
+        /** Read the current value of the counter */
+        inline uint64_t Get() const { return Value.load(std::memory_order_relaxed); }
+    };
+
+    /**
+     * The counters shared by every worker process participating in a copy. This lives in a shared memory mapping
+     * created by the root process and inherited by each forked worker, so it must only contain lock-free atomics.
+     */
+    struct Counters
+    {
+        /** The number of non-directory entries encountered while scanning */
+        Counter FilesScanned;
+        /** The number of directories that have been opened and scanned */
+        Counter DirectoriesScanned;
+        /** The number of files (and links) successfully copied */
+        Counter FilesCopied;
+        /** The number of bytes of file data written to the destination */
+        Counter BytesCopied;
+        /** The number of entries skipped by the include/exclude rules */
+        Counter Excluded;
+        /** The number of destination entries removed by --delete */
+        Counter Deleted;
+        /** The number of files recreated as links to another copy of the same contents by --dedup */
+        Counter Deduplicated;
+        /** The number of errors encountered */
+        Counter Errors;
+        /** The number of directories handed to a worker that has not started scanning them yet */
+        Counter DirectoriesQueued;
+        /** The number of workers currently scanning or copying a directory */
+        Counter ActiveWorkers;
+        /** The number of (de)compression threads running across every worker, see compress.cpp */
+        Counter CompressionThreads;
+    };
+
+    /** A point-in-time copy of the shared counters */
+    struct Snapshot
+    {
+        /** The number of seconds since the copy started */
+        double ElapsedSeconds = 0;
+        /** The average throughput since the copy started */
+        double BytesPerSecond = 0;
+        /** The throughput since the previous report (only set by the Reporter) */
+        double CurrentBytesPerSecond = 0;
+        uint64_t FilesScanned = 0;
+        uint64_t DirectoriesScanned = 0;
+        uint64_t FilesCopied = 0;
+        uint64_t BytesCopied = 0;
+        uint64_t Excluded = 0;
+        uint64_t Deleted = 0;
+        uint64_t Deduplicated = 0;
+        uint64_t Errors = 0;
+        uint64_t DirectoriesQueued = 0;
+        uint64_t ActiveWorkers = 0;
+    };
+
+    /** The counters for the current copy. Always valid once Create or Attach has been called */
+    extern Counters* Shared;
+
+    /**
+     * Create the shared counter block. This should only be called by the root process, before any workers are
+     * forked. If shared memory is unavailable, the counters fall back to process-local memory and only reflect the
+     * work done by the root process.
+     *
+     * @return the file descriptor that workers should attach to, or -1 if the counters are process-local
+     */
+    int Create();
+
+    /**
+     * Attach to the shared counter block created by the root process
+     *
+     * @param fd the file descriptor passed down from the parent process
+     * @return true iff the counters were mapped successfully
+     */
+    bool Attach(int fd);
+
+    /**
+     * Take a snapshot of the shared counters
+     *
+     * @param elapsedSeconds the number of seconds since the copy started
+     * @return the current values of all counters
+     */
+    Snapshot Take(double elapsedSeconds);
+
+    /**
+     * Take a snapshot of the specified counters, such as those of a single library job
+     *
+     * @param counters the counters to read
+     * @param elapsedSeconds the number of seconds since the copy started
+     * @return the current values of all counters
+     */
+    Snapshot Take(const Counters& counters, double elapsedSeconds);
+
+    /**
+     * Serialize the specified snapshot as a single JSON object
+     *
+     * @param s the snapshot to serialize
+     * @param done whether or not the copy has finished
+     * @return the JSON representation of the snapshot
+     */
+    std::string ToJson(const Snapshot& s, bool done);
+
+    /**
+     * Format a byte count for humans (e.g. "12.3 MiB")
+     *
+     * @param bytes the number of bytes
+     * @return the formatted byte count
+     */
+    std::string HumanBytes(double bytes);
+
+    /**
+     * Periodically reports the shared counters while a copy is running. The reporter owns a single background thread
+     * in the root process that redraws a one line progress display on standard error and/or rewrites a JSON stats
+     * file. Workers never interact with it, they only bump the shared counters.
+     */
+    class Reporter
+    {
+    public:
+        /**
+         * Start reporting
+         *
+         * @param progress whether or not to draw the progress line on standard error
+         * @param statsFile the JSON file to rewrite periodically, or an empty string to disable it
+         * @param statsInterval the number of seconds between rewrites of the stats file
+         */
+        void Start(bool progress, std::string statsFile, unsigned statsInterval);
+
+        /**
+         * Stop reporting, writing out the final state of the counters
+         *
+         * @return the final snapshot of the counters
+         */
+        Snapshot Stop();
+
+    private:
+        void Run();
+        void DrawProgress(const Snapshot& s);
+        void WriteStatsFile(const Snapshot& s, bool done);
+        double Elapsed() const;
+
+        uint64_t lastBytes = 0;
+        double lastElapsed = 0;
+        double currentRate = 0;
+
+        bool progress = false;
+        std::string statsFile;
+        unsigned statsInterval = 5;
+
+        std::chrono::steady_clock::time_point started;
+        std::thread worker;
+        std::mutex lock;
+        std::condition_variable wake;
+        bool stopping = false;
+    };
+}
+
+#endif //EECS3540_STATS_H
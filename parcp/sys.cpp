@@ -0,0 +1,386 @@
+/*
+ * Copyright (c) 2016 Nathan Lowe
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of this software
+ * and associated documentation files (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all copies or substantial
+ * portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT
+ * LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN
+ * NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <cerrno>
+#include "sys.h"
+#include "latency.h"
+#include "throttle.h"
+
+#ifdef PARCP_FAULT_INJECTION
+#include <atomic>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <random>
+#include <sstream>
+#include <string>
+#include <thread>
+#include "Logger.h"
+#endif
+
+namespace Sys
+{
+#ifdef PARCP_FAULT_INJECTION
+    L3::Logger Log("Sys");
+
+    /**
+     * The faults to inject for a single operation. PARCP_FAULTS is a comma separated list of
+     * "<op>:<fault>=<value>" rules, where op is one of the operation names used by the latency report (open, read,
+     * write, lstat, mkdir, ...) or "all", and fault is one of:
+     *
+     *   eintr=<p>      fail with EINTR, without doing anything, with probability p. Never injected for close
+     *   eio=<p>        fail with EIO with probability p
+     *   short=<p>      (read/write) transfer a random, shorter length with probability p
+     *   delay=<us>     sleep for the specified number of microseconds before every call
+     *   enospc=<bytes> (write) fail with ENOSPC once this process has written the specified number of bytes
+     *
+     * For example: PARCP_FAULTS="read:eintr=0.1,write:short=0.5,write:delay=100". PARCP_FAULT_SEED makes the
+     * injected faults repeatable.
+     */
+    struct FaultRule
+    {
+        bool Active = false;
+        double Eintr = 0;
+        double Eio = 0;
+        double Short = 0;
+        unsigned DelayMicroseconds = 0;
+        uint64_t EnospcAfter = UINT64_MAX;
+    };
+
+    struct FaultConfig
+    {
+        FaultRule Rules[Latency::OP_COUNT];
+        uint64_t Seed = 0;
+        std::atomic<uint64_t> Written{0};
+
+        FaultConfig()
+        {
+            auto seed = getenv("PARCP_FAULT_SEED");
+            Seed = seed != nullptr ? strtoull(seed, nullptr, 10) : (uint64_t) getpid();
+
+            auto raw = getenv("PARCP_FAULTS");
+            if(raw == nullptr) return;
+
+            std::istringstream in(raw);
+            std::string rule;
+            while(std::getline(in, rule, ','))
+            {
+                auto colon = rule.find(':');
+                auto eq = rule.find('=');
+                if(colon == std::string::npos || eq == std::string::npos || eq < colon)
+                {
+                    Log.Error("Ignoring malformed fault rule '" + rule + "'");
+                    continue;
+                }
+
+                auto op = rule.substr(0, colon);
+                auto fault = rule.substr(colon + 1, eq - colon - 1);
+                auto value = rule.substr(eq + 1);
+
+                bool matched = false;
+                for(int i = 0; i < Latency::OP_COUNT; i++)
+                {
+                    if(op != "all" && op != Latency::NameOfOp((Latency::Op) i)) continue;
+                    matched = true;
+
+                    auto& r = Rules[i];
+                    r.Active = true;
+
+                    if(fault == "eintr") r.Eintr = atof(value.c_str());
+                    else if(fault == "eio") r.Eio = atof(value.c_str());
+                    else if(fault == "short") r.Short = atof(value.c_str());
+                    else if(fault == "delay") r.DelayMicroseconds = (unsigned) atoi(value.c_str());
+                    else if(fault == "enospc") r.EnospcAfter = strtoull(value.c_str(), nullptr, 10);
+                    else
+                    {
+                        Log.Error("Ignoring unknown fault '" + fault + "'");
+                        break;
+                    }
+                }
+
+                if(!matched) Log.Error("Ignoring fault rule for unknown operation '" + op + "'");
+            }
+        }
+    };
+
+    static FaultConfig& Faults()
+    {
+        static FaultConfig config;
+        return config;
+    }
+
+    static double Roll()
+    {
+        static thread_local std::mt19937_64 rng(Faults().Seed ^ std::hash<std::thread::id>()(std::this_thread::get_id()));
+        return (rng() >> 11) * (1.0 / 9007199254740992.0);
+    }
+
+    /**
+     * Decide whether to inject a fault in front of the specified operation
+     *
+     * @param op the operation about to be performed
+     * @param count for reads and writes, the number of bytes to transfer. May be shortened
+     * @return the errno to fail the call with, or 0 to go ahead with the (possibly shortened) call
+     */
+    static int Inject(Latency::Op op, size_t* count)
+    {
+        auto& config = Faults();
+        auto& rule = config.Rules[op];
+        if(!rule.Active) return 0;
+
+        if(rule.DelayMicroseconds > 0) usleep(rule.DelayMicroseconds);
+
+        // close() releases the descriptor even when interrupted and must not be retried, so it is never interrupted
+        if(op != Latency::CLOSE && rule.Eintr > 0 && Roll() < rule.Eintr) return EINTR;
+        if(rule.Eio > 0 && Roll() < rule.Eio) return EIO;
+
+        if(count != nullptr && *count > 1 && rule.Short > 0 && Roll() < rule.Short)
+        {
+            *count = 1 + (size_t) (Roll() * (double) (*count - 1));
+        }
+
+        if(count != nullptr && rule.EnospcAfter != UINT64_MAX)
+        {
+            if(config.Written.fetch_add(*count) + *count > rule.EnospcAfter) return ENOSPC;
+        }
+
+        return 0;
+    }
+#else
+    static inline int Inject(Latency::Op, size_t*) { return 0; }
+#endif
+
+    /**
+     * Time the specified call, injecting a fault in front of it if configured to. Reads and writes wait for the I/O
+     * limits first, outside of the measurement, so that throttling doesn't show up as latency
+     *
+     * @param op the operation being performed
+     * @param dev the device the operation is performed against
+     * @param count for reads and writes, the number of bytes to transfer. May be shortened by fault injection
+     * @param call the call to make
+     * @return whatever the call returned, or -1 if a fault was injected
+     */
+    template<typename F>
+    static inline auto Call(Latency::Op op, dev_t dev, size_t* count, F call) -> decltype(call())
+    {
+        if(op == Latency::READ || op == Latency::WRITE)
+        {
+            Throttle::Acquire(op == Latency::WRITE && count != nullptr ? *count : 0);
+        }
+
+        return Latency::Measure(op, dev, [&]() -> decltype(call()) {
+            int fault = Inject(op, count);
+            if(fault != 0)
+            {
+                // A failed close still releases the descriptor, so it is closed before the fault is reported
+                if(op == Latency::CLOSE) call();
+
+                errno = fault;
+                return -1;
+            }
+
+            return call();
+        });
+    }
+
+    /** Make the specified call until it is not interrupted */
+    template<typename F>
+    static inline auto Retry(F call) -> decltype(call())
+    {
+        decltype(call()) result;
+        while((result = call()) == -1 && errno == EINTR);
+
+        return result;
+    }
+
+    int Open(const char* path, int flags, mode_t mode, dev_t dev)
+    {
+        return Openat(AT_FDCWD, path, flags, mode, dev);
+    }
+
+    int Openat(int dir, const char* name, int flags, mode_t mode, dev_t dev)
+    {
+        return Retry([&]{ return Call(Latency::OPEN, dev, nullptr, [&]{ return openat(dir, name, flags, mode); }); });
+    }
+
+    int Close(int fd, dev_t dev)
+    {
+        return Call(Latency::CLOSE, dev, nullptr, [&]{ return close(fd); });
+    }
+
+    ssize_t Read(int fd, void* buf, size_t count, dev_t dev)
+    {
+        return Retry([&]{
+            size_t length = count;
+            return Call(Latency::READ, dev, &length, [&]{ return read(fd, buf, length); });
+        });
+    }
+
+    ssize_t Pread(int fd, void* buf, size_t count, off_t offset, dev_t dev)
+    {
+        return Retry([&]{
+            size_t length = count;
+            return Call(Latency::READ, dev, &length, [&]{ return pread(fd, buf, length, offset); });
+        });
+    }
+
+    /**
+     * Keep making the specified write call until everything has been written. The call is given the number of bytes
+     * already written and how many to try to write this time.
+     */
+    template<typename F>
+    static size_t WriteFully(size_t count, dev_t dev, F call)
+    {
+        size_t done = 0;
+        while(done < count)
+        {
+            size_t length = count - done;
+            auto written = Call(Latency::WRITE, dev, &length, [&]{ return call(done, length); });
+
+            if(written < 0)
+            {
+                if(errno == EINTR) continue;
+                break;
+            }
+
+            // A regular file should never accept nothing, treat it like running out of space rather than spinning
+            if(written == 0)
+            {
+                errno = ENOSPC;
+                break;
+            }
+
+            done += (size_t) written;
+        }
+
+        return done;
+    }
+
+    size_t WriteAll(int fd, const void* buf, size_t count, dev_t dev)
+    {
+        return WriteFully(count, dev, [&](size_t done, size_t length) {
+            return write(fd, static_cast<const char*>(buf) + done, length);
+        });
+    }
+
+    size_t PwriteAll(int fd, const void* buf, size_t count, off_t offset, dev_t dev)
+    {
+        return WriteFully(count, dev, [&](size_t done, size_t length) {
+            return pwrite(fd, static_cast<const char*>(buf) + done, length, offset + (off_t) done);
+        });
+    }
+
+    size_t CopyRangeAll(int in, int out, size_t count, dev_t dev)
+    {
+        return WriteFully(count, dev, [&](size_t, size_t length) {
+            return copy_file_range(in, nullptr, out, nullptr, length, 0);
+        });
+    }
+
+    int Lstat(const char* path, struct stat* info, dev_t dev)
+    {
+        return Lstatat(AT_FDCWD, path, info, dev);
+    }
+
+    int Lstatat(int dir, const char* name, struct stat* info, dev_t dev)
+    {
+        return Retry([&]{ return Call(Latency::LSTAT, dev, nullptr, [&]{ return fstatat(dir, name, info, AT_SYMLINK_NOFOLLOW); }); });
+    }
+
+    int Stat(const char* path, struct stat* info)
+    {
+        return Retry([&]{
+            auto start = Latency::Enabled ? Latency::Now() : 0;
+
+            int fault = Inject(Latency::STAT, nullptr);
+            int result = fault != 0 ? -1 : stat(path, info);
+            if(fault != 0) errno = fault;
+
+            if(Latency::Enabled) Latency::Record(Latency::STAT, result == 0 ? info->st_dev : 0, Latency::Now() - start);
+            return result;
+        });
+    }
+
+    int Mkdir(const char* path, mode_t mode, dev_t& device)
+    {
+        return Retry([&]{
+            auto start = Latency::Enabled ? Latency::Now() : 0;
+
+            int fault = Inject(Latency::MKDIR, nullptr);
+            int result = fault != 0 ? -1 : mkdir(path, mode);
+            if(fault != 0) errno = fault;
+
+            // We can only tell which device the directory is on once it exists
+            if(Latency::Enabled)
+            {
+                auto elapsed = Latency::Now() - start;
+                auto mkdirErrno = errno;
+
+                struct stat created;
+                device = stat(path, &created) == 0 ? created.st_dev : 0;
+                Latency::Record(Latency::MKDIR, device, elapsed);
+
+                errno = mkdirErrno;
+            }
+
+            return result;
+        });
+    }
+
+    ssize_t Readlink(const char* path, char* buf, size_t size, dev_t dev)
+    {
+        return Readlinkat(AT_FDCWD, path, buf, size, dev);
+    }
+
+    ssize_t Readlinkat(int dir, const char* name, char* buf, size_t size, dev_t dev)
+    {
+        return Retry([&]{ return Call(Latency::READLINK, dev, nullptr, [&]{ return readlinkat(dir, name, buf, size); }); });
+    }
+
+    int Symlink(const char* target, const char* path, dev_t dev)
+    {
+        return Symlinkat(target, AT_FDCWD, path, dev);
+    }
+
+    int Symlinkat(const char* target, int dir, const char* name, dev_t dev)
+    {
+        return Retry([&]{ return Call(Latency::SYMLINK, dev, nullptr, [&]{ return symlinkat(target, dir, name); }); });
+    }
+
+    DIR* Opendir(const char* path, dev_t dev)
+    {
+        return Latency::Measure(Latency::OPENDIR, dev, [&]{ return opendir(path); });
+    }
+
+    struct dirent* Readdir(DIR* dir, dev_t dev)
+    {
+        return Latency::Measure(Latency::READDIR, dev, [&]{ return readdir(dir); });
+    }
+
+    bool FaultInjectionEnabled()
+    {
+#ifdef PARCP_FAULT_INJECTION
+        return true;
+#else
+        return false;
+#endif
+    }
+}
@@ -0,0 +1,111 @@
+/*
+ * Copyright (c) 2016 Nathan Lowe
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of this software
+ * and associated documentation files (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all copies or substantial
+ * portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT
+ * LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN
+ * NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef EECS3540_SYS_H
+#define EECS3540_SYS_H
+
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <cstddef>
+
+/**
+ * The syscalls made by the copy engine. Every call is timed by the latency instrumentation, interrupted calls are
+ * retried and writes are always completed in full. When built with PARCP_FAULT_INJECTION, faults described by the
+ * PARCP_FAULTS environment variable are injected in front of the real calls (see sys.cpp for the syntax).
+ *
+ * Each call takes the device it is performed against, which is only used to attribute latencies.
+ */
+namespace Sys
+{
+    /** open(2), retried on EINTR */
+    int Open(const char* path, int flags, mode_t mode, dev_t dev);
+
+    /** openat(2), retried on EINTR */
+    int Openat(int dir, const char* name, int flags, mode_t mode, dev_t dev);
+
+    /** close(2). Not retried, the descriptor is gone either way */
+    int Close(int fd, dev_t dev);
+
+    /** read(2), retried on EINTR. May still return less than requested */
+    ssize_t Read(int fd, void* buf, size_t count, dev_t dev);
+
+    /**
+     * Write the whole buffer, retrying on EINTR and continuing after short writes
+     *
+     * @return the number of bytes written, which is less than count only if an error occurred (errno is set)
+     */
+    size_t WriteAll(int fd, const void* buf, size_t count, dev_t dev);
+
+    /** pread(2), retried on EINTR. May still return less than requested */
+    ssize_t Pread(int fd, void* buf, size_t count, off_t offset, dev_t dev);
+
+    /**
+     * Write the whole buffer at the specified offset, retrying on EINTR and continuing after short writes
+     *
+     * @return the number of bytes written, which is less than count only if an error occurred (errno is set)
+     */
+    size_t PwriteAll(int fd, const void* buf, size_t count, off_t offset, dev_t dev);
+
+    /**
+     * Copy from one file to another in the kernel with copy_file_range(2), from and to their current offsets. Counted
+     * (and throttled) as a write, retrying on EINTR and continuing after short copies
+     *
+     * @return the number of bytes copied, which is less than count only if an error occurred (errno is set)
+     */
+    size_t CopyRangeAll(int in, int out, size_t count, dev_t dev);
+
+    /** lstat(2), retried on EINTR */
+    int Lstat(const char* path, struct stat* info, dev_t dev);
+
+    /** fstatat(2) with AT_SYMLINK_NOFOLLOW, retried on EINTR */
+    int Lstatat(int dir, const char* name, struct stat* info, dev_t dev);
+
+    /** stat(2), retried on EINTR. The latency is attributed to the device the path turned out to be on */
+    int Stat(const char* path, struct stat* info);
+
+    /**
+     * mkdir(2), retried on EINTR. Since the device is not known until the directory exists, if latency
+     * instrumentation is enabled, device is set to the device the directory ended up on
+     */
+    int Mkdir(const char* path, mode_t mode, dev_t& device);
+
+    /** readlink(2), retried on EINTR */
+    ssize_t Readlink(const char* path, char* buf, size_t size, dev_t dev);
+
+    /** readlinkat(2), retried on EINTR */
+    ssize_t Readlinkat(int dir, const char* name, char* buf, size_t size, dev_t dev);
+
+    /** symlink(2), retried on EINTR */
+    int Symlink(const char* target, const char* path, dev_t dev);
+
+    /** symlinkat(2), retried on EINTR */
+    int Symlinkat(const char* target, int dir, const char* name, dev_t dev);
+
+    /** opendir(3) */
+    DIR* Opendir(const char* path, dev_t dev);
+
+    /** readdir(3) */
+    struct dirent* Readdir(DIR* dir, dev_t dev);
+
+    /** Whether or not this build injects the faults described by PARCP_FAULTS */
+    bool FaultInjectionEnabled();
+}
+
+#endif //EECS3540_SYS_H
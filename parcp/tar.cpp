@@ -0,0 +1,1500 @@
+/*
+ * Copyright (c) 2016 Nathan Lowe
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of this software
+ * and associated documentation files (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all copies or substantial
+ * portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT
+ * LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN
+ * NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include <fcntl.h>
+#include <grp.h>
+#include <pwd.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <algorithm>
+#include <climits>
+#include <atomic>
+#include <condition_variable>
+#include <cstring>
+#include <deque>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+#include "tar.h"
+#include "filter.h"
+#include "Logger.h"
+#include "stats.h"
+#include "sys.h"
+#include "util.h"
+
+/** The size of a tar block. Headers take one block and member data is padded out to a whole number of blocks */
+#define TAR_BLOCK_SIZE 512
+/** The most file data read or written as a single unit of work */
+#define TAR_CHUNK_SIZE (1024 * 1024)
+/** How many chunks readers may get ahead of the archive writer, which bounds the memory held by the reorder buffer */
+#define TAR_REORDER_WINDOW 64
+/** How many chunks the scanner may queue up ahead of the readers */
+#define TAR_MAX_QUEUED_CHUNKS 4096
+/** The most file data read from an archive that may be waiting to be written out */
+#define TAR_MAX_PENDING_WRITES (64 * 1024 * 1024)
+/** The most threads used to read or write file data */
+#define TAR_MAX_THREADS 16
+
+namespace Tar
+{
+    L3::Logger Log("Tar");
+
+    /** The number of threads to read or write file data with */
+    static unsigned ThreadCount()
+    {
+        return std::min(std::max(2u, std::thread::hardware_concurrency()), (unsigned) TAR_MAX_THREADS);
+    }
+
+    /** Whether or not the specified block is all zeros, which marks the end of an archive */
+    static bool IsZeroBlock(const char* block)
+    {
+        for(size_t i = 0; i < TAR_BLOCK_SIZE; i++) if(block[i] != 0) return false;
+        return true;
+    }
+
+    /** The number of bytes needed to pad the specified size out to a whole number of blocks */
+    static size_t Padding(uint64_t size)
+    {
+        return (size_t) ((TAR_BLOCK_SIZE - size % TAR_BLOCK_SIZE) % TAR_BLOCK_SIZE);
+    }
+
+    /** The checksum of a header block, which is computed as if the checksum field were all spaces */
+    static unsigned Checksum(const char* block)
+    {
+        unsigned sum = 0;
+        for(size_t i = 0; i < TAR_BLOCK_SIZE; i++)
+        {
+            sum += (i >= 148 && i < 156) ? (unsigned) ' ' : (unsigned) (unsigned char) block[i];
+        }
+
+        return sum;
+    }
+
+    /**
+     * Write a number to a header field as zero padded octal followed by a NUL
+     *
+     * @param field the field to write to
+     * @param width the width of the field, including the NUL
+     * @param value the value to write
+     * @return false if the value doesn't fit, in which case the field is left zeroed
+     */
+    static bool WriteOctal(char* field, size_t width, uint64_t value)
+    {
+        if(value >> (3 * (width - 1)) != 0) return false;
+
+        snprintf(field, width, "%0*llo", (int) (width - 1), (unsigned long long) value);
+        return true;
+    }
+
+    /**
+     * Read a number from a header field, either in octal or in the base-256 encoding GNU tar uses for values that
+     * don't fit
+     *
+     * @param field the field to read
+     * @param width the width of the field
+     * @return the value of the field
+     */
+    static uint64_t ReadNumber(const char* field, size_t width)
+    {
+        uint64_t value = 0;
+        if(((unsigned char) field[0] & 0x80) != 0)
+        {
+            value = (unsigned char) field[0] & 0x7f;
+            for(size_t i = 1; i < width; i++) value = (value << 8) | (unsigned char) field[i];
+            return value;
+        }
+
+        size_t i = 0;
+        while(i < width && field[i] == ' ') i++;
+        for(; i < width && field[i] >= '0' && field[i] <= '7'; i++) value = (value << 3) | (uint64_t) (field[i] - '0');
+
+        return value;
+    }
+
+    /** Read a string from a header field, which is only NUL terminated if it is shorter than the field */
+    static std::string ReadString(const char* field, size_t width)
+    {
+        return std::string(field, strnlen(field, width));
+    }
+
+    /**
+     * Append a pax extended header record. Each record starts with its own length in decimal, which counts the
+     * digits of the length itself.
+     */
+    static void AppendRecord(std::string& records, const std::string& key, const std::string& value)
+    {
+        auto body = " " + key + "=" + value + "\n";
+
+        size_t length = body.size() + 1;
+        while(std::to_string(length).size() + body.size() != length) length = std::to_string(length).size() + body.size();
+
+        records += std::to_string(length) + body;
+    }
+
+    /** The fields of a header, after any pax extended header has been applied */
+    struct Header
+    {
+        std::string Path;
+        std::string LinkPath;
+        char Type = '0';
+        mode_t Mode = 0;
+        uid_t Uid = 0;
+        gid_t Gid = 0;
+        uint64_t Size = 0;
+        struct timespec ModifiedTime = {0, 0};
+    };
+
+    /** Gets the name of a user, or an empty string if it has none. Only called from the archive writer */
+    static const std::string& UserName(uid_t uid)
+    {
+        static std::unordered_map<uid_t, std::string> names;
+
+        auto existing = names.find(uid);
+        if(existing != names.end()) return existing->second;
+
+        auto user = getpwuid(uid);
+        return names[uid] = user == nullptr ? "" : user->pw_name;
+    }
+
+    /** Gets the name of a group, or an empty string if it has none. Only called from the archive writer */
+    static const std::string& GroupName(gid_t gid)
+    {
+        static std::unordered_map<gid_t, std::string> names;
+
+        auto existing = names.find(gid);
+        if(existing != names.end()) return existing->second;
+
+        auto group = getgrgid(gid);
+        return names[gid] = group == nullptr ? "" : group->gr_name;
+    }
+
+    /**
+     * Fill in a ustar header block
+     *
+     * @param block the block to fill in
+     * @param name the name field
+     * @param prefix the prefix field, which is joined to the name with a '/' when read back
+     * @param header the rest of the fields. Anything that doesn't fit is left zeroed and has to be in a pax header
+     */
+    static void FillBlock(char* block, const std::string& name, const std::string& prefix, const Header& header)
+    {
+        memset(block, 0, TAR_BLOCK_SIZE);
+
+        memcpy(block, name.data(), std::min(name.size(), (size_t) 100));
+        WriteOctal(block + 100, 8, header.Mode & 07777);
+        WriteOctal(block + 108, 8, header.Uid);
+        WriteOctal(block + 116, 8, header.Gid);
+        WriteOctal(block + 124, 12, header.Size);
+        WriteOctal(block + 136, 12, header.ModifiedTime.tv_sec < 0 ? 0 : (uint64_t) header.ModifiedTime.tv_sec);
+        block[156] = header.Type;
+        memcpy(block + 157, header.LinkPath.data(), std::min(header.LinkPath.size(), (size_t) 100));
+        memcpy(block + 257, "ustar", 6);
+        memcpy(block + 263, "00", 2);
+
+        // Names are a courtesy for extracting on another host, numeric ids are always present
+        auto& user = UserName(header.Uid);
+        memcpy(block + 265, user.data(), std::min(user.size(), (size_t) 31));
+        auto& group = GroupName(header.Gid);
+        memcpy(block + 297, group.data(), std::min(group.size(), (size_t) 31));
+
+        memcpy(block + 345, prefix.data(), std::min(prefix.size(), (size_t) 155));
+
+        snprintf(block + 148, 8, "%06o", Checksum(block));
+        block[155] = ' ';
+    }
+
+    /**
+     * Encode the header for an archive member. Anything that doesn't fit in a ustar header (long names, large sizes
+     * or ids) is written to a pax extended header in front of it.
+     *
+     * @param header the member to encode
+     * @return the header blocks for the member
+     */
+    static std::string Encode(const Header& header)
+    {
+        std::string records;
+
+        // Long names can be split between the name and prefix fields at a '/', as long as each part fits
+        auto name = header.Path;
+        std::string prefix;
+        if(name.size() > 100)
+        {
+            // The last '/' that leaves a short enough prefix gives the shortest name, if that's too long nothing fits
+            auto split = name.size() > 256 ? std::string::npos : name.rfind('/', std::min((size_t) 155, name.size() - 2));
+
+            if(split != std::string::npos && split > 0 && name.size() - split - 1 <= 100)
+            {
+                prefix = name.substr(0, split);
+                name = name.substr(split + 1);
+            }
+            else
+            {
+                AppendRecord(records, "path", header.Path);
+            }
+        }
+
+        if(header.LinkPath.size() > 100) AppendRecord(records, "linkpath", header.LinkPath);
+        if(header.Size >> 33 != 0) AppendRecord(records, "size", std::to_string(header.Size));
+        if(header.Uid >> 21 != 0) AppendRecord(records, "uid", std::to_string(header.Uid));
+        if(header.Gid >> 21 != 0) AppendRecord(records, "gid", std::to_string(header.Gid));
+
+        std::string encoded;
+        if(!records.empty())
+        {
+            auto base = header.Path.substr(header.Path.rfind('/', header.Path.size() - 2) + 1);
+
+            Header extended;
+            extended.Type = 'x';
+            extended.Mode = 0644;
+            extended.Size = records.size();
+            extended.ModifiedTime = header.ModifiedTime;
+
+            char block[TAR_BLOCK_SIZE];
+            FillBlock(block, ("PaxHeaders/" + base).substr(0, 100), "", extended);
+
+            encoded.append(block, TAR_BLOCK_SIZE);
+            encoded += records;
+            encoded.append(Padding(records.size()), '\0');
+        }
+
+        char block[TAR_BLOCK_SIZE];
+        FillBlock(block, name, prefix, header);
+        encoded.append(block, TAR_BLOCK_SIZE);
+
+        return encoded;
+    }
+
+    /** A member of an archive being written */
+    struct Member
+    {
+        Header Fields;
+        /** The full path of the member on disk */
+        std::string Source;
+        /** The device the member lives on */
+        dev_t Device = 0;
+
+        /** Regular files are opened by the first reader to get to them and closed along with the last chunk */
+        std::mutex Lock;
+        int Fd = -1;
+        bool OpenFailed = false;
+
+        ~Member()
+        {
+            if(Fd >= 0) Sys::Close(Fd, Device);
+        }
+    };
+
+    /** A piece of a member, in archive order. Members without data are a single empty chunk */
+    struct Chunk
+    {
+        uint64_t Sequence = 0;
+        std::shared_ptr<Member> Owner;
+        uint64_t Offset = 0;
+        size_t Length = 0;
+        bool First = false;
+        bool Last = false;
+        std::vector<char> Data;
+    };
+
+    /**
+     * Writes an archive of a tree. A scanner walks the tree and queues up each member in archive order, readers
+     * take chunks off the queue and read them in parallel, and the writer (the calling thread) writes chunks out in
+     * order as they become ready. Readers may only get TAR_REORDER_WINDOW chunks ahead of the writer, so a slow read
+     * holds up at most that much data.
+     */
+    class ArchiveWriter
+    {
+    public:
+        ArchiveWriter(const std::string& source, int output, dev_t outputDevice) :
+                source(source), output(output), outputDevice(outputDevice) {}
+
+        /**
+         * Write the archive
+         *
+         * @return true iff every member was archived
+         */
+        bool Run()
+        {
+            std::thread scanner([this]{
+                struct stat rootStat;
+                if(Sys::Stat(source.c_str(), &rootStat) != 0)
+                {
+                    Log.Fatal("[" + std::to_string(getpid()) + "] Unable to stat " + source + " (errno " + std::to_string(errno) + ")");
+                    Stats::Shared->Errors.Add(1);
+                    error = true;
+                }
+                else
+                {
+                    Scan(source, "", rootStat.st_dev, Filter::Rules.Root());
+                }
+
+                std::lock_guard<std::mutex> guard(lock);
+                scanned = true;
+                readable.notify_all();
+                writable.notify_all();
+            });
+
+            std::vector<std::thread> readers;
+            for(unsigned i = 0; i < ThreadCount(); i++) readers.emplace_back([this]{ ReadChunks(); });
+
+            WriteChunks();
+
+            scanner.join();
+            for(auto& reader : readers) reader.join();
+
+            return !error;
+        }
+
+    private:
+        std::string source;
+        int output;
+        dev_t outputDevice;
+
+        std::mutex lock;
+        /** Signalled when chunks are queued, when the window moves, and when the scanner is done */
+        std::condition_variable readable;
+        /** Signalled when a chunk is ready to be written, and when the scanner is done */
+        std::condition_variable writable;
+        /** Signalled when there is room to queue more chunks */
+        std::condition_variable queueable;
+
+        std::deque<Chunk> queued;
+        std::map<uint64_t, Chunk> ready;
+        uint64_t nextSequence = 0;
+        uint64_t nextToWrite = 0;
+        bool scanned = false;
+        /** Set if the archive can't be written, which stops everything else */
+        bool failed = false;
+
+        std::atomic<bool> error{false};
+
+        /** The first path seen for each inode with multiple links, only used by the scanner */
+        std::map<std::pair<dev_t, ino_t>, std::string> links;
+
+        std::vector<char> pending;
+
+        /**
+         * Queue a chunk for the readers, waiting for room if the scanner is too far ahead
+         *
+         * @return false if the archive can't be written and scanning should stop
+         */
+        bool Queue(Chunk&& chunk)
+        {
+            std::unique_lock<std::mutex> guard(lock);
+            queueable.wait(guard, [this]{ return failed || queued.size() < TAR_MAX_QUEUED_CHUNKS; });
+            if(failed) return false;
+
+            chunk.Sequence = nextSequence++;
+            queued.push_back(std::move(chunk));
+            readable.notify_one();
+
+            return true;
+        }
+
+        /**
+         * Queue a member, split into chunks
+         *
+         * @return false if the archive can't be written and scanning should stop
+         */
+        bool Queue(const std::shared_ptr<Member>& member)
+        {
+            uint64_t offset = 0;
+            do
+            {
+                Chunk chunk;
+                chunk.Owner = member;
+                chunk.Offset = offset;
+                chunk.Length = (size_t) std::min((uint64_t) TAR_CHUNK_SIZE, member->Fields.Size - offset);
+                chunk.First = offset == 0;
+                offset += chunk.Length;
+                chunk.Last = offset == member->Fields.Size;
+
+                if(!Queue(std::move(chunk))) return false;
+            } while(offset < member->Fields.Size);
+
+            return true;
+        }
+
+        /**
+         * Queue the members in a directory, and everything under it, in sorted order so archives of the same tree
+         * come out the same
+         *
+         * @param dir the directory to scan, with a trailing '/'
+         * @param relative the path of the directory in the archive, with a trailing '/' unless it is the root
+         * @param dev the device the directory lives on
+         * @param filterState where the directory is in the include/exclude rules
+         * @return false if the archive can't be written and scanning should stop
+         */
+        bool Scan(const std::string& dir, const std::string& relative, dev_t dev, const Filter::State& filterState)
+        {
+            auto myPid = getpid();
+
+            DIR* handle = Sys::Opendir(dir.c_str(), dev);
+            if(handle == nullptr)
+            {
+                Log.Fatal("[" + std::to_string(myPid) + "] Unable to open directory " + dir + " (errno " + std::to_string(errno) + ")");
+                Stats::Shared->Errors.Add(1);
+                error = true;
+                return true;
+            }
+
+            Stats::Shared->DirectoriesScanned.Add(1);
+
+            std::vector<std::string> names;
+            struct dirent* details;
+            while((details = Sys::Readdir(handle, dev)) != nullptr)
+            {
+                if(strcmp(details->d_name, ".") == 0 || strcmp(details->d_name, "..") == 0) continue;
+                names.push_back(details->d_name);
+            }
+
+            closedir(handle);
+            std::sort(names.begin(), names.end());
+
+            bool filtering = !Filter::Rules.Empty();
+            for(auto& name : names)
+            {
+                auto member = std::make_shared<Member>();
+                member->Source = dir + name;
+
+                struct stat info;
+                if(Sys::Lstat(member->Source.c_str(), &info, dev) != 0)
+                {
+                    Log.Error("[" + std::to_string(myPid) + "] Unable to stat " + member->Source + " (errno " + std::to_string(errno) + ")");
+                    Stats::Shared->Errors.Add(1);
+                    error = true;
+                    continue;
+                }
+
+                Filter::State childState;
+                if(filtering && !Filter::Rules.Included(filterState, name.c_str(), S_ISDIR(info.st_mode), &childState))
+                {
+                    Log.Debug("[" + std::to_string(myPid) + "] Excluding " + member->Source);
+                    Stats::Shared->Excluded.Add(1);
+                    continue;
+                }
+
+                member->Device = info.st_dev;
+                member->Fields.Path = relative + name;
+                member->Fields.Mode = info.st_mode;
+                member->Fields.Uid = info.st_uid;
+                member->Fields.Gid = info.st_gid;
+                member->Fields.ModifiedTime = info.st_mtim;
+
+                if(S_ISDIR(info.st_mode))
+                {
+                    member->Fields.Type = '5';
+                    member->Fields.Path += '/';
+
+                    if(!Queue(member)) return false;
+                    if(!Scan(member->Source + '/', member->Fields.Path, info.st_dev, childState)) return false;
+                    continue;
+                }
+
+                Stats::Shared->FilesScanned.Add(1);
+
+                if(S_ISLNK(info.st_mode))
+                {
+                    char target[PATH_MAX];
+                    auto length = Sys::Readlink(member->Source.c_str(), target, sizeof(target), info.st_dev);
+                    if(length < 0)
+                    {
+                        Log.Error("[" + std::to_string(myPid) + "] Unable to read symlink " + member->Source + " (errno " + std::to_string(errno) + ")");
+                        Stats::Shared->Errors.Add(1);
+                        error = true;
+                        continue;
+                    }
+
+                    member->Fields.Type = '2';
+                    member->Fields.LinkPath = std::string(target, (size_t) length);
+                }
+                else if(S_ISREG(info.st_mode))
+                {
+                    // Only the first link to a file carries its data, the rest refer back to it
+                    auto existing = info.st_nlink > 1 ? links.find(std::make_pair(info.st_dev, info.st_ino)) : links.end();
+                    if(existing != links.end())
+                    {
+                        member->Fields.Type = '1';
+                        member->Fields.LinkPath = existing->second;
+                    }
+                    else
+                    {
+                        if(info.st_nlink > 1) links.emplace(std::make_pair(info.st_dev, info.st_ino), member->Fields.Path);
+
+                        member->Fields.Type = '0';
+                        member->Fields.Size = (uint64_t) info.st_size;
+                    }
+                }
+                else
+                {
+                    Log.Warn("[" + std::to_string(myPid) + "] Skipping '" + member->Source + "' (not a regular file, directory or symlink)");
+                    continue;
+                }
+
+                if(!Queue(member)) return false;
+            }
+
+            return true;
+        }
+
+        /** Read the data for a chunk. If the file can't be read or has shrunk, the rest of the chunk is zeros */
+        void Read(Chunk& chunk)
+        {
+            chunk.Data.resize(chunk.Length);
+            if(chunk.Length == 0) return;
+
+            auto& member = *chunk.Owner;
+            auto myPid = getpid();
+
+            int fd;
+            {
+                std::lock_guard<std::mutex> guard(member.Lock);
+                if(member.Fd < 0 && !member.OpenFailed)
+                {
+                    member.Fd = Sys::Open(member.Source.c_str(), O_RDONLY, 0, member.Device);
+                    if(member.Fd < 0)
+                    {
+                        member.OpenFailed = true;
+                        Log.Error("[" + std::to_string(myPid) + "] Could not open file for read " + member.Source + " (errno " + std::to_string(errno) + ")");
+                        Stats::Shared->Errors.Add(1);
+                        error = true;
+                    }
+#ifndef NO_POSIX_ADVISE
+                    else
+                    {
+                        posix_fadvise(member.Fd, 0, 0, POSIX_FADV_NOREUSE);
+                    }
+#endif
+                }
+
+                fd = member.Fd;
+            }
+
+            if(fd < 0) return;
+
+            size_t done = 0;
+            while(done < chunk.Length)
+            {
+                auto bytesRead = Sys::Pread(fd, chunk.Data.data() + done, chunk.Length - done, (off_t) (chunk.Offset + done), member.Device);
+                if(bytesRead <= 0)
+                {
+                    // The header has already promised this much data, so the best we can do is pad it out
+                    if(bytesRead < 0) Log.Error("[" + std::to_string(myPid) + "] Failure reading " + member.Source + " (errno " + std::to_string(errno) + ")");
+                    else Log.Error("[" + std::to_string(myPid) + "] " + member.Source + " shrank while it was being archived, padding it with zeros");
+
+                    Stats::Shared->Errors.Add(1);
+                    error = true;
+                    break;
+                }
+
+                done += (size_t) bytesRead;
+            }
+        }
+
+        /** Read chunks in queue order, staying within the reorder window, until there are none left */
+        void ReadChunks()
+        {
+            while(true)
+            {
+                Chunk chunk;
+                {
+                    std::unique_lock<std::mutex> guard(lock);
+                    readable.wait(guard, [this]{
+                        if(failed) return true;
+                        if(queued.empty()) return scanned;
+                        return queued.front().Sequence < nextToWrite + TAR_REORDER_WINDOW;
+                    });
+
+                    if(failed || queued.empty()) return;
+
+                    chunk = std::move(queued.front());
+                    queued.pop_front();
+                    queueable.notify_one();
+                }
+
+                Read(chunk);
+
+                std::lock_guard<std::mutex> guard(lock);
+                auto sequence = chunk.Sequence;
+                ready.emplace(sequence, std::move(chunk));
+                if(sequence == nextToWrite) writable.notify_one();
+            }
+        }
+
+        /**
+         * Add data to the archive, writing it out once enough has built up
+         *
+         * @return false if the archive couldn't be written
+         */
+        bool Append(const char* data, size_t length, bool flush = false)
+        {
+            pending.insert(pending.end(), data, data + length);
+            if(pending.size() < TAR_CHUNK_SIZE && !flush) return true;
+
+            auto written = Sys::WriteAll(output, pending.data(), pending.size(), outputDevice);
+            if(written != pending.size())
+            {
+                Log.Fatal("[" + std::to_string(getpid()) + "] Unable to write the archive (errno " + std::to_string(errno) + ")");
+                return false;
+            }
+
+            pending.clear();
+            return true;
+        }
+
+        /** Write chunks out in order as they become ready, followed by the end of archive marker */
+        void WriteChunks()
+        {
+            bool ok = true;
+            while(ok)
+            {
+                Chunk chunk;
+                {
+                    std::unique_lock<std::mutex> guard(lock);
+                    writable.wait(guard, [this]{ return ready.count(nextToWrite) != 0 || (scanned && nextToWrite == nextSequence); });
+
+                    auto next = ready.find(nextToWrite);
+                    if(next == ready.end()) break;
+
+                    chunk = std::move(next->second);
+                    ready.erase(next);
+                    nextToWrite++;
+                    readable.notify_all();
+                }
+
+                auto& member = *chunk.Owner;
+                if(chunk.First)
+                {
+                    Log.Info("[" + std::to_string(getpid()) + "] '" + member.Source + "' --> '" + member.Fields.Path + "'");
+
+                    auto header = Encode(member.Fields);
+                    ok = Append(header.data(), header.size());
+                }
+
+                ok = ok && Append(chunk.Data.data(), chunk.Data.size());
+                Stats::Shared->BytesCopied.Add(chunk.Data.size());
+
+                if(ok && chunk.Last)
+                {
+                    char padding[TAR_BLOCK_SIZE] = {0};
+                    ok = Append(padding, Padding(member.Fields.Size));
+                    if(member.Fields.Type != '5') Stats::Shared->FilesCopied.Add(1);
+                }
+            }
+
+            // The archive ends with two zero blocks
+            char end[2 * TAR_BLOCK_SIZE] = {0};
+            ok = ok && Append(end, sizeof(end), true);
+
+            if(!ok)
+            {
+                Stats::Shared->Errors.Add(1);
+                error = true;
+
+                std::lock_guard<std::mutex> guard(lock);
+                failed = true;
+                queued.clear();
+                readable.notify_all();
+                queueable.notify_all();
+            }
+        }
+    };
+
+    int Create(const std::string& source, const std::string& output)
+    {
+        int fd = STDOUT_FILENO;
+        if(output != "-")
+        {
+            fd = Sys::Open(output.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644, 0);
+            if(fd < 0)
+            {
+                Log.Fatal("[" + std::to_string(getpid()) + "] Unable to open " + output + " for write (errno " + std::to_string(errno) + ")");
+                Stats::Shared->Errors.Add(1);
+                return -1;
+            }
+        }
+
+        struct stat outputStat;
+        dev_t outputDevice = fstat(fd, &outputStat) == 0 ? outputStat.st_dev : 0;
+
+        Stats::Shared->ActiveWorkers.Add(1);
+        ArchiveWriter writer(source, fd, outputDevice);
+        bool ok = writer.Run();
+        Stats::Shared->ActiveWorkers.Sub(1);
+
+        if(output != "-" && Sys::Close(fd, outputDevice) != 0 && ok)
+        {
+            Log.Fatal("[" + std::to_string(getpid()) + "] Failure closing " + output + " (errno " + std::to_string(errno) + ")");
+            Stats::Shared->Errors.Add(1);
+            ok = false;
+        }
+
+        return ok ? 0 : -1;
+    }
+
+    /** A file being extracted. It is closed, and its modification time set, once the last write to it is done */
+    struct OutputFile
+    {
+        OutputFile(int fd, const std::string& path, const struct timespec& modifiedTime, dev_t device, std::atomic<bool>& error) :
+                Fd(fd), Path(path), ModifiedTime(modifiedTime), Device(device), Error(error) {}
+
+        int Fd;
+        std::string Path;
+        struct timespec ModifiedTime;
+        dev_t Device;
+        std::atomic<bool>& Error;
+        std::atomic<bool> Failed{false};
+
+        ~OutputFile()
+        {
+            struct timespec times[2] = {ModifiedTime, ModifiedTime};
+            if(!Failed) futimens(Fd, times);
+
+            if(Sys::Close(Fd, Device) != 0 && !Failed)
+            {
+                Log.Error("[" + std::to_string(getpid()) + "] Failure closing " + Path + " (errno " + std::to_string(errno) + ")");
+                Failed = true;
+            }
+
+            if(Failed)
+            {
+                // Don't leave a truncated file behind that looks like a complete one
+                unlink(Path.c_str());
+                Stats::Shared->Errors.Add(1);
+                Error = true;
+            }
+            else
+            {
+                Stats::Shared->FilesCopied.Add(1);
+            }
+        }
+    };
+
+    /** A chunk of file data read from an archive, waiting to be written */
+    struct WriteJob
+    {
+        std::shared_ptr<OutputFile> File;
+        uint64_t Offset;
+        std::vector<char> Data;
+    };
+
+    /**
+     * A pool of threads that write file data to its destination. Chunks of the same file can be written by different
+     * threads at once since each one goes to its own offset. The amount of data waiting to be written is bounded, so
+     * the archive is only read as fast as it can be written.
+     */
+    class WritePool
+    {
+    public:
+        WritePool()
+        {
+            for(unsigned i = 0; i < ThreadCount(); i++) threads.emplace_back([this]{ Work(); });
+        }
+
+        /** Queue a chunk to be written, waiting until there is room for it */
+        void Submit(WriteJob&& job)
+        {
+            std::unique_lock<std::mutex> guard(lock);
+            room.wait(guard, [&]{ return pendingBytes == 0 || pendingBytes + job.Data.size() <= TAR_MAX_PENDING_WRITES; });
+
+            pendingBytes += job.Data.size();
+            jobs.push_back(std::move(job));
+            work.notify_one();
+        }
+
+        /** Wait for everything queued to be written */
+        void Finish()
+        {
+            {
+                std::lock_guard<std::mutex> guard(lock);
+                closing = true;
+                work.notify_all();
+            }
+
+            for(auto& thread : threads) thread.join();
+            threads.clear();
+        }
+
+    private:
+        std::vector<std::thread> threads;
+        std::mutex lock;
+        std::condition_variable work;
+        std::condition_variable room;
+        std::deque<WriteJob> jobs;
+        size_t pendingBytes = 0;
+        bool closing = false;
+
+        void Work()
+        {
+            while(true)
+            {
+                WriteJob job;
+                {
+                    std::unique_lock<std::mutex> guard(lock);
+                    work.wait(guard, [this]{ return closing || !jobs.empty(); });
+                    if(jobs.empty()) return;
+
+                    job = std::move(jobs.front());
+                    jobs.pop_front();
+                }
+
+                auto& file = *job.File;
+                if(!file.Failed)
+                {
+                    auto written = Sys::PwriteAll(file.Fd, job.Data.data(), job.Data.size(), (off_t) job.Offset, file.Device);
+                    Stats::Shared->BytesCopied.Add(written);
+
+                    if(written != job.Data.size())
+                    {
+                        Log.Error("[" + std::to_string(getpid()) + "] Failure writing " + file.Path + " (errno " + std::to_string(errno) + ")");
+                        file.Failed = true;
+                    }
+                }
+
+                // Let go of the file before making room, so it gets closed by this thread rather than held up
+                auto size = job.Data.size();
+                job = WriteJob();
+
+                std::lock_guard<std::mutex> guard(lock);
+                pendingBytes -= size;
+                room.notify_one();
+            }
+        }
+    };
+
+    /** Buffered, sequential reads of an archive */
+    class ArchiveReader
+    {
+    public:
+        ArchiveReader(int fd, dev_t device) : fd(fd), device(device), buffer(TAR_CHUNK_SIZE) {}
+
+        /**
+         * Read exactly the specified number of bytes
+         *
+         * @param dest where to put the data, or nullptr to skip over it
+         * @param count the number of bytes to read
+         * @return false if the archive ended early or couldn't be read
+         */
+        bool Read(char* dest, uint64_t count)
+        {
+            while(count > 0)
+            {
+                if(position == length)
+                {
+                    auto bytesRead = Sys::Read(fd, buffer.data(), buffer.size(), device);
+                    if(bytesRead <= 0)
+                    {
+                        if(bytesRead < 0) Log.Fatal("[" + std::to_string(getpid()) + "] Failure reading the archive (errno " + std::to_string(errno) + ")");
+                        else Log.Fatal("[" + std::to_string(getpid()) + "] The archive ended unexpectedly");
+
+                        Stats::Shared->Errors.Add(1);
+                        return false;
+                    }
+
+                    position = 0;
+                    length = (size_t) bytesRead;
+                }
+
+                auto available = (size_t) std::min((uint64_t) (length - position), count);
+                if(dest != nullptr)
+                {
+                    memcpy(dest, buffer.data() + position, available);
+                    dest += available;
+                }
+
+                position += available;
+                count -= available;
+            }
+
+            return true;
+        }
+
+        /** Read the specified number of bytes into a string */
+        bool Read(std::string& dest, uint64_t count)
+        {
+            dest.resize((size_t) count);
+            return Read(&dest[0], count);
+        }
+
+    private:
+        int fd;
+        dev_t device;
+        std::vector<char> buffer;
+        size_t position = 0;
+        size_t length = 0;
+    };
+
+    /** The fields set by a pax extended header or a GNU long name, which override those in the next header */
+    struct Overrides
+    {
+        Header Fields;
+        bool HasPath = false;
+        bool HasLinkPath = false;
+        bool HasSize = false;
+        bool HasModifiedTime = false;
+
+        void ApplyTo(Header& header) const
+        {
+            if(HasPath) header.Path = Fields.Path;
+            if(HasLinkPath) header.LinkPath = Fields.LinkPath;
+            if(HasSize) header.Size = Fields.Size;
+            if(HasModifiedTime) header.ModifiedTime = Fields.ModifiedTime;
+        }
+    };
+
+    /**
+     * Read the records of a pax extended header. Records for fields that aren't extracted are ignored
+     *
+     * @param records the contents of the extended header
+     * @param overrides the fields set by the records
+     * @return false if the records are malformed
+     */
+    static bool ReadRecords(const std::string& records, Overrides& overrides)
+    {
+        auto& header = overrides.Fields;
+
+        size_t position = 0;
+        while(position < records.size())
+        {
+            auto space = records.find(' ', position);
+            if(space == std::string::npos) return false;
+
+            size_t length = 0;
+            try { length = std::stoul(records.substr(position, space - position)); }
+            catch(std::exception&) { return false; }
+
+            if(length <= space - position || position + length > records.size() || records[position + length - 1] != '\n') return false;
+
+            auto record = records.substr(space + 1, position + length - space - 2);
+            auto equals = record.find('=');
+            if(equals == std::string::npos) return false;
+
+            auto key = record.substr(0, equals);
+            auto value = record.substr(equals + 1);
+
+            if(key == "path")
+            {
+                header.Path = value;
+                overrides.HasPath = true;
+            }
+            else if(key == "linkpath")
+            {
+                header.LinkPath = value;
+                overrides.HasLinkPath = true;
+            }
+            else if(key == "size")
+            {
+                header.Size = std::strtoull(value.c_str(), nullptr, 10);
+                overrides.HasSize = true;
+            }
+            else if(key == "mtime")
+            {
+                auto dot = value.find('.');
+                header.ModifiedTime.tv_sec = (time_t) std::strtoll(value.c_str(), nullptr, 10);
+                header.ModifiedTime.tv_nsec = 0;
+                if(dot != std::string::npos)
+                {
+                    auto fraction = (value.substr(dot + 1) + "000000000").substr(0, 9);
+                    header.ModifiedTime.tv_nsec = std::strtol(fraction.c_str(), nullptr, 10);
+                }
+
+                overrides.HasModifiedTime = true;
+            }
+
+            position += length;
+        }
+
+        return true;
+    }
+
+    /** Extracts an archive into a directory */
+    class Extractor
+    {
+    public:
+        Extractor(const std::string& dest, int input, dev_t inputDevice, dev_t destDevice) :
+                dest(dest), reader(input, inputDevice), destDevice(destDevice)
+        {
+            rootFd = open(dest.c_str(), O_PATH | O_DIRECTORY | O_CLOEXEC);
+        }
+
+        ~Extractor()
+        {
+            if(lastFd >= 0 && lastFd != rootFd) close(lastFd);
+            if(rootFd >= 0) close(rootFd);
+        }
+
+        /**
+         * Extract the archive
+         *
+         * @return true iff every member was extracted
+         */
+        bool Run()
+        {
+            auto myPid = getpid();
+
+            if(rootFd < 0)
+            {
+                Log.Fatal("[" + std::to_string(myPid) + "] Unable to open directory " + dest + " (errno " + std::to_string(errno) + ")");
+                Stats::Shared->Errors.Add(1);
+                return false;
+            }
+
+            Overrides overrides;
+
+            char block[TAR_BLOCK_SIZE];
+            while(true)
+            {
+                if(!reader.Read(block, TAR_BLOCK_SIZE))
+                {
+                    error = true;
+                    break;
+                }
+
+                if(IsZeroBlock(block)) break;
+
+                if(ReadNumber(block + 148, 8) != Checksum(block))
+                {
+                    Log.Fatal("[" + std::to_string(myPid) + "] Bad header checksum, this isn't a tar archive or it is corrupt");
+                    Stats::Shared->Errors.Add(1);
+                    error = true;
+                    break;
+                }
+
+                Header header;
+                header.Type = block[156] == '\0' ? '0' : block[156];
+                header.Mode = (mode_t) ReadNumber(block + 100, 8);
+                header.Uid = (uid_t) ReadNumber(block + 108, 8);
+                header.Gid = (gid_t) ReadNumber(block + 116, 8);
+                header.Size = ReadNumber(block + 124, 12);
+                header.ModifiedTime.tv_sec = (time_t) ReadNumber(block + 136, 12);
+                header.Path = ReadString(block, 100);
+                header.LinkPath = ReadString(block + 157, 100);
+
+                auto prefix = ReadString(block + 345, 155);
+                if(memcmp(block + 257, "ustar", 5) == 0 && !prefix.empty() && block[156] != 'L' && block[156] != 'K')
+                {
+                    header.Path = prefix + "/" + header.Path;
+                }
+
+                // Extended headers, and GNU long names, apply to the member that follows them
+                if(header.Type == 'x' || header.Type == 'L' || header.Type == 'K')
+                {
+                    std::string data;
+                    if(!reader.Read(data, header.Size) || !reader.Read(nullptr, Padding(header.Size)))
+                    {
+                        error = true;
+                        break;
+                    }
+
+                    if(header.Type == 'x' && !ReadRecords(data, overrides))
+                    {
+                        Log.Error("[" + std::to_string(myPid) + "] Ignoring a malformed pax header");
+                        Stats::Shared->Errors.Add(1);
+                        error = true;
+                    }
+                    else if(header.Type == 'L')
+                    {
+                        overrides.Fields.Path = ReadString(data.data(), data.size());
+                        overrides.HasPath = true;
+                    }
+                    else if(header.Type == 'K')
+                    {
+                        overrides.Fields.LinkPath = ReadString(data.data(), data.size());
+                        overrides.HasLinkPath = true;
+                    }
+
+                    continue;
+                }
+
+                overrides.ApplyTo(header);
+                overrides = Overrides();
+
+                // Only regular files have data to extract, but anything else with a size (global headers, vendor
+                // extensions) still has to be skipped over. Links and directories never have data
+                bool hasData = header.Type == '0' || header.Type == '7';
+                auto dataSize = header.Type == '1' || header.Type == '2' || header.Type == '5' ? 0 : header.Size;
+
+                if(!Extract(header, hasData))
+                {
+                    if(!reader.Read(nullptr, dataSize))
+                    {
+                        error = true;
+                        break;
+                    }
+                }
+
+                if(!reader.Read(nullptr, Padding(dataSize)))
+                {
+                    error = true;
+                    break;
+                }
+            }
+
+            pool.Finish();
+
+            // Directory permissions and times go on last, since extracting into a directory changes its mtime and
+            // read only directories couldn't be extracted into. Deepest first, so parents are still writable.
+            for(auto it = directories.rbegin(); it != directories.rend(); ++it)
+            {
+                if(chmod(it->Path.c_str(), it->Mode & 07777) != 0 || utimensat(AT_FDCWD, it->Path.c_str(), it->Times, 0) != 0)
+                {
+                    Log.Warn("[" + std::to_string(myPid) + "] Unable to set the mode or times of " + it->Path + " (errno " + std::to_string(errno) + ")");
+                }
+            }
+
+            return !error;
+        }
+
+    private:
+        std::string dest;
+        ArchiveReader reader;
+        dev_t destDevice;
+        WritePool pool;
+        std::atomic<bool> error{false};
+
+        /** The destination, which every member is extracted relative to */
+        int rootFd = -1;
+
+        /** The directory the last member was extracted into, relative to the destination, and a descriptor for it */
+        std::string lastDirectory;
+        int lastFd = -1;
+
+        /** Directories excluded by the include/exclude rules, whose contents are excluded too */
+        std::unordered_set<std::string> excluded;
+
+        /** The directory the last filtered member was in, and its state */
+        std::string filterDirectory = "\x01";
+        Filter::State filterState;
+
+        struct Directory
+        {
+            std::string Path;
+            mode_t Mode;
+            struct timespec Times[2];
+        };
+
+        /** The directories extracted, whose mode and times are set once everything else is done */
+        std::vector<Directory> directories;
+
+        /**
+         * Open a directory relative to the destination, creating it and its parents as needed. Each component is
+         * opened without following symlinks, so a link extracted from the archive can't send later members outside of
+         * the destination
+         *
+         * @param relative the directory, relative to the destination, or an empty string for the destination itself
+         * @return a descriptor for the directory, which stays valid until the next call, or -1 on failure
+         */
+        int OpenDirectory(const std::string& relative)
+        {
+            if(relative.empty()) return rootFd;
+            if(lastFd >= 0 && relative == lastDirectory) return lastFd;
+
+            if(lastFd >= 0 && lastFd != rootFd) close(lastFd);
+            lastFd = -1;
+
+            int fd = rootFd;
+            size_t start = 0;
+            while(start < relative.size())
+            {
+                auto end = relative.find('/', start);
+                if(end == std::string::npos) end = relative.size();
+
+                auto component = relative.substr(start, end - start);
+                int next = -1;
+                if(mkdirat(fd, component.c_str(), S_IRWXU | S_IRWXG | S_IRWXO) == 0 || errno == EEXIST)
+                {
+                    next = openat(fd, component.c_str(), O_PATH | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+                }
+
+                if(next < 0)
+                {
+                    auto path = dest + relative.substr(0, end);
+                    if(errno == ENOTDIR || errno == ELOOP) Log.Error("[" + std::to_string(getpid()) + "] Refusing to extract into " + path + ", it isn't a directory");
+                    else Log.Error("[" + std::to_string(getpid()) + "] Unable to create directory " + path + " (errno " + std::to_string(errno) + ")");
+
+                    if(fd != rootFd) close(fd);
+                    return -1;
+                }
+
+                if(fd != rootFd) close(fd);
+                fd = next;
+                start = end + 1;
+            }
+
+            lastDirectory = relative;
+            lastFd = fd;
+            return fd;
+        }
+
+        /** Whether or not a member should be extracted according to the include/exclude rules */
+        bool Included(const std::string& path, bool isDirectory)
+        {
+            if(Filter::Rules.Empty()) return true;
+
+            auto slash = path.rfind('/');
+            auto parent = slash == std::string::npos ? "" : path.substr(0, slash);
+            auto name = slash == std::string::npos ? path : path.substr(slash + 1);
+
+            // Anything under an excluded directory is excluded, even though a directory's members come after it
+            for(auto next = path.find('/'); next != std::string::npos; next = path.find('/', next + 1))
+            {
+                if(excluded.count(path.substr(0, next)) != 0) return false;
+            }
+
+            if(parent != filterDirectory)
+            {
+                filterDirectory = parent;
+                filterState = Filter::Rules.ForPath(parent.empty() ? "" : "/" + parent);
+            }
+
+            if(Filter::Rules.Included(filterState, name.c_str(), isDirectory, nullptr)) return true;
+
+            if(isDirectory) excluded.insert(path);
+            return false;
+        }
+
+        /**
+         * Replace whatever is in the way of a link with the link. Only non-directories are replaced
+         *
+         * @param dir the directory the link goes in
+         * @param name the name of the link
+         * @param create creates the link, returning 0 on success
+         * @return 0 on success
+         */
+        template<typename F>
+        int Link(int dir, const std::string& name, F create)
+        {
+            auto result = create();
+
+            struct stat existing;
+            if(result != 0 && errno == EEXIST && fstatat(dir, name.c_str(), &existing, AT_SYMLINK_NOFOLLOW) == 0 &&
+               !S_ISDIR(existing.st_mode) && unlinkat(dir, name.c_str(), 0) == 0)
+            {
+                result = create();
+            }
+
+            return result;
+        }
+
+        /**
+         * Extract a member
+         *
+         * @param header the member's header
+         * @param hasData whether or not the member has data following its header
+         * @return true if the member's data was consumed, false if it still has to be skipped over
+         */
+        bool Extract(const Header& header, bool hasData)
+        {
+            auto myPid = getpid();
+            bool isDirectory = header.Type == '5';
+
+            std::string relative;
+            if(!util::SanitizePath(header.Path, relative))
+            {
+                Log.Error("[" + std::to_string(myPid) + "] Refusing to extract " + header.Path + " outside of the destination");
+                Stats::Shared->Errors.Add(1);
+                error = true;
+                return false;
+            }
+
+            // The root of the archive is the destination itself, which already exists
+            if(relative.empty()) return false;
+
+            if(isDirectory) Stats::Shared->DirectoriesScanned.Add(1);
+            else Stats::Shared->FilesScanned.Add(1);
+
+            if(!Included(relative, isDirectory))
+            {
+                Log.Debug("[" + std::to_string(myPid) + "] Excluding " + relative);
+                Stats::Shared->Excluded.Add(1);
+                return false;
+            }
+
+            // Everything is created relative to its parent directory, never through a path that could contain a link
+            auto slash = relative.rfind('/');
+            auto parent = slash == std::string::npos ? std::string() : relative.substr(0, slash);
+            auto name = slash == std::string::npos ? relative : relative.substr(slash + 1);
+
+            auto path = dest + relative;
+            if(isDirectory)
+            {
+                if(OpenDirectory(relative) < 0)
+                {
+                    Stats::Shared->Errors.Add(1);
+                    error = true;
+                    return false;
+                }
+
+                directories.push_back(Directory{path, header.Mode, {header.ModifiedTime, header.ModifiedTime}});
+                return false;
+            }
+
+            if(header.Type == '2' || header.Type == '1')
+            {
+                Log.Info("[" + std::to_string(myPid) + "] link '" + path + "' --> '" + header.LinkPath + "'");
+
+                int result = -1;
+                if(header.Type == '2')
+                {
+                    int dir = OpenDirectory(parent);
+                    if(dir >= 0) result = Link(dir, name, [&]{ return Sys::Symlinkat(header.LinkPath.c_str(), dir, name.c_str(), destDevice); });
+                }
+                else
+                {
+                    // Hardlink targets are names in the archive, so they go through the same checks
+                    std::string target;
+                    if(!util::SanitizePath(header.LinkPath, target))
+                    {
+                        Log.Error("[" + std::to_string(myPid) + "] Refusing to link " + path + " outside of the destination");
+                        Stats::Shared->Errors.Add(1);
+                        error = true;
+                        return false;
+                    }
+
+                    // The target's directory is opened the same way, so the link can't be to a file reached through a link
+                    auto targetSlash = target.rfind('/');
+                    auto targetName = targetSlash == std::string::npos ? target : target.substr(targetSlash + 1);
+                    int targetDir = OpenDirectory(targetSlash == std::string::npos ? std::string() : target.substr(0, targetSlash));
+                    if(targetDir >= 0) targetDir = dup(targetDir);
+
+                    int dir = targetDir >= 0 ? OpenDirectory(parent) : -1;
+                    if(dir >= 0) result = Link(dir, name, [&]{ return linkat(targetDir, targetName.c_str(), dir, name.c_str(), 0); });
+
+                    if(targetDir >= 0) close(targetDir);
+                }
+
+                if(result != 0)
+                {
+                    Log.Error("[" + std::to_string(myPid) + "] Failed to create link " + path + " (errno " + std::to_string(errno) + ")");
+                    Stats::Shared->Errors.Add(1);
+                    error = true;
+                }
+                else
+                {
+                    Stats::Shared->FilesCopied.Add(1);
+                }
+
+                return false;
+            }
+
+            if(!hasData)
+            {
+                Log.Warn("[" + std::to_string(myPid) + "] Skipping '" + relative + "' (not a regular file, directory or link)");
+                return false;
+            }
+
+            Log.Info("[" + std::to_string(myPid) + "] '" + header.Path + "' --> '" + path + "'");
+
+            // Whatever is in the way is replaced rather than written through, since it could be a link (hard or
+            // symbolic) to a file outside of the destination
+            int dir = OpenDirectory(parent);
+            if(dir < 0)
+            {
+                Stats::Shared->Errors.Add(1);
+                error = true;
+                return false;
+            }
+
+            struct stat existing;
+            if(fstatat(dir, name.c_str(), &existing, AT_SYMLINK_NOFOLLOW) == 0 && !S_ISDIR(existing.st_mode)) unlinkat(dir, name.c_str(), 0);
+
+            int fd = Sys::Openat(dir, name.c_str(), O_CREAT | O_EXCL | O_WRONLY | O_NOFOLLOW, header.Mode & 07777, destDevice);
+            if(fd < 0)
+            {
+                Log.Error("[" + std::to_string(myPid) + "] Could not open file for write " + path + " (errno " + std::to_string(errno) + ")");
+                Stats::Shared->Errors.Add(1);
+                error = true;
+                return false;
+            }
+
+            // The file is closed by whichever writer finishes with it last
+            auto file = std::make_shared<OutputFile>(fd, path, header.ModifiedTime, destDevice, error);
+
+            uint64_t offset = 0;
+            while(offset < header.Size)
+            {
+                WriteJob job;
+                job.File = file;
+                job.Offset = offset;
+                job.Data.resize((size_t) std::min((uint64_t) TAR_CHUNK_SIZE, header.Size - offset));
+
+                if(!reader.Read(job.Data.data(), job.Data.size()))
+                {
+                    file->Failed = true;
+                    error = true;
+                    return true;
+                }
+
+                offset += job.Data.size();
+                pool.Submit(std::move(job));
+            }
+
+            return true;
+        }
+    };
+
+    int Extract(const std::string& input, const std::string& dest)
+    {
+        auto myPid = getpid();
+
+        int fd = STDIN_FILENO;
+        if(input != "-")
+        {
+            fd = Sys::Open(input.c_str(), O_RDONLY, 0, 0);
+            if(fd < 0)
+            {
+                Log.Fatal("[" + std::to_string(myPid) + "] Unable to open " + input + " for read (errno " + std::to_string(errno) + ")");
+                Stats::Shared->Errors.Add(1);
+                return -1;
+            }
+        }
+
+        struct stat inputStat;
+        dev_t inputDevice = fstat(fd, &inputStat) == 0 ? inputStat.st_dev : 0;
+
+        // The destination itself is created like it is for a copy, but there's no source to take its mode from
+        auto root = dest;
+        if(util::StringEndsWith(root, '/')) root = root.substr(0, root.length() - 1);
+
+        dev_t destDevice = 0;
+        if(Sys::Mkdir(root.c_str(), S_IRWXU | S_IRWXG | S_IRWXO, destDevice) != 0 && errno != EEXIST)
+        {
+            Log.Fatal("[" + std::to_string(myPid) + "] Unable to create directory: Error code " + std::to_string(errno));
+            Stats::Shared->Errors.Add(1);
+            if(input != "-") Sys::Close(fd, inputDevice);
+            return -1;
+        }
+
+        Stats::Shared->ActiveWorkers.Add(1);
+        bool ok;
+        {
+            Extractor extractor(dest, fd, inputDevice, destDevice);
+            ok = extractor.Run();
+        }
+        Stats::Shared->ActiveWorkers.Sub(1);
+
+        if(input != "-") Sys::Close(fd, inputDevice);
+
+        return ok ? 0 : -1;
+    }
+}
@@ -0,0 +1,57 @@
+/*
+ * Copyright (c) 2016 Nathan Lowe
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of this software
+ * and associated documentation files (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all copies or substantial
+ * portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT
+ * LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN
+ * NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef EECS3540_TAR_H
+#define EECS3540_TAR_H
+
+#include <string>
+
+/**
+ * Streaming POSIX tar (pax) archives, so a tree can be piped to another host instead of copied into a directory.
+ *
+ * Archives are written by a single writer that emits members in a fixed order, while several readers fetch file
+ * contents ahead of it in parallel. Reads that finish early wait in a bounded reorder buffer until the writer gets
+ * to them. Extraction parses the stream on one thread and hands file contents to a pool of writers, so the parallel
+ * write path is used no matter where the archive came from.
+ */
+namespace Tar
+{
+    /**
+     * Write the tree at source as a pax archive. Member names are relative to source, include/exclude rules are
+     * applied the same way they are for a copy, and only directories, regular files, symlinks and hardlinks are
+     * archived.
+     *
+     * @param source the directory to archive, not including itself
+     * @param output the file to write the archive to, or "-" for standard output
+     * @return 0 iff every entry was archived
+     */
+    int Create(const std::string& source, const std::string& output);
+
+    /**
+     * Extract a tar archive (pax, ustar or GNU) into the specified directory. Members that would end up outside of
+     * the destination are refused.
+     *
+     * @param input the archive to read, or "-" for standard input
+     * @param dest the directory to extract into. It will be created if it does not exist
+     * @return 0 iff every member was extracted
+     */
+    int Extract(const std::string& input, const std::string& dest);
+}
+
+#endif //EECS3540_TAR_H
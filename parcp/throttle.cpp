@@ -0,0 +1,296 @@
+/*
+ * Copyright (c) 2016 Nathan Lowe
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of this software
+ * and associated documentation files (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all copies or substantial
+ * portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT
+ * LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN
+ * NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <ctime>
+#include <fstream>
+#include <new>
+#include <sstream>
+#include "throttle.h"
+#include "latency.h"
+#include "Logger.h"
+#include "stats.h"
+#include "util.h"
+
+/** How many batches of tokens each thread takes from a bucket per second, at most */
+#define THROTTLE_BATCHES_PER_SECOND 50
+/** How far (in nanoseconds) a bucket can fill up while nobody is taking from it, which allows short bursts */
+#define THROTTLE_BURST_NANOS 100000000ULL
+/** The number of milliseconds between checks of the control file */
+#define THROTTLE_CONTROL_INTERVAL_MS 500
+
+/** From linux/ioprio.h, which isn't exposed by glibc */
+#define IOPRIO_WHO_PROCESS 1
+#define IOPRIO_CLASS_IDLE 3
+#define IOPRIO_CLASS_SHIFT 13
+
+namespace Throttle
+{
+    L3::Logger Log("Throttle");
+
+    /** Backing storage used until the buckets are created or attached to, which never limits anything */
+    static Buckets localBuckets;
+
+    Buckets* Shared = &localBuckets;
+
+    /** The tokens this thread has taken from each bucket but not used yet */
+    static thread_local uint64_t bandwidthCredit = 0;
+    static thread_local uint64_t operationCredit = 0;
+
+    /**
+     * Map the buckets backed by the specified file descriptor
+     *
+     * @param fd the file descriptor to map
+     * @return the mapped buckets, or nullptr if the mapping failed
+     */
+    static Buckets* Map(int fd)
+    {
+        void* mem = mmap(nullptr, sizeof(Buckets), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        return mem == MAP_FAILED ? nullptr : static_cast<Buckets*>(mem);
+    }
+
+    int Create(uint64_t bytesPerSecond, uint64_t operationsPerSecond)
+    {
+        // Not close-on-exec: the descriptor has to survive into the workers we exec
+        int fd = memfd_create("parcp-throttle", 0);
+        if(fd < 0 || ftruncate(fd, sizeof(Buckets)) != 0)
+        {
+            Log.Fatal("Unable to create shared memory for the I/O limits (errno " + std::to_string(errno) + ")");
+            if(fd >= 0) close(fd);
+            return -1;
+        }
+
+        auto mapped = Map(fd);
+        if(mapped == nullptr)
+        {
+            Log.Fatal("Unable to map shared memory for the I/O limits (errno " + std::to_string(errno) + ")");
+            close(fd);
+            return -1;
+        }
+
+        Shared = new (mapped) Buckets();
+        Shared->Bandwidth.Rate.store(bytesPerSecond);
+        Shared->Operations.Rate.store(operationsPerSecond);
+
+        return fd;
+    }
+
+    bool Attach(int fd)
+    {
+        auto mapped = Map(fd);
+        if(mapped == nullptr)
+        {
+            Log.Warn("Unable to attach to the shared I/O limits (errno " + std::to_string(errno) + ")");
+            return false;
+        }
+
+        Shared = mapped;
+        return true;
+    }
+
+    /** Sleep for the specified number of nanoseconds, even if interrupted by a signal */
+    static void Sleep(uint64_t nanos)
+    {
+        struct timespec remaining;
+        remaining.tv_sec = (time_t) (nanos / 1000000000ULL);
+        remaining.tv_nsec = (long) (nanos % 1000000000ULL);
+
+        while(nanosleep(&remaining, &remaining) != 0 && errno == EINTR);
+    }
+
+    /**
+     * Take tokens from a bucket, from this thread's credit if it has enough, otherwise by taking a batch from the
+     * shared bucket and sleeping until the batch has been paid for
+     *
+     * @param bucket the bucket to take from
+     * @param amount the number of tokens to take
+     * @param credit this thread's credit for the bucket
+     */
+    static void Take(Bucket& bucket, uint64_t amount, uint64_t& credit)
+    {
+        if(credit >= amount)
+        {
+            credit -= amount;
+            return;
+        }
+
+        auto rate = bucket.Rate.load(std::memory_order_relaxed);
+        if(rate == 0) return;
+
+        auto needed = amount - credit;
+        auto batch = std::max(needed, std::max((uint64_t) 1, rate / THROTTLE_BATCHES_PER_SECOND));
+        auto cost = (uint64_t) ((double) batch * 1e9 / (double) rate);
+
+        // The bucket can't have filled up past the burst allowance, however long it has been idle
+        auto now = Latency::Now();
+        uint64_t earliest = now > THROTTLE_BURST_NANOS ? now - THROTTLE_BURST_NANOS : 0;
+
+        auto paid = bucket.PaidUntil.load(std::memory_order_relaxed);
+        uint64_t next;
+        do
+        {
+            next = std::max(paid, earliest) + cost;
+        } while(!bucket.PaidUntil.compare_exchange_weak(paid, next, std::memory_order_relaxed));
+
+        credit = batch - needed;
+        if(next > now) Sleep(next - now);
+    }
+
+    void Acquire(size_t bytes)
+    {
+        Take(Shared->Operations, 1, operationCredit);
+        if(bytes > 0) Take(Shared->Bandwidth, bytes, bandwidthCredit);
+    }
+
+    /** Halve (SIGUSR1) or double (SIGUSR2) every limit that is set. Only touches lock-free atomics */
+    static void Adjust(int signal)
+    {
+        Bucket* buckets[] = {&Shared->Bandwidth, &Shared->Operations};
+        for(auto bucket : buckets)
+        {
+            auto rate = bucket->Rate.load();
+            if(rate == 0) continue;
+
+            bucket->Rate.store(signal == SIGUSR1 ? std::max((uint64_t) 1, rate / 2) : std::min(rate, UINT64_MAX / 2) * 2);
+        }
+    }
+
+    void HandleSignals()
+    {
+        struct sigaction action;
+        memset(&action, 0, sizeof(action));
+        action.sa_handler = Adjust;
+        action.sa_flags = SA_RESTART;
+        sigemptyset(&action.sa_mask);
+
+        sigaction(SIGUSR1, &action, nullptr);
+        sigaction(SIGUSR2, &action, nullptr);
+    }
+
+    bool SetIdlePriority()
+    {
+        if(syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0, IOPRIO_CLASS_IDLE << IOPRIO_CLASS_SHIFT) == 0) return true;
+
+        Log.Warn("Unable to switch to the idle I/O scheduling class (errno " + std::to_string(errno) + ")");
+        return false;
+    }
+
+    /** Describe a limit for the log */
+    static std::string Describe(uint64_t rate, bool bytes)
+    {
+        if(rate == 0) return "unlimited";
+        return bytes ? Stats::HumanBytes((double) rate) + "/s" : std::to_string(rate) + " ops/s";
+    }
+
+    void Controller::Start(std::string path)
+    {
+        this->path = path;
+        bandwidth = Shared->Bandwidth.Rate.load();
+        operations = Shared->Operations.Rate.load();
+
+        // Apply the control file before any I/O happens, rather than racing the first check
+        Check();
+        worker = std::thread(&Controller::Run, this);
+    }
+
+    void Controller::Stop()
+    {
+        if(!worker.joinable()) return;
+
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            stopping = true;
+        }
+
+        wake.notify_all();
+        worker.join();
+    }
+
+    void Controller::Run()
+    {
+        std::unique_lock<std::mutex> guard(lock);
+        while(!stopping)
+        {
+            wake.wait_for(guard, std::chrono::milliseconds(THROTTLE_CONTROL_INTERVAL_MS));
+            Check();
+        }
+    }
+
+    /** Re-read the control file if it changed, and log the limits if they changed since they were last logged */
+    void Controller::Check()
+    {
+        struct stat info;
+        if(!path.empty() && stat(path.c_str(), &info) == 0 &&
+           (info.st_mtim.tv_sec != lastModified.tv_sec || info.st_mtim.tv_nsec != lastModified.tv_nsec))
+        {
+            lastModified = info.st_mtim;
+            ReadControlFile();
+        }
+
+        // Changes can come from signals too, so just compare against what was logged last
+        auto newBandwidth = Shared->Bandwidth.Rate.load();
+        auto newOperations = Shared->Operations.Rate.load();
+        if(newBandwidth != bandwidth || newOperations != operations)
+        {
+            bandwidth = newBandwidth;
+            operations = newOperations;
+            Log.Info("I/O limits are now " + Describe(bandwidth, true) + " and " + Describe(operations, false));
+        }
+    }
+
+    void Controller::ReadControlFile()
+    {
+        std::ifstream in(path);
+        if(!in)
+        {
+            Log.Warn("Unable to read I/O limits from " + path);
+            return;
+        }
+
+        std::string line;
+        while(std::getline(in, line))
+        {
+            std::istringstream fields(line);
+            std::string key, value;
+            if(!(fields >> key) || key[0] == '#') continue;
+            fields >> value;
+
+            uint64_t rate;
+            if(key == "bwlimit" && util::ParseBytes(value, rate))
+            {
+                Shared->Bandwidth.Rate.store(rate);
+            }
+            else if(key == "iops-limit" && !value.empty() && value.find_first_not_of("0123456789") == std::string::npos)
+            {
+                Shared->Operations.Rate.store(std::stoull(value));
+            }
+            else
+            {
+                Log.Warn("Ignoring \"" + line + "\" in " + path);
+            }
+        }
+    }
+}
@@ -0,0 +1,132 @@
+/*
+ * Copyright (c) 2016 Nathan Lowe
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of this software
+ * and associated documentation files (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all copies or substantial
+ * portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT
+ * LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN
+ * NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef EECS3540_THROTTLE_H
+#define EECS3540_THROTTLE_H
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <ctime>
+#include <mutex>
+#include <string>
+#include <thread>
+
+/** The size of a cache line, used to keep the buckets apart */
+#define THROTTLE_CACHE_LINE 64
+
+/**
+ * Bandwidth and IOPS limits shared by every worker. Each limit is a token bucket, implemented as a generic cell rate
+ * algorithm over a single shared timestamp, so taking tokens is one compare-and-swap no matter how many workers there
+ * are. To keep even that off the hot path, each thread takes tokens from the shared bucket in batches of about 20ms
+ * worth and hands them out locally.
+ *
+ * Every read and write made through Sys counts against the IOPS limit, and the bytes written count against the
+ * bandwidth limit. The limits can be changed while a copy runs: SIGUSR1 halves them, SIGUSR2 doubles them, and a
+ * control file (see Controller) can set them to anything.
+ */
+namespace Throttle
+{
+    /** A single token bucket, in shared memory */
+    struct alignas(THROTTLE_CACHE_LINE) Bucket
+    {
+        /** The number of tokens added per second, or 0 if there is no limit */
+        std::atomic<uint64_t> Rate;
+        /** The time (from Latency::Now) at which everything taken so far will have been paid for */
+        alignas(THROTTLE_CACHE_LINE) std::atomic<uint64_t> PaidUntil;
+    };
+
+    /** The limits for the current copy */
+    struct Buckets
+    {
+        /** Bytes written per second */
+        Bucket Bandwidth;
+        /** Reads and writes per second */
+        Bucket Operations;
+    };
+
+    /** The buckets for the current copy. Always valid, without limits until Create or Attach has been called */
+    extern Buckets* Shared;
+
+    /**
+     * Create the shared buckets. This should only be called by the root process, before any workers are forked
+     *
+     * @param bytesPerSecond the bandwidth limit, or 0 for none
+     * @param operationsPerSecond the IOPS limit, or 0 for none
+     * @return the file descriptor that workers should attach to, or -1 on failure
+     */
+    int Create(uint64_t bytesPerSecond, uint64_t operationsPerSecond);
+
+    /**
+     * Attach to the shared buckets created by the root process
+     *
+     * @param fd the file descriptor passed down from the parent process
+     * @return true iff the buckets were mapped successfully
+     */
+    bool Attach(int fd);
+
+    /**
+     * Wait until the limits allow an I/O operation. Cheap if there are no limits
+     *
+     * @param bytes the number of bytes written by the operation, or 0 for reads
+     */
+    void Acquire(size_t bytes);
+
+    /** Make SIGUSR1 halve the limits and SIGUSR2 double them. Only the root process should handle these */
+    void HandleSignals();
+
+    /** Put this process, and every process and thread it starts, in the idle I/O scheduling class */
+    bool SetIdlePriority();
+
+    /**
+     * Watches a control file for changes to the limits, and logs whenever they change (including by signal). The file
+     * holds "bwlimit <bytes>" and "iops-limit <count>" lines, where 0 removes the limit. Blank lines and lines starting
+     * with '#' are ignored.
+     */
+    class Controller
+    {
+    public:
+        /**
+         * Start watching
+         *
+         * @param path the control file, or an empty string to only log changes
+         */
+        void Start(std::string path);
+
+        /** Stop watching */
+        void Stop();
+
+    private:
+        std::string path;
+        std::thread worker;
+        std::mutex lock;
+        std::condition_variable wake;
+        bool stopping = false;
+        struct timespec lastModified = {0, 0};
+        uint64_t bandwidth = 0;
+        uint64_t operations = 0;
+
+        void Run();
+        void Check();
+        void ReadControlFile();
+    };
+}
+
+#endif //EECS3540_THROTTLE_H
@@ -17,8 +17,14 @@
  * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
  */
 
+#include <cctype>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
 #include <string>
+#include <fcntl.h>
 #include <sys/stat.h>
+#include <unistd.h>
 #include "util.h"
 
 /**
@@ -33,4 +39,124 @@ bool util::DirectoryExists(std::string dir)
     int result = stat(dir.c_str(), &s);
 
     return result != -1 && S_ISDIR(s.st_mode);
-}
\ No newline at end of file
+}
+
+/**
+ * Parses a byte count with an optional K, M, G or T suffix (powers of 1024), e.g. "64K" or "1G"
+ *
+ * @param raw the string to parse
+ * @param bytes the parsed byte count
+ * @return true iff the string was a valid byte count
+ */
+bool util::ParseBytes(const std::string& raw, uint64_t& bytes)
+{
+    if(raw.empty() || !isdigit((unsigned char) raw[0])) return false;
+
+    char* end = nullptr;
+    auto value = strtoull(raw.c_str(), &end, 10);
+
+    uint64_t multiplier = 1;
+    std::string suffix(end);
+    if(suffix.size() == 2 && toupper((unsigned char) suffix[1]) == 'B') suffix.pop_back();
+    if(suffix.size() > 1) return false;
+
+    if(!suffix.empty())
+    {
+        switch(toupper((unsigned char) suffix[0]))
+        {
+            case 'K': multiplier = 1ull << 10; break;
+            case 'M': multiplier = 1ull << 20; break;
+            case 'G': multiplier = 1ull << 30; break;
+            case 'T': multiplier = 1ull << 40; break;
+            default: return false;
+        }
+    }
+
+    bytes = value * multiplier;
+    return true;
+}
+
+/**
+ * Create an unlinked temporary file in $TMPDIR (or /tmp)
+ *
+ * @param name what the file is for, used in its name if the filesystem doesn't support O_TMPFILE
+ * @param inherited whether the descriptor is inherited by workers. Otherwise it is close-on-exec, so the file is gone
+ *                  as soon as this process closes it
+ * @return the descriptor, or -1 on failure (errno is set)
+ */
+int util::TemporaryFile(const std::string& name, bool inherited)
+{
+    auto dir = getenv("TMPDIR");
+    std::string path = dir != nullptr && dir[0] != '\0' ? dir : "/tmp";
+    int cloexec = inherited ? 0 : O_CLOEXEC;
+
+    int fd = open(path.c_str(), O_TMPFILE | O_RDWR | cloexec, S_IRUSR | S_IWUSR);
+    if(fd >= 0 || (errno != EOPNOTSUPP && errno != EISDIR)) return fd;
+
+    // Not every filesystem supports O_TMPFILE
+    path += "/parcp-" + name + "-XXXXXX";
+    fd = mkostemp(&path[0], cloexec);
+    if(fd >= 0) unlink(path.c_str());
+
+    return fd;
+}
+
+/**
+ * Clean up a relative path so it can't escape the directory it is relative to: leading '/'s and "." components are
+ * dropped, and paths with ".." components are refused
+ *
+ * @param path the path to clean up
+ * @param clean the cleaned up path, without a trailing '/'
+ * @return false if the path should be refused
+ */
+bool util::SanitizePath(const std::string& path, std::string& clean)
+{
+    clean.clear();
+
+    size_t start = 0;
+    while(start <= path.size())
+    {
+        auto end = path.find('/', start);
+        if(end == std::string::npos) end = path.size();
+
+        auto component = path.substr(start, end - start);
+        if(component == "..") return false;
+
+        if(!component.empty() && component != ".")
+        {
+            if(!clean.empty()) clean += '/';
+            clean += component;
+        }
+
+        start = end + 1;
+    }
+
+    return true;
+}
+
+/**
+ * Escape a string so it can be written out as a JSON string, between a pair of quotes
+ *
+ * @param raw the string to escape
+ * @return the escaped string, without the quotes
+ */
+std::string util::JsonEscape(const std::string& raw)
+{
+    std::string escaped;
+    for(unsigned char c : raw)
+    {
+        if(c == '"') escaped += "\\\"";
+        else if(c == '\\') escaped += "\\\\";
+        else if(c == '\n') escaped += "\\n";
+        else if(c == '\t') escaped += "\\t";
+        else if(c < 0x20)
+        {
+            char buf[8];
+            snprintf(buf, sizeof(buf), "\\u%04x", c);
+            escaped += buf;
+        }
+        else escaped += (char) c;
+    }
+
+    return escaped;
+}
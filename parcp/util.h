@@ -20,6 +20,7 @@
 #ifndef EECS3540_UTIL_H
 #define EECS3540_UTIL_H
 
+#include <cstdint>
 #include <string>
 
 namespace util
@@ -32,6 +33,43 @@ namespace util
      */
     bool DirectoryExists(std::string dir);
 
+    /**
+     * Parses a byte count with an optional K, M, G or T suffix (powers of 1024), e.g. "64K" or "1G"
+     *
+     * @param raw the string to parse
+     * @param bytes the parsed byte count
+     * @return true iff the string was a valid byte count
+     */
+    bool ParseBytes(const std::string& raw, uint64_t& bytes);
+
+    /**
+     * Create an unlinked temporary file in $TMPDIR (or /tmp)
+     *
+     * @param name what the file is for, used in its name if the filesystem doesn't support O_TMPFILE
+     * @param inherited whether the descriptor is inherited by workers. Otherwise it is close-on-exec, so the file is
+     *                  gone as soon as this process closes it
+     * @return the descriptor, or -1 on failure (errno is set)
+     */
+    int TemporaryFile(const std::string& name, bool inherited = true);
+
+    /**
+     * Clean up a relative path so it can't escape the directory it is relative to: leading '/'s and "." components
+     * are dropped, and paths with ".." components are refused
+     *
+     * @param path the path to clean up
+     * @param clean the cleaned up path, without a trailing '/'
+     * @return false if the path should be refused
+     */
+    bool SanitizePath(const std::string& path, std::string& clean);
+
+    /**
+     * Escape a string so it can be written out as a JSON string, between a pair of quotes
+     *
+     * @param raw the string to escape
+     * @return the escaped string, without the quotes
+     */
+    std::string JsonEscape(const std::string& raw);
+
     /**
      * Checks to see if the specified input string ends with the specified character
      * @param input the string to check